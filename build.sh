@@ -85,8 +85,11 @@ do
     --profiler)
         profiler_option="perfetto=true"
         ;;
+    --file-trace)
+        profiler_option="file_trace=true"
+        ;;
     *)
-        echo "Usage: $0 [--debug]"
+        echo "Usage: $0 [--debug] [--profiler] [--file-trace]"
         exit 1
         ;;
     esac
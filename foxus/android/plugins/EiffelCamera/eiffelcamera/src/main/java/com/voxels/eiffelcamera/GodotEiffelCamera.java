@@ -57,6 +57,12 @@ public class GodotEiffelCamera extends org.godotengine.godot.plugin.GodotPlugin{
 
     int fileDescriptor;
 
+    // One permission receiver for the plugin, and one connection per device
+    // that is kept until the device is detached. A grant for a device that is
+    // already open reports the same file descriptor again.
+    PermissionReceiver permissionReceiver;
+    HashMap<String, UsbDeviceConnection> connections = new HashMap<>();
+
     public GodotEiffelCamera(Godot godot) {
         super(godot);
         fileDescriptor=-1;
@@ -85,10 +91,18 @@ public class GodotEiffelCamera extends org.godotengine.godot.plugin.GodotPlugin{
                         if(device != null) {
                             camDevice = device;
                             //call method to set up device communication
-                            UsbDeviceConnection usbDeviceConnection = usbManager.openDevice(camDevice);
+                            UsbDeviceConnection usbDeviceConnection = connections.get(device.getDeviceName());
+                            if (usbDeviceConnection == null) {
+                                usbDeviceConnection = usbManager.openDevice(camDevice);
+                                if (usbDeviceConnection == null) {
+                                    Log.d("PERMISSIONS", "could not open device " + device.getDeviceName());
+                                    return;
+                                }
+                                connections.put(device.getDeviceName(), usbDeviceConnection);
+                            }
                             fileDescriptor = usbDeviceConnection.getFileDescriptor();
                             Log.d("PERMISSIONS","got permissions for device FD: " + fileDescriptor);
-                            eiffelCamera.emitSignal("permission_received", fileDescriptor);
+                            eiffelCamera.emitSignal("permission_received", fileDescriptor, device.getDeviceName());
                             Log.d("DEBUG", "Emitting signal permission received " + fileDescriptor);
                         }
                     }
@@ -100,6 +114,45 @@ public class GodotEiffelCamera extends org.godotengine.godot.plugin.GodotPlugin{
         }
     }
 
+    // Attach and detach broadcasts for one vid/pid, so the native side does
+    // not have to poll the device list.
+    public class AttachReceiver extends BroadcastReceiver {
+        GodotEiffelCamera eiffelCamera;
+        int vid;
+        int pid;
+
+        AttachReceiver(GodotEiffelCamera eiffelCamera, int vid, int pid) {
+            super();
+            this.eiffelCamera = eiffelCamera;
+            this.vid = vid;
+            this.pid = pid;
+        }
+
+        @Override
+        public void onReceive(Context context, Intent intent) {
+            String action = intent.getAction();
+            UsbDevice device = (UsbDevice)intent.getParcelableExtra(UsbManager.EXTRA_DEVICE);
+
+            if (device == null || device.getVendorId() != vid || device.getProductId() != pid) {
+                return;
+            }
+
+            if (UsbManager.ACTION_USB_DEVICE_ATTACHED.equals(action)) {
+                Log.d("DEBUG", "Camera attached " + device.getDeviceName());
+                eiffelCamera.emitSignal("camera_attached", device.getDeviceName(), getSerial(device));
+            } else if (UsbManager.ACTION_USB_DEVICE_DETACHED.equals(action)) {
+                Log.d("DEBUG", "Camera detached " + device.getDeviceName());
+                UsbDeviceConnection connection = connections.remove(device.getDeviceName());
+                if (connection != null) {
+                    connection.close();
+                }
+                eiffelCamera.emitSignal("camera_detached", device.getDeviceName());
+            }
+        }
+    }
+
+    AttachReceiver attachReceiver;
+
     @Override
     public String getPluginName() {
         return "EiffelCamera";
@@ -112,24 +165,40 @@ public class GodotEiffelCamera extends org.godotengine.godot.plugin.GodotPlugin{
 
     @Override
     public List<String> getPluginMethods() {
-        return Arrays.asList("isCameraConnected","connectCamera", "isCameraAttached");
+        return Arrays.asList("isCameraConnected","connectCamera", "isCameraAttached", "watchCamera");
     }
 
     public int isCameraConnected() {
         return fileDescriptor;
     }
 
-    public boolean connectCamera(int vid,int pid) {
-        GodotEiffelCamera.PermissionReceiver p = new GodotEiffelCamera.PermissionReceiver(this);
+    // Serial numbers can only be read once the app has permission for the
+    // device, empty before that. The native side reads the serial itself once
+    // the device is open.
+    static String getSerial(UsbDevice device) {
+        try {
+            String serial = device.getSerialNumber();
+            return serial != null ? serial : "";
+        } catch (SecurityException e) {
+            return "";
+        }
+    }
+
+    // deviceName selects one of several cameras, empty takes the first one.
+    public boolean connectCamera(int vid, int pid, String deviceName) {
         fileDescriptor = -1;
         Context c = this.getActivity().getApplicationContext();
         usbPermIntent = PendingIntent.getBroadcast(c, 0, new Intent(ACTION_USB_PERMISSION), 0);
-        IntentFilter filter = new IntentFilter(ACTION_USB_PERMISSION);
-        this.getActivity().registerReceiver(p, filter);
+        if (permissionReceiver == null) {
+            permissionReceiver = new GodotEiffelCamera.PermissionReceiver(this);
+            IntentFilter filter = new IntentFilter(ACTION_USB_PERMISSION);
+            this.getActivity().registerReceiver(permissionReceiver, filter);
+        }
         usbManager = (UsbManager) this.getActivity().getSystemService(c.USB_SERVICE);
         HashMap<String, UsbDevice> deviceList = usbManager.getDeviceList();
         for (UsbDevice usbDevice : deviceList.values()) {
-            if (usbDevice.getVendorId() == vid && usbDevice.getProductId() == pid) {
+            if (usbDevice.getVendorId() == vid && usbDevice.getProductId() == pid &&
+                    (deviceName.isEmpty() || deviceName.equals(usbDevice.getDeviceName()))) {
                 camDevice = usbDevice;
                 usbManager.requestPermission(camDevice, usbPermIntent);
                 PermissionsUtil.requestPermission("CAMERA", getActivity());
@@ -139,6 +208,26 @@ public class GodotEiffelCamera extends org.godotengine.godot.plugin.GodotPlugin{
         return false;
     }
 
+    public void watchCamera(int vid, int pid) {
+        if (attachReceiver != null) {
+            this.getActivity().unregisterReceiver(attachReceiver);
+        }
+
+        attachReceiver = new AttachReceiver(this, vid, pid);
+        IntentFilter filter = new IntentFilter();
+        filter.addAction(UsbManager.ACTION_USB_DEVICE_ATTACHED);
+        filter.addAction(UsbManager.ACTION_USB_DEVICE_DETACHED);
+        this.getActivity().registerReceiver(attachReceiver, filter);
+
+        // Broadcasts only report changes, cameras that are already plugged in are reported here
+        HashMap<String, UsbDevice> deviceList = ((UsbManager) this.getActivity().getSystemService(Context.USB_SERVICE)).getDeviceList();
+        for (UsbDevice usbDevice : deviceList.values()) {
+            if (usbDevice.getVendorId() == vid && usbDevice.getProductId() == pid) {
+                emitSignal("camera_attached", usbDevice.getDeviceName(), getSerial(usbDevice));
+            }
+        }
+    }
+
     public boolean isCameraAttached(int vid, int pid) {
         Context c = this.getActivity().getApplicationContext();
 
@@ -160,7 +249,9 @@ public class GodotEiffelCamera extends org.godotengine.godot.plugin.GodotPlugin{
 	public Set<SignalInfo> getPluginSignals() {
 		Set<SignalInfo> signals = new ArraySet<>();
 
-		signals.add(new SignalInfo("permission_received", Integer.class));
+		signals.add(new SignalInfo("permission_received", Integer.class, String.class));
+		signals.add(new SignalInfo("camera_attached", String.class, String.class));
+		signals.add(new SignalInfo("camera_detached", String.class));
 
 		return signals;
 	}
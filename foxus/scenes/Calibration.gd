@@ -41,7 +41,10 @@ var user_calibration_file_name_android = "user://stereo_cam_calibrated.yml"
 var user_calibration_file_name_pc = "res://calibration/stereo_cam_calibrated.yml"
 var current_user_calibration_file_name : String
 
-var thread: Thread = null
+var tracked_view_good = false
+
+const CALIBRATION_STAGES : Array = ["Detecting chessboards", "Calibrating cameras", "Calibrating stereo pair", "Saving", "Done"]
+enum CalibrationState { IDLE, RUNNING, SUCCEEDED, FAILED, CANCELLED }
 
 func _ready():
   if OS.get_name() == "Android":
@@ -58,6 +61,9 @@ func _ready():
   finish_calibration_button.connect("pressed", self, "_on_finish_calibration")
   calibrate_from_files_button.connect("pressed", self, "_on_calibrate_from_files")
   eiffel_camera.connect("ready_for_calibration", self, "_on_front_camera_calibration_buffer_full")
+  eiffel_camera.connect("chessboard_tracked", self, "_on_chessboard_tracked")
+  eiffel_camera.connect("calibration_progress", self, "_on_calibration_progress")
+  eiffel_camera.connect("calibration_finished", self, "_on_calibration_finished")
 
 func _load_user_calibration():
     if File.new().open(current_user_calibration_file_name, File.READ) == OK:
@@ -73,14 +79,6 @@ func _test_disparity_map():
     user_notification_quad.popup("Error: Camera not connected.", 5)
     return
 
-  if fullscreen_quad.color_space != fullscreen_quad.RGB:
-    user_notification_quad.popup("Error: Set colorspace to RGB before testing disparity map.", 5)
-    return
-  
-  if  fullscreen_quad.remap_mode != fullscreen_quad.CPU_REMAP:
-    user_notification_quad.popup("Error: Disparity maps only available with CPU remapping.", 5)
-    return
-  
   fullscreen_quad.visible = false
   eiffel_camera.set_disparity_test_mode(true)
   disparity_map_quad.visible = true
@@ -97,10 +95,6 @@ func _on_enter_calibration_mode():
     user_notification_quad.popup("Error: Camera not connected.", 5)
     return
   
-  if fullscreen_quad.color_space != fullscreen_quad.RGB:
-    user_notification_quad.popup("Error: Set colorspace to RGB before calibrating.", 5)
-    return
-  
   finish_calibration_button.visible = false
   eiffel_camera.enter_calibration_mode()
   enter_calibration_mode_button.visible = false
@@ -110,12 +104,17 @@ func _on_enter_calibration_mode():
   var calibration_images_left = eiffel_camera.calibration_images_left()
   user_notification_quad.popup("Take " + str(calibration_images_left) + " more pictures for calibration.")
 
+func _on_chessboard_tracked(left_corners, right_corners, good):
+  if good and not tracked_view_good and not eiffel_camera.is_image_on_hold():
+    user_notification_quad.popup("Good view of the chessboard. Take the picture now.", 2)
+  tracked_view_good = good
+
 func _on_front_camera_calibration_buffer_full():
   user_notification_quad.popup("Enough pictures taken. Click 'Finish Calibration' to continue.")
   finish_calibration_button.visible = true
 
 func _on_cancel_calibration():
-  if thread != null and thread.is_alive():
+  if eiffel_camera.is_calibrating():
     eiffel_camera.cancel_recalibration()
   else: 
     enter_calibration_mode_button.visible = true
@@ -129,44 +128,33 @@ func _on_finish_calibration():
   finish_calibration_button.visible = false
   
   user_notification_quad.popup("Calibrating camera. Please wait...")
-  
-  if thread != null:
-    thread.wait_to_finish()
 
   eiffel_camera.exit_calibration_mode()
+  eiffel_camera.start_calibration()
 
-  thread = Thread.new()
-  thread.start(self, "recalibrate_camera")
-
-func recalibrate_camera():
-  var calibration_successful = eiffel_camera.recalibrate_camera()
+func _on_calibrate_from_files():
+  user_notification_quad.popup("Calibrating camera. Please wait...")
 
-  if calibration_successful:
-    user_notification_quad.popup("Calibration successful.", 5)
+  eiffel_camera.exit_calibration_mode()
+  eiffel_camera.start_calibration_from_files()
+
+func _on_calibration_progress(stage, iteration, rms):
+  var message = CALIBRATION_STAGES[stage] + "..."
+  if rms > 0:
+    message += " (error: " + str(stepify(rms, 0.001)) + ")"
+  user_notification_quad.popup(message)
+
+func _on_calibration_finished(state, message):
+  if state == CalibrationState.SUCCEEDED:
+    var diagnostics = eiffel_camera.get_calibration_diagnostics()
+    if diagnostics.get("rejected_count", 0) > 0:
+      user_notification_quad.popup("Calibration successful, %d blurry or misdetected pictures were left out." % diagnostics["rejected_count"], 5)
+    else:
+      user_notification_quad.popup("Calibration successful.", 5)
     use_calibrated_button.visible = true
-  else:
+  elif state == CalibrationState.FAILED:
     user_notification_quad.popup("Calibration failed. Try again with better pictures.", 5)
 
   enter_calibration_mode_button.visible = true
   cancel_calibration_button.visible = false
   finish_calibration_button.visible = false
-
-func _on_calibrate_from_files():
-  user_notification_quad.popup("Calibrating camera. Please wait...")
-
-  if thread != null:
-    thread.wait_to_finish()
-
-  eiffel_camera.exit_calibration_mode()
-
-  thread = Thread.new()
-  thread.start(self, "recalibrate_camera_from_files")
-
-func recalibrate_camera_from_files():
-  var calibration_successful = eiffel_camera.recalibrate_camera_from_files();
-
-  if calibration_successful:
-    user_notification_quad.popup("Calibration successful.", 5)
-    use_calibrated_button.visible = true
-  else:
-    user_notification_quad.popup("Calibration failed. Try again with better pictures.", 5)
@@ -41,6 +41,7 @@ var tab_index
 
 func _ready():
   eiffel_camera.connect("chessboard_detected", self, "on_chessboard_detected")
+  eiffel_camera.connect("chessboard_not_detected", self, "on_chessboard_not_detected")
   
   discard_button.connect("pressed", self, "on_discard_pressed")
   accept_button.connect("pressed", self, "on_accept_pressed")
@@ -87,3 +88,8 @@ func on_chessboard_detected(left, right):
 
   vrui.show()
   tab_container.current_tab = tab_index
+
+  user_notification_quad.popup("Accept or discard the image on the 'Images' tab.")
+
+func on_chessboard_not_detected():
+  user_notification_quad.popup("Invalid picture. Try again.")
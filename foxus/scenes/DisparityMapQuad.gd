@@ -27,6 +27,8 @@ var DISTANCE = 50
 var material = get_active_material(0)
 var eiffel_camera : Node
 
+const DISPARITY_PRESETS : Array = ["FULL", "QUALITY", "SPEED"]
+
 func connect_to_camera():
   if eiffel_camera == null:
     eiffel_camera = get_node("/root/Scene/EiffelCamera")
@@ -58,3 +60,13 @@ func _input(event):
   if event is InputEventKey and event.scancode == KEY_SPACE:
     eiffel_camera.save_disparity_images()	#save the next frame's pictures into res://debug_images
     eiffel_camera.get_disparity_map().get_data().save_png("res://debug_images/godot_image.png")
+
+  if event is InputEventKey and event.pressed and event.scancode == KEY_TAB:
+    var preset = (eiffel_camera.get_disparity_preset() + 1) % DISPARITY_PRESETS.size()
+    eiffel_camera.set_disparity_preset(preset)
+    eiffel_camera.set_disparity_test_mode(true)
+    print("Disparity preset: " + DISPARITY_PRESETS[preset])
+
+  if event is InputEventKey and event.pressed and event.scancode == KEY_C:
+    eiffel_camera.set_continuous_depth(not eiffel_camera.is_continuous_depth())
+    print("Continuous depth: " + str(eiffel_camera.is_continuous_depth()))
@@ -54,6 +54,8 @@ const STATUS_TO_MSG : Array = [
 ]
 
 const STANDARD_LUT = 'res://luts/Neutral.png'
+# Texels per axis of the baked LUTs, looks may be .cube files or 512x512 PNGs.
+const LUT_SIZE = 33
 
 var uniform_texture_rgb : String
 
@@ -93,7 +95,7 @@ func _ready():
 
   # Load LUT (standard if unspecified, otherwise from settings.cfg)
   var fn = config.get_value('lut', 'default', STANDARD_LUT)
-  self.load_lut(load(fn).get_data())
+  self.load_lut(fn)
 
 func on_camera_status_changed(new_state):
   display_error = true
@@ -120,25 +122,21 @@ func on_opened():
   material.set_shader_param(uniform_texture_array_u, eiffel_camera.getEyeUFrameArray())
   material.set_shader_param(uniform_texture_array_v, eiffel_camera.getEyeVFrameArray())
 
+  material.set_shader_param("depth_map", eiffel_camera.get_depth_map())
+
   refresh_options()
 
 func set_lut_filename(fn):
   config.set_value('lut', 'default', fn)
   save_config()
 
-  var img = load(fn).get_data()
-  self.load_lut(img)
-
-func load_lut(img):
-  var t = Texture3D.new()
-  t.create(64, 64, 64, Image.FORMAT_RGB8)
-
-  for z in range(0, 63):
-    var u = floor(fmod(z, 8.0))
-    var v = floor(z / 8)
+  self.load_lut(fn)
 
-    var sub = img.get_rect(Rect2(u * 64, v * 64, 64, 64))
-    t.set_data_partial(sub, 0, 0, z)
+func load_lut(fn):
+  var t = eiffel_camera.load_lut(fn, LUT_SIZE)
+  if t == null:
+    user_notification_quad.popup("Could not load the look " + fn.get_file() + ".", 5)
+    return
 
   material.set_shader_param("lut", t)
 
@@ -211,9 +209,8 @@ func _unhandled_input(event):
   else:
     var calibration_images_left = eiffel_camera.calibration_images_left()
     
+    # The result arrives with the chessboard_detected / chessboard_not_detected signals.
     if eiffel_camera.take_picture():
-      if calibration_images_left > 0:
-        user_notification_quad.popup("Accept or discard the image on the 'Images' tab.")
       current_button_press_delay = button_press_delay
     else:
       if calibration_images_left > 0:
@@ -0,0 +1,98 @@
+#
+# Copyright (c) 2022 Nolan Consulting Limited.
+#
+# Permission is hereby granted, free of charge, to any person obtaining
+# a copy of this software and associated documentation files (the
+# "Software"), to deal in the Software without restriction, including
+# without limitation the rights to use, copy, modify, merge, publish,
+# distribute, sublicense, and/or sell copies of the Software, and to
+# permit persons to whom the Software is furnished to do so, subject to
+#  the following conditions:
+#
+# The above copyright notice and this permission notice shall be
+# included in all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+# CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+# TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+# SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+
+# Optional in-headset view of the native metrics, toggled with M.
+
+extends MeshInstance
+
+const DISTANCE = 49.8
+const REFRESH_INTERVAL = 0.5
+const HISTOGRAMS : Array = ["decode_ms", "remap_ms", "upload_ms", "jpeg_size_kb"]
+const COUNTERS : Array = ["frames_received", "dropped_frames", "decode_errors", "decoder_resets", "usb_errors"]
+
+onready var overlay_viewport = get_node("MetricsViewport")
+onready var overlay_text = get_node("MetricsViewport/MetricsText")
+onready var eiffel_camera = get_node("/root/Scene/EiffelCamera")
+
+var time_since_refresh = 0.0
+var metrics_overlay_transform = Transform()
+
+func _ready():
+  get_active_material(0).set_texture(0, overlay_viewport.get_texture())
+  self.visible = false
+
+func on_frame_start():
+  var spatial_viewport = get_viewport()
+  var camera = spatial_viewport.get_camera()
+
+  metrics_overlay_transform.origin = camera.project_position(spatial_viewport.size / 2, DISTANCE)
+  metrics_overlay_transform.basis = camera.transform.basis
+
+func on_frame_end():
+  if metrics_overlay_transform:
+    transform.origin = metrics_overlay_transform.origin
+    transform.basis = metrics_overlay_transform.basis
+
+func refresh():
+  var metrics = eiffel_camera.get_metrics()
+  var text = ""
+
+  for name in HISTOGRAMS:
+    if metrics["histograms"].has(name):
+      var histogram = metrics["histograms"][name]
+      text += "%s  p50 %.1f  p95 %.1f  p99 %.1f  max %.1f\n" % [name, histogram["p50"], histogram["p95"], histogram["p99"], histogram["max"]]
+
+  for name in COUNTERS:
+    if metrics["counters"].has(name):
+      text += "%s  %d\n" % [name, metrics["counters"][name]]
+
+  if metrics["gauges"].has("frame_queue_depth"):
+    text += "frame_queue_depth  %d\n" % metrics["gauges"]["frame_queue_depth"]
+
+  var usb = eiffel_camera.get_usb_stats()
+  text += "usb %.0f Mbit/s  %.1f fps  lost %d  incomplete %d  skipped %d\n" % [usb["bandwidth_mbps"], usb["frame_rate"], usb["lost_frames"], usb["incomplete_frames"], usb["skipped_frames"]]
+
+  var pacing = eiffel_camera.get_frame_pacing()
+  text += "camera %.1f fps  render %.1f Hz  judder %.1f ms\n" % [pacing["camera_rate"], pacing["render_rate"], pacing["judder_ms"]]
+  text += "suggested %d fps / %d Hz  (%.1f ms)\n" % [pacing["suggested_camera_fps"], pacing["suggested_refresh_rate"], pacing["suggested_judder_ms"]]
+
+  var memory = eiffel_camera.get_memory_usage()["total"]
+  text += "memory  cpu %.0f MB  opencv %.0f MB (peak %.0f)  gpu %.0f MB\n" % [memory["cpu"] / 1048576.0, memory["opencv"] / 1048576.0, memory["opencv_peak"] / 1048576.0, memory["gpu"] / 1048576.0]
+
+  overlay_text.set_text(text)
+
+func _process(delta):
+  if visible:
+    on_frame_start()
+    on_frame_end()
+
+    time_since_refresh += delta
+    if time_since_refresh >= REFRESH_INTERVAL:
+      time_since_refresh = 0.0
+      refresh()
+
+func _input(event):
+  if event is InputEventKey and event.pressed and event.scancode == KEY_M:
+    self.visible = not visible
+    if visible:
+      refresh()
@@ -82,9 +82,8 @@ func _process(_delta):
     else:
       var calibration_images_left = eiffel_camera.calibration_images_left()
 
+      # The result arrives with the chessboard_detected / chessboard_not_detected signals.
       if eiffel_camera.take_picture():
-        if calibration_images_left > 0:
-          user_notification_quad.popup("Accept or discard the image on the 'Images' tab.")
         current_button_press_delay = button_press_delay
       else:
         if calibration_images_left > 0:
@@ -34,7 +34,9 @@ func dir_contents(path):
 		var file_name = dir.get_next()
 		while file_name != "":
 			if !dir.current_is_dir() and file_name.ends_with("png.import"):
-				results.append(file_name.rstrip(".import"))
+				results.append(file_name.trim_suffix(".import"))
+			elif !dir.current_is_dir() and file_name.ends_with(".cube"):
+				results.append(file_name)
 			file_name = dir.get_next()
 	else:
 		print("An error occurred when trying to access the path.")
@@ -50,8 +52,18 @@ func _ready():
 	luts = dir_contents("res://luts/")
 	for i in luts:
 		$ItemList.add_item(i)
+	prebake_luts()
 	get_node("ItemList").connect("item_selected", self, "load_shader")
 
+# Bakes the looks in the background, so that switching does not stall a frame.
+func prebake_luts():
+	var paths = PoolStringArray()
+	for i in luts:
+		paths.append('res://luts/' + i)
+
+	var mesh = get_node("/root/Scene/ARVROrigin/FullscreenQuad")
+	get_node("/root/Scene/EiffelCamera").prebake_luts(paths, mesh.LUT_SIZE)
+
 var shaders
 
 func _on_request_completed(result, response_code, headers, body):
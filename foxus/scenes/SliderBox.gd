@@ -36,6 +36,9 @@ var mode = "number"
 var enum_values
 var enum_names
 
+# Set while the slider follows the camera, so the value is not written back.
+var updating_from_camera = false
+
 func _ready():
   slider.connect("value_changed", self, "on_value_changed")
   reset_button.connect("pressed", self, "on_reset_pressed")
@@ -44,7 +47,9 @@ func on_reset_pressed():
   if eiffel_camera != null and property_name != "":
     eiffel_camera.reset_camera_setting(property_name)
 
+    updating_from_camera = true
     slider.value = eiffel_camera.get(property_name)
+    updating_from_camera = false
     value_label.text = str(eiffel_camera.get_camera_setting_label(property_name))
 
 func set_range(property, minimum, maximum, current):
@@ -53,13 +58,19 @@ func set_range(property, minimum, maximum, current):
 
   property_name = property
 
+  updating_from_camera = true
   slider.min_value = minimum
   slider.max_value = maximum
   slider.value = current
+  updating_from_camera = false
 
   value_label.text = str(eiffel_camera.get_camera_setting_label(property_name))
 
 func on_value_changed(value):
+  if updating_from_camera:
+    return
+
+  # Only queues the write, the camera is updated in the background.
   if property_name != "" && eiffel_camera:
     eiffel_camera.set(property_name, value)
     value_label.text = str(eiffel_camera.get_camera_setting_label(property_name))
@@ -35,10 +35,23 @@ const STATUS_TO_MSG : Array = [
   "[color=#00FF00]Connected[/color]"
 ]
 
+# Indexed by the bring-up stage of the native module, IDLE and STREAMING show the status instead.
+const BRING_UP_TO_MSG : Array = [
+  "",
+  "[color=#0000FF]Opening camera[/color]",
+  "[color=#0000FF]Negotiating stream[/color]",
+  "[color=#0000FF]Starting stream[/color]",
+  "[color=#0000FF]Preparing decoder[/color]",
+  "[color=#0000FF]Waiting for first frame[/color]",
+  "",
+  "[color=#FF0000]Connection failed[/color]"
+]
+
 onready var eiffel_camera = get_node("/root/Scene/EiffelCamera")
 
 func _ready():
   eiffel_camera.connect("camera_status_changed", self, "on_camera_status_changed")
+  eiffel_camera.connect("bring_up_stage_changed", self, "on_bring_up_stage_changed")
   button.connect("pressed", self, "on_ask_for_permission_pressed")
 
 func on_camera_status_changed(new_status):
@@ -46,6 +59,14 @@ func on_camera_status_changed(new_status):
 
   button.disabled = (new_status != CONNECTION_STATUS.ATTACHED)
 
+func on_bring_up_stage_changed(stage, _elapsed_ms):
+  if stage < BRING_UP_TO_MSG.size() and BRING_UP_TO_MSG[stage] != "":
+    rich_text_label.bbcode_text = BRING_UP_TO_MSG[stage]
+
+  # Allow another attempt after a failure
+  if stage == BRING_UP_TO_MSG.size() - 1:
+    button.disabled = false
+
 func on_ask_for_permission_pressed():
   eiffel_camera.connect_to_camera()
   button.disabled = true
@@ -0,0 +1,261 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "calibration_dataset.hpp"
+
+#include "opencv2/imgproc.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+using namespace godot;
+
+// The values are written in host byte order
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the calibration dataset format is little endian");
+
+namespace {
+
+const char MAGIC[4] = { 'F', 'X', 'C', 'D' };
+
+// Sizes read from a file are checked against these before anything is allocated
+const int MAX_PATTERN_SIDE = 64;
+const int MAX_THUMBNAIL_SIDE = 4 * CalibrationDataset::THUMBNAIL_WIDTH;
+const int MAX_INTRINSICS_SIDE = 16;     // K is 3 x 3, D at most 1 x 14
+
+template <typename T>
+void write_value(std::ostream& stream, const T& value) {
+    stream.write((const char*) &value, sizeof(T));
+}
+
+template <typename T>
+bool read_value(std::istream& stream, T& r_value) {
+    stream.read((char*) &r_value, sizeof(T));
+    return (bool) stream;
+}
+
+void write_points(std::ostream& stream, const std::vector<cv::Point2f>& points) {
+    stream.write((const char*) points.data(), points.size() * sizeof(cv::Point2f));
+}
+
+bool read_points(std::istream& stream, uint32_t count, std::vector<cv::Point2f>& r_points) {
+    r_points.resize(count);
+    stream.read((char*) r_points.data(), count * sizeof(cv::Point2f));
+    return (bool) stream;
+}
+
+void write_mat(std::ostream& stream, const cv::Mat& mat, int type) {
+    cv::Mat converted;
+    if (!mat.empty()) mat.convertTo(converted, type);
+
+    write_value<int32_t>(stream, converted.rows);
+    write_value<int32_t>(stream, converted.cols);
+    for (int y = 0; y < converted.rows; ++y) {
+        stream.write((const char*) converted.ptr(y), converted.cols * converted.elemSize());
+    }
+}
+
+bool read_mat(std::istream& stream, cv::Mat& r_mat, int type, int max_side) {
+    int32_t rows = 0, cols = 0;
+    if (!read_value(stream, rows) || !read_value(stream, cols) || rows < 0 || cols < 0 || rows > max_side || cols > max_side) return false;
+
+    if (rows == 0 || cols == 0) {
+        r_mat = cv::Mat();
+        return true;
+    }
+
+    r_mat.create(rows, cols, type);
+    stream.read((char*) r_mat.data, r_mat.total() * r_mat.elemSize());
+    return (bool) stream;
+}
+
+}
+
+CalibrationDataset::CalibrationDataset(cv::Size p_pattern_size, float p_square_size, cv::Size p_image_size) :
+    pattern_size(p_pattern_size),
+    square_size(p_square_size),
+    image_size(p_image_size) {
+}
+
+bool CalibrationDataset::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    char magic[4];
+    uint32_t version = 0;
+    file.read(magic, 4);
+    if (!file || std::memcmp(magic, MAGIC, 4) != 0 || !read_value(file, version) || version != VERSION) return false;
+
+    CalibrationDataset loaded;
+    int32_t pattern_width, pattern_height, image_width, image_height;
+    uint32_t view_count;
+    if (!read_value(file, pattern_width) || !read_value(file, pattern_height) || !read_value(file, loaded.square_size) ||
+        !read_value(file, image_width) || !read_value(file, image_height) ||
+        !read_value(file, loaded.next_id) || !read_value(file, view_count)) {
+        return false;
+    }
+    if (pattern_width <= 0 || pattern_height <= 0 || pattern_width > MAX_PATTERN_SIDE || pattern_height > MAX_PATTERN_SIDE) {
+        return false;
+    }
+    loaded.pattern_size = cv::Size(pattern_width, pattern_height);
+    loaded.image_size = cv::Size(image_width, image_height);
+    uint32_t pattern_corners = (uint32_t) loaded.pattern_size.area();
+
+    for (uint32_t i = 0; i < view_count; ++i) {
+        CalibrationDatasetView view;
+        uint32_t corner_count;
+        if (!read_value(file, view.id) || !read_value(file, corner_count) || corner_count != pattern_corners ||
+            !read_points(file, corner_count, view.left_corners) ||
+            !read_points(file, corner_count, view.left_refined_corners) ||
+            !read_points(file, corner_count, view.right_corners) ||
+            !read_points(file, corner_count, view.right_refined_corners) ||
+            !read_mat(file, view.left_thumbnail, CV_8UC1, MAX_THUMBNAIL_SIDE) ||
+            !read_mat(file, view.right_thumbnail, CV_8UC1, MAX_THUMBNAIL_SIDE)) {
+            return false;
+        }
+        loaded.views.push_back(std::move(view));
+    }
+
+    uint8_t has_intrinsics = 0;
+    if (!read_value(file, has_intrinsics)) return false;
+    if (has_intrinsics) {
+        if (!read_mat(file, loaded.K1, CV_64FC1, MAX_INTRINSICS_SIDE) || !read_mat(file, loaded.D1, CV_64FC1, MAX_INTRINSICS_SIDE) ||
+            !read_mat(file, loaded.K2, CV_64FC1, MAX_INTRINSICS_SIDE) || !read_mat(file, loaded.D2, CV_64FC1, MAX_INTRINSICS_SIDE)) {
+            return false;
+        }
+    }
+
+    *this = std::move(loaded);
+    return true;
+}
+
+bool CalibrationDataset::save(const std::string& path) const {
+    // Written next to the target and renamed, a crash never leaves half a file.
+    std::string temporary_path = path + ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+
+        file.write(MAGIC, 4);
+        write_value<uint32_t>(file, VERSION);
+        write_value<int32_t>(file, pattern_size.width);
+        write_value<int32_t>(file, pattern_size.height);
+        write_value<float>(file, square_size);
+        write_value<int32_t>(file, image_size.width);
+        write_value<int32_t>(file, image_size.height);
+        write_value<uint32_t>(file, next_id);
+        write_value<uint32_t>(file, (uint32_t) views.size());
+
+        for (const CalibrationDatasetView& view : views) {
+            write_value<uint32_t>(file, view.id);
+            write_value<uint32_t>(file, (uint32_t) view.left_corners.size());
+            write_points(file, view.left_corners);
+            write_points(file, view.left_refined_corners);
+            write_points(file, view.right_corners);
+            write_points(file, view.right_refined_corners);
+            write_mat(file, view.left_thumbnail, CV_8UC1);
+            write_mat(file, view.right_thumbnail, CV_8UC1);
+        }
+
+        write_value<uint8_t>(file, has_intrinsics() ? 1 : 0);
+        if (has_intrinsics()) {
+            write_mat(file, K1, CV_64FC1);
+            write_mat(file, D1, CV_64FC1);
+            write_mat(file, K2, CV_64FC1);
+            write_mat(file, D2, CV_64FC1);
+        }
+
+        if (!file) return false;
+    }
+
+    return std::rename(temporary_path.c_str(), path.c_str()) == 0;
+}
+
+uint32_t CalibrationDataset::add_view(const std::vector<cv::Point2f>& left_corners, const std::vector<cv::Point2f>& left_refined_corners,
+                                      const std::vector<cv::Point2f>& right_corners, const std::vector<cv::Point2f>& right_refined_corners,
+                                      const cv::Mat& left_gray, const cv::Mat& right_gray) {
+    CalibrationDatasetView view;
+    view.id = next_id++;
+    view.left_corners = left_corners;
+    view.left_refined_corners = left_refined_corners;
+    view.right_corners = right_corners;
+    view.right_refined_corners = right_refined_corners;
+
+    double scale = (double) THUMBNAIL_WIDTH / left_gray.cols;
+    cv::resize(left_gray, view.left_thumbnail, cv::Size(), scale, scale, cv::INTER_AREA);
+    cv::resize(right_gray, view.right_thumbnail, cv::Size(), scale, scale, cv::INTER_AREA);
+
+    views.push_back(std::move(view));
+    return views.back().id;
+}
+
+bool CalibrationDataset::remove_view(uint32_t id) {
+    for (auto it = views.begin(); it != views.end(); ++it) {
+        if (it->id == id) {
+            views.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+CalibrationViews CalibrationDataset::get_calibration_views() const {
+    CalibrationViews calibration_views;
+    std::vector<cv::Point3f> object_points = StereoCalibration::board_object_points(pattern_size, square_size);
+
+    for (const CalibrationDatasetView& view : views) {
+        calibration_views.object_points.push_back(object_points);
+        calibration_views.left_image_points.push_back(view.left_refined_corners);
+        calibration_views.right_image_points.push_back(view.right_refined_corners);
+    }
+
+    return calibration_views;
+}
+
+void CalibrationDataset::set_calibration_views(const CalibrationViews& calibration_views) {
+    views.clear();
+
+    for (size_t i = 0; i < calibration_views.left_image_points.size(); ++i) {
+        CalibrationDatasetView view;
+        view.id = next_id++;
+        view.left_corners = calibration_views.left_image_points[i];
+        view.left_refined_corners = calibration_views.left_image_points[i];
+        view.right_corners = calibration_views.right_image_points[i];
+        view.right_refined_corners = calibration_views.right_image_points[i];
+        views.push_back(std::move(view));
+    }
+}
+
+void CalibrationDataset::set_intrinsics(const cv::Mat& p_K1, const cv::Mat& p_D1, const cv::Mat& p_K2, const cv::Mat& p_D2) {
+    K1 = p_K1.clone();
+    D1 = p_D1.clone();
+    K2 = p_K2.clone();
+    D2 = p_D2.clone();
+}
+
+void CalibrationDataset::get_intrinsics(cv::Mat& r_K1, cv::Mat& r_D1, cv::Mat& r_K2, cv::Mat& r_D2) const {
+    r_K1 = K1.clone();
+    r_D1 = D1.clone();
+    r_K2 = K2.clone();
+    r_D2 = D2.clone();
+}
@@ -0,0 +1,103 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <string>
+#include <vector>
+
+#include "stereo_calibration.hpp"
+
+namespace godot {
+
+// One accepted stereo picture. Thumbnails are small gray previews, they may
+// be empty for views imported from elsewhere.
+struct CalibrationDatasetView {
+    uint32_t id = 0;
+    std::vector<cv::Point2f> left_corners;            // as detected
+    std::vector<cv::Point2f> left_refined_corners;    // after cornerSubPix, used for solving
+    std::vector<cv::Point2f> right_corners;
+    std::vector<cv::Point2f> right_refined_corners;
+    cv::Mat left_thumbnail;                           // CV_8UC1
+    cv::Mat right_thumbnail;
+};
+
+// Compact on-disk calibration data: the detected corners of every view plus
+// thumbnails, and the intrinsics of the last solve to warm start the next one.
+// A few hundred kilobytes instead of the full resolution pictures, and no
+// detection is needed to solve again.
+//
+// File layout (little endian, the only byte order of the supported targets):
+//   "FXCD", uint32 version
+//   int32 pattern width, height, float square size, int32 image width, height
+//   uint32 next id, uint32 view count
+//   per view: uint32 id, uint32 corner count, 4 x corner count x (float x, float y),
+//             2 x (int32 rows, int32 cols, rows * cols bytes)
+//   uint8 has intrinsics, then K1, D1, K2, D2 as (int32 rows, int32 cols, doubles)
+class CalibrationDataset {
+public:
+    static const uint32_t VERSION = 1;
+    static const int THUMBNAIL_WIDTH = 128;
+
+    CalibrationDataset() {}
+    CalibrationDataset(cv::Size p_pattern_size, float p_square_size, cv::Size p_image_size);
+
+    // Leaves the dataset untouched if the file is missing or malformed.
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+
+    // Returns the id of the new view. The thumbnails are made from the full resolution eyes.
+    uint32_t add_view(const std::vector<cv::Point2f>& left_corners, const std::vector<cv::Point2f>& left_refined_corners,
+                      const std::vector<cv::Point2f>& right_corners, const std::vector<cv::Point2f>& right_refined_corners,
+                      const cv::Mat& left_gray, const cv::Mat& right_gray);
+    bool remove_view(uint32_t id);
+    void clear_views() { views.clear(); }
+
+    const std::vector<CalibrationDatasetView>& get_views() const { return views; }
+    CalibrationViews get_calibration_views() const;
+
+    // Replaces the views, without thumbnails, e.g. after a calibration from files.
+    void set_calibration_views(const CalibrationViews& calibration_views);
+
+    bool has_intrinsics() const { return !K1.empty() && !K2.empty(); }
+    void set_intrinsics(const cv::Mat& p_K1, const cv::Mat& p_D1, const cv::Mat& p_K2, const cv::Mat& p_D2);
+    void get_intrinsics(cv::Mat& r_K1, cv::Mat& r_D1, cv::Mat& r_K2, cv::Mat& r_D2) const;
+
+    cv::Size get_pattern_size() const { return pattern_size; }
+    float get_square_size() const { return square_size; }
+    cv::Size get_image_size() const { return image_size; }
+
+private:
+    cv::Size pattern_size;
+    float square_size = 1.0f;
+    cv::Size image_size;
+
+    uint32_t next_id = 1;
+    std::vector<CalibrationDatasetView> views;
+
+    cv::Mat K1, D1, K2, D2;
+};
+
+}
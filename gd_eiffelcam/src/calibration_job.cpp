@@ -0,0 +1,377 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "calibration_job.hpp"
+
+#include "opencv2/calib3d.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <future>
+#include <numeric>
+
+#include "memory_accounting.hpp"
+#include "tracing.h"
+
+using namespace godot;
+
+CalibrationJob::CalibrationJob(const Settings& p_settings, const CalibrationViews& p_views) :
+    settings(p_settings),
+    views(p_views),
+    cancelled(false),
+    state(STATE_IDLE) {
+}
+
+CalibrationJob::~CalibrationJob() {
+    cancel();
+    if (thread.joinable()) thread.join();
+}
+
+void CalibrationJob::start() {
+    state = STATE_RUNNING;
+    thread = std::thread(&CalibrationJob::run, this);
+}
+
+CalibrationJob::Progress CalibrationJob::get_progress() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return progress;
+}
+
+std::string CalibrationJob::get_error() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return error;
+}
+
+void CalibrationJob::get_intrinsics(cv::Mat& r_K1, cv::Mat& r_D1, cv::Mat& r_K2, cv::Mat& r_D2) {
+    std::unique_lock<std::mutex> lock(mutex);
+    r_K1 = solved_K1;
+    r_D1 = solved_D1;
+    r_K2 = solved_K2;
+    r_D2 = solved_D2;
+}
+
+CalibrationJob::Diagnostics CalibrationJob::get_diagnostics() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return diagnostics;
+}
+
+void CalibrationJob::report(int stage, int iteration, double rms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    progress.stage = stage;
+    progress.iteration = iteration;
+    progress.rms = rms;
+    ++progress.serial;
+}
+
+void CalibrationJob::fail(const std::string& message) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        error = message;
+    }
+    state = STATE_FAILED;
+}
+
+bool CalibrationJob::solve_intrinsics(const std::vector<std::vector<cv::Point3f> >& object_points, const std::vector<std::vector<cv::Point2f> >& image_points, const cv::Mat& initial_camera_matrix, const cv::Mat& initial_distortion_coefficients, cv::Mat& r_camera_matrix, cv::Mat& r_distortion_coefficients, std::vector<cv::Mat>& r_rvecs, std::vector<cv::Mat>& r_tvecs, double& r_rms) {
+    int flags = 0;
+
+    if (!initial_camera_matrix.empty() && !initial_distortion_coefficients.empty()) {
+        r_camera_matrix = initial_camera_matrix.clone();
+        r_distortion_coefficients = initial_distortion_coefficients.clone();
+        flags |= cv::CALIB_USE_INTRINSIC_GUESS;
+    }
+    double previous_rms = DBL_MAX;
+
+    for (int iteration = 0; iteration < settings.max_intrinsic_iterations; iteration += settings.iterations_per_chunk) {
+        if (cancelled) return false;
+
+        cv::TermCriteria chunk(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, settings.iterations_per_chunk, DBL_EPSILON);
+        r_rms = cv::calibrateCamera(object_points, image_points, settings.image_size, r_camera_matrix, r_distortion_coefficients, r_rvecs, r_tvecs, flags, chunk);
+        flags |= cv::CALIB_USE_INTRINSIC_GUESS;
+
+        report(STAGE_INTRINSICS, iteration + settings.iterations_per_chunk, r_rms);
+
+        if (previous_rms - r_rms < 1e-4) break;
+        previous_rms = r_rms;
+    }
+
+    return !cancelled;
+}
+
+bool CalibrationJob::solve_stereo(const CalibrationViews& subset, const cv::Mat& K1, const cv::Mat& D1, const cv::Mat& K2, const cv::Mat& D2, cv::Mat& r_R, cv::Vec3d& r_T, cv::Mat& r_E, cv::Mat& r_F, cv::Mat& r_errors, double& r_rms) {
+    // The first chunk starts from the poses of the views, the next ones from R and T.
+    int flags = cv::CALIB_FIX_INTRINSIC;
+    double previous_rms = DBL_MAX;
+
+    for (int iteration = 0; iteration < settings.max_stereo_iterations; iteration += settings.iterations_per_chunk) {
+        if (cancelled) return false;
+
+        cv::TermCriteria chunk(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, settings.iterations_per_chunk, settings.criteria.epsilon);
+        r_rms = cv::stereoCalibrate(
+            subset.object_points,
+            subset.left_image_points,
+            subset.right_image_points,
+            K1, D1, K2, D2,
+            settings.image_size, r_R, r_T, r_E, r_F, r_errors, flags, chunk);
+        flags |= cv::CALIB_USE_EXTRINSIC_GUESS;
+
+        if (previous_rms - r_rms < 1e-4) break;
+        previous_rms = r_rms;
+    }
+
+    return !cancelled;
+}
+
+std::vector<double> CalibrationJob::compute_view_errors(const std::vector<std::vector<cv::Point3f> >& object_points, const std::vector<std::vector<cv::Point2f> >& image_points, const cv::Mat& camera_matrix, const cv::Mat& distortion_coefficients, const std::vector<cv::Mat>& rvecs, const std::vector<cv::Mat>& tvecs) {
+    std::vector<double> errors(object_points.size(), 0.0);
+    std::vector<cv::Point2f> projected;
+
+    for (size_t i = 0; i < object_points.size(); ++i) {
+        cv::projectPoints(object_points[i], rvecs[i], tvecs[i], camera_matrix, distortion_coefficients, projected);
+        double error = cv::norm(image_points[i], projected, cv::NORM_L2);
+        errors[i] = std::sqrt(error * error / projected.size());
+    }
+
+    return errors;
+}
+
+std::vector<int> CalibrationJob::find_outliers(const std::vector<double>& errors) {
+    std::vector<double> sorted = errors;
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    double median = sorted[sorted.size() / 2];
+    double threshold = std::max(settings.max_view_error, settings.outlier_factor * median);
+
+    std::vector<int> outliers;
+    for (size_t i = 0; i < errors.size(); ++i) {
+        if (errors[i] > threshold) outliers.push_back(i);
+    }
+    std::sort(outliers.begin(), outliers.end(), [&](int a, int b) { return errors[a] > errors[b]; });
+
+    int removable = std::max(0, (int) errors.size() - settings.min_views);
+    if ((int) outliers.size() > removable) outliers.resize(removable);
+    return outliers;
+}
+
+void CalibrationJob::run() {
+    TRACE_EVENT("calibration", "CalibrationJob::run");
+    MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_CALIBRATION);
+
+    state = STATE_RUNNING;
+
+    try {
+        execute();
+    } catch (const std::exception& exception) {
+        // cv::Exception, and std::bad_alloc from the big solves
+        fail(exception.what());
+    }
+}
+
+void CalibrationJob::execute() {
+
+    if (!settings.images_folder.empty()) {
+        report(STAGE_DETECTING, 0, 0.0);
+
+        std::string detection_error;
+        views = CalibrationViews();
+        if (!StereoCalibration::detect_from_files(settings.images_folder, settings.image_count, settings.pattern_size, settings.square_size, settings.criteria, views, detection_error, &cancelled)) {
+            if (cancelled) {
+                state = STATE_CANCELLED;
+                return;
+            }
+            fail(detection_error);
+            return;
+        }
+    }
+
+    if (views.object_points.empty()) {
+        fail("No calibration views.");
+        return;
+    }
+
+    if (cancelled) {
+        state = STATE_CANCELLED;
+        return;
+    }
+
+    // Indices into views of the views the solves still use.
+    std::vector<int> active(views.object_points.size());
+    std::iota(active.begin(), active.end(), 0);
+
+    Diagnostics pass_diagnostics;
+    pass_diagnostics.views.resize(views.object_points.size());
+
+    cv::Mat guess_K1 = settings.initial_K1, guess_D1 = settings.initial_D1;
+    cv::Mat guess_K2 = settings.initial_K2, guess_D2 = settings.initial_D2;
+
+    cv::Mat K1, D1, K2, D2;
+    cv::Mat R;
+    cv::Vec3d T;
+    cv::Mat E;
+    cv::Mat F;
+    double stereo_rms = 0.0;
+
+    for (int pass = 0; ; ++pass) {
+        if (cancelled) {
+            state = STATE_CANCELLED;
+            return;
+        }
+
+        CalibrationViews subset;
+        for (int index : active) {
+            subset.object_points.push_back(views.object_points[index]);
+            subset.left_image_points.push_back(views.left_image_points[index]);
+            subset.right_image_points.push_back(views.right_image_points[index]);
+        }
+
+        // The eyes are independent, the right one is solved on a second thread.
+        std::vector<cv::Mat> left_rvecs, left_tvecs, right_rvecs, right_tvecs;
+        double left_rms = 0.0, right_rms = 0.0;
+
+        std::future<bool> right = std::async(std::launch::async, [&]() {
+            MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_CALIBRATION);
+            return solve_intrinsics(subset.object_points, subset.right_image_points, guess_K2, guess_D2, K2, D2, right_rvecs, right_tvecs, right_rms);
+        });
+        bool left_solved = solve_intrinsics(subset.object_points, subset.left_image_points, guess_K1, guess_D1, K1, D1, left_rvecs, left_tvecs, left_rms);
+        bool right_solved = right.get();
+
+        if (!left_solved || !right_solved) {
+            state = STATE_CANCELLED;
+            return;
+        }
+
+        // The next pass only has to absorb the effect of the dropped views.
+        guess_K1 = K1.clone();
+        guess_D1 = D1.clone();
+        guess_K2 = K2.clone();
+        guess_D2 = D2.clone();
+
+        cv::Mat new_K1 = cv::getOptimalNewCameraMatrix(K1, D1, settings.image_size, 1, settings.image_size);
+        cv::Mat new_K2 = cv::getOptimalNewCameraMatrix(K2, D2, settings.image_size, 1, settings.image_size);
+
+        report(STAGE_STEREO, pass, std::max(left_rms, right_rms));
+
+        // Every pass solves the extrinsics from scratch, the views changed
+        cv::Mat stereo_errors;
+        R = cv::Mat();
+        T = cv::Vec3d();
+        if (!solve_stereo(subset, new_K1, D1, new_K2, D2, R, T, E, F, stereo_errors, stereo_rms)) {
+            state = STATE_CANCELLED;
+            return;
+        }
+
+        report(STAGE_STEREO, pass + 1, stereo_rms);
+
+        std::vector<double> left_errors = compute_view_errors(subset.object_points, subset.left_image_points, K1, D1, left_rvecs, left_tvecs);
+        std::vector<double> right_errors = compute_view_errors(subset.object_points, subset.right_image_points, K2, D2, right_rvecs, right_tvecs);
+
+        std::vector<double> worst(active.size());
+        for (size_t i = 0; i < active.size(); ++i) {
+            ViewDiagnostics& view = pass_diagnostics.views[active[i]];
+            view.left_error = left_errors[i];
+            view.right_error = right_errors[i];
+            view.stereo_left_error = stereo_errors.at<double>(i, 0);
+            view.stereo_right_error = stereo_errors.at<double>(i, 1);
+            worst[i] = std::max(std::max(view.left_error, view.right_error), std::max(view.stereo_left_error, view.stereo_right_error));
+        }
+        pass_diagnostics.left_rms = left_rms;
+        pass_diagnostics.right_rms = right_rms;
+        pass_diagnostics.stereo_rms = stereo_rms;
+        pass_diagnostics.passes = pass + 1;
+
+        std::vector<int> outliers;
+        if (pass < settings.max_rejection_passes) {
+            outliers = find_outliers(worst);
+        }
+
+        std::vector<bool> drop(active.size(), false);
+        for (int outlier : outliers) {
+            ViewDiagnostics& view = pass_diagnostics.views[active[outlier]];
+            view.rejected = true;
+            view.rejected_pass = pass;
+            drop[outlier] = true;
+        }
+        pass_diagnostics.rejected_count += outliers.size();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            diagnostics = pass_diagnostics;
+            solved_K1 = K1.clone();
+            solved_D1 = D1.clone();
+            solved_K2 = K2.clone();
+            solved_D2 = D2.clone();
+        }
+
+        if (outliers.empty()) {
+            K1 = new_K1;
+            K2 = new_K2;
+            break;
+        }
+
+        std::vector<int> kept;
+        for (size_t i = 0; i < active.size(); ++i) {
+            if (!drop[i]) kept.push_back(active[i]);
+        }
+        active.swap(kept);
+    }
+
+    cv::Mat R1, R2, P1, P2, Q;
+    cv::stereoRectify(K1, D1, K2, D2, settings.image_size, R, T, R1, R2, P1, P2, Q, cv::CALIB_ZERO_DISPARITY, 1.0, settings.image_size);
+
+    report(STAGE_SAVING, 0, stereo_rms);
+
+    if (!save_stereo_coefficients(settings.output_path, K1, D1, K2, D2, R, cv::Mat(T), E, F, R1, R2, P1, P2, Q)) {
+        fail("Unable to write " + settings.output_path);
+        return;
+    }
+
+    report(STAGE_DONE, 0, stereo_rms);
+    state = STATE_SUCCEEDED;
+}
+
+bool CalibrationJob::save_stereo_coefficients(
+    const std::string& path,
+    const cv::Mat& K1, const cv::Mat& D1, const cv::Mat& K2, const cv::Mat& D2,
+    const cv::Mat& R, const cv::Mat& T, const cv::Mat& E, const cv::Mat& F,
+    const cv::Mat& R1, const cv::Mat& R2, const cv::Mat& P1, const cv::Mat& P2, const cv::Mat& Q) {
+
+    //Save the stereo coefficients to given path/file.
+    cv::FileStorage cv_file = cv::FileStorage();
+    bool file_opened = cv_file.open(path, cv::FileStorage::WRITE);
+    if (!file_opened) return false;
+
+    cv_file.write("K1", K1);
+    cv_file.write("D1", D1);
+    cv_file.write("K2", K2);
+    cv_file.write("D2", D2);
+    cv_file.write("R", R);
+    cv_file.write("T", T);
+    cv_file.write("E", E);
+    cv_file.write("F", F);
+    cv_file.write("R1", R1);
+    cv_file.write("R2", R2);
+    cv_file.write("P1", P1);
+    cv_file.write("P2", P2);
+    cv_file.write("Q", Q);
+    cv_file.release();
+    return true;
+}
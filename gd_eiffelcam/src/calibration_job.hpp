@@ -0,0 +1,175 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "stereo_calibration.hpp"
+
+namespace godot {
+
+// Stereo calibration on its own thread. The job owns a copy of the views,
+// reports its stage, iteration and current RMS, and can be cancelled.
+//
+// The intrinsic and stereo solves run in chunks of a few Levenberg-Marquardt
+// iterations, each continuing from the previous result, so a cancel is
+// noticed after at most one chunk instead of after the whole solve.
+//
+// After every pass the per view reprojection errors of both eyes are checked,
+// outlier views are dropped and the rest is solved again, starting from the
+// intrinsics of the previous pass.
+class CalibrationJob {
+public:
+    enum STAGE {
+        STAGE_DETECTING,
+        STAGE_INTRINSICS,
+        STAGE_STEREO,
+        STAGE_SAVING,
+        STAGE_DONE
+    };
+
+    enum STATE {
+        STATE_IDLE,
+        STATE_RUNNING,
+        STATE_SUCCEEDED,
+        STATE_FAILED,
+        STATE_CANCELLED
+    };
+
+    struct Settings {
+        cv::Size image_size;
+        cv::Size pattern_size;
+        float square_size = 1.0f;
+        cv::TermCriteria criteria;          // corner refinement, its epsilon also ends the stereo solve
+        int max_intrinsic_iterations = 30;
+        int max_stereo_iterations = 30;
+        int iterations_per_chunk = 5;
+        std::string output_path;
+
+        // Calibration from files: detect the views from <images_folder>full_image_<n>.png first.
+        std::string images_folder;
+        int image_count = 0;
+
+        // Intrinsics of a previous solve. If set, the solves start from them
+        // and usually converge within the first chunk.
+        cv::Mat initial_K1, initial_D1, initial_K2, initial_D2;
+
+        // A view is an outlier if its error is above both max_view_error and
+        // outlier_factor times the median error, in pixels. Views are never
+        // dropped below min_views.
+        double max_view_error = 1.0;
+        double outlier_factor = 3.0;
+        int max_rejection_passes = 3;
+        int min_views = 10;
+    };
+
+    // RMS reprojection errors in pixels. Rejected views keep the errors of
+    // the pass that dropped them.
+    struct ViewDiagnostics {
+        double left_error = 0.0;            // intrinsic solve of each eye
+        double right_error = 0.0;
+        double stereo_left_error = 0.0;     // stereo solve
+        double stereo_right_error = 0.0;
+        bool rejected = false;
+        int rejected_pass = -1;
+    };
+
+    struct Diagnostics {
+        std::vector<ViewDiagnostics> views; // same order as get_views()
+        double left_rms = 0.0;
+        double right_rms = 0.0;
+        double stereo_rms = 0.0;
+        int passes = 0;
+        int rejected_count = 0;
+    };
+
+    struct Progress {
+        int stage = STAGE_DETECTING;
+        int iteration = 0;
+        double rms = 0.0;
+        int serial = 0;                     // incremented on every update
+    };
+
+    CalibrationJob(const Settings& p_settings, const CalibrationViews& p_views);
+    ~CalibrationJob();
+
+    void start();
+    void cancel() { cancelled = true; }
+
+    // Runs on the calling thread, start() runs this on the job thread.
+    void run();
+
+    STATE get_state() { return (STATE) state.load(); }
+    Progress get_progress();
+    std::string get_error();
+
+    // Valid once the job succeeded. The intrinsics are the solver output,
+    // before getOptimalNewCameraMatrix, so they can warm start the next job.
+    const CalibrationViews& get_views() { return views; }
+    void get_intrinsics(cv::Mat& r_K1, cv::Mat& r_D1, cv::Mat& r_K2, cv::Mat& r_D2);
+    Diagnostics get_diagnostics();
+
+    static bool save_stereo_coefficients(
+        const std::string& path,
+        const cv::Mat& K1, const cv::Mat& D1, const cv::Mat& K2, const cv::Mat& D2,
+        const cv::Mat& R, const cv::Mat& T, const cv::Mat& E, const cv::Mat& F,
+        const cv::Mat& R1, const cv::Mat& R2, const cv::Mat& P1, const cv::Mat& P2, const cv::Mat& Q);
+
+private:
+    Settings settings;
+    CalibrationViews views;
+
+    std::thread thread;
+    std::atomic<bool> cancelled;
+    std::atomic<int> state;
+
+    std::mutex mutex;
+    Progress progress;
+    std::string error;
+
+    cv::Mat solved_K1, solved_D1, solved_K2, solved_D2;
+    Diagnostics diagnostics;
+
+    void execute();
+    void report(int stage, int iteration, double rms);
+    void fail(const std::string& message);
+
+    // Returns false if cancelled.
+    bool solve_intrinsics(const std::vector<std::vector<cv::Point3f> >& object_points, const std::vector<std::vector<cv::Point2f> >& image_points, const cv::Mat& initial_camera_matrix, const cv::Mat& initial_distortion_coefficients, cv::Mat& r_camera_matrix, cv::Mat& r_distortion_coefficients, std::vector<cv::Mat>& r_rvecs, std::vector<cv::Mat>& r_tvecs, double& r_rms);
+
+    // R and T are the result of the previous chunk. Returns false if cancelled.
+    bool solve_stereo(const CalibrationViews& subset, const cv::Mat& K1, const cv::Mat& D1, const cv::Mat& K2, const cv::Mat& D2, cv::Mat& r_R, cv::Vec3d& r_T, cv::Mat& r_E, cv::Mat& r_F, cv::Mat& r_errors, double& r_rms);
+
+    static std::vector<double> compute_view_errors(const std::vector<std::vector<cv::Point3f> >& object_points, const std::vector<std::vector<cv::Point2f> >& image_points, const cv::Mat& camera_matrix, const cv::Mat& distortion_coefficients, const std::vector<cv::Mat>& rvecs, const std::vector<cv::Mat>& tvecs);
+
+    // Indices into errors of the views to drop, worst first.
+    std::vector<int> find_outliers(const std::vector<double>& errors);
+};
+
+}
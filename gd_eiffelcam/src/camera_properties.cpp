@@ -0,0 +1,413 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "camera_properties.hpp"
+
+#include <algorithm>
+
+#include "tracing.h"
+
+using namespace godot;
+
+ICameraProperty::~ICameraProperty() {
+
+}
+
+namespace {
+
+template<typename DT>
+class CameraProperty : public ICameraProperty {
+public:
+    CameraProperty(String name,
+                        uvc_device_handle_t* dh,
+                        uvc_error_t (*getter)(uvc_device_handle_t*, DT*, uvc_req_code),
+                        uvc_error_t (*setter)(uvc_device_handle_t*, DT),
+                        String type = "range",
+                        Array values = Array(),
+                        Array labels = Array()) {
+                            this->_name = name;
+                            this->dh = dh;
+                            get_funcptr = getter;
+                            set_funcptr = setter;
+                            this->type = type == "enum" ? TYPE_ENUM : (type == "bool" ? TYPE_BOOL : TYPE_RANGE);
+                            // Plain copy, the worker thread must not touch Godot arrays.
+                            for (int i = 0; i < values.size(); ++i) {
+                                this->values.push_back((int) values[i]);
+                            }
+                            this->labels = labels;
+
+    }
+
+    ~CameraProperty() {
+
+    }
+
+    String name() {
+        return _name;
+    }
+
+    uvc_error_t set(int p, bool convert) {
+        if (type == TYPE_ENUM && convert) {
+            if (p < 0 || p >= (int) values.size()) return UVC_ERROR_INVALID_PARAM;
+            p = values[p];
+        }
+
+        uvc_error_t res = set_funcptr(dh, static_cast<DT>(p));
+        return res;
+    }
+
+    int get() {
+        return read(uvc_req_code::UVC_GET_CUR);
+    }
+
+    Variant label_for(int value) {
+        if (type == TYPE_ENUM && value >= 0 && value < labels.size()) {
+            return labels[value];
+        }
+
+        return value;
+    }
+
+    int get_max() {
+        if (type == TYPE_BOOL) {
+            return 1;
+        } else if (type == TYPE_ENUM) {
+            return (int) values.size() - 1;
+        } else {
+            DT result;
+            get_funcptr(dh, &result, uvc_req_code::UVC_GET_MAX);
+            return static_cast<int>(result);
+        }
+    }
+
+    int get_min() {
+        if (type == TYPE_BOOL || type == TYPE_ENUM) {
+            return 0;
+        } else {
+            DT result;
+            get_funcptr(dh, &result, uvc_req_code::UVC_GET_MIN);
+            return static_cast<int>(result);
+        }
+    }
+
+    int get_def() {
+        return read(uvc_req_code::UVC_GET_DEF);
+    }
+
+private:
+    enum TYPE {
+        TYPE_RANGE,
+        TYPE_BOOL,
+        TYPE_ENUM
+    };
+
+    int read(uvc_req_code request) {
+        DT result = 0;
+        get_funcptr(dh, &result, request);
+
+        int res = static_cast<int>(result);
+
+        if (type == TYPE_ENUM) {
+            auto it = std::find(values.begin(), values.end(), res);
+            return it == values.end() ? -1 : (int) (it - values.begin());
+        }
+
+        return res;
+    }
+
+    String _name;
+    uvc_error_t (*get_funcptr)(uvc_device_handle_t*, DT*, uvc_req_code);
+    uvc_error_t (*set_funcptr)(uvc_device_handle_t*, DT);
+    int type;
+
+    std::vector<int> values;
+    Array labels;
+};
+
+template<typename DT>
+void add_property(std::map<std::string, std::unique_ptr<ICameraProperty>>& properties,
+                  const char* name,
+                  uvc_device_handle_t* dh,
+                  uvc_error_t (*getter)(uvc_device_handle_t*, DT*, uvc_req_code),
+                  uvc_error_t (*setter)(uvc_device_handle_t*, DT),
+                  String type = "range",
+                  Array values = Array(),
+                  Array labels = Array()) {
+    properties[name] = std::unique_ptr<ICameraProperty>(new CameraProperty<DT>(name, dh, getter, setter, type, values, labels));
+}
+
+std::string to_key(const String& name) {
+    return std::string(name.utf8().get_data());
+}
+
+}
+
+void CameraProperties::init(MetricsRegistry& metrics) {
+    writes_sent = metrics.counter("camera_property_writes");
+    writes_coalesced = metrics.counter("camera_property_writes_coalesced");
+    write_errors = metrics.counter("camera_property_write_errors");
+    write_ms = metrics.histogram("camera_property_write_ms", MetricsRegistry::latency_buckets_ms());
+}
+
+void CameraProperties::start(uvc_device_handle_t* devh) {
+    stop();
+
+    add_property<int16_t>(properties, "brightness", devh, &uvc_get_brightness, &uvc_set_brightness);
+    add_property<uint16_t>(properties, "contrast", devh, &uvc_get_contrast, &uvc_set_contrast);
+    add_property<uint16_t>(properties, "saturation", devh, &uvc_get_saturation, &uvc_set_saturation);
+    add_property<int16_t>(properties, "hue", devh, &uvc_get_hue, &uvc_set_hue);
+    add_property<uint8_t>(properties, "white_balance_temperature_auto", devh, &uvc_get_white_balance_temperature_auto, &uvc_set_white_balance_temperature_auto, "bool");
+    add_property<uint16_t>(properties, "gamma", devh, &uvc_get_gamma, &uvc_set_gamma);
+    add_property<uint16_t>(properties, "gain", devh, &uvc_get_gain, &uvc_set_gain);
+    add_property<uint16_t>(properties, "white_balance_temperature", devh, &uvc_get_white_balance_temperature, &uvc_set_white_balance_temperature);
+    add_property<uint16_t>(properties, "sharpness", devh, &uvc_get_sharpness, &uvc_set_sharpness);
+    add_property<uint16_t>(properties, "backlight_compensation", devh, &uvc_get_backlight_compensation, &uvc_set_backlight_compensation);
+    add_property<uint32_t>(properties, "exposure_abs", devh, &uvc_get_exposure_abs, &uvc_set_exposure_abs);
+    add_property<uint16_t>(properties, "focus_abs", devh, &uvc_get_focus_abs, &uvc_set_focus_abs);
+    add_property<uint8_t>(properties, "focus_auto", devh, &uvc_get_focus_auto, &uvc_set_focus_auto, "bool");
+
+    Array power_line_frequency_values, power_line_frequency_names;
+    Array ae_mode_values, ae_mode_names;
+
+    {
+        power_line_frequency_values.append(0);
+        power_line_frequency_values.append(1);
+        power_line_frequency_values.append(2);
+
+        power_line_frequency_names.append("Disabled");
+        power_line_frequency_names.append("50 Hz");
+        power_line_frequency_names.append("60 Hz");
+    }
+
+    {
+        ae_mode_values.append(1);
+        ae_mode_values.append(8);
+
+        ae_mode_names.append("Manual Mode");
+        ae_mode_names.append("Aperture Priority Mode");
+    }
+
+    add_property<uint8_t>(properties, "power_line_frequency", devh, &uvc_get_power_line_frequency, &uvc_set_power_line_frequency, "enum", power_line_frequency_values, power_line_frequency_names);
+    add_property<uint8_t>(properties, "ae_mode", devh, &uvc_get_ae_mode, &uvc_set_ae_mode, "enum", ae_mode_values, ae_mode_names);
+
+    quit = false;
+    paused = false;
+    worker = std::thread(&CameraProperties::run, this);
+}
+
+void CameraProperties::pause() {
+    std::unique_lock<std::mutex> lock(mutex);
+    paused = true;
+    idle.wait(lock, [this]() { return !transferring; });
+}
+
+void CameraProperties::resume() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        paused = false;
+    }
+    condition.notify_all();
+}
+
+void CameraProperties::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    condition.notify_all();
+
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ready = false;
+    properties.clear();
+    cache.clear();
+    pending.clear();
+    pending_order.clear();
+    changed.clear();
+}
+
+bool CameraProperties::has(const String& name) {
+    return properties.find(to_key(name)) != properties.end();
+}
+
+std::vector<String> CameraProperties::get_names() {
+    std::vector<String> names;
+    if (!ready) return names;
+
+    for (const auto& entry : properties) {
+        names.push_back(entry.second->name());
+    }
+    return names;
+}
+
+bool CameraProperties::get(const String& name, CameraPropertyValue& r_value) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = cache.find(to_key(name));
+    if (it == cache.end()) return false;
+
+    r_value = it->second;
+    return true;
+}
+
+Variant CameraProperties::get_label(const String& name) {
+    std::string key = to_key(name);
+
+    auto property = properties.find(key);
+    if (property == properties.end()) return Variant();
+
+    int current;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(key);
+        if (it == cache.end()) return Variant();
+        current = it->second.current;
+    }
+
+    return property->second->label_for(current);
+}
+
+bool CameraProperties::set(const String& name, int value, bool convert) {
+    std::string key = to_key(name);
+    if (properties.find(key) == properties.end()) return false;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto cached = cache.find(key);
+        if (convert && cached != cache.end()) {
+            value = std::max(cached->second.min, std::min(value, cached->second.max));
+            if (value == cached->second.current && pending.find(key) == pending.end()) {
+                return true;
+            }
+            cached->second.current = value;
+        }
+
+        if (pending.find(key) != pending.end()) {
+            writes_coalesced->add();
+        } else {
+            pending_order.push_back(key);
+        }
+        pending[key] = PendingWrite{ value, convert };
+    }
+
+    condition.notify_one();
+    return true;
+}
+
+bool CameraProperties::reset(const String& name) {
+    CameraPropertyValue value;
+    if (!get(name, value)) return false;
+
+    return set(name, value.def);
+}
+
+std::vector<String> CameraProperties::take_changed() {
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        names.swap(changed);
+    }
+
+    std::vector<String> result;
+    for (const std::string& name : names) {
+        result.push_back(String(name.c_str()));
+    }
+    return result;
+}
+
+void CameraProperties::discover() {
+    TRACE_EVENT("camera_properties", "CameraProperties::discover");
+
+    for (const auto& entry : properties) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]() { return quit || !paused; });
+            if (quit) return;
+            transferring = true;
+        }
+
+        CameraPropertyValue value;
+        value.current = entry.second->get();
+        value.min = entry.second->get_min();
+        value.max = entry.second->get_max();
+        value.def = entry.second->get_def();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cache[entry.first] = value;
+            changed.push_back(entry.first);
+            transferring = false;
+        }
+        idle.notify_all();
+    }
+
+    ready = true;
+}
+
+void CameraProperties::run() {
+    discover();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        condition.wait(lock, [this]() { return quit || (!paused && !pending_order.empty()); });
+        if (quit) return;
+
+        std::string key = pending_order.front();
+        pending_order.pop_front();
+        PendingWrite write = pending[key];
+        pending.erase(key);
+        transferring = true;
+
+        lock.unlock();
+
+        ICameraProperty* property = properties.at(key).get();
+        uvc_error_t res;
+        int current;
+        {
+            TRACE_EVENT("camera_properties", "write_control");
+            MetricTimer timer(write_ms);
+            res = property->set(write.value, write.convert);
+            current = property->get();
+        }
+        writes_sent->add();
+        if (res != UVC_SUCCESS) write_errors->add();
+
+        lock.lock();
+        transferring = false;
+        idle.notify_all();
+
+        // The UI already shows a newer value, report once that one is applied.
+        if (pending.find(key) != pending.end()) continue;
+
+        // Rejected or clamped by the camera.
+        auto cached = cache.find(key);
+        if (cached != cache.end() && cached->second.current != current) {
+            cached->second.current = current;
+            changed.push_back(key);
+        }
+    }
+}
@@ -0,0 +1,141 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <Godot.hpp>
+
+#include <libuvc/libuvc.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace godot {
+
+// One UVC control. Every accessor but name and label_for is a blocking USB
+// control transfer, so only the CameraProperties worker thread calls them.
+// Enum controls are exposed as indices into their value list.
+class ICameraProperty {
+public:
+    virtual String name() = 0;
+    virtual uvc_error_t set(int, bool) = 0;
+    virtual int get() = 0;
+    virtual int get_max() = 0;
+    virtual int get_min() = 0;
+    virtual int get_def() = 0;
+
+    // Display text of a value, main thread only.
+    virtual Variant label_for(int value) = 0;
+
+    virtual ~ICameraProperty() = 0;
+
+    uvc_device_handle_t* dh;
+};
+
+struct CameraPropertyValue {
+    int current = 0;
+    int min = 0;
+    int max = 0;
+    int def = 0;
+};
+
+// Camera controls as seen by the UI. The values are read from the camera once
+// per connection and served from a cache afterwards. Writes are queued for a
+// background thread that only sends the latest value of every control, so a
+// slider drag costs one control transfer per worker round trip instead of one
+// per mouse event, and none on the render thread.
+class CameraProperties {
+public:
+    ~CameraProperties() { stop(); }
+
+    void init(MetricsRegistry& metrics);
+
+    // Creates the controls of the device and starts reading them, stops a
+    // previous connection first.
+    void start(uvc_device_handle_t* devh);
+    void stop();
+
+    // Holds the worker between control transfers, pause returns once the one
+    // in flight is done. Writes queued meanwhile are sent on resume.
+    void pause();
+    void resume();
+
+    // True once all controls were read.
+    bool is_ready() { return ready.load(); }
+
+    bool has(const String& name);
+    std::vector<String> get_names();
+    bool get(const String& name, CameraPropertyValue& r_value);
+    Variant get_label(const String& name);
+
+    // Queues a write. With convert the value is in the UI range (an index for
+    // enums) and is cached right away, otherwise it is sent as is and the cache
+    // follows the value read back from the camera.
+    bool set(const String& name, int value, bool convert = true);
+    bool reset(const String& name);
+
+    // Controls whose cached value or range changed since the previous call.
+    std::vector<String> take_changed();
+
+private:
+    struct PendingWrite {
+        int value;
+        bool convert;
+    };
+
+    void run();
+    void discover();
+
+    // Created in start and not modified while the worker runs.
+    std::map<std::string, std::unique_ptr<ICameraProperty>> properties;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::map<std::string, CameraPropertyValue> cache;
+    std::map<std::string, PendingWrite> pending;
+    std::deque<std::string> pending_order;     // first queued is sent first
+    std::vector<std::string> changed;
+    bool quit = false;
+    bool paused = false;
+    bool transferring = false;     // a control transfer is in flight, the mutex is not held
+    std::condition_variable idle;
+
+    std::atomic<bool> ready{false};
+    std::thread worker;
+
+    MetricCounter* writes_sent = nullptr;
+    MetricCounter* writes_coalesced = nullptr;
+    MetricCounter* write_errors = nullptr;
+    MetricHistogram* write_ms = nullptr;
+};
+
+}
@@ -0,0 +1,87 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "chessboard_detector.hpp"
+
+#include "opencv2/calib3d.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+
+using namespace godot;
+
+bool ChessboardDetector::pre_check(const cv::Mat& gray, cv::Size pattern_size, std::vector<cv::Point2f>& r_corners, float pre_check_scale) {
+    cv::Mat small = gray;
+    if (pre_check_scale != 1.0f) {
+        cv::resize(gray, small, cv::Size(), pre_check_scale, pre_check_scale, cv::INTER_AREA);
+    }
+
+    int flags = cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK;
+    if (!cv::findChessboardCorners(small, pattern_size, r_corners, flags)) return false;
+
+    for (cv::Point2f& corner : r_corners) {
+        corner *= 1.0f / pre_check_scale;
+    }
+
+    return true;
+}
+
+bool ChessboardDetector::find_corners(const cv::Mat& gray, cv::Size pattern_size, std::vector<cv::Point2f>& r_corners, float pre_check_scale) {
+    std::vector<cv::Point2f> rough_corners;
+    if (!pre_check(gray, pattern_size, rough_corners, pre_check_scale)) return false;
+
+    // The inner corners are one square inside the board, which needs a
+    // light border around it. Two squares of margin cover both.
+    cv::Rect board = cv::boundingRect(rough_corners);
+    int square = std::max(board.width / std::max(pattern_size.width - 1, 1), board.height / std::max(pattern_size.height - 1, 1));
+    int margin = 2 * square + 8;
+
+    cv::Rect region(board.x - margin, board.y - margin, board.width + 2 * margin, board.height + 2 * margin);
+    region &= cv::Rect(0, 0, gray.cols, gray.rows);
+
+    if (!cv::findChessboardCorners(gray(region), pattern_size, r_corners)) return false;
+
+    cv::Point2f offset((float) region.x, (float) region.y);
+    for (cv::Point2f& corner : r_corners) {
+        corner += offset;
+    }
+
+    return true;
+}
+
+StereoChessboard ChessboardDetector::detect_stereo(const cv::Mat& side_by_side_gray, cv::Size pattern_size, float pre_check_scale) {
+    StereoChessboard result;
+
+    int eye_width = side_by_side_gray.cols / 2;
+    cv::Mat left_gray = side_by_side_gray(cv::Rect(0, 0, eye_width, side_by_side_gray.rows));
+    cv::Mat right_gray = side_by_side_gray(cv::Rect(eye_width, 0, eye_width, side_by_side_gray.rows));
+
+    if (!find_corners(left_gray, pattern_size, result.left_corners, pre_check_scale)) return result;
+    if (!find_corners(right_gray, pattern_size, result.right_corners, pre_check_scale)) return result;
+
+    result.left_gray = left_gray.clone();
+    result.right_gray = right_gray.clone();
+    result.found = true;
+
+    return result;
+}
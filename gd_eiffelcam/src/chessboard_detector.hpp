@@ -0,0 +1,57 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+namespace godot {
+
+// Chessboard found in both halves of a side by side stereo frame.
+struct StereoChessboard {
+    bool found = false;
+    cv::Mat left_gray;
+    cv::Mat right_gray;
+    std::vector<cv::Point2f> left_corners;
+    std::vector<cv::Point2f> right_corners;
+};
+
+// Two pass chessboard detection. A FAST_CHECK pass on a downscaled copy
+// rejects frames without a board in a few milliseconds, the full resolution
+// search then only runs inside the region the board was found in.
+class ChessboardDetector {
+public:
+    // Returns the corners in full resolution pixels of gray.
+    static bool find_corners(const cv::Mat& gray, cv::Size pattern_size, std::vector<cv::Point2f>& r_corners, float pre_check_scale = 0.5f);
+
+    // Only the downscaled pass, r_corners are in full resolution pixels but
+    // not refined. Used where a rough position is enough.
+    static bool pre_check(const cv::Mat& gray, cv::Size pattern_size, std::vector<cv::Point2f>& r_corners, float pre_check_scale = 0.5f);
+
+    // Stops at the first eye without a board.
+    static StereoChessboard detect_stereo(const cv::Mat& side_by_side_gray, cv::Size pattern_size, float pre_check_scale = 0.5f);
+};
+
+}
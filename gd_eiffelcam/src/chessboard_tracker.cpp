@@ -0,0 +1,206 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "chessboard_tracker.hpp"
+
+#include "opencv2/imgproc.hpp"
+
+#include <chrono>
+#include <cmath>
+
+#if defined(__linux__) || defined(__ANDROID__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "chessboard_detector.hpp"
+#include "memory_accounting.hpp"
+#include "tracing.h"
+
+using namespace godot;
+
+ChessboardTracker::~ChessboardTracker() {
+    stop();
+}
+
+void ChessboardTracker::start(FramePool* p_frame_pool, cv::Size p_pattern_size) {
+    if (running) return;
+
+    frame_pool = p_frame_pool;
+    pattern_size = p_pattern_size;
+    stop_requested = false;
+    last_sequence = UINT64_MAX;
+    updated = false;
+
+    running = true;
+    thread = std::thread(&ChessboardTracker::run, this);
+}
+
+void ChessboardTracker::stop() {
+    if (!running) return;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop_requested = true;
+    }
+    condition.notify_one();
+
+    thread.join();
+    running = false;
+}
+
+void ChessboardTracker::set_params(const Params& p_params) {
+    std::unique_lock<std::mutex> lock(mutex);
+    params = p_params;
+}
+
+ChessboardTracker::Params ChessboardTracker::get_params() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return params;
+}
+
+void ChessboardTracker::add_accepted_view(const std::vector<cv::Point2f>& corners, cv::Size image_size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    accepted_views.push_back(describe_view(corners, pattern_size, image_size));
+}
+
+void ChessboardTracker::clear_accepted_views() {
+    std::unique_lock<std::mutex> lock(mutex);
+    accepted_views.clear();
+}
+
+bool ChessboardTracker::fetch(TrackedChessboard& r_tracked) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (!updated) return false;
+
+    r_tracked = latest;
+    updated = false;
+    return true;
+}
+
+cv::Vec4f ChessboardTracker::describe_view(const std::vector<cv::Point2f>& corners, cv::Size pattern_size, cv::Size image_size) {
+    const cv::Point2f& up_left = corners[0];
+    const cv::Point2f& up_right = corners[pattern_size.width - 1];
+    const cv::Point2f& down_right = corners[corners.size() - 1];
+    const cv::Point2f& down_left = corners[corners.size() - pattern_size.width];
+
+    cv::Point2f center = (up_left + up_right + down_right + down_left) * 0.25f;
+
+    std::vector<cv::Point2f> outline = { up_left, up_right, down_right, down_left };
+    float area = (float) cv::contourArea(outline);
+    float size = std::sqrt(area / image_size.area());
+
+    // Deviation of the corner angle from 90 degrees, a tilted board has a larger one.
+    cv::Point2f a = up_right - up_left;
+    cv::Point2f b = down_left - up_left;
+    float angle = std::acos(std::max(-1.0f, std::min(1.0f, a.dot(b) / (float) (cv::norm(a) * cv::norm(b)))));
+    float skew = std::min(1.0f, 2.0f * std::abs((float) CV_PI / 2.0f - angle));
+
+    return cv::Vec4f(center.x / image_size.width, center.y / image_size.height, size, skew);
+}
+
+void ChessboardTracker::sample(const RetainedFrame& frame, const Params& sample_params, TrackedChessboard& r_tracked) {
+    int eye_width = frame.luma.cols / 2;
+    cv::Size eye_size(eye_width, frame.luma.rows);
+
+    cv::Mat left_small, right_small;
+    cv::resize(frame.luma(cv::Rect(0, 0, eye_width, eye_size.height)), left_small, cv::Size(), sample_params.scale, sample_params.scale, cv::INTER_AREA);
+    cv::resize(frame.luma(cv::Rect(eye_width, 0, eye_width, eye_size.height)), right_small, cv::Size(), sample_params.scale, sample_params.scale, cv::INTER_AREA);
+
+    r_tracked.left_found = ChessboardDetector::pre_check(left_small, pattern_size, r_tracked.left_corners, 1.0f);
+    if (!r_tracked.left_found) return;
+
+    r_tracked.right_found = ChessboardDetector::pre_check(right_small, pattern_size, r_tracked.right_corners, 1.0f);
+
+    // Sharpness inside the left board only, the background does not matter.
+    cv::Rect board = cv::boundingRect(r_tracked.left_corners) & cv::Rect(0, 0, left_small.cols, left_small.rows);
+    if (board.area() > 0) {
+        cv::Mat laplacian;
+        cv::Laplacian(left_small(board), laplacian, CV_32F);
+        cv::Scalar mean, deviation;
+        cv::meanStdDev(laplacian, mean, deviation);
+        r_tracked.sharpness = (float) (deviation[0] * deviation[0]);
+    }
+
+    float to_full = 1.0f / sample_params.scale;
+    for (cv::Point2f& corner : r_tracked.left_corners) corner *= to_full;
+    for (cv::Point2f& corner : r_tracked.right_corners) corner *= to_full;
+
+    cv::Vec4f view = describe_view(r_tracked.left_corners, pattern_size, eye_size);
+    r_tracked.coverage = view[2] * view[2];
+
+    r_tracked.novelty = 1.0f;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (const cv::Vec4f& accepted : accepted_views) {
+            r_tracked.novelty = std::min(r_tracked.novelty, (float) cv::norm(view, accepted, cv::NORM_L1));
+        }
+    }
+
+    r_tracked.good = r_tracked.right_found &&
+        r_tracked.sharpness >= sample_params.min_sharpness &&
+        r_tracked.coverage >= sample_params.min_coverage &&
+        r_tracked.novelty >= sample_params.min_novelty;
+}
+
+void ChessboardTracker::run() {
+    MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_CALIBRATION);
+
+#if defined(__linux__) || defined(__ANDROID__)
+    // Lower than the decode and render threads of the process.
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 10);
+#endif
+
+    while (true) {
+        Params current_params;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stop_requested) break;
+            current_params = params;
+        }
+
+        std::shared_ptr<const RetainedFrame> frame = frame_pool->get();
+        if (frame != nullptr && !frame->luma.empty() && frame->sequence != last_sequence) {
+            last_sequence = frame->sequence;
+
+            TRACE_EVENT("calibration", "ChessboardTracker::sample");
+
+            TrackedChessboard tracked;
+            tracked.sequence = frame->sequence;
+            sample(*frame, current_params, tracked);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            latest = std::move(tracked);
+            updated = true;
+        }
+
+        // Release the frame before sleeping, so the pool can recycle it.
+        frame.reset();
+
+        // A full period after the sample, not a fixed rate, bounds the duty cycle.
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait_for(lock, std::chrono::duration<float>(1.0f / std::max(current_params.rate_hz, 0.1f)), [this] { return stop_requested; });
+    }
+}
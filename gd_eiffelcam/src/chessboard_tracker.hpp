@@ -0,0 +1,106 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_pool.hpp"
+
+namespace godot {
+
+// Result of one tracking sample. Corners are in full resolution pixels of
+// the respective eye.
+struct TrackedChessboard {
+    uint64_t sequence = 0;
+    bool left_found = false;
+    bool right_found = false;
+    std::vector<cv::Point2f> left_corners;
+    std::vector<cv::Point2f> right_corners;
+
+    float sharpness = 0.0f;     // variance of the Laplacian inside the board, decimated image
+    float coverage = 0.0f;      // board area / eye area
+    float novelty = 0.0f;       // distance to the closest accepted view
+    bool good = false;          // worth taking as a calibration picture
+};
+
+// Low rate chessboard tracking for calibration mode. Samples the newest luma
+// frame of the frame pool at rate_hz, decimated, and rates the view. The
+// thread runs at a lower priority and sleeps a full period after every
+// sample, so it never takes more than a small share of a core from decoding.
+class ChessboardTracker {
+public:
+    struct Params {
+        float rate_hz = 5.0f;
+        float scale = 0.25f;            // decimation of the sampled eyes
+        float min_sharpness = 50.0f;
+        float min_coverage = 0.04f;
+        float min_novelty = 0.15f;
+    };
+
+    ~ChessboardTracker();
+
+    void start(FramePool* p_frame_pool, cv::Size p_pattern_size);
+    void stop();
+    bool is_running() { return running; }
+
+    void set_params(const Params& p_params);
+    Params get_params();
+
+    // Views already taken for calibration, novelty is measured against them.
+    void add_accepted_view(const std::vector<cv::Point2f>& corners, cv::Size image_size);
+    void clear_accepted_views();
+
+    // Returns true and the newest sample if there was one since the last call.
+    bool fetch(TrackedChessboard& r_tracked);
+
+    // Position, size and skew of the board, all roughly in [0, 1].
+    static cv::Vec4f describe_view(const std::vector<cv::Point2f>& corners, cv::Size pattern_size, cv::Size image_size);
+
+private:
+    void run();
+    void sample(const RetainedFrame& frame, const Params& sample_params, TrackedChessboard& r_tracked);
+
+    FramePool* frame_pool = nullptr;
+    cv::Size pattern_size;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool running = false;
+    bool stop_requested = false;
+
+    Params params;
+    std::vector<cv::Vec4f> accepted_views;
+
+    uint64_t last_sequence = UINT64_MAX;
+    TrackedChessboard latest;
+    bool updated = false;
+};
+
+}
@@ -0,0 +1,284 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "color_lut.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace godot;
+
+const uint32_t ColorLut::VERSION;
+
+namespace {
+
+const char MAGIC[4] = { 'F', 'X', 'L', 'T' };
+const int MAX_SIZE = 256;
+
+// Luminance weights of the saturation step, as the shader had them
+const float LUMINANCE_WEIGHTS[3] = { 0.2125f, 0.5854f, 0.0721f };
+
+template <typename T>
+void write_value(std::ostream& stream, const T& value) {
+    stream.write((const char*) &value, sizeof(T));
+}
+
+template <typename T>
+bool read_value(std::istream& stream, T& r_value) {
+    stream.read((char*) &r_value, sizeof(T));
+    return (bool) stream;
+}
+
+}
+
+bool ColorLut::parse_cube(const std::string& text, std::string& r_error) {
+    int cube_size = 0;
+    float cube_min[3] = { 0.0f, 0.0f, 0.0f };
+    float cube_max[3] = { 1.0f, 1.0f, 1.0f };
+    std::vector<float> values;
+
+    std::istringstream lines(text);
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(lines, line)) {
+        ++line_number;
+
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') continue;
+
+        std::istringstream fields(line.substr(start));
+        std::string keyword;
+        fields >> keyword;
+
+        if (keyword == "TITLE") {
+            continue;
+        } else if (keyword == "LUT_3D_SIZE") {
+            fields >> cube_size;
+            if (!fields || cube_size < 2 || cube_size > MAX_SIZE) {
+                r_error = "invalid LUT_3D_SIZE in line " + std::to_string(line_number);
+                return false;
+            }
+            values.reserve((size_t) cube_size * cube_size * cube_size * 3);
+        } else if (keyword == "LUT_1D_SIZE") {
+            r_error = "1D LUTs are not supported";
+            return false;
+        } else if (keyword == "DOMAIN_MIN") {
+            fields >> cube_min[0] >> cube_min[1] >> cube_min[2];
+        } else if (keyword == "DOMAIN_MAX") {
+            fields >> cube_max[0] >> cube_max[1] >> cube_max[2];
+        } else if (keyword == "LUT_3D_INPUT_RANGE") {
+            float range_min, range_max;
+            fields >> range_min >> range_max;
+            std::fill(cube_min, cube_min + 3, range_min);
+            std::fill(cube_max, cube_max + 3, range_max);
+        } else {
+            // A table row, the keyword is the red value
+            float rgb[3];
+            char* end;
+            rgb[0] = std::strtof(keyword.c_str(), &end);
+            if (*end != '\0' || !(fields >> rgb[1] >> rgb[2])) {
+                r_error = "unexpected \"" + keyword + "\" in line " + std::to_string(line_number);
+                return false;
+            }
+            values.insert(values.end(), rgb, rgb + 3);
+            continue;
+        }
+
+        if (!fields) {
+            r_error = "invalid " + keyword + " in line " + std::to_string(line_number);
+            return false;
+        }
+    }
+
+    if (cube_size == 0) {
+        r_error = "no LUT_3D_SIZE";
+        return false;
+    }
+    if (values.size() != (size_t) cube_size * cube_size * cube_size * 3) {
+        r_error = "expected " + std::to_string(cube_size * cube_size * cube_size) + " entries, found " + std::to_string(values.size() / 3);
+        return false;
+    }
+    for (int c = 0; c < 3; ++c) {
+        if (!(cube_max[c] > cube_min[c])) {
+            r_error = "empty domain";
+            return false;
+        }
+    }
+
+    size = cube_size;
+    table = std::move(values);
+    std::copy(cube_min, cube_min + 3, domain_min);
+    std::copy(cube_max, cube_max + 3, domain_max);
+    return true;
+}
+
+bool ColorLut::parse_tiles(const uint8_t* rgb, int width, int height, int tile_size) {
+    if (tile_size < 2 || tile_size > MAX_SIZE || width % tile_size != 0) {
+        return false;
+    }
+
+    int tiles_per_row = width / tile_size;
+    int rows = (tile_size + tiles_per_row - 1) / tiles_per_row;
+    if (height < rows * tile_size) {
+        return false;
+    }
+
+    size = tile_size;
+    table.resize((size_t) size * size * size * 3);
+    std::fill(domain_min, domain_min + 3, 0.0f);
+    std::fill(domain_max, domain_max + 3, 1.0f);
+
+    float* out = table.data();
+    for (int b = 0; b < size; ++b) {
+        int tile_x = (b % tiles_per_row) * size;
+        int tile_y = (b / tiles_per_row) * size;
+
+        for (int g = 0; g < size; ++g) {
+            const uint8_t* row = rgb + ((size_t) (tile_y + g) * width + tile_x) * 3;
+            for (int i = 0; i < size * 3; ++i) {
+                *out++ = row[i] / 255.0f;
+            }
+        }
+    }
+
+    return true;
+}
+
+void ColorLut::sample(const float* in, float* out) const {
+    int index[3];
+    float fraction[3];
+
+    for (int c = 0; c < 3; ++c) {
+        float position = (in[c] - domain_min[c]) / (domain_max[c] - domain_min[c]) * (size - 1);
+        position = std::min(std::max(position, 0.0f), (float) (size - 1));
+        index[c] = std::min((int) position, size - 2);
+        fraction[c] = position - index[c];
+    }
+
+    const size_t stride_g = (size_t) size * 3;
+    const size_t stride_b = (size_t) size * size * 3;
+    const float* base = table.data() + index[2] * stride_b + index[1] * stride_g + index[0] * 3;
+
+    for (int c = 0; c < 3; ++c) {
+        const float* p = base + c;
+        float c00 = p[0] + (p[3] - p[0]) * fraction[0];
+        float c10 = p[stride_g] + (p[stride_g + 3] - p[stride_g]) * fraction[0];
+        float c01 = p[stride_b] + (p[stride_b + 3] - p[stride_b]) * fraction[0];
+        float c11 = p[stride_b + stride_g] + (p[stride_b + stride_g + 3] - p[stride_b + stride_g]) * fraction[0];
+
+        float c0 = c00 + (c10 - c00) * fraction[1];
+        float c1 = c01 + (c11 - c01) * fraction[1];
+        out[c] = c0 + (c1 - c0) * fraction[2];
+    }
+}
+
+std::vector<uint8_t> ColorLut::bake(const BakeParams& params, int bake_size) const {
+    std::vector<uint8_t> texels((size_t) bake_size * bake_size * bake_size * 3);
+    if (is_empty()) {
+        return texels;
+    }
+
+    uint8_t* out = texels.data();
+    for (int b = 0; b < bake_size; ++b) {
+        for (int g = 0; g < bake_size; ++g) {
+            for (int r = 0; r < bake_size; ++r) {
+                float c[3] = { (r + 0.5f) / bake_size, (g + 0.5f) / bake_size, (b + 0.5f) / bake_size };
+
+                float luminance = c[0] * LUMINANCE_WEIGHTS[0] + c[1] * LUMINANCE_WEIGHTS[1] + c[2] * LUMINANCE_WEIGHTS[2];
+                for (int i = 0; i < 3; ++i) {
+                    c[i] = luminance + (c[i] - luminance) * params.saturation;
+                    c[i] = std::min(std::max(c[i], params.clamp_min), params.clamp_max);
+                }
+
+                float looked_up[3];
+                sample(c, looked_up);
+                for (int i = 0; i < 3; ++i) {
+                    *out++ = (uint8_t) std::lround(std::min(std::max(looked_up[i], 0.0f), 1.0f) * 255.0f);
+                }
+            }
+        }
+    }
+
+    return texels;
+}
+
+uint64_t ColorLut::hash(const void* data, size_t length, uint64_t seed) {
+    // FNV-1a
+    const uint8_t* bytes = (const uint8_t*) data;
+    uint64_t result = seed;
+    for (size_t i = 0; i < length; ++i) {
+        result = (result ^ bytes[i]) * 1099511628211ULL;
+    }
+    return result;
+}
+
+uint64_t ColorLut::hash(const BakeParams& params, int bake_size, uint64_t seed) {
+    float values[3] = { params.saturation, params.clamp_min, params.clamp_max };
+    uint32_t header[2] = { VERSION, (uint32_t) bake_size };
+    return hash(values, sizeof(values), hash(header, sizeof(header), seed));
+}
+
+bool ColorLut::save_baked(const std::string& path, uint64_t key, int bake_size, const std::vector<uint8_t>& texels) {
+    // Written next to the target and renamed, a reader never sees half a table
+    std::string temporary_path = path + ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+
+        file.write(MAGIC, 4);
+        write_value<uint32_t>(file, VERSION);
+        write_value<uint64_t>(file, key);
+        write_value<uint32_t>(file, bake_size);
+        file.write((const char*) texels.data(), texels.size());
+        if (!file) return false;
+    }
+
+    return std::rename(temporary_path.c_str(), path.c_str()) == 0;
+}
+
+bool ColorLut::load_baked(const std::string& path, uint64_t key, int& r_bake_size, std::vector<uint8_t>& r_texels) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    char magic[4];
+    uint32_t version;
+    uint64_t file_key;
+    uint32_t bake_size;
+    file.read(magic, 4);
+    if (!file || std::memcmp(magic, MAGIC, 4) != 0 || !read_value(file, version) || version != VERSION ||
+        !read_value(file, file_key) || file_key != key || !read_value(file, bake_size) || bake_size < 2 || bake_size > MAX_SIZE) {
+        return false;
+    }
+
+    r_texels.resize((size_t) bake_size * bake_size * bake_size * 3);
+    file.read((char*) r_texels.data(), r_texels.size());
+    if (!file) return false;
+
+    r_bake_size = bake_size;
+    return true;
+}
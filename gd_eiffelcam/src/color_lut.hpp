@@ -0,0 +1,86 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace godot {
+
+// 3D colour lookup table for the looks of the camera view. Knows nothing
+// about Godot so the tools can use it too.
+//
+// A look comes from a .cube file or from the tiled PNG layout of the bundled
+// looks, and is baked together with the saturation and clamp that used to run
+// in the shader into one 8 bit table. Baked tables are cached on disk:
+//
+//   "FXLT", uint32 version, uint64 key, uint32 size, size^3 x (uint8 r, g, b)
+//
+// The key is a hash of the source and the bake parameters, a changed source
+// or parameter simply misses the cache.
+class ColorLut {
+public:
+    static const uint32_t VERSION = 1;
+
+    // The colour chain applied before the look, as fsquad.gdshader had it.
+    struct BakeParams {
+        float saturation = 1.1f;
+        float clamp_min = 2.0f / 64.0f;
+        float clamp_max = 1.0f - 2.0f / 64.0f;
+    };
+
+    // Adobe/Resolve .cube, 3D tables only.
+    bool parse_cube(const std::string& text, std::string& r_error);
+
+    // Square tiles of size x size pixels, one per blue level, left to right
+    // and top to bottom. Red grows along x and green along y in every tile.
+    bool parse_tiles(const uint8_t* rgb, int width, int height, int size);
+
+    int get_size() const { return size; }
+    bool is_empty() const { return size == 0; }
+
+    // Trilinear lookup, in and out are RGB in 0..1.
+    void sample(const float* in, float* out) const;
+
+    // size^3 RGB8 texels, red fastest. Texel i holds the look at input
+    // (i + 0.5) / size, the centre of the texel, so a linear filtered
+    // texture(lut, c) gives the look at c without any scale and offset.
+    std::vector<uint8_t> bake(const BakeParams& params, int bake_size) const;
+
+    static uint64_t hash(const void* data, size_t length, uint64_t seed = 14695981039346656037ULL);
+    static uint64_t hash(const BakeParams& params, int bake_size, uint64_t seed);
+
+    static bool save_baked(const std::string& path, uint64_t key, int bake_size, const std::vector<uint8_t>& texels);
+    // False if there is no cache file or it was baked from something else.
+    static bool load_baked(const std::string& path, uint64_t key, int& r_bake_size, std::vector<uint8_t>& r_texels);
+
+private:
+    int size = 0;
+    std::vector<float> table;   // size^3 x RGB, red fastest
+    float domain_min[3] = { 0.0f, 0.0f, 0.0f };
+    float domain_max[3] = { 1.0f, 1.0f, 1.0f };
+};
+
+}
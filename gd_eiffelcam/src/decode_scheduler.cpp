@@ -0,0 +1,88 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "decode_scheduler.hpp"
+
+#include <algorithm>
+
+#include "tracing.h"
+
+using namespace godot;
+
+// One stereo module per thread, OpenCV's own pool parallelises the remap inside a job.
+static const int MAX_DECODE_THREADS = 4;
+
+DecodeScheduler* DecodeScheduler::get_singleton() {
+    static DecodeScheduler scheduler;
+    return &scheduler;
+}
+
+DecodeScheduler::DecodeScheduler() {
+    int count = std::max(1, std::min(MAX_DECODE_THREADS, (int) std::thread::hardware_concurrency() - 1));
+    for (int i = 0; i < count; ++i) {
+        threads.emplace_back(&DecodeScheduler::run, this);
+    }
+}
+
+DecodeScheduler::~DecodeScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    condition.notify_all();
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+std::future<bool> DecodeScheduler::submit(std::function<bool()> job) {
+    std::packaged_task<bool()> task(std::move(job));
+    std::future<bool> result = task.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(task));
+    }
+    condition.notify_one();
+
+    return result;
+}
+
+void DecodeScheduler::run() {
+    while (true) {
+        std::packaged_task<bool()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]() { return quit || !jobs.empty(); });
+            if (quit && jobs.empty()) {
+                return;
+            }
+            task = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        TRACE_EVENT("decode_scheduler", "decode_job");
+        task();
+    }
+}
@@ -0,0 +1,62 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace godot {
+
+// Worker threads shared by every GDEiffelCam in the process. Each camera
+// submits the CPU part of its frame (JPEG decode and CPU remap) in _process
+// and collects it before the frame is drawn, so with two camera modules both
+// frames are decoded at the same time on different cores.
+class DecodeScheduler {
+public:
+    static DecodeScheduler* get_singleton();
+
+    ~DecodeScheduler();
+
+    std::future<bool> submit(std::function<bool()> job);
+
+    int get_thread_count() { return (int) threads.size(); }
+
+private:
+    DecodeScheduler();
+
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::packaged_task<bool()>> jobs;
+    std::vector<std::thread> threads;
+    bool quit = false;
+};
+
+}
@@ -0,0 +1,150 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "depth_worker.hpp"
+
+#include <chrono>
+
+#include "memory_accounting.hpp"
+#include "tracing.h"
+
+using namespace godot;
+
+DepthWorker::~DepthWorker() {
+    stop();
+}
+
+void DepthWorker::start(FramePool* p_frame_pool) {
+    if (running) return;
+
+    frame_pool = p_frame_pool;
+    stop_requested = false;
+    frame_pending = false;
+    last_sequence = UINT64_MAX;
+    stereo_depth.reset_incremental();
+
+    running = true;
+    thread = std::thread(&DepthWorker::run, this);
+}
+
+void DepthWorker::stop() {
+    if (!running) return;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop_requested = true;
+    }
+    condition.notify_one();
+
+    thread.join();
+    running = false;
+}
+
+void DepthWorker::notify_frame() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        frame_pending = true;
+    }
+    condition.notify_one();
+}
+
+void DepthWorker::set_preset(int p_preset) {
+    std::unique_lock<std::mutex> lock(mutex);
+    pending_preset = p_preset;
+}
+
+void DepthWorker::set_incremental_params(const StereoDepth::IncrementalParams& p_params) {
+    std::unique_lock<std::mutex> lock(mutex);
+    pending_params = p_params;
+    params_pending = true;
+}
+
+bool DepthWorker::fetch_disparity(cv::Mat& r_disparity) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (!disparity_updated) return false;
+
+    r_disparity = latest_disparity;
+    disparity_updated = false;
+    return true;
+}
+
+float DepthWorker::get_last_compute_ms() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return last_compute_ms;
+}
+
+float DepthWorker::get_last_changed_fraction() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return last_changed_fraction;
+}
+
+void DepthWorker::run() {
+    MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_DEPTH);
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stop_requested || frame_pending; });
+
+            if (stop_requested) break;
+            frame_pending = false;
+
+            if (pending_preset >= 0) {
+                stereo_depth.set_preset(pending_preset);
+                pending_preset = -1;
+            }
+            if (params_pending) {
+                stereo_depth.set_incremental_params(pending_params);
+                stereo_depth.reset_incremental();
+                params_pending = false;
+            }
+        }
+
+        std::shared_ptr<const RetainedFrame> frame = frame_pool->get();
+        if (frame == nullptr || frame->rectified_luma.empty() || frame->sequence == last_sequence) {
+            continue;
+        }
+        last_sequence = frame->sequence;
+
+        TRACE_EVENT("depth", "DepthWorker::compute");
+
+        auto start = std::chrono::steady_clock::now();
+
+        int eye_width = frame->rectified_luma.cols / 2;
+        int eye_height = frame->rectified_luma.rows;
+        cv::Mat left = frame->rectified_luma(cv::Rect(0, 0, eye_width, eye_height));
+        cv::Mat right = frame->rectified_luma(cv::Rect(eye_width, 0, eye_width, eye_height));
+
+        cv::Mat disparity = stereo_depth.compute_incremental(left, right);
+
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        TRACE_COUNTER("depth", "changed_fraction", stereo_depth.get_last_changed_fraction());
+
+        std::unique_lock<std::mutex> lock(mutex);
+        latest_disparity = disparity;
+        disparity_updated = true;
+        last_compute_ms = elapsed.count();
+        last_changed_fraction = stereo_depth.get_last_changed_fraction();
+    }
+}
@@ -0,0 +1,85 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "frame_pool.hpp"
+#include "stereo_depth.hpp"
+
+namespace godot {
+
+// Continuous depth on a background thread. Every notified frame wakes the
+// worker, which computes an incremental disparity from the newest rectified
+// luma in the frame pool. Frames that arrive while it is busy are skipped.
+class DepthWorker {
+public:
+    ~DepthWorker();
+
+    void start(FramePool* p_frame_pool);
+    void stop();
+    bool is_running() { return running; }
+
+    void notify_frame();
+
+    void set_preset(int p_preset);
+    void set_incremental_params(const StereoDepth::IncrementalParams& p_params);
+
+    // Returns true and the newest disparity if there was an update since the last call.
+    bool fetch_disparity(cv::Mat& r_disparity);
+
+    float get_last_compute_ms();
+    float get_last_changed_fraction();
+
+private:
+    void run();
+
+    FramePool* frame_pool = nullptr;
+    StereoDepth stereo_depth;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool running = false;
+    bool stop_requested = false;
+    bool frame_pending = false;
+
+    // Settings are handed over under the mutex and applied between frames.
+    int pending_preset = -1;
+    bool params_pending = false;
+    StereoDepth::IncrementalParams pending_params;
+
+    uint64_t last_sequence = UINT64_MAX;
+
+    cv::Mat latest_disparity;
+    bool disparity_updated = false;
+    float last_compute_ms = 0.0f;
+    float last_changed_fraction = 0.0f;
+};
+
+}
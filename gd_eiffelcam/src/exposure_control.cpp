@@ -0,0 +1,223 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "exposure_control.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "tracing.h"
+
+using namespace godot;
+
+// Errors below this many stops are left alone, so the controller does not
+// hunt around the target on sensor noise.
+static const double EXPOSURE_DEADBAND_STOPS = 0.1;
+// Fraction of the error corrected per update and the largest step.
+static const double EXPOSURE_DAMPING = 0.5;
+static const double MAX_EXPOSURE_STEP_STOPS = 1.0;
+// More clipped samples than this darken the image even at a mean below target.
+static const double MAX_CLIPPED_FRACTION = 0.05;
+static const double CLIPPED_STEP_STOPS = 0.25;
+// The gain control has vendor units, its range is taken as this many stops.
+static const double GAIN_RANGE_STOPS = 4.0;
+
+static const uint32_t MIN_WHITE_BALANCE_SAMPLES = 256;
+static const double WHITE_BALANCE_DEADBAND_STOPS = 0.05;
+static const double WHITE_BALANCE_DAMPING = 0.5;
+static const double KELVIN_PER_STOP = 1500.0;
+
+void ExposureStats::clear() {
+    *this = ExposureStats();
+}
+
+void ExposureStats::add_sample(int r, int g, int b, int luma) {
+    ++luma_histogram[luma * HISTOGRAM_BINS / 256];
+    ++samples;
+    luma_sum += luma;
+    if (luma >= 250) ++clipped;
+
+    if (luma >= WHITE_BALANCE_MIN_LUMA && std::max(r, std::max(g, b)) < WHITE_BALANCE_MAX_CHANNEL) {
+        ++white_balance_samples;
+        red_sum += r;
+        green_sum += g;
+        blue_sum += b;
+    }
+}
+
+void ExposureStats::gather_rgb(const uint8_t* rgb, int width, int height) {
+    TRACE_EVENT("exposure", "ExposureStats::gather_rgb");
+    clear();
+
+    for (int y = GRID_STEP / 2; y < height; y += GRID_STEP) {
+        const uint8_t* row = rgb + (size_t) y * width * 3;
+        for (int x = GRID_STEP / 2; x < width; x += GRID_STEP) {
+            const uint8_t* pixel = row + x * 3;
+            int luma = (77 * pixel[0] + 150 * pixel[1] + 29 * pixel[2]) >> 8;
+            add_sample(pixel[0], pixel[1], pixel[2], luma);
+        }
+    }
+}
+
+void ExposureStats::gather_yuv(const uint8_t* y_plane, const uint8_t* u_plane, const uint8_t* v_plane, int width, int height, int chroma_width, int chroma_height) {
+    TRACE_EVENT("exposure", "ExposureStats::gather_yuv");
+    clear();
+
+    for (int y = GRID_STEP / 2; y < height; y += GRID_STEP) {
+        const uint8_t* luma_row = y_plane + (size_t) y * width;
+        size_t chroma_row = (size_t) (y * chroma_height / height) * chroma_width;
+
+        for (int x = GRID_STEP / 2; x < width; x += GRID_STEP) {
+            int luma = luma_row[x];
+            size_t chroma = chroma_row + x * chroma_width / width;
+            int cb = u_plane[chroma] - 128;
+            int cr = v_plane[chroma] - 128;
+
+            // JFIF YCbCr to RGB in 8.8 fixed point
+            int r = std::max(0, std::min(255, luma + ((359 * cr) >> 8)));
+            int g = std::max(0, std::min(255, luma - ((88 * cb + 183 * cr) >> 8)));
+            int b = std::max(0, std::min(255, luma + ((454 * cb) >> 8)));
+            add_sample(r, g, b, luma);
+        }
+    }
+}
+
+void ExposureController::init(MetricsRegistry& metrics) {
+    mean_luma = metrics.gauge("exposure_mean_luma");
+    exposure_adjustments = metrics.counter("exposure_adjustments");
+    white_balance_adjustments = metrics.counter("white_balance_adjustments");
+}
+
+void ExposureController::reset() {
+    last_update_time = -1.0;
+}
+
+std::vector<String> ExposureController::update(const ExposureStats& stats, double time_s, CameraProperties& properties) {
+    std::vector<String> written;
+
+    if (!is_active() || stats.samples == 0) {
+        return written;
+    }
+    mean_luma->set(stats.get_mean_luma());
+
+    // Controls are known once the property worker read them
+    if (!properties.is_ready()) {
+        return written;
+    }
+    if (last_update_time >= 0.0 && time_s - last_update_time < 1.0 / std::max(settings.rate_hz, 0.1)) {
+        return written;
+    }
+    last_update_time = time_s;
+
+    TRACE_EVENT("exposure", "ExposureController::update");
+
+    if (settings.auto_exposure && update_exposure(stats, properties, written)) {
+        exposure_adjustments->add();
+    }
+    if (settings.auto_white_balance && update_white_balance(stats, properties, written)) {
+        white_balance_adjustments->add();
+    }
+
+    return written;
+}
+
+bool ExposureController::update_exposure(const ExposureStats& stats, CameraProperties& properties, std::vector<String>& r_written) {
+    CameraPropertyValue exposure;
+    if (!properties.get("exposure_abs", exposure)) {
+        return false;
+    }
+    CameraPropertyValue gain;
+    bool has_gain = properties.get("gain", gain) && gain.max > gain.min;
+
+    double error = std::log2(settings.target_luma / std::max(stats.get_mean_luma(), 1.0 / 255.0));
+    if (stats.get_clipped_fraction() > MAX_CLIPPED_FRACTION) {
+        error = std::min(error, -CLIPPED_STEP_STOPS);
+    }
+    if (std::fabs(error) < EXPOSURE_DEADBAND_STOPS) {
+        return false;
+    }
+    double step = std::max(-MAX_EXPOSURE_STEP_STOPS, std::min(error * EXPOSURE_DAMPING, MAX_EXPOSURE_STEP_STOPS));
+
+    // exposure_abs is in units of 100us
+    int exposure_limit = std::max(exposure.min, std::min((int) std::lround(settings.max_exposure_ms * 10.0), exposure.max));
+    double gain_per_stop = has_gain ? (gain.max - gain.min) / GAIN_RANGE_STOPS : 0.0;
+    int gain_step = std::max(1, (int) std::lround(std::fabs(step) * gain_per_stop));
+
+    int new_exposure = exposure.current;
+    int new_gain = has_gain ? gain.current : 0;
+
+    if (step > 0.0) {
+        if (exposure.current < exposure_limit) {
+            int scaled = (int) std::ceil(std::max(exposure.current, 1) * std::exp2(step));
+            new_exposure = std::min(exposure_limit, std::max(scaled, exposure.current + 1));
+        } else if (has_gain) {
+            new_gain = std::min(gain.max, gain.current + gain_step);
+        }
+    } else {
+        if (has_gain && gain.current > gain.min) {
+            new_gain = std::max(gain.min, gain.current - gain_step);
+        } else {
+            int scaled = (int) std::floor(exposure.current * std::exp2(step));
+            new_exposure = std::max(exposure.min, std::min(scaled, exposure.current - 1));
+        }
+    }
+
+    bool changed = false;
+    if (new_exposure != exposure.current && properties.set("exposure_abs", new_exposure)) {
+        r_written.push_back("exposure_abs");
+        changed = true;
+    }
+    if (has_gain && new_gain != gain.current && properties.set("gain", new_gain)) {
+        r_written.push_back("gain");
+        changed = true;
+    }
+    return changed;
+}
+
+bool ExposureController::update_white_balance(const ExposureStats& stats, CameraProperties& properties, std::vector<String>& r_written) {
+    if (stats.white_balance_samples < MIN_WHITE_BALANCE_SAMPLES) {
+        return false;
+    }
+
+    CameraPropertyValue temperature;
+    if (!properties.get("white_balance_temperature", temperature) || temperature.max <= temperature.min) {
+        return false;
+    }
+
+    // Grey world: the average of the scene is neutral. An image that is too
+    // blue was corrected for a warmer light than there is, so the temperature
+    // goes up.
+    double error = std::log2((stats.blue_sum + 1.0) / (stats.red_sum + 1.0));
+    if (std::fabs(error) < WHITE_BALANCE_DEADBAND_STOPS) {
+        return false;
+    }
+
+    int delta = (int) std::lround(error * WHITE_BALANCE_DAMPING * KELVIN_PER_STOP);
+    int new_temperature = std::max(temperature.min, std::min(temperature.current + delta, temperature.max));
+    if (new_temperature == temperature.current || !properties.set("white_balance_temperature", new_temperature)) {
+        return false;
+    }
+
+    r_written.push_back("white_balance_temperature");
+    return true;
+}
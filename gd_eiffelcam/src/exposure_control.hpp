@@ -0,0 +1,117 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <Godot.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "camera_properties.hpp"
+#include "metrics.hpp"
+
+namespace godot {
+
+// Luma histogram and colour sums of a decoded frame, from every GRID_STEP-th
+// pixel of every GRID_STEP-th row. Gathered on the decode thread right after
+// decoding, while the frame is still warm in the cache, which is about 10k
+// samples for the side by side frame.
+struct ExposureStats {
+    static const int HISTOGRAM_BINS = 64;
+    static const int GRID_STEP = 16;
+
+    // Samples darker or with a channel brighter than these are left out of
+    // the white balance sums, their colour says nothing about the light.
+    static const int WHITE_BALANCE_MIN_LUMA = 16;
+    static const int WHITE_BALANCE_MAX_CHANNEL = 250;
+
+    uint32_t luma_histogram[HISTOGRAM_BINS] = {};
+    uint32_t samples = 0;
+    uint64_t luma_sum = 0;
+    uint32_t clipped = 0;           // samples with a luma of 250 or more
+
+    uint32_t white_balance_samples = 0;
+    uint64_t red_sum = 0;
+    uint64_t green_sum = 0;
+    uint64_t blue_sum = 0;
+
+    void clear();
+
+    // Interleaved RGB8, rows of width pixels.
+    void gather_rgb(const uint8_t* rgb, int width, int height);
+
+    // Planar JFIF YCbCr as written by tjDecompressToYUV, the chroma planes
+    // subsampled to chroma_width x chroma_height.
+    void gather_yuv(const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, int height, int chroma_width, int chroma_height);
+
+    // 0..1
+    double get_mean_luma() const { return samples > 0 ? luma_sum / (255.0 * samples) : 0.0; }
+    double get_clipped_fraction() const { return samples > 0 ? (double) clipped / samples : 0.0; }
+
+private:
+    void add_sample(int r, int g, int b, int luma);
+};
+
+// Software auto exposure and white balance. Runs on the main thread at a low
+// rate, far below the camera frame rate so that every write had time to show
+// in the frames before the next decision, and writes through the
+// CameraProperties queue, so no control transfer blocks a frame.
+//
+// Exposure is raised up to max_exposure_ms before gain is added, and gain is
+// taken back before exposure is lowered, which keeps noise down in bright
+// scenes and motion blur bounded in dark ones. White balance is grey world
+// on the sampled colours.
+class ExposureController {
+public:
+    struct Settings {
+        bool auto_exposure = false;
+        bool auto_white_balance = false;
+        double target_luma = 0.45;      // mean of the luma samples, 0..1
+        double rate_hz = 5.0;
+        double max_exposure_ms = 16.0;  // below one frame at 60 fps
+    };
+
+    void init(MetricsRegistry& metrics);
+    void reset();
+
+    Settings& get_settings() { return settings; }
+    bool is_active() const { return settings.auto_exposure || settings.auto_white_balance; }
+
+    // Called with the statistics of every decoded frame, queues the control
+    // writes when an update is due. Returns the names of the written controls.
+    std::vector<String> update(const ExposureStats& stats, double time_s, CameraProperties& properties);
+
+private:
+    Settings settings;
+    double last_update_time = -1.0;
+
+    MetricGauge* mean_luma = nullptr;
+    MetricCounter* exposure_adjustments = nullptr;
+    MetricCounter* white_balance_adjustments = nullptr;
+
+    bool update_exposure(const ExposureStats& stats, CameraProperties& properties, std::vector<String>& r_written);
+    bool update_white_balance(const ExposureStats& stats, CameraProperties& properties, std::vector<String>& r_written);
+};
+
+}
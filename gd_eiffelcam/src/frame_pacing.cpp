@@ -0,0 +1,179 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "frame_pacing.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace godot;
+
+// Smoothing of the measured periods, about a second of frames.
+static const double PERIOD_SMOOTHING = 0.02;
+
+static double standard_deviation(const std::vector<double>& values) {
+    if (values.empty()) return 0.0;
+
+    double mean = 0.0;
+    for (double value : values) mean += value;
+    mean /= values.size();
+
+    double variance = 0.0;
+    for (double value : values) variance += (value - mean) * (value - mean);
+    return std::sqrt(variance / values.size());
+}
+
+// Judder of a display count pattern (0 for skipped camera frames). A cadence
+// is smooth if every shown camera frame stays on screen equally long and the
+// content advances by the same amount between them, so 60 fps on 120 Hz
+// (2, 2, 2) and 120 fps on 60 Hz (1, 0, 1, 0) are both fine while 60 fps on
+// 72 Hz (1, 1, 1, 1, 2) is not. Combines the deviation of both, in ms.
+static double cadence_judder_ms(const std::vector<int>& counts, double render_period, double camera_period) {
+    std::vector<double> durations;
+    std::vector<double> steps;
+    int skipped = 0;
+
+    for (int count : counts) {
+        if (count == 0) {
+            ++skipped;
+            continue;
+        }
+        if (!durations.empty()) steps.push_back((skipped + 1) * camera_period * 1000.0);
+        durations.push_back(count * render_period * 1000.0);
+        skipped = 0;
+    }
+
+    double duration_deviation = standard_deviation(durations);
+    double step_deviation = standard_deviation(steps);
+    return std::sqrt(duration_deviation * duration_deviation + step_deviation * step_deviation);
+}
+
+void FramePacing::init(MetricsRegistry& metrics) {
+    render_jitter_ms = metrics.histogram("render_jitter_ms", MetricsRegistry::latency_buckets_ms());
+    camera_jitter_ms = metrics.histogram("camera_jitter_ms", MetricsRegistry::latency_buckets_ms());
+    display_duration_ms = metrics.histogram("display_duration_ms", MetricsRegistry::latency_buckets_ms());
+}
+
+void FramePacing::reset() {
+    last_render_time = -1.0;
+    render_period = 0.0;
+    camera_period = 0.0;
+    shown_sequence = 0;
+    shown_count = 0;
+    pattern.clear();
+    std::fill(display_counts.begin(), display_counts.end(), 0);
+}
+
+void FramePacing::push_display_count(int count) {
+    pattern.push_back(count);
+    if ((int) pattern.size() > PATTERN_LENGTH) pattern.pop_front();
+
+    ++display_counts[std::min(count, MAX_DISPLAY_COUNT)];
+    if (display_duration_ms != nullptr && count > 0) {
+        display_duration_ms->record(count * render_period * 1000.0);
+    }
+}
+
+void FramePacing::record_render_frame(double time_s, uint32_t camera_sequence) {
+    if (last_render_time >= 0.0) {
+        double interval = time_s - last_render_time;
+        render_period = render_period > 0.0 ? render_period + PERIOD_SMOOTHING * (interval - render_period) : interval;
+        if (render_jitter_ms != nullptr) render_jitter_ms->record(std::abs(interval - render_period) * 1000.0);
+    }
+    last_render_time = time_s;
+
+    if (camera_sequence == 0) return;
+
+    if (camera_sequence == shown_sequence) {
+        ++shown_count;
+        return;
+    }
+
+    if (shown_sequence != 0 && camera_sequence > shown_sequence) {
+        push_display_count(shown_count);
+
+        uint32_t delivered = camera_sequence - shown_sequence;
+        for (uint32_t i = 1; i < delivered && i <= (uint32_t) PATTERN_LENGTH; ++i) {
+            push_display_count(0);
+        }
+
+        // Arrivals are only seen at render frame granularity, so this jitter
+        // includes the quantisation the viewer actually sees.
+        double interval = (time_s - shown_since) / delivered;
+        camera_period = camera_period > 0.0 ? camera_period + PERIOD_SMOOTHING * (interval - camera_period) : interval;
+        if (camera_jitter_ms != nullptr) camera_jitter_ms->record(std::abs(interval - camera_period) * 1000.0);
+    }
+
+    shown_sequence = camera_sequence;
+    shown_since = time_s;
+    shown_count = 1;
+}
+
+double FramePacing::get_judder_ms() {
+    return cadence_judder_ms(get_recent_pattern(), render_period, camera_period);
+}
+
+double FramePacing::predicted_judder_ms(double camera_fps, double refresh_rate) {
+    if (camera_fps <= 0.0 || refresh_rate <= 0.0) return 0.0;
+
+    // Render frame k shows the newest camera frame that arrived before it.
+    // Two seconds cover a full beat of all common rate pairs.
+    int frames = (int) std::ceil(2.0 * camera_fps);
+    double ratio = refresh_rate / camera_fps;
+    std::vector<int> counts(frames);
+    for (int i = 0; i < frames; ++i) {
+        counts[i] = (int) (std::floor((i + 1) * ratio + 1e-9) - std::floor(i * ratio + 1e-9));
+    }
+
+    return cadence_judder_ms(counts, 1.0 / refresh_rate, 1.0 / camera_fps);
+}
+
+FramePacing::Suggestion FramePacing::suggest(const std::vector<double>& camera_rates, const std::vector<double>& refresh_rates, double current_refresh_rate) {
+    Suggestion best;
+    bool found = false;
+
+    for (double camera_fps : camera_rates) {
+        for (double refresh_rate : refresh_rates) {
+            Suggestion candidate;
+            candidate.camera_fps = camera_fps;
+            candidate.refresh_rate = refresh_rate;
+            candidate.judder_ms = predicted_judder_ms(camera_fps, refresh_rate);
+
+            bool better = !found || candidate.judder_ms < best.judder_ms - 0.1;
+            if (!better && std::abs(candidate.judder_ms - best.judder_ms) <= 0.1) {
+                if (camera_fps != best.camera_fps) {
+                    better = camera_fps > best.camera_fps;
+                } else {
+                    better = std::abs(refresh_rate - current_refresh_rate) < std::abs(best.refresh_rate - current_refresh_rate);
+                }
+            }
+
+            if (better) {
+                best = candidate;
+                found = true;
+            }
+        }
+    }
+
+    return best;
+}
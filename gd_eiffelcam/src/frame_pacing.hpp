@@ -0,0 +1,96 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace godot {
+
+// Measures how camera frames map onto render frames. The camera runs at its
+// own rate (60 fps) and the headset renders at 72/90 Hz, so some camera frames
+// stay on screen for one render frame and others for two. The irregular
+// sequence of display counts (the beat pattern) is what is seen as judder.
+//
+// Everything runs on the main thread, once per render frame.
+class FramePacing {
+public:
+    static const int PATTERN_LENGTH = 120;     // camera frames kept for the pattern and judder
+    static const int MAX_DISPLAY_COUNT = 4;    // last bucket of the display count histogram
+
+    struct Suggestion {
+        double camera_fps = 0.0;
+        double refresh_rate = 0.0;
+        double judder_ms = 0.0;
+    };
+
+    void init(MetricsRegistry& metrics);
+    void reset();
+
+    // camera_sequence is the UVC sequence number of the camera frame shown in
+    // this render frame, 0 until the first one arrived.
+    void record_render_frame(double time_s, uint32_t camera_sequence);
+
+    double get_render_rate() { return render_period > 0.0 ? 1.0 / render_period : 0.0; }
+    double get_camera_rate() { return camera_period > 0.0 ? 1.0 / camera_period : 0.0; }
+
+    // Render frames each of the last camera frames was shown for, oldest first.
+    // Skipped camera frames are 0.
+    std::vector<int> get_recent_pattern() { return std::vector<int>(pattern.begin(), pattern.end()); }
+    std::vector<uint64_t> get_display_count_histogram() { return display_counts; }
+
+    // Irregularity of the recent pattern: deviation of how long shown camera
+    // frames stay on screen and of how far the content advances between them.
+    double get_judder_ms();
+
+    // The same for an ideal pairing, with every camera frame arriving on time.
+    static double predicted_judder_ms(double camera_fps, double refresh_rate);
+
+    // Pairing with the least predicted judder. Ties go to the higher camera
+    // frame rate and then to the refresh rate closest to current_refresh_rate.
+    static Suggestion suggest(const std::vector<double>& camera_rates, const std::vector<double>& refresh_rates, double current_refresh_rate);
+
+private:
+    MetricHistogram* render_jitter_ms = nullptr;
+    MetricHistogram* camera_jitter_ms = nullptr;
+    MetricHistogram* display_duration_ms = nullptr;
+
+    double last_render_time = -1.0;
+    double render_period = 0.0;
+    double camera_period = 0.0;
+
+    uint32_t shown_sequence = 0;
+    double shown_since = 0.0;
+    int shown_count = 0;
+
+    std::deque<int> pattern;
+    std::vector<uint64_t> display_counts = std::vector<uint64_t>(MAX_DISPLAY_COUNT + 1, 0);
+
+    void push_display_count(int count);
+};
+
+}
@@ -0,0 +1,125 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "frame_pool.hpp"
+
+using namespace godot;
+
+// Drops a buffer that somebody still references outside of the pool, so the
+// decoder never writes into memory that is being read.
+static void detach_shared_buffer(cv::Mat& mat) {
+    if (mat.u != nullptr && mat.u->refcount > 1) {
+        mat.release();
+    }
+}
+
+FramePool::FramePool() {
+    free_list = std::make_shared<FreeList>();
+}
+
+void FramePool::set_capacity(int p_capacity) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    capacity = std::max(p_capacity, 1);
+    while ((int)frames.size() > capacity) {
+        frames.pop_back();
+    }
+}
+
+int FramePool::get_capacity() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return capacity;
+}
+
+std::shared_ptr<RetainedFrame> FramePool::acquire() {
+    std::unique_ptr<RetainedFrame> frame;
+
+    {
+        std::unique_lock<std::mutex> lock(free_list->mutex);
+        if (!free_list->frames.empty()) {
+            frame = std::move(free_list->frames.back());
+            free_list->frames.pop_back();
+        }
+    }
+
+    if (!frame) {
+        frame = std::make_unique<RetainedFrame>();
+    }
+
+    detach_shared_buffer(frame->rgb);
+    detach_shared_buffer(frame->luma);
+    detach_shared_buffer(frame->rectified_luma);
+
+    // Representations that are no longer requested must not leak stale pixels.
+    int flags = retention;
+    if (!(flags & RETAIN_RGB)) frame->rgb.release();
+    if (!(flags & RETAIN_LUMA)) frame->luma.release();
+    if (!(flags & RETAIN_RECTIFIED_LUMA)) frame->rectified_luma.release();
+    if (!(flags & RETAIN_JPEG)) frame->jpeg.clear();
+    frame->rgb_rectified = false;
+
+    // The pool may be gone by the time the last reader lets go of the frame.
+    std::weak_ptr<FreeList> weak_free_list = free_list;
+
+    return std::shared_ptr<RetainedFrame>(frame.release(), [weak_free_list](RetainedFrame* released) {
+        std::shared_ptr<FreeList> list = weak_free_list.lock();
+        if (list) {
+            std::unique_lock<std::mutex> lock(list->mutex);
+            list->frames.emplace_back(released);
+        } else {
+            delete released;
+        }
+    });
+}
+
+void FramePool::publish(std::shared_ptr<RetainedFrame> frame) {
+    // Dropped frames are recycled outside of the lock.
+    std::shared_ptr<RetainedFrame> dropped;
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    frame->sequence = next_sequence++;
+    frame->timestamp = std::chrono::steady_clock::now();
+
+    frames.push_front(frame);
+
+    if ((int)frames.size() > capacity) {
+        dropped = frames.back();
+        frames.pop_back();
+    }
+}
+
+std::shared_ptr<const RetainedFrame> FramePool::get(int age) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (age < 0 || age >= (int)frames.size()) {
+        return nullptr;
+    }
+
+    return frames[age];
+}
+
+void FramePool::clear() {
+    std::unique_lock<std::mutex> lock(mutex);
+    frames.clear();
+}
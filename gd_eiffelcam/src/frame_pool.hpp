@@ -0,0 +1,105 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace godot {
+
+// A decoded frame kept in CPU memory after it was uploaded to the GPU.
+// Only the representations requested through FramePool::set_retention are filled in.
+struct RetainedFrame {
+    uint64_t sequence = 0;
+    std::chrono::steady_clock::time_point timestamp;
+
+    cv::Mat rgb;               // CV_8UC3 side by side frame, exactly as uploaded
+    bool rgb_rectified = false;
+
+    cv::Mat luma;              // CV_8UC1 side by side frame, not rectified
+    cv::Mat rectified_luma;    // CV_8UC1 side by side frame, epipolar rectified for depth
+
+    std::vector<uint8_t> jpeg; // MJPEG payload as received from the camera
+};
+
+// Reference counted ring of the last N decoded frames, so depth and calibration
+// can read pixels without reading textures back from the GPU. Released frames
+// go back to a free list and their buffers are reused by the decoder.
+//
+// Readers must keep the shared_ptr alive for as long as they use the cv::Mat
+// buffers of a frame.
+class FramePool {
+public:
+    enum RETENTION {
+        RETAIN_NONE = 0,
+        RETAIN_RGB = 1,
+        RETAIN_LUMA = 2,
+        RETAIN_RECTIFIED_LUMA = 4,
+        RETAIN_JPEG = 8
+    };
+
+    FramePool();
+
+    void set_capacity(int p_capacity);
+    int get_capacity();
+
+    void set_retention(int p_retention) { retention = p_retention; }
+    void add_retention(int flags) { retention |= flags; }
+    void remove_retention(int flags) { retention &= ~flags; }
+    int get_retention() { return retention; }
+
+    // Returns a frame to be filled in by the decoder, recycled when possible.
+    std::shared_ptr<RetainedFrame> acquire();
+
+    // Makes a filled in frame visible to readers, dropping the oldest one.
+    void publish(std::shared_ptr<RetainedFrame> frame);
+
+    // age 0 is the newest frame. Returns nullptr if there is no such frame.
+    std::shared_ptr<const RetainedFrame> get(int age = 0);
+
+    void clear();
+
+private:
+    struct FreeList {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<RetainedFrame>> frames;
+    };
+
+    std::shared_ptr<FreeList> free_list;
+
+    std::mutex mutex;
+    std::deque<std::shared_ptr<RetainedFrame>> frames;  // newest first
+    int capacity = 3;
+    uint64_t next_sequence = 0;
+
+    std::atomic<int> retention { RETAIN_NONE };
+};
+
+}
@@ -23,11 +23,17 @@
 
 #include "gd_eiffelcam.hpp"
 
+#include <Directory.hpp>
 #include <Engine.hpp>
+#include <File.hpp>
 #include <OS.hpp>
+#include <ResourceLoader.hpp>
+#include <VisualServer.hpp>
 
 #include <unistd.h>
 
+#include <cmath>
+#include <cstdio>
 #include <string>
 #include <map>
 #include <thread>
@@ -38,7 +44,7 @@
 #include "opencv2/imgproc.hpp"
 #include "opencv2/ximgproc.hpp"
 
-#include "profiler.h"
+#include "tracing.h"
 
 using namespace godot;
 
@@ -51,14 +57,15 @@ void logDuration(std::string message, const float duration) {
     Godot::print(godotString);
 }
 
-GDEiffelCam* singleton;
-
 extern "C" void GDN_EXPORT godot_gdnative_init(godot_gdnative_init_options *o) {
     PROFILER_INIT();
     Godot::gdnative_init(o);
 }
 
 extern "C" void GDN_EXPORT godot_gdnative_terminate(godot_gdnative_terminate_options *o) {
+#ifdef ENABLE_FILE_TRACE
+    TraceFile::get_singleton()->flush(TraceFile::get_default_path());
+#endif
     Godot::gdnative_terminate(o);
 }
 
@@ -77,125 +84,6 @@ void jpegErrorExit ( j_common_ptr cinfo )
     throw std::runtime_error( jpegLastErrorMsg ); // or your preffered exception ...
 }
 
-class ICameraProperty {
-public:
-    virtual String name() = 0;
-    virtual uvc_error_t set(int, bool) = 0;
-    virtual int get() = 0;
-    virtual int get_max() = 0;
-    virtual int get_min() = 0;
-    virtual int get_def() = 0;
-
-    virtual Variant get_label() = 0;
-
-    virtual ~ICameraProperty() = 0;
-
-    uvc_device_handle_t* dh;
-};
-
-ICameraProperty::~ICameraProperty() {
-
-}
-template<typename DT>
-class CameraProperty : public ICameraProperty {
-public:
-    CameraProperty(String name,
-                        uvc_device_handle_t* dh,
-                        uvc_error_t (*getter)(uvc_device_handle_t*, DT*, uvc_req_code),
-                        uvc_error_t (*setter)(uvc_device_handle_t*, DT),
-                        String type = "range",
-                        Array values = Array(),
-                        Array labels = Array()) {
-                            this->_name = name;
-                            this->dh = dh;
-                            get_funcptr = getter;
-                            set_funcptr = setter;
-                            this->type = type;
-                            this->values = values;
-                            this->labels = labels;
-
-    }
-
-    ~CameraProperty() {
-
-    }
-
-    String name() {
-        return _name;
-    }
-
-    uvc_error_t set(int p, bool convert) {
-        if (type == "enum" && convert) {
-            p = values[p];
-        }
-
-        uvc_error_t res = set_funcptr(dh, static_cast<DT>(p));
-        return res;
-    }
-
-    int get() {
-        DT result;
-        get_funcptr(dh, &result, uvc_req_code::UVC_GET_CUR);
-
-        int res = static_cast<int>(result);
-
-        if (type == "enum") {
-            return values.find(res);
-        }
-
-        return res;
-    }
-
-    Variant get_label() {
-        int index = get();
-
-        if (type == "enum") {
-            return labels[index];
-        }
-
-        return index;
-    }
-
-    int get_max() {
-        if (type == "bool") {
-            return 1;
-        } else if (type == "enum") {
-            return labels.size() - 1;
-        } else {
-            DT result;
-            get_funcptr(dh, &result, uvc_req_code::UVC_GET_MAX);
-            return static_cast<int>(result);
-        }
-    }
-
-    int get_min() {
-        if (type == "bool" || type == "enum") {
-            return 0;
-        } else {
-            DT result;
-            get_funcptr(dh, &result, uvc_req_code::UVC_GET_MIN);
-            return static_cast<int>(result);
-        }
-    }
-
-    int get_def() {
-        DT result;
-        get_funcptr(dh, &result, uvc_req_code::UVC_GET_DEF);
-        return static_cast<int>(result);
-    }
-
-private:
-    String _name;
-    uvc_error_t (*get_funcptr)(uvc_device_handle_t*, DT*, uvc_req_code);
-    uvc_error_t (*set_funcptr)(uvc_device_handle_t*, DT);
-    String type;
-
-    Array values;
-    Array labels;
-};
-
-std::map<String, std::unique_ptr<ICameraProperty>> camera_range_properties;
-
 void ImageProcessor::create_decompressor()  {
     jpeg_create_decompress(&cinfo);
 
@@ -229,38 +117,65 @@ ImageProcessor::~ImageProcessor() {
 
 void ImageProcessor::init(Node* cam) {
     eiffelcam = Object::cast_to<GDEiffelCam>(cam);
+    frame_pool = &eiffelcam->frame_pool;
     TRACE_EVENT("image_processor", "ImageProcessor::init");
+
+    decode_ms = eiffelcam->metrics.histogram("decode_ms", MetricsRegistry::latency_buckets_ms());
+    remap_ms = eiffelcam->metrics.histogram("remap_ms", MetricsRegistry::latency_buckets_ms());
+    upload_ms = eiffelcam->metrics.histogram("upload_ms", MetricsRegistry::latency_buckets_ms());
+    jpeg_size_kb = eiffelcam->metrics.histogram("jpeg_size_kb", MetricsRegistry::size_buckets_kb());
+    decode_errors = eiffelcam->metrics.counter("decode_errors");
+    decoder_resets = eiffelcam->metrics.counter("decoder_resets");
     jtd = tjInitDecompress();
 
     rgb_data.resize(WIDTH * HEIGHT * 6);
     rgb_decoded.resize(WIDTH * HEIGHT * 6);
     yuv_data.resize(HEIGHT * WIDTH * 4);
+
+    decode_memory.set(rgb_data.size() + rgb_decoded.size() + yuv_data.size());
 }
 
 bool ImageProcessor::decode_yuv(PoolByteArray& bytes) {
     TRACE_EVENT("image_processor", "ImageProcessor::decode_yuv");
 
-    PoolByteArray::Write yuv_data_wrt = bytes.write();
-    int result = tjDecompressToYUV(jtd, (unsigned char*)inbuffer, insize, yuv_data_wrt.ptr(), TJFLAG_FASTDCT | TJFLAG_NOREALLOC);
+    int result;
+    {
+        MetricTimer timer(decode_ms);
+        PoolByteArray::Write yuv_data_wrt = bytes.write();
+        result = tjDecompressToYUV(jtd, (unsigned char*)inbuffer, insize, yuv_data_wrt.ptr(), TJFLAG_FASTDCT | TJFLAG_NOREALLOC);
+    }
     if (result != 0) {
         char* errstr = tjGetErrorStr2(jtd);
         String msg = String("ERROR during JPEG decode: ") + errstr;
         Godot::print(msg);
 
         return false;
-    } else {
-        TRACE_EVENT("image_processor", "upload_yuv_to_gpu");
+    }
 
-        gtc->update_yuv_frame_array(bytes);
+    return true;
+}
 
-        eiffelcam->emit_signal("frame_index_updated", gtc->get_current_frame_index());
+void ImageProcessor::warm_up(const unsigned char* p_inbuffer, unsigned long p_insize) {
+    TRACE_EVENT("image_processor", "ImageProcessor::warm_up");
 
-        return true;
+    inbuffer = p_inbuffer;
+    insize = p_insize;
+
+    // Both decoders, the colorspace can be switched at any time. Nothing is uploaded.
+    {
+        PoolByteArray::Write yuv_data_wrt = yuv_data.write();
+        tjDecompressToYUV(jtd, (unsigned char*)inbuffer, insize, yuv_data_wrt.ptr(), TJFLAG_FASTDCT | TJFLAG_NOREALLOC);
     }
+    decode_rgb(rgb_decoded);
+
+    // Fault in the CPU remap target
+    PoolByteArray::Write data_wrt = rgb_data.write();
+    memset(data_wrt.ptr(), 0, rgb_data.size());
 }
 
 bool ImageProcessor::decode_rgb (PoolByteArray& decoded) {
     TRACE_EVENT("image_processor", "ImageProcessor::decode_rgb");
+    MetricTimer timer(decode_ms);
 
     // Wild guess at valid sizes..
     if (insize < 0xFF || insize > 0xFFFFF) {
@@ -287,6 +202,7 @@ bool ImageProcessor::decode_rgb (PoolByteArray& decoded) {
             crop_y + crop_height > cinfo.output_height) {
             Godot::print("ERROR: crop dimensions exceed image dimensions {} x {}\n",
                 cinfo.output_width, cinfo.output_height);
+            jpeg_abort_decompress(&cinfo);
             return false;
         }
         jpeg_crop_scanline(&cinfo, &crop_x, &crop_width);
@@ -295,6 +211,7 @@ bool ImageProcessor::decode_rgb (PoolByteArray& decoded) {
         if ((tmp = jpeg_skip_scanlines(&cinfo, crop_y)) != crop_y) {
             Godot::print("jpeg_skip_scanlines() returned {} rather than {}\n",
                 tmp, crop_y);
+            jpeg_abort_decompress(&cinfo);
             return false;
         }
 
@@ -318,6 +235,7 @@ bool ImageProcessor::decode_rgb (PoolByteArray& decoded) {
                 cinfo.output_height - crop_y - crop_height) {
                 Godot::print("jpeg_skip_scanlines() returned {} rather than {}\n",
                     tmp, cinfo.output_height - crop_y - crop_height);
+                jpeg_abort_decompress(&cinfo);
                 return false;
             }
         }
@@ -333,58 +251,139 @@ bool ImageProcessor::decode_rgb (PoolByteArray& decoded) {
 
         Godot::print(pszErr);
 
-        // Probably leaks memory like shit when the decompressor dies, plus creates a stall
-        // due to flushing all the sweet cached DCT data
-        jpeg_destroy_decompress( &cinfo );
-        create_decompressor();
+        // Back to the idle state for the next frame. Unlike destroying and
+        // recreating the decompressor this keeps its permanent allocations.
+        jpeg_abort_decompress(&cinfo);
+        decoder_resets->add();
 
         return false;
     }
 }
 
-void ImageProcessor::run() {
-    TRACE_EVENT("image_processor", "ImageProcessor::run");
-
-    if (colorspace == COLORSPACE::COLORSPACE_YUV) {
-        decode_yuv(yuv_data);
+void ImageProcessor::retain_frame(const unsigned char* raw_rgb, const unsigned char* uploaded_rgb, const unsigned char* y_plane) {
+    int retention = frame_pool->get_retention();
+    if (retention == FramePool::RETAIN_NONE) {
+        return;
     }
 
-    if (colorspace == COLORSPACE::COLORSPACE_RGB) {
-        if (decode_rgb(rgb_decoded)) {
+    TRACE_EVENT("image_processor", "ImageProcessor::retain_frame");
+    MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_FRAME_POOL);
 
-            // remap
-            if (remap_mode == REMAP_MODE::CPU_REMAP) {
-                PoolByteArray::Write decoded_wrt = rgb_decoded.write();
-                PoolByteArray::Write data_wrt = rgb_data.write();
+    cv::Size frame_size(WIDTH * 2, HEIGHT);
+    std::shared_ptr<RetainedFrame> frame = frame_pool->acquire();
 
-                cv::Mat decodedImage { cv::Size(WIDTH * 2, HEIGHT), CV_8UC3, decoded_wrt.ptr() };
-                cv::Mat targetFrame { cv::Size(WIDTH * 2, HEIGHT), CV_8UC3, data_wrt.ptr() };
+    // A copy of the compressed frame is a fraction of the decoded one
+    if (retention & FramePool::RETAIN_JPEG) {
+        frame->jpeg.assign(inbuffer, inbuffer + insize);
+    }
 
-                // try preload the l2 cache
-                for (int i = 0 ; i < insize; i += 64) {
-                    __builtin_prefetch (inbuffer + i, 0, 1);
-                }
+    if ((retention & FramePool::RETAIN_RGB) && uploaded_rgb != nullptr) {
+        cv::Mat(frame_size, CV_8UC3, (void*) uploaded_rgb).copyTo(frame->rgb);
+        frame->rgb_rectified = remap_mode == REMAP_MODE::CPU_REMAP;
+    }
 
-                cv::remap(decodedImage, targetFrame, *mapX, *mapY, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
-            }
+    if (retention & (FramePool::RETAIN_LUMA | FramePool::RETAIN_RECTIFIED_LUMA)) {
+        cv::Mat luma;
 
-            // upload
-            {
-                TRACE_EVENT("image_processor", "upload_rgb_to_gpu");
-                if (remap_mode == REMAP_MODE::CPU_REMAP) {
-                    gtc->update_rgb_frame_array(rgb_data);
-                } else {
-                    gtc->update_rgb_frame_array(rgb_decoded);
-                }
-                eiffelcam->emit_signal("frame_index_updated", gtc->get_current_frame_index());
+        if (y_plane != nullptr) {
+            // The YUV decoder already produced the luma plane
+            luma = cv::Mat(frame_size, CV_8UC1, (void*) y_plane);
+            if (retention & FramePool::RETAIN_LUMA) {
+                luma.copyTo(frame->luma);
             }
+        } else {
+            cv::Mat& target = (retention & FramePool::RETAIN_LUMA) ? frame->luma : scratch_luma;
+            cv::cvtColor(cv::Mat(frame_size, CV_8UC3, (void*) raw_rgb), target, cv::COLOR_RGB2GRAY);
+            luma = target;
+        }
+
+        // Remapping a single channel is a third of the work of remapping RGB
+        if ((retention & FramePool::RETAIN_RECTIFIED_LUMA) && !eiffelcam->rectifyMapX.empty()) {
+            cv::remap(luma, frame->rectified_luma, eiffelcam->rectifyMapX, eiffelcam->rectifyMapY, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
         }
     }
+
+    frame_pool->publish(frame);
 }
 
-Error ImageProcessor::process(const unsigned char* inbuffer, unsigned long insize, cv::Mat& mapX, cv::Mat& mapY, GodotTextureComponents* gtc, int colorspace, int remap_mode) {
-    TRACE_EVENT("image_processor", "ImageProcessor::process");
+bool ImageProcessor::decode() {
+    TRACE_EVENT("image_processor", "ImageProcessor::decode");
+
+    jpeg_size_kb->record(insize / 1024.0);
+
+    if (colorspace == COLORSPACE::COLORSPACE_YUV) {
+        if (!decode_yuv(yuv_data)) {
+            decode_errors->add();
+            return false;
+        }
+
+        PoolByteArray::Read yuv_data_rd = yuv_data.read();
+        if (gather_exposure_stats) {
+            // 4:2:2, see the planes in fsquad.gdshader
+            const uint8_t* y_plane = yuv_data_rd.ptr();
+            const uint8_t* u_plane = y_plane + FRAME_WIDTH * HEIGHT;
+            const uint8_t* v_plane = u_plane + WIDTH * HEIGHT;
+            exposure_stats.gather_yuv(y_plane, u_plane, v_plane, FRAME_WIDTH, HEIGHT, WIDTH, HEIGHT);
+        }
+        retain_frame(nullptr, nullptr, yuv_data_rd.ptr());
+        return true;
+    }
+
+    if (!decode_rgb(rgb_decoded)) {
+        decode_errors->add();
+        return false;
+    }
+
+    // From the camera image, before the remap adds its black border
+    if (gather_exposure_stats) {
+        PoolByteArray::Read decoded_rd = rgb_decoded.read();
+        exposure_stats.gather_rgb(decoded_rd.ptr(), FRAME_WIDTH, HEIGHT);
+    }
+
+    // remap
+    if (remap_mode == REMAP_MODE::CPU_REMAP) {
+        MetricTimer timer(remap_ms);
+        PoolByteArray::Write decoded_wrt = rgb_decoded.write();
+        PoolByteArray::Write data_wrt = rgb_data.write();
+
+        cv::Mat decodedImage { cv::Size(WIDTH * 2, HEIGHT), CV_8UC3, decoded_wrt.ptr() };
+        cv::Mat targetFrame { cv::Size(WIDTH * 2, HEIGHT), CV_8UC3, data_wrt.ptr() };
+
+        // try preload the l2 cache
+        for (int i = 0 ; i < insize; i += 64) {
+            __builtin_prefetch (inbuffer + i, 0, 1);
+        }
+
+        cv::remap(decodedImage, targetFrame, *mapX, *mapY, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
+    }
+
+    {
+        PoolByteArray::Read decoded_rd = rgb_decoded.read();
+        PoolByteArray::Read data_rd = rgb_data.read();
+        retain_frame(decoded_rd.ptr(), remap_mode == REMAP_MODE::CPU_REMAP ? data_rd.ptr() : decoded_rd.ptr(), nullptr);
+    }
+
+    return true;
+}
 
+void ImageProcessor::upload() {
+    TRACE_EVENT("image_processor", "ImageProcessor::upload");
+
+    {
+        MetricTimer timer(upload_ms);
+        if (colorspace == COLORSPACE::COLORSPACE_YUV) {
+            gtc->update_yuv_frame_array(yuv_data);
+        } else if (remap_mode == REMAP_MODE::CPU_REMAP) {
+            gtc->update_rgb_frame_array(rgb_data);
+        } else {
+            gtc->update_rgb_frame_array(rgb_decoded);
+        }
+    }
+
+    eiffelcam->emit_signal("frame_index_updated", gtc->get_current_frame_index());
+}
+
+void ImageProcessor::set_frame(const unsigned char* inbuffer, unsigned long insize, cv::Mat& mapX, cv::Mat& mapY, GodotTextureComponents* gtc, int colorspace, int remap_mode) {
     this->inbuffer = inbuffer;
     this->insize = insize;
     this->mapX = &mapX;
@@ -392,8 +391,17 @@ Error ImageProcessor::process(const unsigned char* inbuffer, unsigned long insiz
     this->gtc = gtc;
     this->colorspace = colorspace;
     this->remap_mode = remap_mode;
+}
+
+Error ImageProcessor::process(const unsigned char* inbuffer, unsigned long insize, cv::Mat& mapX, cv::Mat& mapY, GodotTextureComponents* gtc, int colorspace, int remap_mode) {
+    TRACE_EVENT("image_processor", "ImageProcessor::process");
 
-    run();
+    set_frame(inbuffer, insize, mapX, mapY, gtc, colorspace, remap_mode);
+
+    if (!decode()) {
+        return Error::FAILED;
+    }
+    upload();
 
     return Error::OK;
 }
@@ -441,20 +449,81 @@ void GDEiffelCam::_register_methods() {
     register_method("get_camera_setting_label", &GDEiffelCam::get_camera_setting_label);
 
     register_method("on_permission_received", &GDEiffelCam::on_permission_received);
+    register_method("on_camera_attached", &GDEiffelCam::on_camera_attached);
+    register_method("on_camera_detached", &GDEiffelCam::on_camera_detached);
+    register_method("_on_frame_pre_draw", &GDEiffelCam::_on_frame_pre_draw);
+    register_method("set_device_serial", &GDEiffelCam::set_device_serial);
+    register_method("get_device_serial", &GDEiffelCam::get_device_serial);
+    register_method("set_device_path", &GDEiffelCam::set_device_path);
+    register_method("get_device_path", &GDEiffelCam::get_device_path);
+    register_method("get_device", &GDEiffelCam::get_device);
     register_method("enter_calibration_mode", &GDEiffelCam::enter_calibration_mode);
     register_method("is_in_calibration_mode", &GDEiffelCam::is_in_calibration_mode);
     register_method("set_image_on_hold", &GDEiffelCam::set_image_on_hold);
     register_method("is_image_on_hold", &GDEiffelCam::is_image_on_hold);
     register_method("take_picture", &GDEiffelCam::take_picture);
     register_method("calibration_images_left", &GDEiffelCam::calibration_images_left);
-    register_method("recalibrate_camera", &GDEiffelCam::recalibrate_camera);
-    register_method("recalibrate_camera_from_files", &GDEiffelCam::recalibrate_camera_from_files);
+    register_method("start_calibration", &GDEiffelCam::start_calibration);
+    register_method("start_calibration_from_files", &GDEiffelCam::start_calibration_from_files);
+    register_method("is_calibrating", &GDEiffelCam::is_calibrating);
+    register_method("get_calibration_diagnostics", &GDEiffelCam::get_calibration_diagnostics);
+    register_method("get_calibration_view_ids", &GDEiffelCam::get_calibration_view_ids);
+    register_method("remove_calibration_view", &GDEiffelCam::remove_calibration_view);
+    register_method("new_calibration_dataset", &GDEiffelCam::new_calibration_dataset);
+    register_method("get_calibration_view_thumbnail", &GDEiffelCam::get_calibration_view_thumbnail);
     register_method("exit_calibration_mode", &GDEiffelCam::exit_calibration_mode);
     register_method("set_disparity_test_mode", &GDEiffelCam::set_disparity_test_mode);
     register_method("cancel_recalibration", &GDEiffelCam::cancel_recalibration);
     register_method("get_disparity_map", &GDEiffelCam::get_disparity_map);
+    register_method("get_depth_map", &GDEiffelCam::get_depth_map);
+    register_method("set_disparity_preset", &GDEiffelCam::set_disparity_preset);
+    register_method("get_disparity_preset", &GDEiffelCam::get_disparity_preset);
     register_method("save_disparity_images", &GDEiffelCam::save_disparity_images);
+    register_method("export_snapshot", &GDEiffelCam::export_snapshot);
+    register_method("set_export_png_compression", &GDEiffelCam::set_export_png_compression);
+    register_method("get_export_png_compression", &GDEiffelCam::get_export_png_compression);
+    register_method("get_pending_exports", &GDEiffelCam::get_pending_exports);
+    register_method("set_save_calibration_images", &GDEiffelCam::set_save_calibration_images);
+    register_method("get_save_calibration_images", &GDEiffelCam::get_save_calibration_images);
     register_method("accept_calibration_image", &GDEiffelCam::accept_calibration_image);
+    register_method("set_frame_pool_size", &GDEiffelCam::set_frame_pool_size);
+    register_method("get_frame_pool_size", &GDEiffelCam::get_frame_pool_size);
+    register_method("set_frame_retention", &GDEiffelCam::set_frame_retention);
+    register_method("get_frame_retention", &GDEiffelCam::get_frame_retention);
+    register_method("set_continuous_depth", &GDEiffelCam::set_continuous_depth);
+    register_method("is_continuous_depth", &GDEiffelCam::is_continuous_depth);
+    register_method("set_depth_change_threshold", &GDEiffelCam::set_depth_change_threshold);
+    register_method("get_depth_change_threshold", &GDEiffelCam::get_depth_change_threshold);
+    register_method("get_depth_changed_fraction", &GDEiffelCam::get_depth_changed_fraction);
+    register_method("set_chessboard_tracking_rate", &GDEiffelCam::set_chessboard_tracking_rate);
+    register_method("get_chessboard_tracking_rate", &GDEiffelCam::get_chessboard_tracking_rate);
+    register_method("get_metrics", &GDEiffelCam::get_metrics);
+    register_method("reset_metrics", &GDEiffelCam::reset_metrics);
+    register_method("flush_trace", &GDEiffelCam::flush_trace);
+    register_method("get_frame_pacing", &GDEiffelCam::get_frame_pacing);
+    register_method("reset_frame_pacing", &GDEiffelCam::reset_frame_pacing);
+    register_method("set_display_refresh_rates", &GDEiffelCam::set_display_refresh_rates);
+    register_method("get_memory_usage", &GDEiffelCam::get_memory_usage);
+    register_method("reset_memory_peaks", &GDEiffelCam::reset_memory_peaks);
+    register_method("get_bring_up_timings", &GDEiffelCam::get_bring_up_timings);
+    register_method("set_auto_exposure", &GDEiffelCam::set_auto_exposure);
+    register_method("get_auto_exposure", &GDEiffelCam::get_auto_exposure);
+    register_method("set_auto_white_balance", &GDEiffelCam::set_auto_white_balance);
+    register_method("get_auto_white_balance", &GDEiffelCam::get_auto_white_balance);
+    register_method("set_exposure_target", &GDEiffelCam::set_exposure_target);
+    register_method("get_exposure_target", &GDEiffelCam::get_exposure_target);
+    register_method("set_max_exposure_ms", &GDEiffelCam::set_max_exposure_ms);
+    register_method("get_max_exposure_ms", &GDEiffelCam::get_max_exposure_ms);
+    register_method("get_exposure_stats", &GDEiffelCam::get_exposure_stats);
+    register_method("set_usb_max_payload_transfer_size", &GDEiffelCam::set_usb_max_payload_transfer_size);
+    register_method("get_usb_max_payload_transfer_size", &GDEiffelCam::get_usb_max_payload_transfer_size);
+    register_method("set_usb_frame_buffers", &GDEiffelCam::set_usb_frame_buffers);
+    register_method("get_usb_frame_buffers", &GDEiffelCam::get_usb_frame_buffers);
+    register_method("get_usb_stats", &GDEiffelCam::get_usb_stats);
+    register_method("load_lut", &GDEiffelCam::load_lut);
+    register_method("prebake_luts", &GDEiffelCam::prebake_luts);
+    register_method("set_lut_saturation", &GDEiffelCam::set_lut_saturation);
+    register_method("get_lut_saturation", &GDEiffelCam::get_lut_saturation);
 
     register_signal<GDEiffelCam>((char*)"error");
     register_signal<GDEiffelCam>((char*)"frame_start");
@@ -464,26 +533,36 @@ void GDEiffelCam::_register_methods() {
     register_signal<GDEiffelCam>((char*)"frame_index_updated", "value", GODOT_VARIANT_TYPE_INT);
     register_signal<GDEiffelCam>("camera_property_range_changed", "property", GODOT_VARIANT_TYPE_STRING, "current", GODOT_VARIANT_TYPE_INT, "min", GODOT_VARIANT_TYPE_INT, "max", GODOT_VARIANT_TYPE_INT);
     register_signal<GDEiffelCam>("camera_status_changed", "status", GODOT_VARIANT_TYPE_INT);
+    register_signal<GDEiffelCam>((char*)"bring_up_stage_changed", "stage", GODOT_VARIANT_TYPE_INT, "elapsed_ms", GODOT_VARIANT_TYPE_REAL);
+    register_signal<GDEiffelCam>((char*)"stream_recovered", "level", GODOT_VARIANT_TYPE_INT, "elapsed_ms", GODOT_VARIANT_TYPE_REAL);
     register_signal<GDEiffelCam>((char*)"ready_for_calibration");
+    register_signal<GDEiffelCam>((char*)"calibration_progress", "stage", GODOT_VARIANT_TYPE_INT, "iteration", GODOT_VARIANT_TYPE_INT, "rms", GODOT_VARIANT_TYPE_REAL);
+    register_signal<GDEiffelCam>((char*)"calibration_finished", "state", GODOT_VARIANT_TYPE_INT, "message", GODOT_VARIANT_TYPE_STRING);
     register_signal<GDEiffelCam>((char*)"frame_diff_changed", "frame_diff", GODOT_VARIANT_TYPE_INT);
+    register_signal<GDEiffelCam>((char*)"image_exported", "id", GODOT_VARIANT_TYPE_INT, "path", GODOT_VARIANT_TYPE_STRING, "error", GODOT_VARIANT_TYPE_STRING);
 
     register_signal<GDEiffelCam>((char*)"chessboard_detected", "left", GODOT_VARIANT_TYPE_OBJECT, "right", GODOT_VARIANT_TYPE_OBJECT);
+    register_signal<GDEiffelCam>((char*)"chessboard_not_detected");
+    register_signal<GDEiffelCam>((char*)"chessboard_tracked", "left_corners", GODOT_VARIANT_TYPE_POOL_VECTOR2_ARRAY, "right_corners", GODOT_VARIANT_TYPE_POOL_VECTOR2_ARRAY, "good", GODOT_VARIANT_TYPE_BOOL);
 }
 
 Array GDEiffelCam::_get_property_list() {
 
-
     Array property_list;
 
-    for (const auto& entry : camera_range_properties) {
+    // Served from the cache, empty until the controls were read after connecting.
+    for (const String& name : camera_properties.get_names()) {
+        CameraPropertyValue value;
+        if (!camera_properties.get(name, value)) continue;
+
         Dictionary dict;
-        dict["name"] = entry.second->name();
+        dict["name"] = name;
         dict["type"] = GODOT_VARIANT_TYPE_INT;
         dict["usage"] = GODOT_PROPERTY_USAGE_EDITOR | GODOT_PROPERTY_USAGE_STORAGE;
         dict["hint"] = GODOT_PROPERTY_HINT_RANGE;
-        String minimum = std::to_string(entry.second->get_min()).c_str();
-        String maximum = std::to_string(entry.second->get_max()).c_str();
-        dict["hint_string"] = maximum + "," + minimum + ",1";
+        String minimum = std::to_string(value.min).c_str();
+        String maximum = std::to_string(value.max).c_str();
+        dict["hint_string"] = minimum + "," + maximum + ",1";
 
         property_list.append(dict);
     }
@@ -493,9 +572,9 @@ Array GDEiffelCam::_get_property_list() {
 
 Variant GDEiffelCam::_get(String property) {
 
-
-    if (camera_range_properties.find(property) != camera_range_properties.end()) {
-        return camera_range_properties[property]->get();
+    CameraPropertyValue value;
+    if (camera_properties.get(property, value)) {
+        return value.current;
     } else if (property == "frame_diff") {
         return eyeData.get_frame_diff();
     }
@@ -506,9 +585,9 @@ Variant GDEiffelCam::_get(String property) {
 
 bool GDEiffelCam::_set(const String property, const Variant value) {
 
-    if (camera_range_properties.find(property) != camera_range_properties.end()) {
-        uvc_error_t res = camera_range_properties[property]->set(value, true);
-        return res == uvc_error_t::UVC_SUCCESS;
+    if (camera_properties.has(property)) {
+        // Queued, the camera is written by the property worker.
+        return camera_properties.set(property, value);
     } else if (property == "frame_diff") {
         eyeData.set_frame_diff(value);
         emit_signal("frame_diff_changed", eyeData.get_frame_diff());
@@ -520,9 +599,8 @@ bool GDEiffelCam::_set(const String property, const Variant value) {
 
 void GDEiffelCam::reset_camera_setting(const String property) {
 
-    if (camera_range_properties.find(property) != camera_range_properties.end()) {
-        int def = camera_range_properties[property]->get_def();
-        camera_range_properties[property]->set(def, false);
+    if (camera_properties.has(property)) {
+        camera_properties.reset(property);
     } else if (property == "frame_diff") {
         eyeData.set_frame_diff(eyeData.get_default_frame_diff());
         emit_signal("frame_diff_changed", eyeData.get_frame_diff());
@@ -531,8 +609,8 @@ void GDEiffelCam::reset_camera_setting(const String property) {
 
 Variant GDEiffelCam::get_camera_setting_label(const String property) {
 
-    if (camera_range_properties.find(property) != camera_range_properties.end()) {
-        return camera_range_properties[property]->get_label();
+    if (camera_properties.has(property)) {
+        return camera_properties.get_label(property);
     } else if (property == "frame_diff") {
         return eyeData.get_frame_diff();
     }
@@ -544,6 +622,16 @@ GDEiffelCam::GDEiffelCam() {
 }
 
 GDEiffelCam::~GDEiffelCam() {
+    // First of all: the libuvc thread writes into usb_frame_queue, the
+    // recovery, bring-up and property threads use the UVC handles. Nothing
+    // listens for the snapshots anymore.
+    pending_snapshots.clear();
+    close_camera();
+
+    if (lut_prebake.valid()) {
+        lut_prebake.wait();
+    }
+    release_device();
 }
 
 void GDEiffelCam::_init() {
@@ -558,10 +646,29 @@ void GDEiffelCam::_init() {
 
     frame_array_size = 10;
 
-    singleton = this;
+    frames_received = metrics.counter("frames_received");
+    dropped_frames = metrics.counter("dropped_frames");
+    usb_errors = metrics.counter("usb_errors");
+    frame_queue_depth = metrics.gauge("frame_queue_depth");
+    time_to_first_frame_ms = metrics.gauge("time_to_first_frame_ms");
+    stream_stalls = metrics.counter("stream_stalls");
+    stream_recovery_failures = metrics.counter("stream_recovery_failures");
+    stream_recovery_ms = metrics.histogram("stream_recovery_ms", MetricsRegistry::latency_buckets_ms());
+    frame_pacing.init(metrics);
+    camera_properties.init(metrics);
+    exposure_controller.init(metrics);
+    usb_frame_queue.init(metrics);
+    image_exporter.init(metrics);
+
+    // Before _ready, the scene sets its look while the nodes are still entering the tree
+    Ref<Directory> directory = Ref<Directory>(Directory::_new());
+    directory->make_dir_recursive("user://lut_cache");
+    lut_cache_dir = ProjectSettings::get_singleton()->globalize_path("user://lut_cache").utf8().get_data();
 
     setenv("JSIMD_FORCENEON", "1", 1);
 
+    MemoryAccounting::install_opencv_allocator();
+
     cv::setUseOptimized(true);
     Godot::print(cv::getBuildInformation().c_str());
 
@@ -592,290 +699,1077 @@ void GDEiffelCam::connect_to_camera() {
     // the necessary Java API calls to open the device and retrieve the
     // file descriptor that we can wrap with libuvc
 
-    uvc_error_t res;
-
     if (isAndroid) { // Engine::get_singleton()->has_singleton("EiffelCamera")) {
         Godot::print("Running on android");
 
-        int libusb_FD = -1;
-
         Godot::print("Calling connectCamera, vid, pid follows:");
         Godot::print(std::to_string(vid).c_str());
         Godot::print(std::to_string(pid).c_str());
-        bool b = eiffelcamera_singleton->call("connectCamera",vid,pid);
+        bool b = eiffelcamera_singleton->call("connectCamera", vid, pid, device_path.c_str());
 
         Godot::print(b ? "Got camera permissions" : "FAIL: Could not get camera permissions");
     } else {
         //We are running on OSX
         Godot::print("Running on os x");
 
-        res = uvc_init(&ctx, NULL);
-        if (res < 0) {
-            Godot::print("uvc_init error!\n");
-            return;
-        }
-
-        res = uvc_find_device(ctx, &dev,vid, pid, NULL); // filter devices: vendor_id, product_id, "serial_num"
-        if (res < 0) {
-            emit_error("ERROR: cannot find Eiffel Camera device");
-            return;
-        } else {
-            Godot::print("INFO: Eiffel Camera Device found");
-            res = uvc_open(dev, &devh);
-            if (res < 0) {
-              emit_error("ERROR: Cannot open UVC device (Needs sudo?)");
-              return;
-            } else {
-              printf("INFO: Eiffel Camera Device opened\n");
-
-              // Uncomment to list camera formats etc.for debugging
-              uvc_print_diag(devh, stderr);
-
-              start_streaming();
-            }
-        }
+        begin_bring_up(-1);
     }
 }
 
-void GDEiffelCam::on_permission_received(int fd) {
+void GDEiffelCam::on_permission_received(int fd, String device) {
 
-    if (fd < 0 || cameraRunning) {
+    // The plugin is shared, the permission may be for the camera of another instance
+    if (fd < 0 || cameraRunning || device != device_path.c_str()) {
         return;
     }
 
-    int err = libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
+    begin_bring_up(fd);
+}
 
-    uvc_error_t res = uvc_init(&ctx, NULL);
-    if (res < 0) {
-        emit_error("ERROR: cannot initialise UVC");
-        return;
-    }
+void GDEiffelCam::begin_bring_up(int fd) {
 
-    res = uvc_wrap(fd,ctx,&devh);
-    if (res < 0) {
-        emit_error("ERROR: cannot find Eiffel Camera device");
-        Godot::print(std::to_string(res).c_str());
+    if (bring_up.valid()) {
         return;
-    } else {
-        Godot::print("INFO: Eiffel Camera Device found");
-        dev = uvc_get_device(devh);
     }
 
-    start_streaming();
-}
-
-void GDEiffelCam::start_streaming() {
-
-    // Try to negotiate a MJPG stream
-    uvc_error_t res = uvc_get_stream_ctrl_format_size(devh, &ctrl, UVC_FRAME_FORMAT_COMPRESSED, streamWidth, streamHeight, streamFps);
+    bring_up_fd = fd;
+    bring_up_device_path = device_path;
+    bring_up_device_serial = device_serial;
+    bring_up_selected_serial = device_selector.serial;
+    bring_up_wrong_device = false;
 
-    // Uncomment to display stream control for debugging
-    uvc_print_stream_ctrl(&ctrl, stderr);
+    bring_up_start = std::chrono::steady_clock::now();
+    reported_bring_up_stage = BRING_UP_IDLE;
+    set_bring_up_stage(BRING_UP_OPENING);
 
-    if (res < 0) {
-        emit_error("Cannot get stream size requested");
-        return;
-    } else {
-        res = uvc_stream_open_ctrl(devh, &streamh, &ctrl);
-        if (res != UVC_SUCCESS) {
-            Godot::print(String("ERROR: Unable to open stream ctrl (") + String(uvc_strerror(res)) + ")");
-            return;
-        }
+    // A recovery keeps the frame buffers, the main thread may still hold one
+    bool configure_queue = recovery_level != RECOVERY_REINITIALISE;
+    bring_up = std::async(std::launch::async, &GDEiffelCam::run_bring_up, this, fd, configure_queue);
+}
 
-        res = uvc_stream_start(streamh, NULL, NULL, 0);
-        if (res != UVC_SUCCESS) {
-            Godot::print(String("ERROR: Unable to start streaming (") + String(uvc_strerror(res)) + ")");
-            return;
-        } else {
-            uvc_set_ae_mode(devh, 0); // turn off auto exposure
-            Godot::print("INFO: setting ae mode to aperture priority");
-            cameraRunning = true;
-            emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::CONNECTED);
+void GDEiffelCam::set_bring_up_stage(int stage) {
 
-            uvc_set_white_balance_temperature_auto(devh, 1);
-            // uvc_set_white_balance_temperature(devh, 32000);
-        }
+    if (stage >= 0 && stage < BRING_UP_STAGE_COUNT) {
+        bring_up_stage_ms[stage] = get_bring_up_elapsed_ms();
     }
+    bring_up_stage = stage;
+}
 
-    send_camera_properties();
-    emit_signal("opened");
+double GDEiffelCam::get_bring_up_elapsed_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - bring_up_start).count();
 }
 
-void GDEiffelCam::_ready() {
+// Runs on the bring-up thread. The main thread does not touch the UVC handles
+// until the returned future is ready. Returns an error message, empty on success.
+std::string GDEiffelCam::run_bring_up(int fd, bool configure_queue) {
 
-    TRACE_EVENT("eiffel_camera", "EiffelCamera::_ready");
+    TRACE_EVENT("eiffel_camera", "bring_up");
 
-    emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::NOT_CONNECTED);
-    cameraRunning = false;
+    uvc_error_t res;
 
-    // Set up our Godot buffer and Image/Texture wrappers
-    eyeData.init(frame_array_size);
+    if (fd >= 0) {
+        libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
 
-    if (Engine::get_singleton()->has_singleton("EiffelCamera")) {
-        eiffelcamera_singleton = Engine::get_singleton()->get_singleton("EiffelCamera");
-        eiffelcamera_singleton->connect("permission_received", this, "on_permission_received");
-    }
+        res = uvc_init(&ctx, NULL);
+        if (res < 0) {
+            return "ERROR: cannot initialise UVC";
+        }
 
-    image_processor->init(this);
+        res = uvc_wrap(fd, ctx, &devh);
+        if (res < 0) {
+            return std::string("ERROR: cannot find Eiffel Camera device (") + uvc_strerror(res) + ")";
+        }
+        dev = uvc_get_device(devh);
 
-    if (!isAndroid) {
-        connect_to_camera();
-        cameraAttached = true;
-    }
+        // Android only reveals the serial once the app has permission
+        std::string serial = UsbDeviceSelector::read_serial(uvc_get_libusb_handle(devh));
+        if (!bring_up_selected_serial.empty() && serial != bring_up_selected_serial) {
+            bring_up_wrong_device = true;
+            return "ERROR: the Eiffel Camera at " + bring_up_device_path + " is not the selected one (serial " + serial + ")";
+        }
+        bring_up_device_serial = serial;
+    } else {
+        res = uvc_init(&ctx, NULL);
+        if (res < 0) {
+            return "ERROR: uvc_init error";
+        }
 
-    emit_signal("frame_diff_changed", eyeData.get_frame_diff());
-}
+        res = find_device();
+        if (res < 0) {
+            return "ERROR: cannot find Eiffel Camera device";
+        }
 
-void GDEiffelCam::send_camera_properties() {
+        res = uvc_open(dev, &devh);
+        uvc_unref_device(dev);
+        if (res < 0) {
+            return "ERROR: Cannot open UVC device (Needs sudo?)";
+        }
 
-    camera_range_properties["brightness"] = std::unique_ptr<ICameraProperty>(new CameraProperty<int16_t>("brightness", devh, &uvc_get_brightness, &uvc_set_brightness));
-    camera_range_properties["contrast"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("contrast", devh, &uvc_get_contrast, &uvc_set_contrast));
-    camera_range_properties["saturation"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("saturation", devh, &uvc_get_saturation, &uvc_set_saturation));
-    camera_range_properties["hue"] = std::unique_ptr<ICameraProperty>(new CameraProperty<int16_t>("hue", devh, &uvc_get_hue, &uvc_set_hue));
-    camera_range_properties["white_balance_temperature_auto"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint8_t>("white_balance_temperature_auto", devh, &uvc_get_white_balance_temperature_auto, &uvc_set_white_balance_temperature_auto, "bool"));
-    camera_range_properties["gamma"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("gamma", devh, &uvc_get_gamma, &uvc_set_gamma));
-    camera_range_properties["gain"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("gain", devh, &uvc_get_gain, &uvc_set_gain));
-    camera_range_properties["white_balance_temperature"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("white_balance_temperature", devh, &uvc_get_white_balance_temperature, &uvc_set_saturation));
-    camera_range_properties["sharpness"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("sharpness", devh, &uvc_get_sharpness, &uvc_set_sharpness));
-    camera_range_properties["backlight_compensation"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("backlight_compensation", devh, &uvc_get_backlight_compensation, &uvc_set_backlight_compensation));
-    camera_range_properties["exposure_abs"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint32_t>("exposure_abs", devh, &uvc_get_exposure_abs, &uvc_set_exposure_abs));
-    camera_range_properties["focus_abs"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint16_t>("focus_abs", devh, &uvc_get_focus_abs, &uvc_set_focus_abs));
-    camera_range_properties["focus_auto"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint8_t>("focus_auto", devh, &uvc_get_focus_auto, &uvc_set_focus_auto, "bool"));
-
-    Array power_line_frequency_values, power_line_frequency_names;
-    Array ae_mode_values, ae_mode_names;
+        // Uncomment to list camera formats etc.for debugging
+        // uvc_print_diag(devh, stderr);
+    }
 
-    {
-        power_line_frequency_values.append(0);
-        power_line_frequency_values.append(1);
-        power_line_frequency_values.append(2);
+    set_bring_up_stage(BRING_UP_NEGOTIATING);
 
-        power_line_frequency_names.append("Disabled");
-        power_line_frequency_names.append("50 Hz");
-        power_line_frequency_names.append("60 Hz");
+    std::string error = negotiate_stream();
+    if (!error.empty()) {
+        return error;
     }
 
-    {
-        ae_mode_values.append(1);
-        ae_mode_values.append(8);
+    set_bring_up_stage(BRING_UP_STARTING);
+
+    error = open_stream(configure_queue);
+    if (!error.empty()) {
+        return error;
+    }
 
-        ae_mode_names.append("Manual Mode");
-        ae_mode_names.append("Aperture Priority Mode");
+    // Decode the first frame here, so the first frame on the main thread does
+    // not pay for the decoder's first use allocations.
+    set_bring_up_stage(BRING_UP_WARMING_UP);
+    {
+        TRACE_EVENT("eiffel_camera", "decoder_warm_up");
+        const UsbFrame* warm_up_frame = usb_frame_queue.take_latest(BRING_UP_WARM_UP_TIMEOUT_US);
+        if (warm_up_frame != nullptr) {
+            image_processor->warm_up(warm_up_frame->data.data(), warm_up_frame->data_bytes);
+        }
     }
 
-    camera_range_properties["power_line_frequency"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint8_t>("power_line_frequency", devh, &uvc_get_power_line_frequency, &uvc_set_power_line_frequency, "enum", power_line_frequency_values, power_line_frequency_names));
-    camera_range_properties["ae_mode"] = std::unique_ptr<ICameraProperty>(new CameraProperty<uint8_t>("ae_mode", devh, &uvc_get_ae_mode, &uvc_set_ae_mode, "enum", ae_mode_values, ae_mode_names));
+    return "";
+}
 
-    emit_signal("camera_property_range_changed", "frame_diff", 0, 0, std::max(frame_array_size - 1, (uint32_t)0));
+// Bring-up thread. The camera at device_path, or without hotplug events the
+// first one matching the selection that no other instance claimed. dev is
+// referenced on success.
+uvc_error_t GDEiffelCam::find_device() {
 
-    for (const auto& entry : camera_range_properties) {
-        emit_signal("camera_property_range_changed",
-            entry.second->name(),
-            entry.second->get(),
-            entry.second->get_min(),
-            entry.second->get_max()
-        );
+    uvc_device_t** list;
+    uvc_error_t res = uvc_get_device_list(ctx, &list);
+    if (res < 0) {
+        return res;
     }
-}
 
-void GDEiffelCam::_process(float delta) {
+    std::map<std::pair<int, int>, std::string> port_paths;
 
-    TRACE_EVENT("eiffel_camera", "EiffelCamera::_process", "delta", delta);
-    time_elapsed += delta;
+    res = UVC_ERROR_NO_DEVICE;
+    for (int i = 0; list[i] != nullptr; ++i) {
+        uvc_device_descriptor_t* descriptor;
+        if (uvc_get_device_descriptor(list[i], &descriptor) != UVC_SUCCESS) continue;
 
-    if (isAndroid && !cameraAttached) {
+        bool is_eiffel_camera = descriptor->idVendor == vid && descriptor->idProduct == pid;
+        std::string serial = descriptor->serialNumber != nullptr ? descriptor->serialNumber : "";
+        uvc_free_device_descriptor(descriptor);
+        if (!is_eiffel_camera) continue;
 
-        {
-        TRACE_EVENT("eiffel_camera", "isCameraAttached");
-        cameraAttached = eiffelcamera_singleton->call("isCameraAttached", vid, pid);
+        // libuvc does not expose the libusb device, the paths come from one enumeration
+        if (port_paths.empty()) {
+            port_paths = UsbDeviceSelector::get_port_paths();
         }
-
-        if (cameraAttached) {
-            TRACE_EVENT("eiffel_camera", "camera_attached");
-            emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::ATTACHED);
-            cameraRunning = false;
-            connect_to_camera();
+        std::string path = port_paths[std::make_pair((int) uvc_get_bus_number(list[i]), (int) uvc_get_device_address(list[i]))];
+        if (!bring_up_device_path.empty() ? path != bring_up_device_path :
+            !device_selector.matches(path, serial) || !UsbDeviceSelector::claim(path)) {
+            continue;
         }
+
+        bring_up_device_path = path;
+        bring_up_device_serial = serial;
+        dev = list[i];
+        uvc_ref_device(dev);
+        res = UVC_SUCCESS;
+        break;
     }
 
-    if (cameraRunning && cameraAttached) {
-        uvc_error_t ret;
+    uvc_free_device_list(list, 1);
+    return res;
+}
 
-        if (!mapsLoaded) {
-            Godot::print("Maps not loaded");
-            return;
-        }
+std::string GDEiffelCam::negotiate_stream() {
 
-        {
-        TRACE_EVENT("eiffel_camera", "uvc_stream_get_frame");
-        ret = uvc_stream_get_frame(streamh, &frame, -1);
-        }
+    TRACE_EVENT("eiffel_camera", "negotiate_stream");
 
-        if (ret != UVC_SUCCESS || frame == nullptr) {
-            TRACE_EVENT("eiffel_camera", "get_frame_error");
-            if (ret == UVC_SUCCESS) {
-                Godot::print("ERROR: Unable to get frame");
-            } else {
-                Godot::print(String("ERROR: ") + String(uvc_strerror(ret)));
-            }
-            if (isAndroid) {
-                cameraAttached = eiffelcamera_singleton->call("isCameraAttached", vid, pid);
-                if (!cameraAttached) {
-                    TRACE_EVENT("eiffel_camera", "camera_not_attached");
-                    emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::NOT_CONNECTED);
-                }
-            }
-            return;
-        }
+    // Try to negotiate a MJPG stream
+    uvc_stream_ctrl_t& ctrl = negotiation.ctrl;
+    uvc_error_t res = uvc_get_stream_ctrl_format_size(devh, &ctrl, UVC_FRAME_FORMAT_COMPRESSED, streamWidth, streamHeight, streamFps);
 
-        {
-        TRACE_EVENT("eiffel_camera", "emit_frame_start");
-        emit_signal("frame_start");
-        }
+    // Uncomment to display stream control for debugging
+    // uvc_print_stream_ctrl(&ctrl, stderr);
 
+    if (res < 0) {
+        return "Cannot get stream size requested";
+    }
 
-        {
-            TRACE_EVENT("eiffel_camera", "frame");
+    negotiation.camera_fps.clear();
+    for (const uvc_format_desc_t* format = uvc_get_format_descs(devh); format != nullptr; format = format->next) {
+        if (format->bDescriptorSubtype != UVC_VS_FORMAT_MJPEG) continue;
 
-            image_processor->process((const unsigned char*) frame->data,
-                                    frame->data_bytes,
-                                    mapX,
-                                    mapY,
-                                    &eyeData,
-                                    get_colorspace(),
-                                    get_remap_mode()
-                                );
-        }
+        for (const uvc_frame_desc_t* frame_desc = format->frame_descs; frame_desc != nullptr; frame_desc = frame_desc->next) {
+            if (frame_desc->wWidth != streamWidth || frame_desc->wHeight != streamHeight || frame_desc->intervals == nullptr) continue;
 
-        if (disparity_test_mode){
-            PoolByteArray disparity_map_data = create_disparity_map(eyeData.get_current_rgb_frame());
-            eyeData.update_disparity_map(disparity_map_data);
-            set_disparity_test_mode(false);
+            // Intervals are in 100ns units, zero terminated
+            for (const uint32_t* interval = frame_desc->intervals; *interval != 0; ++interval) {
+                negotiation.camera_fps.push_back(10000000.0 / *interval);
+            }
         }
+    }
 
-        emit_signal("frame_end");
+    // A smaller payload size reserves less isochronous bandwidth, a larger
+    // one means fewer, bigger bulk transfers.
+    negotiation.payload_transfer_size = ctrl.dwMaxPayloadTransferSize;
+    if (usb_settings.max_payload_transfer_size > 0) {
+        ctrl.dwMaxPayloadTransferSize = usb_settings.max_payload_transfer_size;
     }
-}
 
-int GDEiffelCam::getCurrentFrameIndex(){
-    return eyeData.get_current_frame_index();
+    return "";
 }
 
-Ref<ImageTexture> GDEiffelCam::getEyeTextureRGB() {
+// configure_queue reallocates the frame buffers, only while the main thread
+// takes no frames.
+std::string GDEiffelCam::open_stream(bool configure_queue) {
 
-    return eyeData.get_current_rgb_frame();
-}
+    TRACE_EVENT("eiffel_camera", "open_stream");
 
-Ref<TextureArray> GDEiffelCam::getEyeRGBFrameArray(){
-    return eyeData.get_rgb_frame_array();
-}
+    if (configure_queue) {
+        usb_frame_queue.configure(usb_settings.frame_buffers, negotiation.ctrl.dwMaxVideoFrameSize);
+    }
 
-Ref<ImageTexture> GDEiffelCam::getEyeTextureY() {
+    uvc_error_t res = uvc_stream_open_ctrl(devh, &streamh, &negotiation.ctrl);
+    if (res != UVC_SUCCESS) {
+        usb_errors->add();
+        return std::string("ERROR: Unable to open stream ctrl (") + uvc_strerror(res) + ")";
+    }
 
-    return eyeData.get_current_y_frame();
+    // Frames arrive on the libuvc thread and are queued for _process
+    res = uvc_stream_start(streamh, &UsbFrameQueue::uvc_callback, &usb_frame_queue, 0);
+    if (res != UVC_SUCCESS) {
+        usb_errors->add();
+        return std::string("ERROR: Unable to start streaming (") + uvc_strerror(res) + ")";
+    }
+
+    return "";
 }
 
-Ref<ImageTexture> GDEiffelCam::getEyeTextureU() {
+void GDEiffelCam::poll_bring_up() {
+
+    report_bring_up_stage();
+
+    if (!bring_up.valid() || bring_up.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+
+    std::string error = take_bring_up_result();
+    if (!error.empty()) {
+        // Whatever was opened before the failure, a retry opens it again
+        close_camera();
+
+        // Claimed by path before its serial was known, leave it to the others
+        if (bring_up_wrong_device) {
+            release_device();
+            cameraAttached = false;
+            emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::NOT_CONNECTED);
+        }
+
+        set_bring_up_stage(BRING_UP_FAILED);
+        report_bring_up_stage();
+        if (recovery_level == RECOVERY_REINITIALISE) {
+            recovery_level = RECOVERY_FAILED;
+            stream_recovery_failures->add();
+        }
+        emit_error(error.c_str());
+        return;
+    }
+
+    publish_stream_negotiation();
+
+    // The negotiation is done, the controls can be read and written now
+    send_camera_properties();
+
+    Godot::print("INFO: Eiffel Camera streaming");
+    cameraRunning = true;
+
+    // The recovery is timed from the last frame before the stall and the
+    // camera never disconnected as far as the scene is concerned.
+    if (recovery_level == RECOVERY_REINITIALISE) {
+        recovery_attempt_start = std::chrono::steady_clock::now();
+        set_bring_up_stage(BRING_UP_STREAMING);
+        report_bring_up_stage();
+        return;
+    }
+
+    // Stalls are timed from here until the first frame arrives
+    last_frame_time = std::chrono::steady_clock::now();
+    recovery_attempt_start = last_frame_time;
+
+    set_bring_up_stage(BRING_UP_WAITING_FOR_FRAME);
+    report_bring_up_stage();
+
+    emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::CONNECTED);
+    emit_signal("opened");
+}
+
+void GDEiffelCam::publish_stream_negotiation() {
+
+    supported_camera_fps = negotiation.camera_fps;
+    negotiated_payload_transfer_size = negotiation.payload_transfer_size;
+    max_video_frame_size = negotiation.ctrl.dwMaxVideoFrameSize;
+}
+
+std::string GDEiffelCam::take_bring_up_result() {
+
+    std::string error = bring_up.get();
+
+    // A camera claimed by find_device is released on detach like any other
+    if (device_path.empty() && !bring_up_device_path.empty()) {
+        device_path = bring_up_device_path;
+        device_serial = bring_up_device_serial;
+        Godot::print(String("INFO: Eiffel Camera at ") + device_path.c_str());
+    } else if (device_path == bring_up_device_path && !bring_up_device_serial.empty()) {
+        device_serial = bring_up_device_serial;
+    }
+
+    return error;
+}
+
+void GDEiffelCam::poll_stream_recovery(bool got_frame) {
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (got_frame) {
+        if (recovery_level != RECOVERY_NONE) {
+            // From the last frame before the stall to the first one after it
+            last_recovery_ms = std::chrono::duration<double, std::milli>(now - last_frame_time).count();
+            last_recovery_level = recovery_level;
+            stream_recovery_ms->record(last_recovery_ms);
+            TRACE_COUNTER("eiffel_camera", "stream_recovery_ms", last_recovery_ms);
+            logDuration("INFO: stream recovered at level " + std::to_string(last_recovery_level), last_recovery_ms);
+
+            recovery_level = RECOVERY_NONE;
+            emit_signal("stream_recovered", last_recovery_level, last_recovery_ms);
+        }
+        last_frame_time = now;
+        return;
+    }
+
+    if (recovery_level == RECOVERY_FAILED) {
+        return;
+    }
+
+    if (recovery.valid()) {
+        if (recovery.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+        }
+
+        // The wait for a frame starts once the attempt is done, a failed
+        // attempt moves on to the next level right away.
+        std::string error = recovery.get();
+        if (recovery_level == RECOVERY_REOPEN_STREAM && error.empty()) {
+            publish_stream_negotiation();
+        }
+        camera_properties.resume();
+
+        recovery_attempt_start = now;
+        if (error.empty()) {
+            return;
+        }
+        Godot::print(error.c_str());
+        recovery_attempt_start -= std::chrono::milliseconds(STREAM_STALL_TIMEOUT_MS);
+    }
+
+    std::chrono::steady_clock::time_point waiting_since = recovery_level == RECOVERY_NONE ? last_frame_time : recovery_attempt_start;
+    if (std::chrono::duration<double, std::milli>(now - waiting_since).count() < STREAM_STALL_TIMEOUT_MS) {
+        return;
+    }
+
+    if (recovery_level == RECOVERY_NONE) {
+        stream_stalls->add();
+    }
+
+    begin_recovery_attempt(recovery_level + 1);
+}
+
+void GDEiffelCam::begin_recovery_attempt(int level) {
+
+    TRACE_EVENT("eiffel_camera", "begin_recovery_attempt", "level", level);
+
+    recovery_level = level;
+    recovery_attempt_start = std::chrono::steady_clock::now();
+
+    if (level == RECOVERY_FAILED) {
+        stream_recovery_failures->add();
+        emit_error("ERROR: Eiffel Camera stream lost, reconnect the camera");
+        return;
+    }
+
+    Godot::print(String("INFO: camera stream stalled, recovery level ") + std::to_string(level).c_str());
+
+    if (level == RECOVERY_REINITIALISE) {
+        // A full bring-up on the warm pipeline, poll_bring_up resumes the frames
+        cameraRunning = false;
+        close_camera();
+        begin_bring_up(bring_up_fd);
+        return;
+    }
+
+    // The stream requests must not interleave with property transfers,
+    // poll_stream_recovery resumes the worker.
+    camera_properties.pause();
+    recovery = std::async(std::launch::async, &GDEiffelCam::run_recovery, this, level);
+}
+
+// Runs on a background thread, the main thread only takes frames from the
+// queue meanwhile and the property worker is paused. Returns an error message, empty on success.
+std::string GDEiffelCam::run_recovery(int level) {
+
+    TRACE_EVENT("eiffel_camera", "run_recovery", "level", level);
+
+    if (level == RECOVERY_RESTART_STREAM) {
+        if (streamh == nullptr) {
+            return "ERROR: no stream to restart";
+        }
+
+        uvc_stream_stop(streamh);
+        uvc_error_t res = uvc_stream_start(streamh, &UsbFrameQueue::uvc_callback, &usb_frame_queue, 0);
+        if (res != UVC_SUCCESS) {
+            usb_errors->add();
+            return std::string("ERROR: Unable to restart streaming (") + uvc_strerror(res) + ")";
+        }
+        return "";
+    }
+
+    // RECOVERY_REOPEN_STREAM, the frame buffers are kept
+    if (streamh != nullptr) {
+        uvc_stream_close(streamh);
+        streamh = nullptr;
+    }
+
+    std::string error = negotiate_stream();
+    if (!error.empty()) {
+        return error;
+    }
+    return open_stream(false);
+}
+
+void GDEiffelCam::report_bring_up_stage() {
+
+    int stage = bring_up_stage;
+    if (stage == reported_bring_up_stage) {
+        return;
+    }
+
+    reported_bring_up_stage = stage;
+    emit_signal("bring_up_stage_changed", stage, get_bring_up_elapsed_ms());
+}
+
+void GDEiffelCam::on_first_frame_displayed() {
+
+    set_bring_up_stage(BRING_UP_STREAMING);
+    report_bring_up_stage();
+
+    double elapsed_ms = bring_up_stage_ms[BRING_UP_STREAMING];
+    time_to_first_frame_ms->set(elapsed_ms);
+    TRACE_COUNTER("eiffel_camera", "time_to_first_frame_ms", elapsed_ms);
+    logDuration("INFO: time to first frame", elapsed_ms);
+}
+
+Dictionary GDEiffelCam::get_usb_stats() {
+
+    UsbFrameQueue::Stats stats = usb_frame_queue.get_stats();
+
+    Dictionary result;
+    result["frames"] = (int64_t) stats.frames;
+    result["bytes"] = (int64_t) stats.bytes;
+    result["lost_frames"] = (int64_t) stats.lost;
+    result["incomplete_frames"] = (int64_t) stats.incomplete;
+    result["skipped_frames"] = (int64_t) stats.skipped;
+    result["bandwidth_mbps"] = stats.bandwidth_mbps;
+    result["frame_rate"] = stats.frame_rate;
+    result["largest_frame"] = (int64_t) stats.largest_frame;
+    result["negotiated_payload_transfer_size"] = (int64_t) negotiated_payload_transfer_size;
+    result["payload_transfer_size"] = (int64_t) (usb_settings.max_payload_transfer_size > 0 ? usb_settings.max_payload_transfer_size : negotiated_payload_transfer_size);
+    result["max_video_frame_size"] = (int64_t) max_video_frame_size;
+    result["frame_buffers"] = usb_settings.frame_buffers;
+    result["recovery_level"] = recovery_level;
+    result["last_recovery_level"] = last_recovery_level;
+    result["last_recovery_ms"] = last_recovery_ms;
+    return result;
+}
+
+Dictionary GDEiffelCam::get_bring_up_timings() {
+
+    // Time spent in every stage, a stage that was not reached yet is left out.
+    const char* names[] = { "", "open_ms", "negotiate_ms", "start_ms", "warm_up_ms", "first_frame_ms" };
+
+    Dictionary timings;
+    int stage = bring_up_stage;
+    timings["stage"] = stage;
+
+    for (int i = BRING_UP_OPENING; i < BRING_UP_STREAMING; ++i) {
+        if (stage <= i || stage == BRING_UP_FAILED) break;
+        timings[names[i]] = bring_up_stage_ms[i + 1].load() - bring_up_stage_ms[i].load();
+    }
+
+    if (stage == BRING_UP_STREAMING) {
+        timings["total_ms"] = bring_up_stage_ms[BRING_UP_STREAMING].load();
+    }
+
+    return timings;
+}
+
+void GDEiffelCam::_ready() {
+
+    TRACE_EVENT("eiffel_camera", "EiffelCamera::_ready");
+
+    emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::NOT_CONNECTED);
+    cameraRunning = false;
+
+    // Set up our Godot buffer and Image/Texture wrappers
+    eyeData.init(frame_array_size);
+
+    image_processor->init(this);
+
+    load_calibration_dataset();
+
+    // Attach and detach are reported by the Android plugin or libusb hotplug,
+    // the handlers run deferred on the main thread.
+    if (Engine::get_singleton()->has_singleton("EiffelCamera")) {
+        eiffelcamera_singleton = Engine::get_singleton()->get_singleton("EiffelCamera");
+        eiffelcamera_singleton->connect("permission_received", this, "on_permission_received");
+        eiffelcamera_singleton->connect("camera_attached", this, "on_camera_attached", Array(), Object::CONNECT_DEFERRED);
+        eiffelcamera_singleton->connect("camera_detached", this, "on_camera_detached", Array(), Object::CONNECT_DEFERRED);
+        eiffelcamera_singleton->call("watchCamera", vid, pid);
+    } else if (!isAndroid) {
+        if (!usb_hotplug.start(vid, pid)) {
+            // No hotplug support, the camera has to be plugged in at start
+            Godot::print("INFO: USB hotplug not supported");
+            on_camera_attached("", "");
+        }
+    }
+
+    // Frames decoded on the DecodeScheduler are uploaded right before drawing
+    VisualServer::get_singleton()->connect("frame_pre_draw", this, "_on_frame_pre_draw");
+
+    emit_signal("frame_diff_changed", eyeData.get_frame_diff());
+}
+
+void GDEiffelCam::poll_usb_hotplug() {
+
+    for (UsbHotplug::Event event = usb_hotplug.take_event(); event.type != UsbHotplug::EVENT_NONE; event = usb_hotplug.take_event()) {
+        if (event.type == UsbHotplug::EVENT_ATTACHED) {
+            on_camera_attached(event.path.c_str(), event.serial.c_str());
+        } else {
+            on_camera_detached(event.path.c_str());
+        }
+    }
+}
+
+bool GDEiffelCam::claim_device(const std::string& path, const std::string& serial) {
+
+    // An empty serial is not known yet, the bring-up checks it
+    bool selected = serial.empty() ? device_selector.matches_path(path) : device_selector.matches(path, serial);
+    if (!selected || !UsbDeviceSelector::claim(path)) {
+        return false;
+    }
+
+    device_path = path;
+    device_serial = serial;
+    return true;
+}
+
+void GDEiffelCam::release_device() {
+
+    if (!device_path.empty()) {
+        UsbDeviceSelector::release(device_path);
+    }
+    device_path.clear();
+    device_serial.clear();
+}
+
+Dictionary GDEiffelCam::get_device() {
+
+    Dictionary device;
+    device["path"] = device_path.c_str();
+    device["serial"] = device_serial.c_str();
+    return device;
+}
+
+// device is empty without hotplug support, the bring-up picks the camera then.
+void GDEiffelCam::on_camera_attached(String device, String serial) {
+
+    TRACE_EVENT("eiffel_camera", "camera_attached");
+
+    if (cameraAttached) {
+        return;
+    }
+
+    // Another instance may have claimed it, or it is not the selected camera
+    if (!device.empty() && !claim_device(device.utf8().get_data(), serial.utf8().get_data())) {
+        return;
+    }
+
+    Godot::print(String("INFO: Eiffel Camera attached ") + device);
+    cameraAttached = true;
+    recovery_level = RECOVERY_NONE;
+    emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::ATTACHED);
+    cameraRunning = false;
+    connect_to_camera();
+}
+
+void GDEiffelCam::on_camera_detached(String device) {
+
+    TRACE_EVENT("eiffel_camera", "camera_not_attached");
+
+    if (!cameraAttached || device != device_path.c_str()) {
+        return;
+    }
+
+    cameraAttached = false;
+    cameraRunning = false;
+    close_camera();
+    release_device();
+    recovery_level = RECOVERY_NONE;
+    emit_signal("camera_status_changed", CAMERA_CONNECTION_STATUS::NOT_CONNECTED);
+}
+
+void GDEiffelCam::close_camera() {
+
+    if (recovery.valid()) {
+        recovery.wait();
+        recovery.get();
+    }
+
+    // A bring-up in flight fails quickly once the device is gone
+    if (bring_up.valid()) {
+        bring_up.wait();
+        take_bring_up_result();
+        set_bring_up_stage(BRING_UP_IDLE);
+        report_bring_up_stage();
+    }
+
+    camera_properties.stop();
+
+    // The decode job may still read the current USB frame
+    if (pending_decode.valid()) {
+        pending_decode.wait();
+    }
+
+    if (streamh != nullptr) {
+        uvc_stream_close(streamh);
+        streamh = nullptr;
+    }
+    if (devh != nullptr) {
+        uvc_close(devh);
+        devh = nullptr;
+    }
+    if (ctx != nullptr) {
+        uvc_exit(ctx);
+        ctx = nullptr;
+    }
+    dev = nullptr;
+
+    // No frame will come for them
+    if (!pending_snapshots.empty()) {
+        std::vector<PendingSnapshot> failed;
+        failed.swap(pending_snapshots);
+        update_frame_retention();
+        for (const PendingSnapshot& snapshot : failed) {
+            emit_signal("image_exported", snapshot.id, String(snapshot.path.c_str()), "camera closed");
+        }
+    }
+}
+
+void GDEiffelCam::send_camera_properties() {
+
+    // The camera controls are reported by poll_camera_properties once the
+    // worker has read them.
+    camera_properties.start(devh);
+    camera_properties_listed = false;
+
+    // Applied by the property worker once the controls were read
+    camera_properties.set("ae_mode", UVC_AE_MODE_MANUAL, false); // turn off auto exposure
+    Godot::print("INFO: setting ae mode to manual");
+    // The software white balance needs the temperature under its control
+    camera_properties.set("white_balance_temperature_auto", get_auto_white_balance() ? 0 : 1, false);
+    exposure_controller.reset();
+
+    emit_signal("camera_property_range_changed", "frame_diff", 0, 0, std::max(frame_array_size - 1, (uint32_t)0));
+}
+
+void GDEiffelCam::poll_camera_properties() {
+
+    if (camera_properties.is_ready() && !camera_properties_listed) {
+        camera_properties_listed = true;
+        property_list_changed_notify();
+    }
+
+    for (const String& name : camera_properties.take_changed()) {
+        CameraPropertyValue value;
+        if (!camera_properties.get(name, value)) continue;
+
+        emit_signal("camera_property_range_changed", name, value.current, value.min, value.max);
+    }
+}
+
+void GDEiffelCam::_process(float delta) {
+
+    TRACE_EVENT("eiffel_camera", "EiffelCamera::_process", "delta", delta);
+    time_elapsed += delta;
+
+    // Normally done in frame_pre_draw, the USB frame of the job is replaced below
+    finish_frame();
+
+    poll_chessboard_capture();
+    poll_chessboard_tracker();
+    poll_calibration_job();
+    poll_lut_prebake();
+    poll_exports();
+    poll_bring_up();
+    poll_camera_properties();
+
+    poll_usb_hotplug();
+
+    if (cameraRunning && cameraAttached) {
+
+        if (!mapsLoaded) {
+            Godot::print("Maps not loaded");
+            return;
+        }
+
+        const UsbFrame* frame;
+        {
+        TRACE_EVENT("eiffel_camera", "take_latest_frame");
+        frame = usb_frame_queue.take_latest();
+        }
+
+        poll_stream_recovery(frame != nullptr);
+
+        if (frame == nullptr) {
+            TRACE_EVENT("eiffel_camera", "get_frame_error");
+            // No new camera frame since the previous render frame
+            frame_pacing.record_render_frame(get_render_time(), last_frame_sequence);
+            Godot::print("ERROR: Unable to get frame");
+            return;
+        }
+
+        // Sequence numbers skipped since the previous poll were replaced in
+        // the USB frame queue before we got to them, or lost on the bus.
+        if (last_frame_sequence != 0 && frame->sequence > last_frame_sequence) {
+            uint32_t delivered = frame->sequence - last_frame_sequence;
+            frame_queue_depth->set(delivered);
+            TRACE_COUNTER("eiffel_camera", "frame_queue_depth", delivered);
+            if (delivered > 1) dropped_frames->add(delivered - 1);
+        }
+        last_frame_sequence = frame->sequence;
+        frames_received->add();
+        frame_pacing.record_render_frame(get_render_time(), frame->sequence);
+
+        {
+        TRACE_EVENT("eiffel_camera", "emit_frame_start");
+        emit_signal("frame_start");
+        }
+
+
+        {
+            TRACE_EVENT("eiffel_camera", "frame");
+
+            image_processor->gather_exposure_stats = exposure_controller.is_active();
+            image_processor->set_frame(frame->data.data(),
+                                    frame->data_bytes,
+                                    mapX,
+                                    mapY,
+                                    &eyeData,
+                                    get_colorspace(),
+                                    get_remap_mode()
+                                );
+
+            // Decodes alongside the rest of the frame and the other cameras
+            ImageProcessor* processor = image_processor.get();
+            pending_decode = DecodeScheduler::get_singleton()->submit([processor]() { return processor->decode(); });
+        }
+    }
+}
+
+void GDEiffelCam::_on_frame_pre_draw() {
+    finish_frame();
+}
+
+void GDEiffelCam::finish_frame() {
+
+    if (!pending_decode.valid()) {
+        return;
+    }
+
+    TRACE_EVENT("eiffel_camera", "finish_frame");
+
+    bool decoded;
+    {
+        TRACE_EVENT("eiffel_camera", "wait_for_decode");
+        decoded = pending_decode.get();
+    }
+
+    if (decoded) {
+        image_processor->upload();
+        update_exposure();
+        poll_snapshots();
+
+        if (bring_up_stage == BRING_UP_WAITING_FOR_FRAME) {
+            on_first_frame_displayed();
+        }
+    }
+
+    if (disparity_test_mode){
+        PoolByteArray disparity_map_data = create_disparity_map();
+        if (disparity_map_data.size() > 0) {
+            eyeData.update_disparity_map(disparity_map_data);
+            set_disparity_test_mode(false);
+        }
+    }
+
+    if (continuous_depth) {
+        depth_worker.notify_frame();
+
+        cv::Mat disparity;
+        if (depth_worker.fetch_disparity(disparity)) {
+            PoolByteArray disparity_map_data = disparity_to_rgb(disparity);
+            eyeData.update_disparity_map(disparity_map_data);
+            update_depth_map(disparity);
+        }
+    }
+
+    emit_signal("frame_end");
+}
+
+int GDEiffelCam::export_snapshot(String path) {
+
+    if (!cameraRunning) {
+        return -1;
+    }
+
+    String extension = path.get_extension().to_lower();
+    PendingSnapshot snapshot;
+    snapshot.id = image_exporter.reserve_id();
+    snapshot.path = ProjectSettings::get_singleton()->globalize_path(path).utf8().get_data();
+    snapshot.format = (extension == "jpg" || extension == "jpeg") ? ImageExporter::FORMAT_JPEG : ImageExporter::FORMAT_PNG;
+    std::shared_ptr<const RetainedFrame> newest = frame_pool.get();
+    snapshot.after_sequence = newest != nullptr ? (int64_t) newest->sequence : -1;
+    pending_snapshots.push_back(snapshot);
+
+    // The decoder keeps a copy of the compressed frame, the encoding runs on the exporter
+    update_frame_retention();
+    return snapshot.id;
+}
+
+void GDEiffelCam::poll_snapshots() {
+
+    if (pending_snapshots.empty()) {
+        return;
+    }
+
+    // The decode that was running when the snapshot was requested may not
+    // have retained the payload yet.
+    std::shared_ptr<const RetainedFrame> frame = frame_pool.get();
+    if (frame == nullptr || frame->jpeg.empty()) {
+        return;
+    }
+
+    auto taken = std::remove_if(pending_snapshots.begin(), pending_snapshots.end(), [&](const PendingSnapshot& snapshot) {
+        if ((int64_t) frame->sequence <= snapshot.after_sequence) return false;
+        image_exporter.export_jpeg(snapshot.path, frame, snapshot.format, snapshot.id);
+        return true;
+    });
+    pending_snapshots.erase(taken, pending_snapshots.end());
+    update_frame_retention();
+}
+
+void GDEiffelCam::poll_exports() {
+
+    for (const ImageExporter::Result& result : image_exporter.take_results()) {
+        if (!result.error.empty()) {
+            Godot::print(String("ERROR: export failed: ") + result.error.c_str());
+        }
+        emit_signal("image_exported", result.id, String(result.path.c_str()), String(result.error.c_str()));
+    }
+}
+
+void GDEiffelCam::update_exposure() {
+
+    if (!image_processor->gather_exposure_stats) {
+        return;
+    }
+    exposure_stats = image_processor->exposure_stats;
+
+    // The sliders follow the controller
+    for (const String& name : exposure_controller.update(exposure_stats, get_render_time(), camera_properties)) {
+        CameraPropertyValue value;
+        if (!camera_properties.get(name, value)) continue;
+
+        emit_signal("camera_property_range_changed", name, value.current, value.min, value.max);
+    }
+}
+
+void GDEiffelCam::set_auto_exposure(bool p_enabled) {
+
+    // The exposure_abs writes are ignored unless the camera is in manual mode
+    exposure_controller.get_settings().auto_exposure = p_enabled;
+    if (p_enabled) {
+        camera_properties.set("ae_mode", UVC_AE_MODE_MANUAL, false);
+    }
+}
+
+void GDEiffelCam::set_auto_white_balance(bool p_enabled) {
+
+    exposure_controller.get_settings().auto_white_balance = p_enabled;
+    camera_properties.set("white_balance_temperature_auto", p_enabled ? 0 : 1, false);
+}
+
+Dictionary GDEiffelCam::get_exposure_stats() {
+
+    Dictionary result;
+    const ExposureStats& stats = exposure_stats;
+    if (!exposure_controller.is_active() || stats.samples == 0) {
+        return result;
+    }
+
+    PoolIntArray histogram;
+    for (int i = 0; i < ExposureStats::HISTOGRAM_BINS; ++i) {
+        histogram.append((int) stats.luma_histogram[i]);
+    }
+
+    double white_balance_samples = std::max(stats.white_balance_samples, (uint32_t) 1) * 255.0;
+    result["samples"] = (int64_t) stats.samples;
+    result["mean_luma"] = stats.get_mean_luma();
+    result["clipped_fraction"] = stats.get_clipped_fraction();
+    result["luma_histogram"] = histogram;
+    result["mean_red"] = stats.red_sum / white_balance_samples;
+    result["mean_green"] = stats.green_sum / white_balance_samples;
+    result["mean_blue"] = stats.blue_sum / white_balance_samples;
+    return result;
+}
+
+Dictionary GDEiffelCam::get_metrics() {
+    Dictionary counters;
+    for (const auto& entry : metrics.get_counters()) {
+        counters[entry.first.c_str()] = (int64_t) entry.second;
+    }
+
+    Dictionary gauges;
+    for (const auto& entry : metrics.get_gauges()) {
+        gauges[entry.first.c_str()] = entry.second;
+    }
+
+    Dictionary histograms;
+    for (const auto& entry : metrics.get_histograms()) {
+        const MetricHistogram::Snapshot& snapshot = entry.second;
+
+        Dictionary histogram;
+        histogram["count"] = (int64_t) snapshot.count;
+        histogram["mean"] = snapshot.mean();
+        histogram["p50"] = snapshot.percentile(0.5);
+        histogram["p95"] = snapshot.percentile(0.95);
+        histogram["p99"] = snapshot.percentile(0.99);
+        histogram["max"] = snapshot.max;
+        histograms[entry.first.c_str()] = histogram;
+    }
+
+    Dictionary result;
+    result["counters"] = counters;
+    result["gauges"] = gauges;
+    result["histograms"] = histograms;
+    return result;
+}
+
+bool GDEiffelCam::flush_trace(String path) {
+#ifdef ENABLE_FILE_TRACE
+    std::string trace_path = path.empty() ? TraceFile::get_default_path() : ProjectSettings::get_singleton()->globalize_path(path).utf8().get_data();
+    if (!TraceFile::get_singleton()->flush(trace_path)) {
+        Godot::print(String("ERROR: Unable to write the trace to ") + trace_path.c_str());
+        return false;
+    }
+    Godot::print(String("Trace written to ") + trace_path.c_str());
+    return true;
+#else
+    Godot::print("Tracing to a file needs a build with file_trace=true");
+    return false;
+#endif
+}
+
+double GDEiffelCam::get_render_time() {
+    return OS::get_singleton()->get_ticks_usec() / 1000000.0;
+}
+
+void GDEiffelCam::set_display_refresh_rates(PoolRealArray p_rates) {
+    display_refresh_rates.clear();
+    PoolRealArray::Read rates = p_rates.read();
+    for (int i = 0; i < p_rates.size(); ++i) {
+        display_refresh_rates.push_back(rates[i]);
+    }
+}
+
+Dictionary GDEiffelCam::get_frame_pacing() {
+    Dictionary pacing;
+    pacing["render_rate"] = frame_pacing.get_render_rate();
+    pacing["camera_rate"] = frame_pacing.get_camera_rate();
+    pacing["judder_ms"] = frame_pacing.get_judder_ms();
+
+    PoolIntArray pattern;
+    for (int count : frame_pacing.get_recent_pattern()) {
+        pattern.append(count);
+    }
+    pacing["pattern"] = pattern;
+
+    // Index is the number of render frames a camera frame was shown for,
+    // the last entry counts everything above.
+    Array display_counts;
+    for (uint64_t count : frame_pacing.get_display_count_histogram()) {
+        display_counts.append((int64_t) count);
+    }
+    pacing["display_counts"] = display_counts;
+
+    std::vector<double> camera_rates = supported_camera_fps;
+    if (camera_rates.empty()) camera_rates.push_back(streamFps);
+    FramePacing::Suggestion suggestion = FramePacing::suggest(camera_rates, display_refresh_rates, frame_pacing.get_render_rate());
+    pacing["suggested_camera_fps"] = suggestion.camera_fps;
+    pacing["suggested_refresh_rate"] = suggestion.refresh_rate;
+    pacing["suggested_judder_ms"] = suggestion.judder_ms;
+
+    return pacing;
+}
+
+Dictionary GDEiffelCam::get_memory_usage() {
+    Dictionary usage;
+
+    for (int subsystem = 0; subsystem <= MemoryAccounting::SUBSYSTEM_COUNT; ++subsystem) {
+        bool total = subsystem == MemoryAccounting::SUBSYSTEM_COUNT;
+
+        Dictionary entry;
+        for (int kind = 0; kind < MemoryAccounting::KIND_COUNT; ++kind) {
+            MemoryAccounting::Usage kind_usage = total ? MemoryAccounting::get_total(kind) : MemoryAccounting::get_usage(subsystem, kind);
+            String name = MemoryAccounting::get_kind_name(kind);
+            entry[name] = kind_usage.current;
+            entry[name + "_peak"] = kind_usage.peak;
+        }
+        usage[total ? "total" : MemoryAccounting::get_subsystem_name(subsystem)] = entry;
+    }
+
+    return usage;
+}
+
+int GDEiffelCam::getCurrentFrameIndex(){
+    return eyeData.get_current_frame_index();
+}
+
+Ref<ImageTexture> GDEiffelCam::getEyeTextureRGB() {
+
+    return eyeData.get_current_rgb_frame();
+}
+
+Ref<TextureArray> GDEiffelCam::getEyeRGBFrameArray(){
+    return eyeData.get_rgb_frame_array();
+}
+
+Ref<ImageTexture> GDEiffelCam::getEyeTextureY() {
+
+    return eyeData.get_current_y_frame();
+}
+
+Ref<ImageTexture> GDEiffelCam::getEyeTextureU() {
 
     return eyeData.get_current_u_frame();
 }
@@ -925,13 +1819,6 @@ Ref<ImageTexture> GDEiffelCam::getMapY() {
     return eyeData.get_map_y_texture();
 }
 
-cv::Ptr<cv::StereoBM> sbm;
-
-int i;
-
-#define PROCESS_WIDTH 320
-#define PROCESS_HEIGHT 240
-
 void print_mat(std::string prefix, cv::Mat& mat) {
     prefix << mat;
     Godot::print(prefix.c_str());
@@ -953,6 +1840,10 @@ void loadMapTexture(Ref<ImageTexture>& tex, cv::Mat& map, int width = WIDTH, int
 void GDEiffelCam::loadMaps (godot::String mapsYamlPath, float fudgeFactor) {
 
     TRACE_EVENT("eiffel_camera", "EiffelCamera::loadMaps");
+    MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_MAPS);
+
+    // A CPU remap in flight reads the maps
+    finish_frame();
 
     Godot::print("Loading " + mapsYamlPath);
 
@@ -982,8 +1873,33 @@ void GDEiffelCam::loadMaps (godot::String mapsYamlPath, float fudgeFactor) {
     fs["P1"] >> P1;
     fs["P2"] >> P2;
 
+    // Older calibration files have no Q, depth then stays disabled.
+    fs["Q"] >> Q;
+
     auto size = cv::Size(WIDTH, HEIGHT);
 
+    // The depth path rectifies with the projections Q was computed for,
+    // before the fudge factor of the display.
+    rectifyMapX = cv::Mat();
+    rectifyMapY = cv::Mat();
+    depthDisplayMapX = cv::Mat();
+    depthDisplayMapY = cv::Mat();
+    cv::Mat rectified_K1;
+    if (!R1.empty() && !R2.empty() && !P1.empty() && !P2.empty()) {
+        cv::Mat left_x, left_y, right_x, right_y;
+        cv::initUndistortRectifyMap(K1, D1, R1, P1, size, CV_32FC1, left_x, left_y);
+        cv::initUndistortRectifyMap(K2, D2, R2, P2, size, CV_32FC1, right_x, right_y);
+
+        // The right eye is the right half of the source frame
+        right_x += WIDTH;
+        cv::hconcat(left_x, right_x, rectifyMapX);
+        cv::hconcat(left_y, right_y, rectifyMapY);
+
+        rectified_K1 = P1(cv::Rect(0, 0, 3, 3)).clone();
+    } else {
+        Q = cv::Mat();
+    }
+
     double f = fudgeFactor;
     P1.at<double>(0,0) *= f;
     P1.at<double>(1,1) *= f;
@@ -997,6 +1913,12 @@ void GDEiffelCam::loadMaps (godot::String mapsYamlPath, float fudgeFactor) {
     cv::initUndistortRectifyMap(K1, D1, cv::Mat(), M1, size, CV_32FC1, leftMapX, leftMapY);
     cv::initUndistortRectifyMap(K2, D2, cv::Mat(), M2, size, CV_32FC1, rightMapX, rightMapY);
 
+    // A display ray r is r' = R1 * r in the rectified frame, projected with P1.
+    // initUndistortRectifyMap applies the inverse of its rotation, hence R1^T.
+    if (!rectified_K1.empty()) {
+        cv::initUndistortRectifyMap(rectified_K1, cv::Mat(), R1.t(), M1, size, CV_32FC1, depthDisplayMapX, depthDisplayMapY);
+    }
+
     // Set up the maps
     loadMapTexture(eyeData.get_left_map_x_texture(), leftMapX);
     loadMapTexture(eyeData.get_left_map_y_texture(), leftMapY);
@@ -1025,7 +1947,9 @@ void GDEiffelCam::loadMaps (godot::String mapsYamlPath, float fudgeFactor) {
     loadMapTexture(eyeData.get_map_x_texture(), mapX, WIDTH * 2);
     loadMapTexture(eyeData.get_map_y_texture(), mapY, WIDTH * 2);
 
-    sbm = cv::StereoBM::create(16, 21);
+    // Four per eye maps and two side by side maps, all FORMAT_RF
+    map_gpu_memory.set(
+        4 * MemoryAccounting::texture_bytes(WIDTH, HEIGHT, 1, 4) + 2 * MemoryAccounting::texture_bytes(WIDTH * 2, HEIGHT, 1, 4));
 
     mapsLoaded = true;
 }
@@ -1038,32 +1962,113 @@ void GDEiffelCam::unloadMaps() {
 
 void GDEiffelCam::enter_calibration_mode(){
     in_calibration_mode = true;
-    eyeData.init_calibration_buffer();
+    update_frame_retention();
+
+    // The session adds to the stored views, new_calibration_dataset starts over.
+    sync_calibration_views();
+    chessboard_tracker.start(&frame_pool, cv::Size(GRID_WIDTH, GRID_HEIGHT));
 }
 
 void GDEiffelCam::exit_calibration_mode(){
     in_calibration_mode = false;
+    calibration_capture_frame = nullptr;
+    update_frame_retention();
+
+    chessboard_tracker.stop();
 }
 
 bool GDEiffelCam::take_picture(){
-    GodotTextureComponents::PictureTakenResult result = eyeData.take_picture();
+    if (eyeData.get_calibration_images_left() == 0) {
+        emit_signal("ready_for_calibration");
+        return false;
+    }
 
-    switch (result) {
-        case GodotTextureComponents::PictureTakenResult::SUCCESS: {
-            emit_signal("chessboard_detected", eyeData.get_current_left_chessboard_image(), eyeData.get_current_right_chessboard_image());
-            return true;
-        } case GodotTextureComponents::PictureTakenResult::INVALID_PICTURE:
-            return false;
-        case GodotTextureComponents::PictureTakenResult::READY_FOR_CALIBRATION: {
-            emit_signal("ready_for_calibration");
-            return false;
-        }
+    // A detection is still running for the previous press.
+    if (chessboard_capture.valid()) return true;
+
+    // The luma of the last decoded frame, kept on the CPU by the frame pool.
+    std::shared_ptr<const RetainedFrame> frame = frame_pool.get();
+    if (frame == nullptr || frame->luma.empty()) return false;
+    calibration_capture_frame = frame;
+
+    // Detection runs off the main thread, _process reports the result with
+    // chessboard_detected or chessboard_not_detected.
+    chessboard_capture = std::async(std::launch::async, [frame]() {
+        TRACE_EVENT("eiffel_camera", "detect_chessboard");
+        MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_CALIBRATION);
+        return ChessboardDetector::detect_stereo(frame->luma, cv::Size(GRID_WIDTH, GRID_HEIGHT));
+    });
+
+    return true;
+}
+
+void GDEiffelCam::poll_chessboard_capture(){
+    if (!chessboard_capture.valid() || chessboard_capture.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+
+    StereoChessboard chessboard = chessboard_capture.get();
+
+    // Calibration mode was left while the detection was running.
+    if (!in_calibration_mode) return;
+
+    if (!chessboard.found) {
+        emit_signal("chessboard_not_detected");
+        return;
+    }
+
+    eyeData.set_detected_chessboard(chessboard);
+    emit_signal("chessboard_detected", eyeData.get_current_left_chessboard_image(), eyeData.get_current_right_chessboard_image());
+}
+
+void GDEiffelCam::poll_chessboard_tracker(){
+    TrackedChessboard tracked;
+    if (!chessboard_tracker.is_running() || !chessboard_tracker.fetch(tracked)) return;
+
+    PoolVector2Array left_corners;
+    PoolVector2Array right_corners;
+
+    if (tracked.left_found) {
+        for (const cv::Point2f& corner : tracked.left_corners) left_corners.append(Vector2(corner.x, corner.y));
+    }
+    if (tracked.right_found) {
+        for (const cv::Point2f& corner : tracked.right_corners) right_corners.append(Vector2(corner.x, corner.y));
     }
+
+    emit_signal("chessboard_tracked", left_corners, right_corners, tracked.good);
+}
+
+void GDEiffelCam::set_chessboard_tracking_rate(float p_rate_hz){
+    ChessboardTracker::Params params = chessboard_tracker.get_params();
+    params.rate_hz = p_rate_hz;
+    chessboard_tracker.set_params(params);
+}
+
+float GDEiffelCam::get_chessboard_tracking_rate(){
+    return chessboard_tracker.get_params().rate_hz;
 }
 
 void GDEiffelCam::accept_calibration_image() {
+    MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_CALIBRATION);
     eyeData.accept_calibration_image();
 
+    const CalibrationViews& views = eyeData.get_calibration_views();
+    chessboard_tracker.add_accepted_view(views.left_image_points.back(), cv::Size(WIDTH, HEIGHT));
+
+    calibration_dataset.add_view(
+        eyeData.get_current_left_corner_points(), views.left_image_points.back(),
+        eyeData.get_current_right_corner_points(), views.right_image_points.back(),
+        eyeData.get_current_left_calibration_image(), eyeData.get_current_right_calibration_image());
+    save_calibration_dataset();
+
+    if (save_calibration_images && calibration_capture_frame != nullptr) {
+        // Numbered like the views, as start_calibration_from_files reads them
+        std::string folder = get_calibration_images_folder();
+        Ref<Directory> directory = Ref<Directory>(Directory::_new());
+        directory->make_dir_recursive(folder.c_str());
+
+        std::string path = folder + "full_image_" + std::to_string(views.left_image_points.size()) + ".png";
+        image_exporter.export_image(path, calibration_capture_frame->luma, false, ImageExporter::FORMAT_PNG);
+    }
+
     if (eyeData.get_calibration_images_left() == 0) {
         emit_signal("ready_for_calibration");
     }
@@ -1073,275 +2078,312 @@ int GDEiffelCam::calibration_images_left(){
     return eyeData.get_calibration_images_left();
 }
 
-void GDEiffelCam::calibrate_single_cameras(
-    std::vector< std::vector<cv::Point3f> >* p_object_points,
-    std::vector< std::vector<cv::Point2f> >* p_left_image_points,
-    std::vector< std::vector<cv::Point2f> >* p_right_image_points,
-    cv::Mat& p_left_camera_matrix,
-    cv::Mat& p_left_camera_distortion_coefficients,
-    cv::Mat& p_right_camera_matrix,
-    cv::Mat& p_right_camera_distortion_coefficients
-    ) {
-    
-    cv::Size image_size = cv::Size_<int>(WIDTH, HEIGHT);
-    cv::Mat left_rvecs;
-    cv::Mat left_tvecs;
-    cv::Mat right_rvecs;
-    cv::Mat right_tvecs;
-
-    cv::calibrateCamera(*p_object_points, *p_left_image_points, image_size, p_left_camera_matrix, p_left_camera_distortion_coefficients, left_rvecs, left_tvecs);
-    p_left_camera_matrix = cv::getOptimalNewCameraMatrix(p_left_camera_matrix, p_left_camera_distortion_coefficients, image_size, 1, image_size);
-    cv::calibrateCamera(*p_object_points, *p_right_image_points, image_size, p_right_camera_matrix, p_right_camera_distortion_coefficients, right_rvecs, right_tvecs);
-    p_right_camera_matrix = cv::getOptimalNewCameraMatrix(p_right_camera_matrix, p_right_camera_distortion_coefficients, image_size, 1, image_size);
-}
-
-bool save_stereo_coefficients(
-    const cv::String& save_file_path,
-    const cv::Mat& K1,
-    const cv::Mat& D1,
-    const cv::Mat& K2,
-    const cv::Mat& D2,
-    cv::InputOutputArray R,
-    cv::InputOutputArray T,
-    cv::OutputArray E,
-    cv::OutputArray F,
-    cv::OutputArray R1,
-    cv::OutputArray R2,
-    cv::OutputArray P1,
-    cv::OutputArray P2,
-    cv::OutputArray Q
-    ){
-    //Save the stereo coefficients to given path/file.
-    cv::FileStorage cv_file = cv::FileStorage();
-    bool file_opened = cv_file.open(save_file_path, cv::FileStorage::WRITE);
-    if (!file_opened) return false;
-
-    cv_file.write("K1", K1);
-    cv_file.write("D1", D1);
-    cv_file.write("K2", K2);
-    cv_file.write("D2", D2);
-    cv_file.write("R", R.getMat());
-    cv_file.write("T", T.getMat());
-    cv_file.write("E", E.getMat());
-    cv_file.write("F", F.getMat());
-    cv_file.write("R1", R1.getMat());
-    cv_file.write("R2", R2.getMat());
-    cv_file.write("P1", P1.getMat());
-    cv_file.write("P2", P2.getMat());
-    cv_file.write("Q", Q.getMat());
-    cv_file.release();
-    return true;
-}
+CalibrationJob::Settings GDEiffelCam::get_calibration_settings(){
+    CalibrationJob::Settings settings;
+    settings.image_size = cv::Size(WIDTH, HEIGHT);
+    settings.pattern_size = cv::Size(GRID_WIDTH, GRID_HEIGHT);
+    settings.square_size = SQUARE_SIZE;
+    settings.criteria = eyeData.get_termination_criteria();
 
-bool GDEiffelCam::calibrate_stereo_camera(
-    std::vector< std::vector<cv::Point3f> >* p_object_points,
-    std::vector< std::vector<cv::Point2f> >* p_left_image_points,
-    std::vector< std::vector<cv::Point2f> >* p_right_image_points,
-    cv::Mat& p_left_camera_matrix,
-    cv::Mat& p_left_camera_distortion_coefficients,
-    cv::Mat& p_right_camera_matrix,
-    cv::Mat& p_right_camera_distortion_coefficients,
-    cv::TermCriteria p_termination_criteria
-    ) {
-    cv::Size image_size = cv::Size(WIDTH, HEIGHT);
-    cv::Mat R;
-    cv::Vec3d T;
-    cv::Mat E;
-    cv::Mat F;
-    int stereo_calibration_flags = cv::CALIB_FIX_INTRINSIC;
-    float re_projection_error = cv::stereoCalibrate(
-        *p_object_points,
-        *p_left_image_points,
-        *p_right_image_points,
-        p_left_camera_matrix,
-        p_left_camera_distortion_coefficients,
-        p_right_camera_matrix,
-        p_right_camera_distortion_coefficients,
-        image_size, R, T, E, F, stereo_calibration_flags, p_termination_criteria);
-    Godot::print(String("Stereo calibration rms: ") + std::to_string(re_projection_error).c_str());
-
-    cv::Mat R1;
-    cv::Mat R2;
-    cv::Mat P1;
-    cv::Mat P2;
-    cv::Mat Q;
-    cv::stereoRectify(p_left_camera_matrix, p_left_camera_distortion_coefficients, p_right_camera_matrix, p_right_camera_distortion_coefficients, image_size, R, T, R1, R2, P1, P2, Q, cv::CALIB_ZERO_DISPARITY, 1.0, image_size);
-
-    cv::String stereo_camera_calibration_file_path;
     if (OS::get_singleton()->get_name() == "Android") {
-        stereo_camera_calibration_file_path = cv::String(ProjectSettings::get_singleton()->globalize_path(String("user://stereo_cam_calibrated.yml")).utf8().get_data());
+        settings.output_path = ProjectSettings::get_singleton()->globalize_path(String("user://stereo_cam_calibrated.yml")).utf8().get_data();
     } else if (OS::get_singleton()->get_name() == "X11" || OS::get_singleton()->get_name() == "OSX") {
-        stereo_camera_calibration_file_path = cv::String(ProjectSettings::get_singleton()->globalize_path(String("res://calibration/stereo_cam_calibrated.yml")).utf8().get_data());
+        settings.output_path = ProjectSettings::get_singleton()->globalize_path(String("res://calibration/stereo_cam_calibrated.yml")).utf8().get_data();
     }
 
-    return save_stereo_coefficients(stereo_camera_calibration_file_path, p_left_camera_matrix, p_left_camera_distortion_coefficients, p_right_camera_matrix, p_right_camera_distortion_coefficients, R, T, E, F, R1, R2, P1, P2, Q);
+    return settings;
 }
 
-bool GDEiffelCam::recalibrate_camera() {
-    bool local_early_stop = false;
-    early_stop_recalibration = false;
+bool GDEiffelCam::start_calibration() {
+    if (is_calibrating()) return false;
 
-    cv::Mat K1; //left camera matrix
-    cv::Mat D1; //left camera distortion coefficients
-    cv::Mat K2; //right camera matrix
-    cv::Mat D2; //right camera distortion coefficients
-
-    calibrate_single_cameras(eyeData.get_object_points(), eyeData.get_left_image_points(), eyeData.get_right_image_points(), K1, D1, K2, D2);
-
-    {
-        std::unique_lock<std::mutex> lock(recalibration_mutex);
-        local_early_stop = early_stop_recalibration;
+    // Solves from the stored corners, nothing is detected again. The job
+    // takes its own copy of the views.
+    CalibrationJob::Settings settings = get_calibration_settings();
+    if (calibration_dataset.has_intrinsics()) {
+        calibration_dataset.get_intrinsics(settings.initial_K1, settings.initial_D1, settings.initial_K2, settings.initial_D2);
     }
 
-    if (local_early_stop || !calibrate_stereo_camera(eyeData.get_object_points(), eyeData.get_left_image_points(), eyeData.get_right_image_points(), K1, D1, K2, D2, eyeData.get_termination_criteria())) return false;
+    calibration_job_view_ids.clear();
+    for (const CalibrationDatasetView& view : calibration_dataset.get_views()) {
+        calibration_job_view_ids.push_back(view.id);
+    }
 
+    calibration_job = std::make_unique<CalibrationJob>(settings, calibration_dataset.get_calibration_views());
+    calibration_job_from_files = false;
+    reported_calibration_serial = -1;
+    calibration_job->start();
     return true;
 }
 
-bool GDEiffelCam::calibrate_single_cameras_from_files(
-    String& p_calibration_images_folder_path,
-    std::vector< std::vector<cv::Point3f> >* p_object_points,
-    std::vector< std::vector<cv::Point2f> >* p_left_image_points,
-    std::vector< std::vector<cv::Point2f> >* p_right_image_points,
-    cv::Mat& p_left_camera_matrix,
-    cv::Mat& p_left_camera_distortion_coefficients,
-    cv::Mat& p_right_camera_matrix,
-    cv::Mat& p_right_camera_distortion_coefficients,
-    cv::TermCriteria p_termination_criteria
-    ) {
+bool GDEiffelCam::start_calibration_from_files() {
+    if (is_calibrating()) return false;
 
-    std::vector<cv::Point3f> object_points_concat;
+    CalibrationJob::Settings settings = get_calibration_settings();
+    settings.images_folder = get_calibration_images_folder();
+    settings.image_count = eyeData.get_calibration_images_required();
 
-    for (int i = 0; i < GRID_HEIGHT; i++) {
-        for (int j = 0; j < GRID_WIDTH; j++) {
-            object_points_concat.push_back(cv::Point3f(j * SQUARE_SIZE, i * SQUARE_SIZE, 0.0));
-        }
+    calibration_job = std::make_unique<CalibrationJob>(settings, CalibrationViews());
+    calibration_job_from_files = true;
+    reported_calibration_serial = -1;
+    calibration_job->start();
+    return true;
+}
+
+std::string GDEiffelCam::get_calibration_images_folder() {
+    if (OS::get_singleton()->get_name() == "Android") {
+        return ProjectSettings::get_singleton()->globalize_path(String("user://")).utf8().get_data();
+    } else if (OS::get_singleton()->get_name() == "X11" || OS::get_singleton()->get_name() == "OSX") {
+        return ProjectSettings::get_singleton()->globalize_path(String("res://calibration/calibration_images/")).utf8().get_data();
     }
-    
-    cv::Mat current_bgr_image;
-    cv::Mat current_rgb_image;
-    cv::Mat current_rgb_image_copy;
-    cv::Rect left_rect = cv::Rect(0, 0, WIDTH, HEIGHT);
-    cv::Mat left_image;
-    cv::Rect right_rect = cv::Rect(WIDTH, 0, WIDTH, HEIGHT);
-    cv::Mat right_image;
-    cv::Mat left_gray_image;
-    cv::Mat right_gray_image;
-    std::vector<cv::Point2f> left_image_corner_points;
-    std::vector<cv::Point2f> right_image_corner_points;
-
-    for (int image_number = 1; image_number <= eyeData.get_calibration_images_required(); ++image_number) {
-        // Load next image from file:
-        current_bgr_image = cv::imread( (p_calibration_images_folder_path + "full_image_" + std::to_string(image_number).c_str() + ".png").utf8().get_data() );
-        if (current_bgr_image.data == NULL){
-            Godot::print("ERROR: NOT ENOUGH IMAGES FOR CALIBRATION.");
-            return false;
-        }
-        cv::cvtColor(current_bgr_image, current_rgb_image, cv::COLOR_BGR2RGB);
+    return "";
+}
 
-        // Do the single camera calibration steps:
-        current_rgb_image_copy = current_rgb_image.clone();
+bool GDEiffelCam::is_calibrating() {
+    return calibration_job != nullptr && calibration_job->get_state() == CalibrationJob::STATE_RUNNING;
+}
 
-        left_image = current_rgb_image(left_rect);
-        right_image = current_rgb_image_copy(right_rect);
+void GDEiffelCam::poll_calibration_job() {
+    if (calibration_job == nullptr) return;
 
-        left_gray_image = cv::Mat(HEIGHT, WIDTH, CV_8UC3);
-        cv::cvtColor(left_image, left_gray_image, cv::COLOR_RGB2GRAY);
+    CalibrationJob::Progress progress = calibration_job->get_progress();
+    if (progress.serial != reported_calibration_serial) {
+        reported_calibration_serial = progress.serial;
+        emit_signal("calibration_progress", progress.stage, progress.iteration, progress.rms);
+    }
 
-        right_gray_image = cv::Mat(HEIGHT, WIDTH, CV_8UC3);
-        cv::cvtColor(right_image, right_gray_image, cv::COLOR_RGB2GRAY);
+    int state = calibration_job->get_state();
+    if (state == CalibrationJob::STATE_RUNNING) return;
 
-        left_image_corner_points.clear();
-        right_image_corner_points.clear();
+    String message;
+    if (state == CalibrationJob::STATE_SUCCEEDED) {
+        message = String("Stereo calibration rms: ") + std::to_string(progress.rms).c_str();
 
-        if (!cv::findChessboardCorners(left_gray_image, cv::Size_<int>(GRID_WIDTH, GRID_HEIGHT), left_image_corner_points)){
-            Godot::print("ERROR: INVALID CALIBRATION IMAGE FOUND.");
-            return false;
+        if (calibration_job_from_files) {
+            calibration_dataset.set_calibration_views(calibration_job->get_views());
+            calibration_job_view_ids.clear();
+            for (const CalibrationDatasetView& view : calibration_dataset.get_views()) {
+                calibration_job_view_ids.push_back(view.id);
+            }
+            sync_calibration_views();
         }
+        update_calibration_diagnostics();
+
+        cv::Mat K1, D1, K2, D2;
+        calibration_job->get_intrinsics(K1, D1, K2, D2);
+        calibration_dataset.set_intrinsics(K1, D1, K2, D2);
+        save_calibration_dataset();
+    } else if (state == CalibrationJob::STATE_FAILED) {
+        message = String("ERROR: ") + calibration_job->get_error().c_str();
+    } else {
+        message = "Calibration cancelled.";
+    }
+    Godot::print(message);
 
-        if (!cv::findChessboardCorners(right_gray_image, cv::Size_<int>(GRID_WIDTH, GRID_HEIGHT), right_image_corner_points)){
-            Godot::print("ERROR: INVALID CALIBRATION IMAGE FOUND.");
-            return false;
-        }
+    calibration_job.reset();
+    emit_signal("calibration_finished", state, message);
+}
 
-        p_object_points->push_back(object_points_concat);
+void GDEiffelCam::update_calibration_diagnostics() {
+    CalibrationJob::Diagnostics diagnostics = calibration_job->get_diagnostics();
 
-        cv::cornerSubPix(left_gray_image, left_image_corner_points, cv::Size_<int>(11, 11), cv::Size_<int>(-1, -1), p_termination_criteria);
-        p_left_image_points->push_back(left_image_corner_points);
+    Array views;
+    for (size_t i = 0; i < diagnostics.views.size(); ++i) {
+        const CalibrationJob::ViewDiagnostics& view = diagnostics.views[i];
 
-        cv::cornerSubPix(right_gray_image, right_image_corner_points, cv::Size_<int>(11, 11), cv::Size_<int>(-1, -1), p_termination_criteria);
-        p_right_image_points->push_back(right_image_corner_points);
+        Dictionary entry;
+        entry["id"] = i < calibration_job_view_ids.size() ? (int) calibration_job_view_ids[i] : -1;
+        entry["left_error"] = view.left_error;
+        entry["right_error"] = view.right_error;
+        entry["stereo_left_error"] = view.stereo_left_error;
+        entry["stereo_right_error"] = view.stereo_right_error;
+        entry["rejected"] = view.rejected;
+        entry["rejected_pass"] = view.rejected_pass;
+        views.append(entry);
     }
 
-    cv::Size image_size = cv::Size_<int>(WIDTH, HEIGHT);
-    cv::Mat left_rvecs;
-    cv::Mat left_tvecs;
-    cv::Mat right_rvecs;
-    cv::Mat right_tvecs;
+    calibration_diagnostics = Dictionary();
+    calibration_diagnostics["left_rms"] = diagnostics.left_rms;
+    calibration_diagnostics["right_rms"] = diagnostics.right_rms;
+    calibration_diagnostics["stereo_rms"] = diagnostics.stereo_rms;
+    calibration_diagnostics["passes"] = diagnostics.passes;
+    calibration_diagnostics["rejected_count"] = diagnostics.rejected_count;
+    calibration_diagnostics["views"] = views;
 
-    cv::calibrateCamera(*p_object_points, *p_left_image_points, image_size, p_left_camera_matrix, p_left_camera_distortion_coefficients, left_rvecs, left_tvecs);
-    p_left_camera_matrix = cv::getOptimalNewCameraMatrix(p_left_camera_matrix, p_left_camera_distortion_coefficients, image_size, 1, image_size);
-    cv::calibrateCamera(*p_object_points, *p_right_image_points, image_size, p_right_camera_matrix, p_right_camera_distortion_coefficients, right_rvecs, right_tvecs);
-    p_right_camera_matrix = cv::getOptimalNewCameraMatrix(p_right_camera_matrix, p_right_camera_distortion_coefficients, image_size, 1, image_size);
-
-    return true;
+    if (diagnostics.rejected_count > 0) {
+        Godot::print(String("Calibration rejected ") + std::to_string(diagnostics.rejected_count).c_str() + " outlier views in " + std::to_string(diagnostics.passes).c_str() + " passes");
+    }
 }
 
-bool GDEiffelCam::recalibrate_camera_from_files() {
-    String calibration_images_folder_path;
+std::string GDEiffelCam::get_calibration_dataset_path() {
+    String path;
     if (OS::get_singleton()->get_name() == "Android") {
-        calibration_images_folder_path = ProjectSettings::get_singleton()->globalize_path(String("user://"));
-    } else if (OS::get_singleton()->get_name() == "X11" || OS::get_singleton()->get_name() == "OSX") {
-        calibration_images_folder_path = ProjectSettings::get_singleton()->globalize_path(String("res://calibration/calibration_images/"));    // Do we need the / at the end?
+        path = "user://calibration_dataset.bin";
+    } else {
+        path = "res://calibration/calibration_dataset.bin";
     }
-    std::vector< std::vector<cv::Point3f> >* object_points      = new std::vector< std::vector<cv::Point3f> >;
-    std::vector< std::vector<cv::Point2f> >* left_image_points  = new std::vector< std::vector<cv::Point2f> >;
-    std::vector< std::vector<cv::Point2f> >* right_image_points = new std::vector< std::vector<cv::Point2f> >;
-    cv::Mat K1; //left camera matrix
-    cv::Mat D1; //left camera distortion coefficients
-    cv::Mat K2; //right camera matrix
-    cv::Mat D2; //right camera distortion coefficients
+    return ProjectSettings::get_singleton()->globalize_path(path).utf8().get_data();
+}
 
-    bool local_early_stop = false;
-    early_stop_recalibration = false;
+void GDEiffelCam::load_calibration_dataset() {
+    CalibrationDataset dataset(cv::Size(GRID_WIDTH, GRID_HEIGHT), SQUARE_SIZE, cv::Size(WIDTH, HEIGHT));
 
-    if (!calibrate_single_cameras_from_files(calibration_images_folder_path, object_points, left_image_points, right_image_points, K1, D1, K2, D2, eyeData.get_termination_criteria())) return false;
+    // Views of another board or resolution can not be mixed with new ones.
+    std::string path = get_calibration_dataset_path();
+    bool loaded = dataset.load(path);
+    if (!loaded && access(path.c_str(), F_OK) == 0) {
+        Godot::print("Calibration dataset is malformed, ignored");
+    }
+    if (loaded &&
+        (dataset.get_pattern_size() != cv::Size(GRID_WIDTH, GRID_HEIGHT) || dataset.get_square_size() != SQUARE_SIZE || dataset.get_image_size() != cv::Size(WIDTH, HEIGHT))) {
+        Godot::print("Calibration dataset does not match the chessboard, ignored");
+        dataset = CalibrationDataset(cv::Size(GRID_WIDTH, GRID_HEIGHT), SQUARE_SIZE, cv::Size(WIDTH, HEIGHT));
+    }
 
-    {
-        std::unique_lock<std::mutex> lock(recalibration_mutex);
-        local_early_stop = early_stop_recalibration;
+    calibration_dataset = std::move(dataset);
+    sync_calibration_views();
+}
+
+void GDEiffelCam::save_calibration_dataset() {
+    if (!calibration_dataset.save(get_calibration_dataset_path())) {
+        Godot::print("ERROR: Unable to save the calibration dataset");
+    }
+}
+
+PoolIntArray GDEiffelCam::get_calibration_view_ids() {
+    PoolIntArray ids;
+    for (const CalibrationDatasetView& view : calibration_dataset.get_views()) {
+        ids.append(view.id);
     }
+    return ids;
+}
 
-    if (local_early_stop || !calibrate_stereo_camera(object_points, left_image_points, right_image_points, K1, D1, K2, D2, eyeData.get_termination_criteria())) return false;
+bool GDEiffelCam::remove_calibration_view(int id) {
+    if (!calibration_dataset.remove_view(id)) return false;
 
+    save_calibration_dataset();
+    sync_calibration_views();
     return true;
 }
 
-void GDEiffelCam::cancel_recalibration() {
+void GDEiffelCam::new_calibration_dataset() {
+    calibration_dataset.clear_views();
+    save_calibration_dataset();
+    sync_calibration_views();
+}
+
+void GDEiffelCam::sync_calibration_views() {
+    CalibrationViews views = calibration_dataset.get_calibration_views();
+    eyeData.set_calibration_views(views);
 
-    std::unique_lock<std::mutex> lock(recalibration_mutex);
-    early_stop_recalibration = true;
+    chessboard_tracker.clear_accepted_views();
+    for (const std::vector<cv::Point2f>& corners : views.left_image_points) {
+        chessboard_tracker.add_accepted_view(corners, cv::Size(WIDTH, HEIGHT));
+    }
+}
+
+Ref<ImageTexture> GDEiffelCam::get_calibration_view_thumbnail(int id, bool right) {
+    Ref<ImageTexture> texture = Ref<ImageTexture>(ImageTexture::_new());
+
+    for (const CalibrationDatasetView& view : calibration_dataset.get_views()) {
+        if (view.id != (uint32_t) id) continue;
+
+        const cv::Mat& thumbnail = right ? view.right_thumbnail : view.left_thumbnail;
+        if (thumbnail.empty()) break;
+
+        PoolByteArray data;
+        data.resize(thumbnail.total());
+        {
+            PoolByteArray::Write wrt = data.write();
+            memcpy(wrt.ptr(), thumbnail.ptr(), thumbnail.total());
+        }
+        Ref<Image> image = Ref<Image>(Image::_new());
+        image->create_from_data(thumbnail.cols, thumbnail.rows, false, Image::FORMAT_L8, data);
+        texture->create_from_image(image, Texture::FLAG_FILTER);
+        break;
+    }
+
+    return texture;
+}
+
+void GDEiffelCam::cancel_recalibration() {
+    if (calibration_job != nullptr) {
+        calibration_job->cancel();
+    }
 }
 
 void GDEiffelCam::set_disparity_test_mode(bool on){
     disparity_test_mode = on;
+    update_frame_retention();
+}
+
+void GDEiffelCam::set_continuous_depth(bool on){
+    if (on == continuous_depth) return;
+
+    continuous_depth = on;
+    update_frame_retention();
+
+    if (on) {
+        depth_worker.set_preset(stereo_depth.get_preset());
+        depth_worker.set_incremental_params(depth_params);
+        depth_worker.start(&frame_pool);
+    } else {
+        depth_worker.stop();
+    }
+}
+
+void GDEiffelCam::set_depth_change_threshold(int p_threshold){
+    depth_params.change_threshold = p_threshold;
+    depth_worker.set_incremental_params(depth_params);
+}
+
+void GDEiffelCam::set_frame_retention(int p_retention){
+    requested_frame_retention = p_retention;
+    update_frame_retention();
 }
 
-PoolByteArray GDEiffelCam::create_disparity_map(Ref<ImageTexture> p_image) {
-    //Porting historic/research/vendor/calibration/stereo_depth.py to C++:
+void GDEiffelCam::update_frame_retention(){
+    int retention = requested_frame_retention;
+
+    if (in_calibration_mode) {
+        retention |= FramePool::RETAIN_LUMA;
+    }
+    if (disparity_test_mode || continuous_depth) {
+        retention |= FramePool::RETAIN_RECTIFIED_LUMA;
+    }
+    if (!pending_snapshots.empty()) {
+        retention |= FramePool::RETAIN_JPEG;
+    }
+
+    frame_pool.set_retention(retention);
+}
+
+void GDEiffelCam::set_disparity_preset(int p_preset){
+    if (p_preset < StereoDepth::PRESET_FULL || p_preset > StereoDepth::PRESET_SPEED) {
+        Godot::print("ERROR: disparity preset has to be between 0 and 2");
+        return;
+    }
 
-    PoolByteArray image = p_image->get_data()->get_data();
-    uint8_t* frame_data = image.write().ptr();
-    cv::Mat frame_original(HEIGHT, WIDTH * 2, CV_8UC3, frame_data);
+    stereo_depth.set_preset(p_preset);
+    depth_worker.set_preset(p_preset);
+}
 
-    cv::Mat frame_remapped(HEIGHT, WIDTH * 2, CV_8UC3);
+int GDEiffelCam::get_disparity_preset(){
+    return stereo_depth.get_preset();
+}
 
-    cv::remap(frame_original, frame_remapped, mapX, mapY, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
+PoolByteArray GDEiffelCam::create_disparity_map() {
+    MemoryScope memory_scope(MemoryAccounting::SUBSYSTEM_DEPTH);
+    PoolByteArray disparity_map_data;
 
-    // We need grayscale for disparity map.
-    cv::Mat frame_gray(HEIGHT, WIDTH * 2, CV_8UC3);
+    // The pool holds the rectified luma of the frame that was just decoded,
+    // so there is no texture readback or second remap here.
+    std::shared_ptr<const RetainedFrame> frame = frame_pool.get();
+    if (frame == nullptr || frame->rectified_luma.empty()) {
+        return disparity_map_data;
+    }
 
-    cv::cvtColor(frame_remapped, frame_gray, cv::COLOR_RGB2GRAY);
+    const cv::Mat& frame_gray = frame->rectified_luma;
 
     cv::Mat left_frame_gray;
     cv::Mat right_frame_gray;
@@ -1352,81 +2394,277 @@ PoolByteArray GDEiffelCam::create_disparity_map(Ref<ImageTexture> p_image) {
     left_frame_gray = frame_gray(left_rect);
     right_frame_gray = frame_gray(right_rect);
 
-    int minDisparity = -1;
-    int numDisparities = 5*16;          // max_disp has to be dividable by 16 f. E. HH 192, 256
-    int window_size = 3;                // wsize default 3; 5; 7 for SGBM reduced size image; 15 for SGBM full size image (1300px and above); 5 Works nicely
-    int blockSize = window_size;
-    int P1 = 8 * 3 * window_size;
-    int P2 = 32 * 3 * window_size;
-    int disp12MaxDiff = 12;
-    int uniquenessRatio = 10;
-    int speckleWindowSize = 50;
-    int speckleRange = 32;
-    int preFilterCap = 63;
-    int mode = cv::StereoSGBM::MODE_SGBM_3WAY;
-
-    cv::Ptr<cv::StereoSGBM> left_matcher = cv::StereoSGBM::create(
-        minDisparity,
-        numDisparities,
-        blockSize,
-        P1,
-        P2,
-        disp12MaxDiff,
-        uniquenessRatio,
-        speckleWindowSize,
-        speckleRange,
-        preFilterCap,
-        mode
-    );
-
-    cv::Ptr<cv::StereoSGBM> right_matcher = cv::ximgproc::createRightMatcher(left_matcher).dynamicCast<cv::StereoSGBM>();
-    // FILTER Parameters
-    int lambda = 80000;
-    float sigma = 1.3;
-
-    cv::Ptr<cv::ximgproc::DisparityWLSFilter> wls_filter = cv::ximgproc::createDisparityWLSFilter(left_matcher);
-    wls_filter->setLambda(lambda);
-    wls_filter->setSigmaColor(sigma);
-
-    cv::Mat left_disparity_map;
-    cv::Mat right_disparity_map;
-    left_matcher->compute(left_frame_gray, right_frame_gray, left_disparity_map);
-    right_matcher->compute(right_frame_gray, left_frame_gray, right_disparity_map);
-
-    left_disparity_map.convertTo(left_disparity_map, CV_16SC1);
-    right_disparity_map.convertTo(right_disparity_map, CV_16SC1);
-
-    cv::Mat filtered_disparity_map;
-    wls_filter->filter(left_disparity_map, left_frame_gray, filtered_disparity_map, right_disparity_map);   //NOTE: left_frame_gray can be YUV's Y array.
-    cv::normalize(filtered_disparity_map, filtered_disparity_map, 255, 0, cv::NORM_MINMAX);
+    auto start = cclock::now();
+    cv::Mat disparity = stereo_depth.compute(left_frame_gray, right_frame_gray);
+    logDuration(std::string("Disparity map (preset ") + std::to_string(stereo_depth.get_preset()) + ")", sec(cclock::now() - start).count());
 
-    PoolByteArray disparity_map_data;
-    disparity_map_data.resize(filtered_disparity_map.rows * filtered_disparity_map.cols * 3);
+    disparity_map_data = disparity_to_rgb(disparity);
+    update_depth_map(disparity);
 
-    cv::Mat filtered_8_bit_disparity_map(filtered_disparity_map.rows, filtered_disparity_map.cols, CV_8UC3);
-    filtered_disparity_map.convertTo(filtered_8_bit_disparity_map, CV_8UC3);
+    if (save_debug_images) {
+        auto debug_path = [](const char* name) {
+            return std::string(ProjectSettings::get_singleton()->globalize_path(String("res://debug_images/") + name).utf8().get_data());
+        };
 
-    cv::Mat filtered_rgb_disparity_map(HEIGHT, WIDTH, CV_8UC3, disparity_map_data.write().ptr());
-    cv::cvtColor(filtered_8_bit_disparity_map, filtered_rgb_disparity_map, cv::COLOR_GRAY2RGB);
+        // The frame buffers are held by the exports, buffers that are
+        // overwritten in place are cloned.
+        PoolByteArray::Read disparity_map_read = disparity_map_data.read();
+        cv::Mat filtered_rgb_disparity_map(HEIGHT, WIDTH, CV_8UC3, (void*) disparity_map_read.ptr());
 
-    if (save_debug_images) {
-        cv::imwrite(ProjectSettings::get_singleton()->globalize_path("res://debug_images/4_1_frame_original.png").utf8().get_data(), frame_original);
-        cv::imwrite(ProjectSettings::get_singleton()->globalize_path("res://debug_images/4_2_frame_remapped.png").utf8().get_data(), frame_remapped);
-        cv::imwrite(ProjectSettings::get_singleton()->globalize_path("res://debug_images/4_3_left_frame_gray.png").utf8().get_data(), left_frame_gray);
-        cv::imwrite(ProjectSettings::get_singleton()->globalize_path("res://debug_images/4_4_right_frame_gray.png").utf8().get_data(), right_frame_gray);
-        cv::imwrite(ProjectSettings::get_singleton()->globalize_path("res://debug_images/4_5_left_disparity_map.png").utf8().get_data(), left_disparity_map);
-        cv::imwrite(ProjectSettings::get_singleton()->globalize_path("res://debug_images/4_6_right_disparity_map.png").utf8().get_data(), right_disparity_map);
-        cv::imwrite(ProjectSettings::get_singleton()->globalize_path("res://debug_images/4_7_filtered_disparity_map.png").utf8().get_data(), filtered_rgb_disparity_map);
+        if (!frame->rgb.empty()) {
+            image_exporter.export_image(debug_path("4_1_frame_original.png"), frame->rgb, true, ImageExporter::FORMAT_PNG);
+        }
+        image_exporter.export_image(debug_path("4_2_frame_remapped.png"), frame_gray, false, ImageExporter::FORMAT_PNG);
+        image_exporter.export_image(debug_path("4_3_left_frame_gray.png"), left_frame_gray, false, ImageExporter::FORMAT_PNG);
+        image_exporter.export_image(debug_path("4_4_right_frame_gray.png"), right_frame_gray, false, ImageExporter::FORMAT_PNG);
+        if (stereo_depth.get_preset() == StereoDepth::PRESET_FULL) {
+            image_exporter.export_image(debug_path("4_5_left_disparity_map.png"), stereo_depth.get_last_left_disparity().clone(), false, ImageExporter::FORMAT_PNG);
+            image_exporter.export_image(debug_path("4_6_right_disparity_map.png"), stereo_depth.get_last_right_disparity().clone(), false, ImageExporter::FORMAT_PNG);
+        }
+        image_exporter.export_image(debug_path("4_7_filtered_disparity_map.png"), filtered_rgb_disparity_map.clone(), true, ImageExporter::FORMAT_PNG);
         save_debug_images = false;
     }
 
     return disparity_map_data;
 }
 
+PoolByteArray GDEiffelCam::disparity_to_rgb(const cv::Mat& disparity) {
+    PoolByteArray disparity_map_data;
+
+    // Normalise to the search range, so the presets are comparable on the debug quad.
+    cv::Mat disparity_8_bit;
+    disparity.convertTo(disparity_8_bit, CV_8UC1, 255.0 / FULL_NUM_DISPARITIES);
+
+    disparity_map_data.resize(HEIGHT * WIDTH * 3);
+
+    PoolByteArray::Write disparity_map_write = disparity_map_data.write();
+    cv::Mat rgb_disparity_map(HEIGHT, WIDTH, CV_8UC3, disparity_map_write.ptr());
+    cv::cvtColor(disparity_8_bit, rgb_disparity_map, cv::COLOR_GRAY2RGB);
+
+    return disparity_map_data;
+}
+
+void GDEiffelCam::update_depth_map(const cv::Mat& disparity) {
+    if (Q.empty()) return;
+
+    TRACE_EVENT("eiffel_camera", "EiffelCamera::update_depth_map");
+
+    cv::Mat depth;
+    StereoDepth::disparity_to_depth(disparity, Q, depth);
+
+    // Nearest, so no depth is blended across an edge
+    cv::Mat display_depth;
+    cv::remap(depth, display_depth, depthDisplayMapX, depthDisplayMapY, cv::INTER_NEAREST, cv::BORDER_CONSTANT, cv::Scalar(0));
+    eyeData.update_depth_map(display_depth);
+}
+
+Ref<ImageTexture> GDEiffelCam::get_depth_map(){
+    return eyeData.get_current_depth_map();
+}
+
 Ref<ImageTexture> GDEiffelCam::get_disparity_map(){
     return eyeData.get_current_disparity_map();
 }
 
 void GDEiffelCam::save_disparity_images(){
     save_debug_images = true;
-}
\ No newline at end of file
+}
+
+bool GDEiffelCam::read_lut_source(String path, int size, LutSource& r_source) {
+
+    TRACE_EVENT("eiffel_camera", "read_lut_source");
+
+    r_source.path = path.utf8().get_data();
+    uint64_t key;
+
+    if (path.get_extension().to_lower() == "cube") {
+        Ref<File> file = Ref<File>(File::_new());
+        if (file->open(path, File::READ) != Error::OK) {
+            Godot::print(String("ERROR: Unable to open ") + path);
+            return false;
+        }
+
+        PoolByteArray bytes = file->get_buffer(file->get_len());
+        file->close();
+
+        PoolByteArray::Read bytes_rd = bytes.read();
+        r_source.cube_text.assign((const char*) bytes_rd.ptr(), bytes.size());
+        key = ColorLut::hash(r_source.cube_text.data(), r_source.cube_text.size());
+    } else {
+        // Imported images, the exported project has no PNG files
+        Ref<Texture> texture = ResourceLoader::get_singleton()->load(path);
+        if (texture.is_null()) {
+            Godot::print(String("ERROR: Unable to load ") + path);
+            return false;
+        }
+
+        Ref<Image> image = texture->get_data();
+        image->decompress();
+        image->convert(Image::FORMAT_RGB8);
+
+        PoolByteArray data = image->get_data();
+        PoolByteArray::Read data_rd = data.read();
+        r_source.tiles.assign(data_rd.ptr(), data_rd.ptr() + data.size());
+        r_source.tiles_width = image->get_width();
+        r_source.tiles_height = image->get_height();
+        key = ColorLut::hash(r_source.tiles.data(), r_source.tiles.size());
+    }
+
+    r_source.key = ColorLut::hash(lut_params, size, key);
+    return true;
+}
+
+bool GDEiffelCam::bake_lut_source(const LutSource& source, int size, std::vector<uint8_t>& r_texels, std::string& r_error) {
+
+    TRACE_EVENT("eiffel_camera", "bake_lut");
+
+    char key_hex[17];
+    snprintf(key_hex, sizeof(key_hex), "%016llx", (unsigned long long) source.key);
+    std::string cache_path = lut_cache_dir + "/" + key_hex + ".lut";
+
+    int cached_size;
+    if (ColorLut::load_baked(cache_path, source.key, cached_size, r_texels) && cached_size == size) {
+        return true;
+    }
+
+    ColorLut lut;
+    if (!source.cube_text.empty()) {
+        if (!lut.parse_cube(source.cube_text, r_error)) {
+            return false;
+        }
+    } else {
+        // size^3 entries in size x size tiles
+        int tile_size = (int) std::lround(std::cbrt((double) source.tiles_width * source.tiles_height));
+        if (!lut.parse_tiles(source.tiles.data(), source.tiles_width, source.tiles_height, tile_size)) {
+            r_error = "not a tiled look image";
+            return false;
+        }
+    }
+
+    r_texels = lut.bake(lut_params, size);
+    if (!ColorLut::save_baked(cache_path, source.key, size, r_texels)) {
+        Godot::print(String("WARNING: Unable to cache the look in ") + cache_path.c_str());
+    }
+    return true;
+}
+
+Ref<Texture3D> GDEiffelCam::add_lut_texture(const std::string& path, int size, const std::vector<uint8_t>& texels) {
+
+    Ref<Texture3D> texture = Ref<Texture3D>(Texture3D::_new());
+    texture->create(size, size, size, Image::FORMAT_RGB8, Texture3D::FLAG_FILTER);
+
+    // One blue level per layer
+    PoolByteArray layer_data;
+    layer_data.resize(size * size * 3);
+    for (int z = 0; z < size; ++z) {
+        {
+            PoolByteArray::Write layer_wrt = layer_data.write();
+            memcpy(layer_wrt.ptr(), texels.data() + (size_t) z * size * size * 3, size * size * 3);
+        }
+
+        Ref<Image> layer = Ref<Image>(Image::_new());
+        layer->create_from_data(size, size, false, Image::FORMAT_RGB8, layer_data);
+        texture->set_layer_data(layer, z);
+    }
+
+    luts[get_lut_name(path, size)] = texture;
+
+    int64_t bytes = 0;
+    for (const auto& entry : luts) {
+        int lut_size = entry.second->get_width();
+        bytes += MemoryAccounting::texture_bytes(lut_size, lut_size, lut_size, 3);
+    }
+    lut_gpu_memory.set(bytes);
+
+    return texture;
+}
+
+Ref<Texture3D> GDEiffelCam::load_lut(String path, int size) {
+
+    TRACE_EVENT("eiffel_camera", "load_lut");
+
+    if (size < 2 || size > 256) {
+        Godot::print("ERROR: look size has to be between 2 and 256");
+        return Ref<Texture3D>();
+    }
+
+    std::string path_string = path.utf8().get_data();
+    auto found = luts.find(get_lut_name(path_string, size));
+    if (found != luts.end()) {
+        return found->second;
+    }
+
+    LutSource source;
+    std::vector<uint8_t> texels;
+    std::string error;
+    if (!read_lut_source(path, size, source) || !bake_lut_source(source, size, texels, error)) {
+        if (!error.empty()) {
+            Godot::print(String("ERROR: ") + path + ": " + error.c_str());
+        }
+        return Ref<Texture3D>();
+    }
+
+    return add_lut_texture(path_string, size, texels);
+}
+
+bool GDEiffelCam::prebake_luts(PoolStringArray paths, int size) {
+
+    if (lut_prebake.valid() || size < 2 || size > 256) {
+        return false;
+    }
+
+    // Godot resources are read here, the parsing and baking run in the background
+    std::vector<LutSource> sources;
+    for (int i = 0; i < paths.size(); ++i) {
+        if (luts.count(get_lut_name(paths[i].utf8().get_data(), size)) > 0) continue;
+
+        LutSource source;
+        if (read_lut_source(paths[i], size, source)) {
+            sources.push_back(std::move(source));
+        }
+    }
+
+    lut_prebake = std::async(std::launch::async, [this, size](std::vector<LutSource> sources) {
+        std::vector<BakedLut> baked;
+        for (const LutSource& source : sources) {
+            BakedLut lut;
+            std::string error;
+            if (bake_lut_source(source, size, lut.texels, error)) {
+                lut.path = source.path;
+                lut.size = size;
+                baked.push_back(std::move(lut));
+            }
+        }
+        return baked;
+    }, std::move(sources));
+
+    return true;
+}
+
+void GDEiffelCam::poll_lut_prebake() {
+
+    if (!lut_prebake.valid() || lut_prebake.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+
+    for (const BakedLut& lut : lut_prebake.get()) {
+        add_lut_texture(lut.path, lut.size, lut.texels);
+    }
+}
+
+void GDEiffelCam::set_lut_saturation(float p_saturation) {
+
+    if (p_saturation == lut_params.saturation) {
+        return;
+    }
+
+    // A prebake in flight uses the parameters
+    if (lut_prebake.valid()) {
+        lut_prebake.wait();
+        lut_prebake.get();
+    }
+
+    lut_params.saturation = p_saturation;
+    luts.clear();
+    lut_gpu_memory.set(0);
+}
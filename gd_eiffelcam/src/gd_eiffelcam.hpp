@@ -34,6 +34,7 @@
 // #include "core/os/os.h"
 #include <ProjectSettings.hpp>
 #include <TextureArray.hpp>
+#include <Texture3D.hpp>
 
 #include <libusb-1.0/libusb.h>
 #include <libuvc/libuvc.h>
@@ -45,18 +46,38 @@
 #include <iostream>
 #include <turbojpeg.h>
 #include <stdexcept>
+#include <algorithm>
+#include <future>
+#include <atomic>
+#include <chrono>
 
 #include <jpeglib.h>
 #include <jerror.h>             /* get library error codes too */
 
 #include "godot_texture_components.hpp"
+#include "camera_properties.hpp"
+#include "calibration_dataset.hpp"
+#include "calibration_job.hpp"
+#include "chessboard_tracker.hpp"
+#include "color_lut.hpp"
+#include "decode_scheduler.hpp"
+#include "depth_worker.hpp"
+#include "exposure_control.hpp"
+#include "frame_pacing.hpp"
+#include "frame_pool.hpp"
+#include "image_exporter.hpp"
+#include "memory_accounting.hpp"
+#include "metrics.hpp"
+#include "stereo_calibration.hpp"
+#include "stereo_depth.hpp"
+#include "usb_device_selector.hpp"
+#include "usb_hotplug.hpp"
+#include "usb_stream.hpp"
 
 #define WIDTH 1280
 #define HEIGHT 960
 #define FRAME_WIDTH (WIDTH * 2)
 
-static void uvcCallback(uvc_frame_t *frame, void *ptr);
-
 namespace godot {
 
 class GDEiffelCam;
@@ -105,14 +126,47 @@ struct ImageProcessor {
 
     GDEiffelCam* eiffelcam;
 
+    FramePool* frame_pool;
+    cv::Mat scratch_luma;
+
+    MetricHistogram* decode_ms = nullptr;
+    MetricHistogram* remap_ms = nullptr;
+    MetricHistogram* upload_ms = nullptr;
+    MetricHistogram* jpeg_size_kb = nullptr;
+    MetricCounter* decode_errors = nullptr;
+    MetricCounter* decoder_resets = nullptr;
+
+    MemoryReservation decode_memory{MemoryAccounting::SUBSYSTEM_DECODE, MemoryAccounting::KIND_CPU};
+
+    // Statistics of the last decoded frame for the ExposureController, only
+    // gathered while it is active.
+    bool gather_exposure_stats = false;
+    ExposureStats exposure_stats;
+
     void init(Node* cam);
 
+    void retain_frame(const unsigned char* raw_rgb, const unsigned char* uploaded_rgb, const unsigned char* y_plane);
+
     bool decode_yuv(PoolByteArray& bytes);
 
     bool decode_rgb (PoolByteArray& decoded);
 
-    void run();
+    // Decodes a frame without showing it, before the main thread processes frames.
+    void warm_up(const unsigned char* inbuffer, unsigned long insize);
+
+    // Frame and settings for decode() and upload(). The input buffer and maps
+    // have to stay unchanged until upload() returned.
+    void set_frame(const unsigned char* inbuffer, unsigned long insize, cv::Mat& mapX, cv::Mat& mapY, GodotTextureComponents* gtc, int colorspace, int remap_mode);
 
+    // CPU part of a frame: JPEG decode, CPU remap and frame retention. Touches
+    // no Godot objects apart from the buffers of this processor, so it can run
+    // on a DecodeScheduler thread. False if the frame could not be decoded.
+    bool decode();
+
+    // Texture upload of the decoded frame, main thread.
+    void upload();
+
+    // set_frame, decode and upload on the calling thread.
     Error process(const unsigned char* inbuffer, unsigned long insize, cv::Mat& mapX, cv::Mat& mapY, GodotTextureComponents* gtc, int colorspace, int remap_mode);
 };
 
@@ -129,12 +183,27 @@ private:
     uint32_t frame_array_size;
 
     // LibUSB / LibUVC handles and control stream
-    uvc_context_t* ctx;
-    uvc_device_t* dev;
-    uvc_device_handle_t* devh;
-    uvc_stream_ctrl_t ctrl;
-    uvc_stream_handle_t* streamh;
-    uvc_frame_t* frame;
+    uvc_context_t* ctx = nullptr;
+    uvc_device_t* dev = nullptr;
+    uvc_device_handle_t* devh = nullptr;
+    uvc_stream_handle_t* streamh = nullptr;
+
+    UsbStreamSettings usb_settings;
+    UsbFrameQueue usb_frame_queue;
+
+    // Written by negotiate_stream on the bring-up thread, copied for the
+    // main thread by publish_stream_negotiation once the future is ready.
+    struct StreamNegotiation {
+        uvc_stream_ctrl_t ctrl;
+        uint32_t payload_transfer_size = 0;     // as negotiated, before the override
+        std::vector<double> camera_fps;         // of the streamed resolution, from the UVC descriptors
+    };
+    StreamNegotiation negotiation;
+    void publish_stream_negotiation();
+
+    // Main thread copies
+    uint32_t negotiated_payload_transfer_size = 0;
+    uint32_t max_video_frame_size = 0;
 
     bool isAndroid;
     bool cameraRunning = false;
@@ -142,12 +211,131 @@ private:
 
     float time_elapsed = 0.0;
 
+    CameraProperties camera_properties;
+    bool camera_properties_listed = false;
+    static const int UVC_AE_MODE_MANUAL = 1;     // bit 0 of CT_AE_MODE, 8 is aperture priority
     void send_camera_properties();
+    void poll_camera_properties();
 
     void connect_to_camera();
-    void start_streaming();
+    void close_camera();
+    std::string negotiate_stream();
+    std::string open_stream(bool configure_queue);
+
+    UsbHotplug usb_hotplug;
+    void poll_usb_hotplug();
     bool connected_to_camera = false;
 
+    // Camera selection for rigs with several modules, applied on the next
+    // attach. device_path is the camera claimed by this instance, empty if none.
+    UsbDeviceSelector device_selector;
+    std::string device_path;
+    std::string device_serial;
+    bool claim_device(const std::string& path, const std::string& serial);
+    void release_device();
+
+    // Copies for the bring-up thread. Without hotplug events the camera is
+    // only known once find_device picked one. A camera claimed before its
+    // serial could be read is checked against the selection once it is open.
+    std::string bring_up_device_path;
+    std::string bring_up_device_serial;
+    std::string bring_up_selected_serial;
+    bool bring_up_wrong_device = false;
+    uvc_error_t find_device();
+
+    // The CPU part of a frame runs on the shared DecodeScheduler between
+    // _process and the frame_pre_draw of the VisualServer, the upload and
+    // everything after it in finish_frame.
+    std::future<bool> pending_decode;
+    void finish_frame();
+
+    // Connection bring-up. Opening the device, stream negotiation and the
+    // decoder warm-up run on a background thread and _process polls for the
+    // result. Property discovery starts on the CameraProperties worker once
+    // the stream runs, so its control transfers never interleave with the
+    // PROBE/COMMIT of the negotiation.
+    enum BRING_UP_STAGE {
+        BRING_UP_IDLE,
+        BRING_UP_OPENING,
+        BRING_UP_NEGOTIATING,
+        BRING_UP_STARTING,
+        BRING_UP_WARMING_UP,
+        BRING_UP_WAITING_FOR_FRAME,     // streaming, first frame not displayed yet
+        BRING_UP_STREAMING,
+        BRING_UP_FAILED,
+        BRING_UP_STAGE_COUNT
+    };
+
+    static const int BRING_UP_WARM_UP_TIMEOUT_US = 500000;
+
+    std::future<std::string> bring_up;
+    std::atomic<int> bring_up_stage{BRING_UP_IDLE};
+    int reported_bring_up_stage = BRING_UP_IDLE;
+    std::chrono::steady_clock::time_point bring_up_start;
+    std::atomic<double> bring_up_stage_ms[BRING_UP_STAGE_COUNT] = {};     // since bring_up_start, when each stage was entered
+
+    void begin_bring_up(int fd);    // fd of the Android USB connection, -1 to look the device up
+    std::string run_bring_up(int fd, bool configure_queue);
+    std::string take_bring_up_result();
+    void set_bring_up_stage(int stage);
+    double get_bring_up_elapsed_ms();
+    void poll_bring_up();
+    void report_bring_up_stage();
+    void on_first_frame_displayed();
+    int bring_up_fd = -1;
+
+    // Stream recovery. A stream that delivers no frames for
+    // STREAM_STALL_TIMEOUT_MS is restarted, then reopened with a new
+    // negotiation, then the UVC context is set up again. Each level gets the
+    // same time to deliver a frame before the next one is tried. Decoders,
+    // frame buffers, textures and maps stay allocated throughout. The
+    // property worker is paused while a restart or reopen runs.
+    enum RECOVERY_LEVEL {
+        RECOVERY_NONE,
+        RECOVERY_RESTART_STREAM,
+        RECOVERY_REOPEN_STREAM,
+        RECOVERY_REINITIALISE,
+        RECOVERY_FAILED
+    };
+
+    static const int STREAM_STALL_TIMEOUT_MS = 500;
+
+    int recovery_level = RECOVERY_NONE;
+    std::future<std::string> recovery;      // restart and reopen run on a background thread
+    std::chrono::steady_clock::time_point last_frame_time;
+    std::chrono::steady_clock::time_point recovery_attempt_start;
+    double last_recovery_ms = 0.0;
+    int last_recovery_level = RECOVERY_NONE;
+    MetricCounter* stream_stalls = nullptr;
+    MetricCounter* stream_recovery_failures = nullptr;
+    MetricHistogram* stream_recovery_ms = nullptr;
+
+    void poll_stream_recovery(bool got_frame);
+    void begin_recovery_attempt(int level);
+    std::string run_recovery(int level);
+
+    // Snapshots, debug dumps and calibration images are written by the
+    // exporter. A snapshot retains the MJPEG payload of the next decoded frame.
+    ImageExporter image_exporter;
+    struct PendingSnapshot {
+        int id;
+        std::string path;
+        int format;
+        int64_t after_sequence;     // newest frame of the pool when requested, -1 for none
+    };
+    std::vector<PendingSnapshot> pending_snapshots;
+    void poll_snapshots();
+    void poll_exports();
+
+    // Frame of the last take_picture, saved as full_image_<n>.png on accept.
+    std::shared_ptr<const RetainedFrame> calibration_capture_frame;
+    bool save_calibration_images = false;
+    std::string get_calibration_images_folder();
+
+    ExposureController exposure_controller;
+    ExposureStats exposure_stats;   // copy for the main thread, the next decode overwrites the processor's
+    void update_exposure();
+
     Object* eiffelcamera_singleton = nullptr;
 
     enum CAMERA_CONNECTION_STATUS {
@@ -158,39 +346,65 @@ private:
 
     bool in_calibration_mode = false;
 
-    void calibrate_single_cameras(
-        std::vector< std::vector<cv::Point3f> >* p_object_points,
-        std::vector< std::vector<cv::Point2f> >* p_left_image_points,
-        std::vector< std::vector<cv::Point2f> >* p_right_image_points,
-        cv::Mat& p_left_camera_matrix,
-        cv::Mat& p_left_camera_distortion_coefficients,
-        cv::Mat& p_right_camera_matrix,
-        cv::Mat& p_right_camera_distortion_coefficients);
-    bool calibrate_stereo_camera(
-        std::vector< std::vector<cv::Point3f> >* p_object_points,
-        std::vector< std::vector<cv::Point2f> >* p_left_image_points,
-        std::vector< std::vector<cv::Point2f> >* p_right_image_points,
-        cv::Mat& p_left_camera_matrix,
-        cv::Mat& p_left_camera_distortion_coefficients,
-        cv::Mat& p_right_camera_matrix,
-        cv::Mat& p_right_camera_distortion_coefficients,
-        cv::TermCriteria p_termination_criteria);
-    bool calibrate_single_cameras_from_files(
-        String& p_calibration_images_folder,
-        std::vector< std::vector<cv::Point3f> >* p_object_points,
-        std::vector< std::vector<cv::Point2f> >* p_left_image_points,
-        std::vector< std::vector<cv::Point2f> >* p_right_image_points,
-        cv::Mat& p_left_camera_matrix,
-        cv::Mat& p_left_camera_distortion_coefficients,
-        cv::Mat& p_right_camera_matrix,
-        cv::Mat& p_right_camera_distortion_coefficients,
-        cv::TermCriteria p_termination_criteria);
-
-    std::mutex recalibration_mutex;
-    bool early_stop_recalibration;
+    std::unique_ptr<CalibrationJob> calibration_job;
+    bool calibration_job_from_files = false;
+    int reported_calibration_serial = -1;
+    std::vector<uint32_t> calibration_job_view_ids;    // dataset ids of the job views, in order
+    Dictionary calibration_diagnostics;
+    void update_calibration_diagnostics();
+
+    CalibrationDataset calibration_dataset;
+    std::string get_calibration_dataset_path();
+    void load_calibration_dataset();
+    void save_calibration_dataset();
+    // Hands the stored views to the picture count and the chessboard tracker.
+    void sync_calibration_views();
+    CalibrationJob::Settings get_calibration_settings();
+    void poll_calibration_job();
+
+    // Looks of the camera view, see ColorLut. Baked tables are kept as
+    // textures per path and size and on disk in user://lut_cache, so a look
+    // that was used or prebaked before is a texture swap.
+    struct LutSource {
+        std::string path;
+        std::string cube_text;          // .cube files
+        std::vector<uint8_t> tiles;     // tiled images, RGB8
+        int tiles_width = 0;
+        int tiles_height = 0;
+        uint64_t key = 0;               // of the source, bake parameters and size
+    };
+
+    struct BakedLut {
+        std::string path;
+        int size = 0;
+        std::vector<uint8_t> texels;
+    };
+
+    ColorLut::BakeParams lut_params;
+    std::string lut_cache_dir;
+    std::map<std::string, Ref<Texture3D>> luts;     // by path and size
+    std::future<std::vector<BakedLut>> lut_prebake;
+    MemoryReservation lut_gpu_memory{MemoryAccounting::SUBSYSTEM_TEXTURES, MemoryAccounting::KIND_GPU};
+
+    static std::string get_lut_name(const std::string& path, int size) { return path + "@" + std::to_string(size); }
+    bool read_lut_source(String path, int size, LutSource& r_source);
+    // Any thread. From the disk cache if possible, stores a fresh bake there.
+    bool bake_lut_source(const LutSource& source, int size, std::vector<uint8_t>& r_texels, std::string& r_error);
+    Ref<Texture3D> add_lut_texture(const std::string& path, int size, const std::vector<uint8_t>& texels);
+    void poll_lut_prebake();
 
 public:
-    void on_permission_received(int fd);
+    void on_permission_received(int fd, String device);
+    void on_camera_attached(String device, String serial);
+    void on_camera_detached(String device);
+    void _on_frame_pre_draw();
+
+    void set_device_serial(String p_serial) { device_selector.serial = p_serial.utf8().get_data(); }
+    String get_device_serial() { return device_selector.serial.c_str(); }
+    void set_device_path(String p_path) { device_selector.path = p_path.utf8().get_data(); }
+    String get_device_path() { return device_selector.path.c_str(); }
+    // Path and serial of the camera this instance is attached to, empty if none.
+    Dictionary get_device();
 
     static void _register_methods();
     GDEiffelCam();
@@ -248,19 +462,121 @@ public:
     Variant get_camera_setting_label(const String property);
 
     GodotTextureComponents eyeData;
+    FramePool frame_pool;
+
+    MetricsRegistry metrics;
+    MetricCounter* frames_received = nullptr;
+    MetricCounter* dropped_frames = nullptr;
+    MetricCounter* usb_errors = nullptr;
+    MetricGauge* frame_queue_depth = nullptr;  // frames the camera delivered since the previous poll
+    MetricGauge* time_to_first_frame_ms = nullptr;
+    uint32_t last_frame_sequence = 0;
+    Dictionary get_metrics();
+    void reset_metrics() { metrics.reset(); }
+
+    // Writes the in-process trace, to the default path if path is empty.
+    bool flush_trace(String path);
+
+    FramePacing frame_pacing;
+    std::vector<double> supported_camera_fps;     // main thread copy of negotiation.camera_fps
+    std::vector<double> display_refresh_rates = { 60.0, 72.0, 90.0, 120.0 };
+    double get_render_time();
+    Dictionary get_frame_pacing();
+    void reset_frame_pacing() { frame_pacing.reset(); }
+    void set_display_refresh_rates(PoolRealArray p_rates);
+
+    Dictionary get_memory_usage();
+
+    // A .cube file or a tiled look image baked at size^3, null on error.
+    Ref<Texture3D> load_lut(String path, int size);
+    // Bakes the looks in the background so switching to them is immediate.
+    bool prebake_luts(PoolStringArray paths, int size);
+    // Applied before the look, changing it rebakes the looks on their next load.
+    void set_lut_saturation(float p_saturation);
+    float get_lut_saturation() { return lut_params.saturation; }
+
+    // Software auto exposure and white balance from the decoded frames,
+    // see ExposureController. Both are off by default.
+    void set_auto_exposure(bool p_enabled);
+    bool get_auto_exposure() { return exposure_controller.get_settings().auto_exposure; }
+    void set_auto_white_balance(bool p_enabled);
+    bool get_auto_white_balance() { return exposure_controller.get_settings().auto_white_balance; }
+    void set_exposure_target(float p_luma) { exposure_controller.get_settings().target_luma = std::max(0.05f, std::min(p_luma, 0.95f)); }
+    float get_exposure_target() { return exposure_controller.get_settings().target_luma; }
+    void set_max_exposure_ms(float p_ms) { exposure_controller.get_settings().max_exposure_ms = std::max(0.1f, p_ms); }
+    float get_max_exposure_ms() { return exposure_controller.get_settings().max_exposure_ms; }
+    // Statistics of the last frame, empty while the controller is off.
+    Dictionary get_exposure_stats();
+
+    // Writes the next camera frame to path, as received for .jpg and .jpeg
+    // and as a PNG otherwise. Returns the id reported by image_exported, -1
+    // without a stream.
+    int export_snapshot(String path);
+    void set_export_png_compression(int p_level) { image_exporter.set_png_compression(p_level); }
+    int get_export_png_compression() { return image_exporter.get_png_compression(); }
+    int get_pending_exports() { return image_exporter.get_pending() + (int) pending_snapshots.size(); }
+    // Accepted calibration views are written for start_calibration_from_files.
+    void set_save_calibration_images(bool p_save) { save_calibration_images = p_save; }
+    bool get_save_calibration_images() { return save_calibration_images; }
+
+    // Time spent in every bring-up stage of the last connection.
+    Dictionary get_bring_up_timings();
+
+    // USB stream tuning, applied on the next connection. 0 keeps the
+    // payload size negotiated with the camera.
+    void set_usb_max_payload_transfer_size(int p_bytes) { usb_settings.max_payload_transfer_size = std::max(0, p_bytes); }
+    int get_usb_max_payload_transfer_size() { return usb_settings.max_payload_transfer_size; }
+    void set_usb_frame_buffers(int p_buffers) { usb_settings.frame_buffers = std::max(2, p_buffers); }
+    int get_usb_frame_buffers() { return usb_settings.frame_buffers; }
+    Dictionary get_usb_stats();
+    void reset_memory_peaks() { MemoryAccounting::reset_peaks(); }
+
+    void set_frame_pool_size(int p_size) { frame_pool.set_capacity(p_size); }
+    int get_frame_pool_size() { return frame_pool.get_capacity(); }
+    void set_frame_retention(int p_retention);
+    int get_frame_retention() { return frame_pool.get_retention(); }
+
+    // Flags requested from script, the modes below add what they need on top.
+    int requested_frame_retention = FramePool::RETAIN_NONE;
+    void update_frame_retention();
 
     cv::Mat leftMapX, leftMapY;
     cv::Mat rightMapX, rightMapY;
     cv::Mat mapX, mapY;
+    // Side by side maps of the depth path, undistorted and epipolar rectified
+    // with R1/P1 and R2/P2. The display maps above only undistort, so they do
+    // not line up the rows of both eyes and do not match Q.
+    cv::Mat rectifyMapX, rectifyMapY;
+    // Left eye map from the rectified frame of the depth back to the
+    // undistorted frame of the display (leftMapX/Y), so depth texels line up
+    // with the pixels on screen.
+    cv::Mat depthDisplayMapX, depthDisplayMapY;
+    cv::Mat Q;              // disparity to depth reprojection matrix from the calibration
+    MemoryReservation map_gpu_memory{MemoryAccounting::SUBSYSTEM_MAPS, MemoryAccounting::KIND_GPU};
 
     void enter_calibration_mode();
     bool is_in_calibration_mode(){ return in_calibration_mode; }
     void set_image_on_hold(bool value){ eyeData.set_image_on_hold(value); };
     bool is_image_on_hold(){ return eyeData.is_image_on_hold(); }
     bool take_picture();
+    std::future<StereoChessboard> chessboard_capture;
+    void poll_chessboard_capture();
+
+    ChessboardTracker chessboard_tracker;
+    void poll_chessboard_tracker();
+    void set_chessboard_tracking_rate(float p_rate_hz);
+    float get_chessboard_tracking_rate();
     int calibration_images_left();
-    bool recalibrate_camera();
-    bool recalibrate_camera_from_files();
+    bool start_calibration();
+    bool start_calibration_from_files();
+    bool is_calibrating();
+    Dictionary get_calibration_diagnostics() { return calibration_diagnostics; }
+
+    PoolIntArray get_calibration_view_ids();
+    bool remove_calibration_view(int id);
+    // Drops every stored view, the intrinsics stay for the warm start.
+    void new_calibration_dataset();
+    Ref<ImageTexture> get_calibration_view_thumbnail(int id, bool right);
     void exit_calibration_mode();
 
     void cancel_recalibration();
@@ -268,7 +584,23 @@ public:
     bool disparity_test_mode = false;
     bool save_debug_images = true;
     void set_disparity_test_mode(bool on);
-    PoolByteArray create_disparity_map(Ref<ImageTexture> p_image);
+    StereoDepth stereo_depth;
+    void set_disparity_preset(int p_preset);
+    int get_disparity_preset();
+    PoolByteArray create_disparity_map();
+    PoolByteArray disparity_to_rgb(const cv::Mat& disparity);
+    void update_depth_map(const cv::Mat& disparity);
+    // Left eye depth in the undistorted frame of the displayed image.
+    Ref<ImageTexture> get_depth_map();
+
+    DepthWorker depth_worker;
+    bool continuous_depth = false;
+    void set_continuous_depth(bool on);
+    bool is_continuous_depth() { return continuous_depth; }
+    void set_depth_change_threshold(int p_threshold);
+    int get_depth_change_threshold() { return depth_params.change_threshold; }
+    float get_depth_changed_fraction() { return depth_worker.get_last_changed_fraction(); }
+    StereoDepth::IncrementalParams depth_params;
     Ref<ImageTexture> get_disparity_map();
     void save_disparity_images();
 
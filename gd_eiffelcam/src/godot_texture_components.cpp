@@ -25,6 +25,8 @@
 #include "gd_eiffelcam.hpp"
 #include "OS.hpp"
 
+#include <algorithm>
+
 using namespace godot;
 
 void GodotTextureComponents::init(int frame_array_size){
@@ -36,6 +38,7 @@ void GodotTextureComponents::init(int frame_array_size){
     current_v_frame = Ref<ImageTexture>(ImageTexture::_new());
 
     current_disparity_map = Ref<ImageTexture>(ImageTexture::_new());
+    current_depth_map = Ref<ImageTexture>(ImageTexture::_new());
 
     rgb_frame_array = Ref<TextureArray>(TextureArray::_new());
     y_frame_array = Ref<TextureArray>(TextureArray::_new());
@@ -72,6 +75,29 @@ void GodotTextureComponents::init(int frame_array_size){
     current_u_frame->create_from_image(current_u_image, 0);
     current_v_frame->create_from_image(current_u_image, 0);
 
+    // Created once, later updates only upload the pixels.
+    Ref<Image> current_disparity_map_image = Ref<Image>(Image::_new());
+    current_disparity_map_image->create(WIDTH, HEIGHT, false, Image::FORMAT_RGB8);
+    current_disparity_map->create_from_image(current_disparity_map_image, Texture::FLAG_FILTER | Texture::FLAG_VIDEO_SURFACE);
+
+    // Half float depth in metres of the left eye, 0 where unknown. Not filtered,
+    // interpolating across an object edge would invent depths in between.
+    Ref<Image> current_depth_map_image = Ref<Image>(Image::_new());
+    current_depth_map_image->create(WIDTH, HEIGHT, false, Image::FORMAT_RH);
+    current_depth_map->create_from_image(current_depth_map_image, Texture::FLAG_VIDEO_SURFACE);
+    depth_map_data.resize(WIDTH * HEIGHT * 2);
+
+    texture_cpu_memory.set(depth_map_data.size());
+    texture_gpu_memory.set(
+        MemoryAccounting::texture_bytes(WIDTH * 2, HEIGHT, frame_array_size, 3) +      // rgb_frame_array
+        MemoryAccounting::texture_bytes(WIDTH * 2, HEIGHT, frame_array_size, 1) +      // y_frame_array
+        2 * MemoryAccounting::texture_bytes(WIDTH, HEIGHT, frame_array_size, 1) +      // u/v_frame_array
+        MemoryAccounting::texture_bytes(WIDTH * 2, HEIGHT, 1, 3) +                     // current_rgb_frame
+        MemoryAccounting::texture_bytes(WIDTH * 2, HEIGHT, 1, 1) +                     // current_y_frame
+        2 * MemoryAccounting::texture_bytes(WIDTH, HEIGHT, 1, 1) +                     // current_u/v_frame
+        MemoryAccounting::texture_bytes(WIDTH, HEIGHT, 1, 3) +                         // current_disparity_map
+        MemoryAccounting::texture_bytes(WIDTH, HEIGHT, 1, 2));                         // current_depth_map
+
     // Preparing for calibration:
 
     // Apply camera calibration operation for images in the given directory path.
@@ -82,10 +108,6 @@ void GodotTextureComponents::init(int frame_array_size){
         }
     }
 
-    object_points      = new std::vector<std::vector<cv::Point3f> >;
-    left_image_points  = new std::vector<std::vector<cv::Point2f> >;
-    right_image_points = new std::vector<std::vector<cv::Point2f> >;
-
     termination_criteria = cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::MAX_ITER, 30, 0.001);
 }
 
@@ -112,9 +134,19 @@ void GodotTextureComponents::update_rgb_frame_array(PoolByteArray& rgb_data){
 }
 
 void GodotTextureComponents::update_disparity_map(PoolByteArray& disparity_map_data){
-    Ref<Image> current_disparity_map_image = Ref<Image>(Image::_new());
-    current_disparity_map_image->create_from_data(WIDTH, HEIGHT, false, Image::FORMAT_RGB8, disparity_map_data);
-    current_disparity_map->create_from_image(current_disparity_map_image, Texture::FLAG_FILTER | Texture::FLAG_VIDEO_SURFACE);
+    current_disparity_map->update_from_data(disparity_map_data, 0);
+}
+
+void GodotTextureComponents::update_depth_map(const cv::Mat& depth){
+    CV_Assert(depth.type() == CV_32FC1 && depth.cols == WIDTH && depth.rows == HEIGHT);
+
+    {
+        PoolByteArray::Write wrt = depth_map_data.write();
+        cv::Mat depth_half(HEIGHT, WIDTH, CV_16FC1, wrt.ptr());
+        depth.convertTo(depth_half, CV_16F);
+    }
+
+    current_depth_map->update_from_data(depth_map_data, 0);
 }
 
 void GodotTextureComponents::update_current_frame_index() {
@@ -126,13 +158,9 @@ void GodotTextureComponents::update_current_frame_index() {
     current_frame_index = (current_frame_index + 1) % frame_array_size;
 }
 
-void GodotTextureComponents::init_calibration_buffer(){
-    calibration_images_left = calibration_images_required;
-    //image_number = 1;
-
-    object_points->clear();
-    left_image_points->clear();
-    right_image_points->clear();
+void GodotTextureComponents::set_calibration_views(const CalibrationViews& views){
+    calibration_views = views;
+    calibration_images_left = std::max(0, calibration_images_required - (int) views.object_points.size());
 }
 
 PoolByteArray GodotTextureComponents::convert_mat_to_pba(cv::Mat rgb_image) {
@@ -159,28 +187,11 @@ PoolByteArray GodotTextureComponents::draw_detected_chessboard(cv::Mat gray_imag
     return pba;
 }
 
-GodotTextureComponents::PictureTakenResult GodotTextureComponents::take_picture(){
-    if (calibration_images_left == 0) return READY_FOR_CALIBRATION;
-
-    // Crop the image using OpenCV:
-
-    Ref<Image> image = current_rgb_frame->get_data();
-    const uint8_t* image_data = image->get_data().read().ptr();
-    cv::Mat original_image = cv::Mat(HEIGHT, WIDTH * 2, CV_8UC3, (uint8_t*) image_data);
-    cv::Mat gray_image;
-    cv::cvtColor(original_image, gray_image, cv::COLOR_RGB2GRAY);
-
-    cv::Rect left_rect = cv::Rect(0, 0, WIDTH, HEIGHT);
-    left_gray_image = cv::Mat(gray_image, left_rect).clone();
-
-    cv::Rect right_rect = cv::Rect(WIDTH, 0, WIDTH, HEIGHT);
-    right_gray_image = cv::Mat(gray_image, right_rect).clone();
-
-    left_image_corner_points.clear();
-    right_image_corner_points.clear();
-
-    if (!cv::findChessboardCorners(left_gray_image, cv::Size_<int>(GRID_WIDTH, GRID_HEIGHT), left_image_corner_points)) return INVALID_PICTURE;
-    if (!cv::findChessboardCorners(right_gray_image, cv::Size_<int>(GRID_WIDTH, GRID_HEIGHT), right_image_corner_points)) return INVALID_PICTURE;
+void GodotTextureComponents::set_detected_chessboard(const StereoChessboard& chessboard){
+    left_gray_image = chessboard.left_gray;
+    right_gray_image = chessboard.right_gray;
+    left_image_corner_points = chessboard.left_corners;
+    right_image_corner_points = chessboard.right_corners;
 
     current_left_calibration_image = left_gray_image.clone();
     current_right_calibration_image = right_gray_image.clone();
@@ -196,17 +207,20 @@ GodotTextureComponents::PictureTakenResult GodotTextureComponents::take_picture(
     current_left_chessboard_image->create_from_image(left_chessboard_image, Texture::FLAG_FILTER | Texture::FLAG_VIDEO_SURFACE);
     current_right_chessboard_image->create_from_image(right_chessboard_image, Texture::FLAG_FILTER | Texture::FLAG_VIDEO_SURFACE);
 
-    return SUCCESS;
+    calibration_gpu_memory.set(2 * MemoryAccounting::texture_bytes(WIDTH, HEIGHT, 1, 3));
 }
 
 void GodotTextureComponents::accept_calibration_image() {
-    object_points->push_back(object_points_concat);
+    calibration_views.object_points.push_back(object_points_concat);
 
-    cv::cornerSubPix(left_gray_image, left_image_corner_points, cv::Size_<int>(11, 11), cv::Size_<int>(-1, -1), termination_criteria);
-    left_image_points->push_back(left_image_corner_points);
+    // Refine copies, the detected corners are kept for the calibration dataset.
+    std::vector<cv::Point2f> left_refined_corner_points = left_image_corner_points;
+    cv::cornerSubPix(left_gray_image, left_refined_corner_points, cv::Size_<int>(11, 11), cv::Size_<int>(-1, -1), termination_criteria);
+    calibration_views.left_image_points.push_back(left_refined_corner_points);
 
-    cv::cornerSubPix(right_gray_image, right_image_corner_points, cv::Size_<int>(11, 11), cv::Size_<int>(-1, -1), termination_criteria);
-    right_image_points->push_back(right_image_corner_points);
+    std::vector<cv::Point2f> right_refined_corner_points = right_image_corner_points;
+    cv::cornerSubPix(right_gray_image, right_refined_corner_points, cv::Size_<int>(11, 11), cv::Size_<int>(-1, -1), termination_criteria);
+    calibration_views.right_image_points.push_back(right_refined_corner_points);
 
     --calibration_images_left;
 }
\ No newline at end of file
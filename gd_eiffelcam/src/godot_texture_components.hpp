@@ -29,6 +29,10 @@
 
 #include <opencv2/core.hpp>
 
+#include "chessboard_detector.hpp"
+#include "memory_accounting.hpp"
+#include "stereo_calibration.hpp"
+
 #define GRID_HEIGHT 6
 #define GRID_WIDTH 9
 #define SQUARE_SIZE 24      // NOTE: The actual square width/height in mm on the chessboard you're using. Can vary between users though.
@@ -47,6 +51,8 @@ private:
     Ref<ImageTexture> current_u_frame;
     Ref<ImageTexture> current_v_frame;
     Ref<ImageTexture> current_disparity_map;
+    Ref<ImageTexture> current_depth_map;
+    PoolByteArray depth_map_data;
 
     Ref<TextureArray> rgb_frame_array;
     Ref<TextureArray> y_frame_array;
@@ -82,11 +88,13 @@ private:
     std::vector<cv::Point2f> left_image_corner_points;
     std::vector<cv::Point2f> right_image_corner_points;
     std::vector<cv::Point3f> object_points_concat;               // Create real world coords. Use your metric.
-    std::vector<std::vector<cv::Point3f> >* object_points;       // 3d point in real world space.
-    std::vector<std::vector<cv::Point2f> >* left_image_points;   // 2d points in image plane.
-    std::vector<std::vector<cv::Point2f> >* right_image_points;  // 2d points in image plane.
+    CalibrationViews calibration_views;                          // accepted pictures, 3d board points and 2d corners
     cv::TermCriteria termination_criteria;
 
+    MemoryReservation texture_cpu_memory{MemoryAccounting::SUBSYSTEM_TEXTURES, MemoryAccounting::KIND_CPU};
+    MemoryReservation texture_gpu_memory{MemoryAccounting::SUBSYSTEM_TEXTURES, MemoryAccounting::KIND_GPU};
+    MemoryReservation calibration_gpu_memory{MemoryAccounting::SUBSYSTEM_CALIBRATION, MemoryAccounting::KIND_GPU};
+
     /*
     // For debugging only, comment them if you don't need them:
     
@@ -98,17 +106,12 @@ private:
 
 public:
 
-    enum PictureTakenResult{
-        SUCCESS = 1,
-        INVALID_PICTURE = 2,
-        READY_FOR_CALIBRATION = 3
-    };
-
     void init(int frame_array_size);
 
     void update_yuv_frame_array(const PoolByteArray& yuv_data);
     void update_rgb_frame_array(PoolByteArray& rgb_data);
     void update_disparity_map(PoolByteArray& disparity_map_data);
+    void update_depth_map(const cv::Mat& depth);
 
     void accept_calibration_image();
 
@@ -128,32 +131,30 @@ public:
     Ref<ImageTexture>& get_map_x_texture(){ return map_x_texture; }
     Ref<ImageTexture>& get_map_y_texture(){ return map_y_texture; }
     Ref<ImageTexture> get_current_disparity_map(){ return current_disparity_map; }
+    Ref<ImageTexture> get_current_depth_map(){ return current_depth_map; }
     Ref<ImageTexture> get_current_left_chessboard_image(){ return current_left_chessboard_image; }
     Ref<ImageTexture> get_current_right_chessboard_image(){ return current_right_chessboard_image; }
     cv::Mat get_current_left_calibration_image(){ return current_left_calibration_image; }
     cv::Mat get_current_right_calibration_image(){ return current_right_calibration_image; }
+    const std::vector<cv::Point2f>& get_current_left_corner_points(){ return left_image_corner_points; }
+    const std::vector<cv::Point2f>& get_current_right_corner_points(){ return right_image_corner_points; }
     int get_frame_diff(){ return frame_diff; }
     void set_frame_diff(int p_frame_diff) { frame_diff = p_frame_diff; }
     int get_default_frame_diff() { return default_frame_diff; }
 
-    void init_calibration_buffer();
-    PictureTakenResult take_picture();
+    // Continues from the stored views, the pictures left count them as taken.
+    void set_calibration_views(const CalibrationViews& views);
+    // Keeps a detected board for accept_calibration_image and draws the preview textures.
+    void set_detected_chessboard(const StereoChessboard& chessboard);
 
     int get_calibration_images_required(){ return calibration_images_required; }
     int get_calibration_images_left(){ return calibration_images_left; }
     void set_image_on_hold(bool value){ image_on_hold = value; }
     bool is_image_on_hold() { return image_on_hold; }
-    std::vector<std::vector<cv::Point3f> >* get_object_points(){ return object_points; }
-    std::vector<std::vector<cv::Point2f> >* get_left_image_points(){ return left_image_points; }
-    std::vector<std::vector<cv::Point2f> >* get_right_image_points(){ return right_image_points; }
+    const CalibrationViews& get_calibration_views(){ return calibration_views; }
     cv::TermCriteria get_termination_criteria(){ return termination_criteria; }
 
     GodotTextureComponents(){};
-    ~GodotTextureComponents(){
-        delete object_points;
-        delete left_image_points;
-        delete right_image_points;
-    };
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,204 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "image_exporter.hpp"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <fstream>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "tracing.h"
+
+using namespace godot;
+
+// Nice value of the workers, below the render, decode and USB threads.
+static const int EXPORT_THREAD_NICE = 10;
+
+static std::string write_file(const std::string& path, const uint8_t* data, size_t size) {
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char*) data, size);
+    return out ? "" : "unable to write " + path;
+}
+
+ImageExporter::~ImageExporter() {
+    // Queued images are still written, a snapshot taken right before quitting is kept.
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    condition.notify_all();
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void ImageExporter::init(MetricsRegistry& metrics) {
+    exports = metrics.counter("exports");
+    export_errors = metrics.counter("export_errors");
+    export_ms = metrics.histogram("export_ms", MetricsRegistry::latency_buckets_ms());
+}
+
+int ImageExporter::reserve_id() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return next_id++;
+}
+
+int ImageExporter::export_image(const std::string& path, const cv::Mat& image, bool rgb, int format, int id) {
+    Job job;
+    job.id = id;
+    job.path = path;
+    job.format = format;
+    job.image = image;
+    job.rgb = rgb;
+    return submit(std::move(job));
+}
+
+int ImageExporter::export_jpeg(const std::string& path, std::shared_ptr<const RetainedFrame> frame, int format, int id) {
+    Job job;
+    job.id = id;
+    job.path = path;
+    job.format = format;
+    job.frame = std::move(frame);
+    return submit(std::move(job));
+}
+
+int ImageExporter::submit(Job job) {
+    job.quality = job.format == FORMAT_PNG ? png_compression : jpeg_quality;
+
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (job.id == 0) {
+            job.id = next_id++;
+        }
+        id = job.id;
+        jobs.push_back(std::move(job));
+        ++pending;
+
+        if (threads.empty()) {
+            for (int i = 0; i < THREAD_COUNT; ++i) {
+                threads.emplace_back(&ImageExporter::run, this);
+            }
+        }
+    }
+    condition.notify_one();
+
+    return id;
+}
+
+std::vector<ImageExporter::Result> ImageExporter::take_results() {
+    std::vector<Result> taken;
+    std::lock_guard<std::mutex> lock(mutex);
+    taken.swap(results);
+    return taken;
+}
+
+void ImageExporter::run() {
+#ifdef __linux__
+    // Per thread on Linux and Android
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), EXPORT_THREAD_NICE);
+#endif
+
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]() { return quit || !jobs.empty(); });
+            if (quit && jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        Result result;
+        result.id = job.id;
+        result.path = job.path;
+        {
+            TRACE_EVENT("image_exporter", "export");
+            MetricTimer timer(export_ms);
+            result.error = write(job);
+        }
+        exports->add();
+        if (!result.error.empty()) export_errors->add();
+
+        // Lets go of the pixels before the result is reported
+        job = Job();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        results.push_back(std::move(result));
+        --pending;
+    }
+}
+
+std::string ImageExporter::write(const Job& job) {
+    cv::Mat image;
+
+    if (job.frame != nullptr) {
+        const std::vector<uint8_t>& jpeg = job.frame->jpeg;
+        if (jpeg.empty()) {
+            return "no JPEG payload was retained";
+        }
+
+        // Nothing was applied to the camera image, so its own encoding is kept
+        if (job.format == FORMAT_JPEG) {
+            return write_file(job.path, jpeg.data(), jpeg.size());
+        }
+
+        image = cv::imdecode(cv::Mat(1, (int) jpeg.size(), CV_8UC1, (void*) jpeg.data()), cv::IMREAD_COLOR);
+        if (image.empty()) {
+            return "unable to decode the JPEG payload";
+        }
+    } else if (job.rgb && job.image.channels() == 3) {
+        cv::cvtColor(job.image, image, cv::COLOR_RGB2BGR);
+    } else {
+        image = job.image;
+    }
+
+    std::vector<int> params;
+    if (job.format == FORMAT_PNG) {
+        params = { cv::IMWRITE_PNG_COMPRESSION, job.quality };
+    } else {
+        params = { cv::IMWRITE_JPEG_QUALITY, job.quality };
+    }
+
+    // Encoded in memory, so the format does not depend on the file extension
+    std::vector<uint8_t> encoded;
+    try {
+        if (!cv::imencode(job.format == FORMAT_PNG ? ".png" : ".jpg", image, encoded, params)) {
+            return "unable to encode " + job.path;
+        }
+    } catch (const cv::Exception& e) {
+        return e.what();
+    }
+
+    return write_file(job.path, encoded.data(), encoded.size());
+}
@@ -0,0 +1,122 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_pool.hpp"
+#include "metrics.hpp"
+
+namespace godot {
+
+// Writes images to disk on low priority worker threads, so encoding a PNG
+// never competes with the decoders or stalls the main thread. Images are
+// passed as cv::Mat headers or retained frames, both reference counted, so
+// queueing an export copies no pixels. The FramePool detaches buffers that
+// are still referenced before the decoder reuses them.
+//
+// Results are collected on the main thread with take_results.
+class ImageExporter {
+public:
+    enum FORMAT {
+        FORMAT_PNG,
+        FORMAT_JPEG
+    };
+
+    struct Result {
+        int id = 0;
+        std::string path;
+        std::string error;      // empty on success
+    };
+
+    ~ImageExporter();
+
+    void init(MetricsRegistry& metrics);
+
+    // zlib level of PNGs, the default favours speed over size.
+    void set_png_compression(int p_level) { png_compression = std::max(0, std::min(p_level, 9)); }
+    int get_png_compression() { return png_compression; }
+    void set_jpeg_quality(int p_quality) { jpeg_quality = std::max(1, std::min(p_quality, 100)); }
+    int get_jpeg_quality() { return jpeg_quality; }
+
+    // Id for an export that is queued later, for callers that report the id
+    // before the image exists.
+    int reserve_id();
+
+    // An 8 bit grey or three channel image, rgb tells the channel order.
+    // Buffers that their owner overwrites in place have to be cloned first.
+    // Returns the id of the result, id 0 takes a new one.
+    int export_image(const std::string& path, const cv::Mat& image, bool rgb, int format, int id = 0);
+
+    // The MJPEG payload of a frame retained with RETAIN_JPEG. Written as is
+    // for FORMAT_JPEG, decoded on the worker for FORMAT_PNG.
+    int export_jpeg(const std::string& path, std::shared_ptr<const RetainedFrame> frame, int format, int id = 0);
+
+    std::vector<Result> take_results();
+    int get_pending() { std::lock_guard<std::mutex> lock(mutex); return pending; }
+
+private:
+    static const int THREAD_COUNT = 2;
+
+    struct Job {
+        int id = 0;
+        std::string path;
+        int format;
+        int quality = 0;        // PNG compression or JPEG quality when queued
+        cv::Mat image;
+        bool rgb = false;
+        std::shared_ptr<const RetainedFrame> frame;
+    };
+
+    int submit(Job job);
+    void run();
+    std::string write(const Job& job);
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<Job> jobs;
+    std::vector<Result> results;
+    std::vector<std::thread> threads;      // started with the first export
+    int pending = 0;
+    int next_id = 1;
+    bool quit = false;
+
+    int png_compression = 1;
+    int jpeg_quality = 95;
+
+    MetricCounter* exports = nullptr;
+    MetricCounter* export_errors = nullptr;
+    MetricHistogram* export_ms = nullptr;
+};
+
+}
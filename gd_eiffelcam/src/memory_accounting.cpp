@@ -0,0 +1,152 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "memory_accounting.hpp"
+
+using namespace godot;
+
+std::atomic<int64_t> MemoryAccounting::current[SUBSYSTEM_COUNT][KIND_COUNT];
+std::atomic<int64_t> MemoryAccounting::peak[SUBSYSTEM_COUNT][KIND_COUNT];
+std::atomic<int64_t> MemoryAccounting::total_current[KIND_COUNT];
+std::atomic<int64_t> MemoryAccounting::total_peak[KIND_COUNT];
+
+static thread_local MemoryAccounting::SUBSYSTEM thread_subsystem = MemoryAccounting::SUBSYSTEM_OTHER;
+
+static void update_peak(std::atomic<int64_t>& peak, int64_t value) {
+    int64_t previous = peak.load(std::memory_order_relaxed);
+    while (previous < value && !peak.compare_exchange_weak(previous, value, std::memory_order_relaxed)) {
+    }
+}
+
+// cv::Mat allocator that counts the bytes it hands out. Mirrors OpenCV's
+// standard allocator, the subsystem is kept in UMatData::userdata so the
+// release is charged to the subsystem that allocated.
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step, cv::AccessFlag /*flags*/, cv::UMatUsageFlags /*usageFlags*/) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; i--) {
+            if (step) {
+                if (data0 && step[i] != CV_AUTOSTEP) {
+                    total = step[i];
+                } else {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+
+        uchar* data = data0 ? (uchar*) data0 : (uchar*) cv::fastMalloc(total);
+        cv::UMatData* u = new cv::UMatData(this);
+        u->data = u->origdata = data;
+        u->size = total;
+        if (data0) {
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+        } else {
+            MemoryAccounting::SUBSYSTEM subsystem = MemoryAccounting::get_thread_subsystem();
+            u->userdata = (void*) (intptr_t) subsystem;
+            MemoryAccounting::add(subsystem, MemoryAccounting::KIND_OPENCV, total);
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag /*accessFlags*/, cv::UMatUsageFlags /*usageFlags*/) const override {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData* u) const override {
+        if (u == nullptr) return;
+
+        CV_Assert(u->urefcount == 0);
+        CV_Assert(u->refcount == 0);
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+            MemoryAccounting::add((MemoryAccounting::SUBSYSTEM) (intptr_t) u->userdata, MemoryAccounting::KIND_OPENCV, -(int64_t) u->size);
+            cv::fastFree(u->origdata);
+            u->origdata = 0;
+        }
+        delete u;
+    }
+};
+
+const char* MemoryAccounting::get_subsystem_name(int subsystem) {
+    static const char* names[SUBSYSTEM_COUNT] = { "other", "decode", "textures", "maps", "frame_pool", "depth", "calibration", "usb" };
+    return names[subsystem];
+}
+
+const char* MemoryAccounting::get_kind_name(int kind) {
+    static const char* names[KIND_COUNT] = { "cpu", "opencv", "gpu" };
+    return names[kind];
+}
+
+void MemoryAccounting::add(SUBSYSTEM subsystem, KIND kind, int64_t bytes) {
+    int64_t value = current[subsystem][kind].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    update_peak(peak[subsystem][kind], value);
+
+    int64_t total = total_current[kind].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    update_peak(total_peak[kind], total);
+}
+
+void MemoryAccounting::set(SUBSYSTEM subsystem, KIND kind, int64_t bytes) {
+    int64_t previous = current[subsystem][kind].exchange(bytes, std::memory_order_relaxed);
+    update_peak(peak[subsystem][kind], bytes);
+
+    int64_t total = total_current[kind].fetch_add(bytes - previous, std::memory_order_relaxed) + bytes - previous;
+    update_peak(total_peak[kind], total);
+}
+
+MemoryAccounting::Usage MemoryAccounting::get_usage(int subsystem, int kind) {
+    Usage usage;
+    usage.current = current[subsystem][kind].load(std::memory_order_relaxed);
+    usage.peak = peak[subsystem][kind].load(std::memory_order_relaxed);
+    return usage;
+}
+
+MemoryAccounting::Usage MemoryAccounting::get_total(int kind) {
+    Usage usage;
+    usage.current = total_current[kind].load(std::memory_order_relaxed);
+    usage.peak = total_peak[kind].load(std::memory_order_relaxed);
+    return usage;
+}
+
+void MemoryAccounting::reset_peaks() {
+    for (int kind = 0; kind < KIND_COUNT; ++kind) {
+        for (int subsystem = 0; subsystem < SUBSYSTEM_COUNT; ++subsystem) {
+            peak[subsystem][kind].store(current[subsystem][kind].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        total_peak[kind].store(total_current[kind].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+}
+
+void MemoryAccounting::install_opencv_allocator() {
+    // Never destroyed, Mats released during static destruction still need it.
+    static CountingMatAllocator* allocator = new CountingMatAllocator();
+    cv::Mat::setDefaultAllocator(allocator);
+}
+
+MemoryAccounting::SUBSYSTEM MemoryAccounting::get_thread_subsystem() {
+    return thread_subsystem;
+}
+
+void MemoryAccounting::set_thread_subsystem(SUBSYSTEM subsystem) {
+    thread_subsystem = subsystem;
+}
@@ -0,0 +1,131 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <cstdint>
+
+namespace godot {
+
+// Byte counts of the big buffers of the pipeline, per subsystem, with high
+// water marks. CPU buffers and GPU textures are reported by their owners,
+// OpenCV allocations are counted by an allocator hook and attributed to the
+// subsystem of the MemoryScope active on the allocating thread.
+//
+// GPU sizes are estimates from the texture formats, drivers may pad RGB8 to
+// four bytes per pixel.
+class MemoryAccounting {
+public:
+    enum SUBSYSTEM {
+        SUBSYSTEM_OTHER,
+        SUBSYSTEM_DECODE,
+        SUBSYSTEM_TEXTURES,
+        SUBSYSTEM_MAPS,
+        SUBSYSTEM_FRAME_POOL,
+        SUBSYSTEM_DEPTH,
+        SUBSYSTEM_CALIBRATION,
+        SUBSYSTEM_USB,
+        SUBSYSTEM_COUNT
+    };
+
+    enum KIND {
+        KIND_CPU,
+        KIND_OPENCV,
+        KIND_GPU,
+        KIND_COUNT
+    };
+
+    struct Usage {
+        int64_t current = 0;
+        int64_t peak = 0;
+    };
+
+    static const char* get_subsystem_name(int subsystem);
+    static const char* get_kind_name(int kind);
+
+    static void add(SUBSYSTEM subsystem, KIND kind, int64_t bytes);
+    // For owners of all bytes of a subsystem and kind. Buffers that exist once
+    // per camera use a MemoryReservation instead.
+    static void set(SUBSYSTEM subsystem, KIND kind, int64_t bytes);
+
+    static Usage get_usage(int subsystem, int kind);
+    static Usage get_total(int kind);
+    static void reset_peaks();
+
+    static int64_t texture_bytes(int width, int height, int layers, int bytes_per_pixel) {
+        return (int64_t) width * height * layers * bytes_per_pixel;
+    }
+
+    // Makes the counting allocator the default of cv::Mat. Has to be called
+    // before the first tracked allocation, Mats allocated earlier are simply
+    // not counted.
+    static void install_opencv_allocator();
+
+    static SUBSYSTEM get_thread_subsystem();
+    static void set_thread_subsystem(SUBSYSTEM subsystem);
+
+private:
+    static std::atomic<int64_t> current[SUBSYSTEM_COUNT][KIND_COUNT];
+    static std::atomic<int64_t> peak[SUBSYSTEM_COUNT][KIND_COUNT];
+    static std::atomic<int64_t> total_current[KIND_COUNT];
+    static std::atomic<int64_t> total_peak[KIND_COUNT];
+};
+
+// Bytes of one owner of a subsystem and kind. Several cameras own buffers of
+// the same subsystems, each reports its own part and the totals add up.
+class MemoryReservation {
+public:
+    MemoryReservation(MemoryAccounting::SUBSYSTEM p_subsystem, MemoryAccounting::KIND p_kind) : subsystem(p_subsystem), kind(p_kind) {}
+    ~MemoryReservation() { set(0); }
+
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    void set(int64_t p_bytes) {
+        MemoryAccounting::add(subsystem, kind, p_bytes - bytes);
+        bytes = p_bytes;
+    }
+
+private:
+    MemoryAccounting::SUBSYSTEM subsystem;
+    MemoryAccounting::KIND kind;
+    int64_t bytes = 0;
+};
+
+// Attributes the OpenCV allocations of the current thread to a subsystem
+// while it is alive.
+class MemoryScope {
+public:
+    explicit MemoryScope(MemoryAccounting::SUBSYSTEM subsystem) : previous(MemoryAccounting::get_thread_subsystem()) {
+        MemoryAccounting::set_thread_subsystem(subsystem);
+    }
+    ~MemoryScope() { MemoryAccounting::set_thread_subsystem(previous); }
+
+private:
+    MemoryAccounting::SUBSYSTEM previous;
+};
+
+}
@@ -0,0 +1,163 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "metrics.hpp"
+
+#include <algorithm>
+
+using namespace godot;
+
+static void atomic_add(std::atomic<double>& target, double value) {
+    double current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {
+    }
+}
+
+static void atomic_max(std::atomic<double>& target, double value) {
+    double current = target.load(std::memory_order_relaxed);
+    while (current < value && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+double MetricHistogram::Snapshot::percentile(double p) const {
+    if (count == 0) return 0.0;
+
+    double rank = p * count;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] == 0 || seen + counts[i] < rank) {
+            seen += counts[i];
+            continue;
+        }
+
+        // The overflow bucket has no upper bound, the maximum stands in for it.
+        double lower = i == 0 ? 0.0 : bounds[i - 1];
+        double upper = i < bounds.size() ? std::min(bounds[i], max) : max;
+        return lower + (upper - lower) * (rank - seen) / counts[i];
+    }
+    return max;
+}
+
+MetricHistogram::MetricHistogram(const std::vector<double>& p_bounds) :
+    bounds(p_bounds),
+    counts(new std::atomic<uint64_t>[p_bounds.size() + 1]) {
+    for (size_t i = 0; i <= bounds.size(); ++i) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void MetricHistogram::record(double value) {
+    size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+    counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    atomic_add(sum, value);
+    atomic_max(max, value);
+}
+
+MetricHistogram::Snapshot MetricHistogram::snapshot() const {
+    Snapshot snapshot;
+    snapshot.bounds = bounds;
+    snapshot.counts.resize(bounds.size() + 1);
+    for (size_t i = 0; i <= bounds.size(); ++i) {
+        snapshot.counts[i] = counts[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.counts[i];
+    }
+    snapshot.sum = sum.load(std::memory_order_relaxed);
+    snapshot.max = max.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void MetricHistogram::reset() {
+    for (size_t i = 0; i <= bounds.size(); ++i) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0.0, std::memory_order_relaxed);
+    max.store(0.0, std::memory_order_relaxed);
+}
+
+std::vector<double> MetricsRegistry::latency_buckets_ms() {
+    return { 0.25, 0.5, 1, 2, 4, 6, 8, 11, 16, 22, 33, 50, 66, 100, 200 };
+}
+
+std::vector<double> MetricsRegistry::size_buckets_kb() {
+    return { 16, 32, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+}
+
+MetricCounter* MetricsRegistry::counter(const std::string& name) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::unique_ptr<MetricCounter>& instrument = counters[name];
+    if (instrument == nullptr) instrument = std::make_unique<MetricCounter>();
+    return instrument.get();
+}
+
+MetricGauge* MetricsRegistry::gauge(const std::string& name) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::unique_ptr<MetricGauge>& instrument = gauges[name];
+    if (instrument == nullptr) instrument = std::make_unique<MetricGauge>();
+    return instrument.get();
+}
+
+MetricHistogram* MetricsRegistry::histogram(const std::string& name, const std::vector<double>& bounds) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::unique_ptr<MetricHistogram>& instrument = histograms[name];
+    if (instrument == nullptr) instrument = std::make_unique<MetricHistogram>(bounds);
+    return instrument.get();
+}
+
+std::map<std::string, uint64_t> MetricsRegistry::get_counters() {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::map<std::string, uint64_t> values;
+    for (const auto& entry : counters) {
+        values[entry.first] = entry.second->get();
+    }
+    return values;
+}
+
+std::map<std::string, double> MetricsRegistry::get_gauges() {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::map<std::string, double> values;
+    for (const auto& entry : gauges) {
+        values[entry.first] = entry.second->get();
+    }
+    return values;
+}
+
+std::map<std::string, MetricHistogram::Snapshot> MetricsRegistry::get_histograms() {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::map<std::string, MetricHistogram::Snapshot> values;
+    for (const auto& entry : histograms) {
+        values[entry.first] = entry.second->snapshot();
+    }
+    return values;
+}
+
+void MetricsRegistry::reset() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto& entry : counters) {
+        entry.second->reset();
+    }
+    for (auto& entry : histograms) {
+        entry.second->reset();
+    }
+}
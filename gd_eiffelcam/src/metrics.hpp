@@ -0,0 +1,131 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace godot {
+
+// Monotonic event count.
+class MetricCounter {
+public:
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+    void reset() { value.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Last reported value of something that goes up and down.
+class MetricGauge {
+public:
+    void set(double p_value) { value.store(p_value, std::memory_order_relaxed); }
+    double get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value{0.0};
+};
+
+// Fixed bucket histogram. bounds are the inclusive upper bounds of the buckets
+// in ascending order, one extra bucket collects everything above the last one.
+// Percentiles are interpolated inside the bucket they fall into.
+class MetricHistogram {
+public:
+    struct Snapshot {
+        std::vector<double> bounds;
+        std::vector<uint64_t> counts;
+        uint64_t count = 0;
+        double sum = 0.0;
+        double max = 0.0;
+
+        double mean() const { return count > 0 ? sum / count : 0.0; }
+        double percentile(double p) const;
+    };
+
+    explicit MetricHistogram(const std::vector<double>& p_bounds);
+
+    void record(double value);
+    Snapshot snapshot() const;
+    void reset();
+
+private:
+    std::vector<double> bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> count{0};
+    std::atomic<double> sum{0.0};
+    std::atomic<double> max{0.0};
+};
+
+// Records the lifetime of the timer in milliseconds.
+class MetricTimer {
+public:
+    explicit MetricTimer(MetricHistogram* p_histogram) : histogram(p_histogram), start(std::chrono::steady_clock::now()) {}
+    ~MetricTimer() {
+        if (histogram != nullptr) {
+            histogram->record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+private:
+    MetricHistogram* histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Named instruments, updated lock-free from the camera and worker threads and
+// read from the main thread. Only registration and enumeration take the lock,
+// so hot paths should look their instruments up once and keep the pointers,
+// which stay valid for the lifetime of the registry.
+class MetricsRegistry {
+public:
+    static std::vector<double> latency_buckets_ms();
+    static std::vector<double> size_buckets_kb();
+
+    // Returns the existing instrument if the name is already registered.
+    MetricCounter* counter(const std::string& name);
+    MetricGauge* gauge(const std::string& name);
+    MetricHistogram* histogram(const std::string& name, const std::vector<double>& bounds);
+
+    std::map<std::string, uint64_t> get_counters();
+    std::map<std::string, double> get_gauges();
+    std::map<std::string, MetricHistogram::Snapshot> get_histograms();
+
+    // Clears counters and histograms, gauges keep their last value.
+    void reset();
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<MetricCounter> > counters;
+    std::map<std::string, std::unique_ptr<MetricGauge> > gauges;
+    std::map<std::string, std::unique_ptr<MetricHistogram> > histograms;
+};
+
+}
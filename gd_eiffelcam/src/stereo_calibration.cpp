@@ -0,0 +1,129 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "stereo_calibration.hpp"
+
+#include "opencv2/calib3d.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+
+using namespace godot;
+
+namespace {
+
+enum DetectionStatus {
+    DETECTION_OK,
+    DETECTION_MISSING_IMAGE,
+    DETECTION_NO_BOARD,
+    DETECTION_CANCELLED
+};
+
+struct DetectionSlot {
+    DetectionStatus status = DETECTION_OK;
+    std::vector<cv::Point2f> left_corners;
+    std::vector<cv::Point2f> right_corners;
+};
+
+}
+
+std::vector<cv::Point3f> StereoCalibration::board_object_points(cv::Size pattern_size, float square_size) {
+    std::vector<cv::Point3f> points;
+    points.reserve(pattern_size.area());
+
+    for (int i = 0; i < pattern_size.height; i++) {
+        for (int j = 0; j < pattern_size.width; j++) {
+            points.push_back(cv::Point3f(j * square_size, i * square_size, 0.0));
+        }
+    }
+
+    return points;
+}
+
+bool StereoCalibration::detect_from_files(
+    const std::string& folder,
+    int image_count,
+    cv::Size pattern_size,
+    float square_size,
+    cv::TermCriteria criteria,
+    CalibrationViews& r_views,
+    std::string& r_error,
+    const std::atomic<bool>* cancel) {
+
+    std::vector<DetectionSlot> slots(image_count);
+
+    cv::parallel_for_(cv::Range(0, image_count), [&](const cv::Range& range) {
+        for (int index = range.start; index < range.end; ++index) {
+            DetectionSlot& slot = slots[index];
+
+            if (cancel != nullptr && *cancel) {
+                slot.status = DETECTION_CANCELLED;
+                continue;
+            }
+
+            // Gray directly from the decoder, the colour image is never needed.
+            cv::Mat gray_image = cv::imread(folder + "full_image_" + std::to_string(index + 1) + ".png", cv::IMREAD_GRAYSCALE);
+            if (gray_image.empty()) {
+                slot.status = DETECTION_MISSING_IMAGE;
+                continue;
+            }
+
+            int eye_width = gray_image.cols / 2;
+            cv::Mat left_gray_image = gray_image(cv::Rect(0, 0, eye_width, gray_image.rows));
+            cv::Mat right_gray_image = gray_image(cv::Rect(eye_width, 0, eye_width, gray_image.rows));
+
+            if (!cv::findChessboardCorners(left_gray_image, pattern_size, slot.left_corners) ||
+                !cv::findChessboardCorners(right_gray_image, pattern_size, slot.right_corners)) {
+                slot.status = DETECTION_NO_BOARD;
+                continue;
+            }
+
+            cv::cornerSubPix(left_gray_image, slot.left_corners, cv::Size(11, 11), cv::Size(-1, -1), criteria);
+            cv::cornerSubPix(right_gray_image, slot.right_corners, cv::Size(11, 11), cv::Size(-1, -1), criteria);
+        }
+    });
+
+    std::vector<cv::Point3f> object_points = board_object_points(pattern_size, square_size);
+
+    for (int index = 0; index < image_count; ++index) {
+        DetectionSlot& slot = slots[index];
+
+        if (slot.status == DETECTION_CANCELLED) {
+            r_error = "Calibration cancelled.";
+            return false;
+        }
+        if (slot.status == DETECTION_MISSING_IMAGE) {
+            r_error = "NOT ENOUGH IMAGES FOR CALIBRATION (full_image_" + std::to_string(index + 1) + ".png is missing).";
+            return false;
+        }
+        if (slot.status == DETECTION_NO_BOARD) {
+            r_error = "INVALID CALIBRATION IMAGE FOUND (full_image_" + std::to_string(index + 1) + ".png).";
+            return false;
+        }
+
+        r_views.object_points.push_back(object_points);
+        r_views.left_image_points.push_back(std::move(slot.left_corners));
+        r_views.right_image_points.push_back(std::move(slot.right_corners));
+    }
+
+    return true;
+}
@@ -0,0 +1,65 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace godot {
+
+// Chessboard views of both eyes, one entry per accepted stereo picture.
+struct CalibrationViews {
+    std::vector<std::vector<cv::Point3f> > object_points;
+    std::vector<std::vector<cv::Point2f> > left_image_points;
+    std::vector<std::vector<cv::Point2f> > right_image_points;
+};
+
+// Batch steps of the stereo calibration. Knows nothing about Godot.
+//
+// The per image work runs on OpenCV's thread pool, every image writes only
+// its own slot and the slots are collected in image order, so the result
+// does not depend on the number of threads.
+class StereoCalibration {
+public:
+    static std::vector<cv::Point3f> board_object_points(cv::Size pattern_size, float square_size);
+
+    // Loads <folder>full_image_<n>.png for n = 1..image_count (side by side
+    // stereo pictures) and detects the board in both halves. On failure
+    // r_error names the first bad image. Images not started yet are skipped
+    // once cancel is set, the result is false then.
+    static bool detect_from_files(
+        const std::string& folder,
+        int image_count,
+        cv::Size pattern_size,
+        float square_size,
+        cv::TermCriteria criteria,
+        CalibrationViews& r_views,
+        std::string& r_error,
+        const std::atomic<bool>* cancel = nullptr);
+};
+
+}
@@ -0,0 +1,485 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "stereo_depth.hpp"
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/ximgproc.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace godot;
+
+StereoDepth::Params StereoDepth::get_preset_params(int preset) {
+    switch (preset) {
+        case PRESET_QUALITY:
+            // 640x480 SGBM, refined at 1280x960
+            return Params { 1, 0, false, 5, 2, 7 };
+        case PRESET_SPEED:
+            // 320x240 block matching, refined at 640x480
+            return Params { 2, 1, true, 11, 1, 5 };
+        case PRESET_FULL:
+        default:
+            return Params { 0, 0, false, 3, 0, 0 };
+    }
+}
+
+void StereoDepth::set_preset(int p_preset) {
+    p_preset = std::max((int) PRESET_FULL, std::min(p_preset, (int) PRESET_SPEED));
+    if (p_preset == preset) return;
+
+    preset = p_preset;
+
+    // The coarse search range depends on the level, so recreate lazily.
+    sbm.release();
+    coarse_sgbm.release();
+
+    reset_incremental();
+}
+
+cv::Mat StereoDepth::compute(const cv::Mat& left_gray, const cv::Mat& right_gray) {
+    CV_Assert(left_gray.type() == CV_8UC1 && right_gray.type() == CV_8UC1);
+    CV_Assert(left_gray.size() == right_gray.size());
+
+    if (preset == PRESET_FULL) {
+        return compute_full(left_gray, right_gray);
+    }
+
+    return compute_pyramid(left_gray, right_gray, get_preset_params(preset));
+}
+
+cv::Mat StereoDepth::compute_full(const cv::Mat& left_frame_gray, const cv::Mat& right_frame_gray) {
+    //Porting historic/research/vendor/calibration/stereo_depth.py to C++:
+
+    int minDisparity = -1;
+    int numDisparities = FULL_NUM_DISPARITIES;
+    int window_size = 3;                // wsize default 3; 5; 7 for SGBM reduced size image; 15 for SGBM full size image (1300px and above); 5 Works nicely
+    int blockSize = window_size;
+    int P1 = 8 * 3 * window_size;
+    int P2 = 32 * 3 * window_size;
+    int disp12MaxDiff = 12;
+    int uniquenessRatio = 10;
+    int speckleWindowSize = 50;
+    int speckleRange = 32;
+    int preFilterCap = 63;
+    int mode = cv::StereoSGBM::MODE_SGBM_3WAY;
+
+    cv::Ptr<cv::StereoSGBM> left_matcher = cv::StereoSGBM::create(
+        minDisparity,
+        numDisparities,
+        blockSize,
+        P1,
+        P2,
+        disp12MaxDiff,
+        uniquenessRatio,
+        speckleWindowSize,
+        speckleRange,
+        preFilterCap,
+        mode
+    );
+
+    cv::Ptr<cv::StereoSGBM> right_matcher = cv::ximgproc::createRightMatcher(left_matcher).dynamicCast<cv::StereoSGBM>();
+    // FILTER Parameters
+    int lambda = 80000;
+    float sigma = 1.3;
+
+    cv::Ptr<cv::ximgproc::DisparityWLSFilter> wls_filter = cv::ximgproc::createDisparityWLSFilter(left_matcher);
+    wls_filter->setLambda(lambda);
+    wls_filter->setSigmaColor(sigma);
+
+    left_matcher->compute(left_frame_gray, right_frame_gray, last_left_disparity);
+    right_matcher->compute(right_frame_gray, left_frame_gray, last_right_disparity);
+
+    last_left_disparity.convertTo(last_left_disparity, CV_16SC1);
+    last_right_disparity.convertTo(last_right_disparity, CV_16SC1);
+
+    cv::Mat filtered_disparity_map;
+    wls_filter->filter(last_left_disparity, left_frame_gray, filtered_disparity_map, last_right_disparity);   //NOTE: left_frame_gray can be YUV's Y array.
+
+    cv::Mat disparity;
+    filtered_disparity_map.convertTo(disparity, CV_32FC1, 1.0 / cv::StereoMatcher::DISP_SCALE);
+    disparity = cv::max(disparity, 0.0);
+
+    return disparity;
+}
+
+cv::Mat StereoDepth::compute_coarse(const cv::Mat& left, const cv::Mat& right, const Params& params) {
+    // Same search range as the full resolution matcher, scaled to this level.
+    int num_disparities = std::max(16, ((FULL_NUM_DISPARITIES >> params.coarse_level) + 15) & ~15);
+
+    cv::Mat raw_disparity;
+
+    if (params.coarse_use_bm) {
+        if (sbm.empty()) {
+            sbm = cv::StereoBM::create(num_disparities, params.coarse_block_size);
+            sbm->setUniquenessRatio(10);
+            sbm->setSpeckleWindowSize(50);
+            sbm->setSpeckleRange(2);
+        }
+        sbm->compute(left, right, raw_disparity);
+    } else {
+        if (coarse_sgbm.empty()) {
+            int block_area = params.coarse_block_size * params.coarse_block_size;
+            coarse_sgbm = cv::StereoSGBM::create(
+                0,
+                num_disparities,
+                params.coarse_block_size,
+                8 * block_area,
+                32 * block_area,
+                1,
+                10,
+                50,
+                2,
+                63,
+                cv::StereoSGBM::MODE_SGBM_3WAY
+            );
+        }
+        coarse_sgbm->compute(left, right, raw_disparity);
+    }
+
+    cv::Mat disparity;
+    raw_disparity.convertTo(disparity, CV_32FC1, 1.0 / cv::StereoMatcher::DISP_SCALE);
+    disparity = cv::max(disparity, 0.0);
+
+    fill_invalid_disparities(disparity);
+
+    return disparity;
+}
+
+cv::Mat StereoDepth::compute_pyramid(const cv::Mat& left_gray, const cv::Mat& right_gray, const Params& params) {
+    std::vector<cv::Mat> left_pyramid { left_gray };
+    std::vector<cv::Mat> right_pyramid { right_gray };
+
+    for (int level = 1; level <= params.coarse_level; ++level) {
+        cv::Mat left_down, right_down;
+        cv::pyrDown(left_pyramid.back(), left_down);
+        cv::pyrDown(right_pyramid.back(), right_down);
+        left_pyramid.push_back(left_down);
+        right_pyramid.push_back(right_down);
+    }
+
+    cv::Mat disparity = compute_coarse(left_pyramid[params.coarse_level], right_pyramid[params.coarse_level], params);
+
+    for (int level = params.coarse_level - 1; level >= params.output_level; --level) {
+        // Nearest neighbour so the prediction never mixes depths across an edge.
+        cv::Mat prediction;
+        cv::resize(disparity, prediction, left_pyramid[level].size(), 0, 0, cv::INTER_NEAREST);
+        prediction *= 2.0;
+
+        refine_disparity(left_pyramid[level], right_pyramid[level], prediction, params.refine_radius, params.refine_block_size, disparity);
+    }
+
+    if (params.output_level > 0) {
+        cv::Mat full_disparity;
+        cv::resize(disparity, full_disparity, left_gray.size(), 0, 0, cv::INTER_LINEAR);
+        full_disparity *= (double)(1 << params.output_level);
+        return full_disparity;
+    }
+
+    return disparity;
+}
+
+void StereoDepth::refine_disparity(const cv::Mat& left, const cv::Mat& right, const cv::Mat& prediction, int radius, int block_size, cv::Mat& refined, cv::Rect region) {
+    CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && prediction.type() == CV_32FC1);
+    CV_Assert(left.size() == right.size() && left.size() == prediction.size());
+
+    const cv::Rect image_rect(cv::Point(0, 0), left.size());
+    if (region.empty()) {
+        region = image_rect;
+    }
+    region &= image_rect;
+
+    if (refined.size() != left.size() || refined.type() != CV_32FC1) {
+        refined.create(left.size(), CV_32FC1);
+    }
+
+    if (region.empty()) {
+        return;
+    }
+
+    // Costs are box filtered, so they need a margin of context around the region.
+    const int margin = block_size / 2;
+    const cv::Rect padded = cv::Rect(region.x - margin, region.y - margin, region.width + 2 * margin, region.height + 2 * margin) & image_rect;
+    const int candidates = 2 * radius + 1;
+
+    cv::Mat base;
+    prediction(padded).convertTo(base, CV_32SC1);
+    cv::Mat base_f;
+    base.convertTo(base_f, CV_32FC1);
+
+    cv::Mat grid_x, grid_y;
+    {
+        cv::Mat row(1, padded.width, CV_32FC1);
+        for (int x = 0; x < padded.width; ++x) row.at<float>(0, x) = (float)(padded.x + x);
+        cv::Mat col(padded.height, 1, CV_32FC1);
+        for (int y = 0; y < padded.height; ++y) col.at<float>(y, 0) = (float)(padded.y + y);
+        cv::repeat(row, padded.height, 1, grid_x);
+        cv::repeat(col, 1, padded.width, grid_y);
+    }
+
+    // One sum of absolute differences image per candidate offset. The offsets
+    // are integral, so nearest neighbour sampling of the right image is exact.
+    std::vector<cv::Mat> costs(candidates);
+    cv::Mat map_x, shifted, diff;
+    cv::subtract(grid_x, base_f, map_x);
+    map_x += (double)radius;
+
+    const cv::Mat left_padded = left(padded);
+
+    for (int i = 0; i < candidates; ++i) {
+        cv::remap(right, shifted, map_x, grid_y, cv::INTER_NEAREST, cv::BORDER_REPLICATE);
+        cv::absdiff(left_padded, shifted, diff);
+        cv::boxFilter(diff, costs[i], CV_16U, cv::Size(block_size, block_size), cv::Point(-1, -1), false, cv::BORDER_REPLICATE);
+        map_x -= 1.0;
+    }
+
+    cv::parallel_for_(cv::Range(region.y, region.y + region.height), [&](const cv::Range& range) {
+        std::vector<const uint16_t*> cost_rows(candidates);
+
+        for (int y = range.start; y < range.end; ++y) {
+            const int py = y - padded.y;
+
+            for (int i = 0; i < candidates; ++i) {
+                cost_rows[i] = costs[i].ptr<uint16_t>(py);
+            }
+
+            const int* base_row = base.ptr<int>(py);
+            float* out = refined.ptr<float>(y);
+
+            for (int x = region.x; x < region.x + region.width; ++x) {
+                const int px = x - padded.x;
+
+                int best = 0;
+                uint16_t best_cost = cost_rows[0][px];
+
+                for (int i = 1; i < candidates; ++i) {
+                    if (cost_rows[i][px] < best_cost) {
+                        best_cost = cost_rows[i][px];
+                        best = i;
+                    }
+                }
+
+                // Parabola through the neighbouring costs for sub-pixel accuracy
+                float delta = 0.0f;
+                if (best > 0 && best < candidates - 1) {
+                    float c0 = cost_rows[best - 1][px];
+                    float c1 = best_cost;
+                    float c2 = cost_rows[best + 1][px];
+                    float denominator = c0 - 2.0f * c1 + c2;
+                    if (denominator > 0.0f) {
+                        delta = 0.5f * (c0 - c2) / denominator;
+                    }
+                }
+
+                float d = base_row[px] + (best - radius) + delta;
+                out[x] = d > 0.0f ? d : 0.0f;
+            }
+        }
+    });
+}
+
+std::vector<cv::Rect> StereoDepth::find_changed_regions(const cv::Mat& changed, int tile_size, float tile_change_fraction) {
+    std::vector<cv::Rect> regions;
+
+    for (int y = 0; y < changed.rows; y += tile_size) {
+        int height = std::min(tile_size, changed.rows - y);
+        cv::Rect run;
+
+        for (int x = 0; x < changed.cols; x += tile_size) {
+            cv::Rect tile(x, y, std::min(tile_size, changed.cols - x), height);
+            bool tile_changed = cv::countNonZero(changed(tile)) > tile_change_fraction * tile.area();
+
+            // Neighbouring tiles on a row are merged, fewer and wider regions
+            // share the filtering margin.
+            if (tile_changed) {
+                run = run.empty() ? tile : (run | tile);
+            } else if (!run.empty()) {
+                regions.push_back(run);
+                run = cv::Rect();
+            }
+        }
+
+        if (!run.empty()) {
+            regions.push_back(run);
+        }
+    }
+
+    return regions;
+}
+
+void StereoDepth::reset_incremental() {
+    previous_left.release();
+    previous_disparity.release();
+    frames_since_refresh = 0;
+    last_changed_fraction = 0.0f;
+}
+
+cv::Mat StereoDepth::compute_incremental(const cv::Mat& left_gray, const cv::Mat& right_gray) {
+    CV_Assert(left_gray.type() == CV_8UC1 && right_gray.type() == CV_8UC1);
+    CV_Assert(left_gray.size() == right_gray.size());
+
+    // Work at the finest level the preset refines, the full preset refines like QUALITY.
+    const Params params = get_preset_params(preset == PRESET_FULL ? PRESET_QUALITY : preset);
+    const int level = preset == PRESET_FULL ? 0 : params.output_level;
+    const double level_scale = (double)(1 << level);
+
+    cv::Mat left = left_gray;
+    cv::Mat right = right_gray;
+    for (int i = 0; i < level; ++i) {
+        cv::Mat left_down, right_down;
+        cv::pyrDown(left, left_down);
+        cv::pyrDown(right, right_down);
+        left = left_down;
+        right = right_down;
+    }
+
+    bool refresh = previous_disparity.empty() || previous_left.size() != left.size() || frames_since_refresh >= incremental.refresh_interval;
+
+    cv::Mat changed;
+    if (!refresh) {
+        cv::Mat diff;
+        cv::absdiff(left, previous_left, diff);
+        cv::threshold(diff, changed, incremental.change_threshold, 255, cv::THRESH_BINARY);
+
+        last_changed_fraction = (float)cv::countNonZero(changed) / (float)changed.total();
+        refresh = last_changed_fraction > incremental.full_refresh_fraction;
+    }
+
+    if (refresh) {
+        cv::Mat full_disparity = compute(left_gray, right_gray);
+
+        if (level > 0) {
+            cv::resize(full_disparity, previous_disparity, left.size(), 0, 0, cv::INTER_AREA);
+            previous_disparity *= 1.0 / level_scale;
+        } else {
+            previous_disparity = full_disparity.clone();
+        }
+
+        // The caller recycles its buffers
+        previous_left = left.clone();
+        frames_since_refresh = 0;
+        last_changed_fraction = 1.0f;
+
+        return full_disparity;
+    }
+
+    std::vector<cv::Rect> regions = find_changed_regions(changed, incremental.tile_size, incremental.tile_change_fraction);
+
+    cv::Mat disparity = previous_disparity.clone();
+    for (const cv::Rect& region : regions) {
+        refine_disparity(left, right, previous_disparity, incremental.search_radius, params.refine_block_size, disparity, region);
+
+        // Unchanged tiles keep their reference luma, so slow changes still add up.
+        left(region).copyTo(previous_left(region));
+    }
+
+    // Small changes are noise and get smoothed, large ones are motion and are taken as is.
+    const float alpha = incremental.temporal_alpha;
+    const float threshold = incremental.temporal_threshold;
+    cv::parallel_for_(cv::Range(0, disparity.rows), [&](const cv::Range& range) {
+        for (int y = range.start; y < range.end; ++y) {
+            const float* previous_row = previous_disparity.ptr<float>(y);
+            float* row = disparity.ptr<float>(y);
+
+            for (int x = 0; x < disparity.cols; ++x) {
+                float delta = row[x] - previous_row[x];
+                if (std::abs(delta) < threshold) {
+                    row[x] = previous_row[x] + alpha * delta;
+                }
+            }
+        }
+    });
+
+    previous_disparity = disparity;
+    ++frames_since_refresh;
+
+    if (level > 0) {
+        cv::Mat full_disparity;
+        cv::resize(disparity, full_disparity, left_gray.size(), 0, 0, cv::INTER_LINEAR);
+        full_disparity *= level_scale;
+        return full_disparity;
+    }
+
+    return disparity.clone();
+}
+
+void StereoDepth::fill_invalid_disparities(cv::Mat& disparity) {
+    CV_Assert(disparity.type() == CV_32FC1);
+
+    cv::parallel_for_(cv::Range(0, disparity.rows), [&](const cv::Range& range) {
+        for (int y = range.start; y < range.end; ++y) {
+            float* row = disparity.ptr<float>(y);
+            int x = 0;
+
+            while (x < disparity.cols) {
+                if (row[x] > 0.0f) {
+                    ++x;
+                    continue;
+                }
+
+                int run_start = x;
+                while (x < disparity.cols && row[x] <= 0.0f) ++x;
+
+                float left_value = run_start > 0 ? row[run_start - 1] : 0.0f;
+                float right_value = x < disparity.cols ? row[x] : 0.0f;
+
+                float fill_value;
+                if (left_value > 0.0f && right_value > 0.0f) {
+                    fill_value = std::min(left_value, right_value);
+                } else {
+                    fill_value = std::max(left_value, right_value);
+                }
+
+                for (int i = run_start; i < x; ++i) row[i] = fill_value;
+            }
+        }
+    });
+}
+
+void StereoDepth::disparity_to_depth(const cv::Mat& disparity, const cv::Mat& Q, cv::Mat& depth, double unit_scale) {
+    CV_Assert(disparity.type() == CV_32FC1);
+    CV_Assert(Q.rows == 4 && Q.cols == 4);
+
+    cv::Mat Q64;
+    Q.convertTo(Q64, CV_64F);
+
+    const float numerator = (float) (Q64.at<double>(2, 3) * unit_scale);
+    const float slope = (float) Q64.at<double>(3, 2);
+    const float offset = (float) Q64.at<double>(3, 3);
+
+    depth.create(disparity.size(), CV_32FC1);
+
+    cv::parallel_for_(cv::Range(0, disparity.rows), [&](const cv::Range& range) {
+        for (int y = range.start; y < range.end; ++y) {
+            const float* d = disparity.ptr<float>(y);
+            float* z = depth.ptr<float>(y);
+
+            for (int x = 0; x < disparity.cols; ++x) {
+                float denominator = slope * d[x] + offset;
+                z[x] = (d[x] > 0.0f && denominator != 0.0f) ? std::abs(numerator / denominator) : 0.0f;
+            }
+        }
+    });
+}
@@ -0,0 +1,134 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <opencv2/core.hpp>
+#include "opencv2/calib3d.hpp"
+
+// Disparity search range at full resolution. Has to be dividable by 16.
+#define FULL_NUM_DISPARITIES (5 * 16)
+
+namespace godot {
+
+// Stereo matching for rectified grayscale pairs. Knows nothing about Godot so
+// it can also be driven by the offline tools.
+//
+// PRESET_FULL is the original SGBM + WLS pipeline at full resolution.
+// The pyramid presets match at a reduced resolution first and then refine
+// every finer level with a narrow search band around the upsampled estimate,
+// which keeps the per level cost at (2 * refine_radius + 1) box filters.
+class StereoDepth {
+public:
+    enum PRESET {
+        PRESET_FULL,
+        PRESET_QUALITY,
+        PRESET_SPEED
+    };
+
+    struct Params {
+        int coarse_level;          // pyramid level of the full search, 0 is full resolution
+        int output_level;          // finest level that is refined, upsampled to full resolution afterwards
+        bool coarse_use_bm;        // StereoBM instead of SGBM for the coarse search
+        int coarse_block_size;
+        int refine_radius;         // +/- disparity band searched around the prediction
+        int refine_block_size;
+    };
+
+    // Continuous depth: reuse the previous disparity where the scene did not change.
+    struct IncrementalParams {
+        int change_threshold = 12;          // luma difference that marks a pixel as changed
+        int tile_size = 32;                 // granularity of recomputed regions, in working level pixels
+        float tile_change_fraction = 0.02f; // changed pixels needed to recompute a tile
+        float full_refresh_fraction = 0.5f; // recompute everything if this much of the frame changed
+        int refresh_interval = 90;          // frames between full recomputes, bounds drift
+        int search_radius = 3;              // +/- band around the previous disparity in changed tiles
+        float temporal_alpha = 0.4f;        // weight of the new estimate where depth is stable
+        float temporal_threshold = 1.0f;    // disparity change treated as real motion, not noise
+    };
+
+    static Params get_preset_params(int preset);
+
+    // Clamped to PRESET_FULL..PRESET_SPEED.
+    void set_preset(int p_preset);
+    int get_preset() { return preset; }
+
+    // Returns a CV_32FC1 disparity map in full resolution pixels, invalid
+    // pixels are 0. Both inputs have to be CV_8UC1 and of the same size.
+    cv::Mat compute(const cv::Mat& left_gray, const cv::Mat& right_gray);
+
+    // Like compute, but only recomputes the tiles whose luma changed since the
+    // previous call and filters the result over time. Consecutive calls must
+    // get consecutive frames of the same camera.
+    cv::Mat compute_incremental(const cv::Mat& left_gray, const cv::Mat& right_gray);
+    void reset_incremental();
+
+    void set_incremental_params(const IncrementalParams& p_params) { incremental = p_params; }
+    IncrementalParams get_incremental_params() { return incremental; }
+
+    // Fraction of the frame recomputed by the last compute_incremental call.
+    float get_last_changed_fraction() { return last_changed_fraction; }
+
+    // Winner takes all search in [prediction - radius, prediction + radius]
+    // for every pixel of region (the whole image if empty). prediction is
+    // CV_32FC1 in the pixel units of left/right, pixels of refined outside of
+    // region are left untouched.
+    static void refine_disparity(const cv::Mat& left, const cv::Mat& right, const cv::Mat& prediction, int radius, int block_size, cv::Mat& refined, cv::Rect region = cv::Rect());
+
+    // Replaces invalid (<= 0) disparities with the smaller of the nearest
+    // valid neighbours on the same row, so holes take the background depth.
+    static void fill_invalid_disparities(cv::Mat& disparity);
+
+    // Converts a disparity map to metric depth along the optical axis with the
+    // reprojection matrix Q from stereoRectify: Z = Q23 / (Q32 * d + Q33).
+    // unit_scale converts the calibration units (millimetres of the chessboard
+    // squares) to the output units. Invalid disparities give a depth of 0.
+    static void disparity_to_depth(const cv::Mat& disparity, const cv::Mat& Q, cv::Mat& depth, double unit_scale = 0.001);
+
+    // Raw left/right matcher output of the last PRESET_FULL run, for debug dumps.
+    cv::Mat get_last_left_disparity() { return last_left_disparity; }
+    cv::Mat get_last_right_disparity() { return last_right_disparity; }
+
+private:
+    int preset = PRESET_FULL;
+
+    cv::Mat last_left_disparity;
+    cv::Mat last_right_disparity;
+
+    cv::Ptr<cv::StereoBM> sbm;
+    cv::Ptr<cv::StereoSGBM> coarse_sgbm;
+
+    IncrementalParams incremental;
+    cv::Mat previous_left;          // luma the previous disparity was computed from, working level
+    cv::Mat previous_disparity;     // working level
+    int frames_since_refresh = 0;
+    float last_changed_fraction = 0.0f;
+
+    static std::vector<cv::Rect> find_changed_regions(const cv::Mat& changed, int tile_size, float tile_change_fraction);
+
+    cv::Mat compute_full(const cv::Mat& left_gray, const cv::Mat& right_gray);
+    cv::Mat compute_pyramid(const cv::Mat& left_gray, const cv::Mat& right_gray, const Params& params);
+    cv::Mat compute_coarse(const cv::Mat& left, const cv::Mat& right, const Params& params);
+};
+
+}
@@ -0,0 +1,135 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "trace_file.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace godot;
+
+static void write_json_string(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const char* c = text; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') fputc('\\', file);
+        fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+TraceFile* TraceFile::get_singleton() {
+    static TraceFile trace;
+    return &trace;
+}
+
+TraceFile::TraceFile() :
+    events(DEFAULT_CAPACITY),
+    origin(std::chrono::steady_clock::now()) {
+}
+
+void TraceFile::set_capacity(size_t p_capacity) {
+    std::unique_lock<std::mutex> lock(mutex);
+    events.assign(std::max<size_t>(p_capacity, 1), Event());
+    next = 0;
+    wrapped = false;
+}
+
+uint64_t TraceFile::now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+uint32_t TraceFile::current_thread() {
+    static std::atomic<uint32_t> thread_count(0);
+    thread_local uint32_t thread = ++thread_count;
+    return thread;
+}
+
+void TraceFile::push(const Event& event) {
+    std::unique_lock<std::mutex> lock(mutex);
+    events[next] = event;
+    if (++next == events.size()) {
+        next = 0;
+        wrapped = true;
+    }
+}
+
+void TraceFile::record_slice(const char* category, const char* name, uint64_t start_us, uint64_t duration_us) {
+    push({ category, name, 'X', current_thread(), start_us, duration_us, 0.0 });
+}
+
+void TraceFile::record_counter(const char* category, const char* name, double value) {
+    push({ category, name, 'C', current_thread(), now_us(), 0, value });
+}
+
+bool TraceFile::flush(const std::string& path) {
+    std::vector<Event> snapshot;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (wrapped) {
+            snapshot.insert(snapshot.end(), events.begin() + next, events.end());
+        }
+        snapshot.insert(snapshot.end(), events.begin(), events.begin() + next);
+    }
+
+    // JSON has no NaN or infinity, the trace viewers reject the whole file
+    snapshot.erase(std::remove_if(snapshot.begin(), snapshot.end(), [](const Event& event) {
+        return event.phase == 'C' && !std::isfinite(event.value);
+    }), snapshot.end());
+
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) return false;
+
+    int pid = getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        const Event& event = snapshot[i];
+
+        fprintf(file, "{\"name\":");
+        write_json_string(file, event.name);
+        fprintf(file, ",\"cat\":");
+        write_json_string(file, event.category);
+
+        if (event.phase == 'X') {
+            fprintf(file, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%llu,\"dur\":%llu}",
+                pid, event.thread, (unsigned long long) event.timestamp_us, (unsigned long long) event.duration_us);
+        } else {
+            // Counter tracks are per process, the value is keyed by the name.
+            fprintf(file, ",\"ph\":\"C\",\"pid\":%d,\"ts\":%llu,\"args\":{\"value\":%g}}",
+                pid, (unsigned long long) event.timestamp_us, event.value);
+        }
+        fprintf(file, i + 1 < snapshot.size() ? ",\n" : "\n");
+    }
+
+    fprintf(file, "]}\n");
+    return fclose(file) == 0;
+}
+
+std::string TraceFile::get_default_path() {
+    const char* path = getenv("FOXUS_TRACE_FILE");
+    return path != nullptr ? path : "foxus_trace.json";
+}
@@ -0,0 +1,104 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace godot {
+
+// In-process trace recorder for builds without Perfetto. Slices and counter
+// samples go into a fixed size ring buffer, the oldest events are overwritten
+// once it is full. flush() writes the retained events as a Chrome JSON trace,
+// which both chrome://tracing and ui.perfetto.dev open.
+//
+// Category and name must be string literals (or otherwise outlive the
+// recorder), only the pointers are stored.
+class TraceFile {
+public:
+    static const size_t DEFAULT_CAPACITY = 1 << 18;
+
+    static TraceFile* get_singleton();
+
+    void set_capacity(size_t p_capacity);
+
+    void record_slice(const char* category, const char* name, uint64_t start_us, uint64_t duration_us);
+    void record_counter(const char* category, const char* name, double value);
+
+    // Microseconds since the recorder was created.
+    uint64_t now_us();
+
+    // Writes the retained events, the buffer is kept.
+    bool flush(const std::string& path);
+
+    // $FOXUS_TRACE_FILE, or foxus_trace.json in the working directory.
+    static std::string get_default_path();
+
+private:
+    struct Event {
+        const char* category;
+        const char* name;
+        char phase;             // 'X' complete slice, 'C' counter
+        uint32_t thread;
+        uint64_t timestamp_us;
+        uint64_t duration_us;
+        double value;
+    };
+
+    TraceFile();
+
+    static uint32_t current_thread();
+
+    std::mutex mutex;
+    std::vector<Event> events;
+    size_t next = 0;
+    bool wrapped = false;
+    std::chrono::steady_clock::time_point origin;
+
+    void push(const Event& event);
+};
+
+// Records a slice for its own lifetime.
+class TraceScope {
+public:
+    TraceScope(const char* p_category, const char* p_name) :
+        category(p_category),
+        name(p_name),
+        start_us(TraceFile::get_singleton()->now_us()) {}
+
+    ~TraceScope() {
+        TraceFile* trace = TraceFile::get_singleton();
+        trace->record_slice(category, name, start_us, trace->now_us() - start_us);
+    }
+
+private:
+    const char* category;
+    const char* name;
+    uint64_t start_us;
+};
+
+}
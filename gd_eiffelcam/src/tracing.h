@@ -0,0 +1,51 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+// Project wide tracing macros. By default they come from the profiler prebuilt
+// (Perfetto when built with perfetto=true, no-ops otherwise). With
+// file_trace=true the in-process backend of trace_file.hpp records them
+// instead, so desktop builds get a timeline without a Perfetto daemon.
+
+#ifdef ENABLE_FILE_TRACE
+
+#include "trace_file.hpp"
+
+#define FOXUS_TRACE_CONCAT_(a, b) a##b
+#define FOXUS_TRACE_CONCAT(a, b) FOXUS_TRACE_CONCAT_(a, b)
+
+// Debug arguments are accepted for compatibility with Perfetto but not recorded.
+#define TRACE_EVENT(category, name, ...) ::godot::TraceScope FOXUS_TRACE_CONCAT(trace_scope_, __LINE__)(category, name)
+#define TRACE_COUNTER(category, name, value) ::godot::TraceFile::get_singleton()->record_counter(category, name, (double) (value))
+#define PROFILER_INIT()
+
+#else
+
+#include "profiler.h"
+
+#ifndef TRACE_COUNTER
+#define TRACE_COUNTER(category, name, value)
+#endif
+
+#endif
@@ -0,0 +1,110 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "usb_device_selector.hpp"
+
+#include <mutex>
+#include <set>
+
+using namespace godot;
+
+static std::mutex claims_mutex;
+static std::set<std::string> claimed_paths;
+
+bool UsbDeviceSelector::matches(const std::string& p_path, const std::string& p_serial) const {
+    return (path.empty() || path == p_path) && (serial.empty() || serial == p_serial);
+}
+
+std::string UsbDeviceSelector::get_port_path(libusb_device* device) {
+    uint8_t ports[8];
+    int count = libusb_get_port_numbers(device, ports, sizeof(ports));
+
+    std::string result = std::to_string(libusb_get_bus_number(device));
+    for (int i = 0; i < count; ++i) {
+        result += (i == 0 ? "-" : ".") + std::to_string(ports[i]);
+    }
+    return result;
+}
+
+std::map<std::pair<int, int>, std::string> UsbDeviceSelector::get_port_paths() {
+    std::map<std::pair<int, int>, std::string> result;
+
+    libusb_context* context = nullptr;
+    if (libusb_init(&context) != LIBUSB_SUCCESS) {
+        return result;
+    }
+
+    libusb_device** list = nullptr;
+    ssize_t count = libusb_get_device_list(context, &list);
+    for (ssize_t i = 0; i < count; ++i) {
+        result[std::make_pair((int) libusb_get_bus_number(list[i]), (int) libusb_get_device_address(list[i]))] = get_port_path(list[i]);
+    }
+
+    if (count >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    libusb_exit(context);
+    return result;
+}
+
+std::string UsbDeviceSelector::read_serial(libusb_device* device) {
+    libusb_device_descriptor descriptor;
+    if (libusb_get_device_descriptor(device, &descriptor) != LIBUSB_SUCCESS || descriptor.iSerialNumber == 0) {
+        return "";
+    }
+
+    libusb_device_handle* handle = nullptr;
+    if (libusb_open(device, &handle) != LIBUSB_SUCCESS) {
+        return "";
+    }
+
+    std::string serial = read_serial(handle);
+    libusb_close(handle);
+    return serial;
+}
+
+std::string UsbDeviceSelector::read_serial(libusb_device_handle* handle) {
+    libusb_device_descriptor descriptor;
+    if (handle == nullptr || libusb_get_device_descriptor(libusb_get_device(handle), &descriptor) != LIBUSB_SUCCESS || descriptor.iSerialNumber == 0) {
+        return "";
+    }
+
+    unsigned char serial[256];
+    int length = libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber, serial, sizeof(serial));
+    return length > 0 ? std::string((const char*) serial, length) : "";
+}
+
+bool UsbDeviceSelector::claim(const std::string& p_path) {
+    std::lock_guard<std::mutex> lock(claims_mutex);
+    return claimed_paths.insert(p_path).second;
+}
+
+void UsbDeviceSelector::release(const std::string& p_path) {
+    std::lock_guard<std::mutex> lock(claims_mutex);
+    claimed_paths.erase(p_path);
+}
+
+bool UsbDeviceSelector::is_claimed(const std::string& p_path) {
+    std::lock_guard<std::mutex> lock(claims_mutex);
+    return claimed_paths.count(p_path) > 0;
+}
@@ -0,0 +1,62 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <libusb-1.0/libusb.h>
+
+#include <map>
+#include <string>
+#include <utility>
+
+namespace godot {
+
+// Which camera a GDEiffelCam opens when several are plugged in. Devices are
+// named by their port path ("bus-port.port", stable while the cable stays in
+// the same socket) on desktop and by the Android USB device name on Android.
+//
+// Claims are process wide, a camera opened by one instance is skipped by the
+// others, so two instances without a selection still get different cameras.
+class UsbDeviceSelector {
+public:
+    std::string serial;     // empty matches any
+    std::string path;       // empty matches any
+
+    bool matches(const std::string& p_path, const std::string& p_serial) const;
+    // For devices whose serial is not known yet, e.g. on Android before the
+    // permission. The serial is checked once the device is open.
+    bool matches_path(const std::string& p_path) const { return path.empty() || path == p_path; }
+
+    static std::string get_port_path(libusb_device* device);
+    // Port paths of all devices by bus number and address, one enumeration.
+    static std::map<std::pair<int, int>, std::string> get_port_paths();
+    // Opens the device, empty if it has no serial or cannot be opened.
+    static std::string read_serial(libusb_device* device);
+    static std::string read_serial(libusb_device_handle* handle);
+
+    static bool claim(const std::string& p_path);
+    static void release(const std::string& p_path);
+    static bool is_claimed(const std::string& p_path);
+};
+
+}
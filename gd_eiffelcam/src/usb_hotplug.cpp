@@ -0,0 +1,135 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "usb_hotplug.hpp"
+
+#include "usb_device_selector.hpp"
+
+using namespace godot;
+
+bool UsbHotplug::start(int vid, int pid) {
+    stop();
+
+    if (libusb_init(&usb_context) != LIBUSB_SUCCESS) {
+        usb_context = nullptr;
+        return false;
+    }
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        libusb_exit(usb_context);
+        usb_context = nullptr;
+        return false;
+    }
+
+    int res = libusb_hotplug_register_callback(usb_context,
+        (libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+        LIBUSB_HOTPLUG_ENUMERATE, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY,
+        &UsbHotplug::hotplug_callback, this, &callback_handle);
+
+    if (res != LIBUSB_SUCCESS) {
+        libusb_exit(usb_context);
+        usb_context = nullptr;
+        return false;
+    }
+
+    quit = false;
+    event_thread = std::thread(&UsbHotplug::run, this);
+    return true;
+}
+
+void UsbHotplug::stop() {
+    if (usb_context == nullptr) {
+        return;
+    }
+
+    quit = true;
+    // Wakes up the event thread
+    libusb_hotplug_deregister_callback(usb_context, callback_handle);
+    if (event_thread.joinable()) {
+        event_thread.join();
+    }
+
+    libusb_exit(usb_context);
+    usb_context = nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    events.clear();
+    for (libusb_device* device : arrived) {
+        libusb_unref_device(device);
+    }
+    arrived.clear();
+}
+
+UsbHotplug::Event UsbHotplug::take_event() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (events.empty()) {
+        return Event();
+    }
+
+    Event event = events.front();
+    events.pop_front();
+    return event;
+}
+
+int LIBUSB_CALL UsbHotplug::hotplug_callback(libusb_context* context, libusb_device* device, libusb_hotplug_event event, void* user_data) {
+    UsbHotplug* hotplug = static_cast<UsbHotplug*>(user_data);
+
+    std::lock_guard<std::mutex> lock(hotplug->mutex);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        // No I/O in the callback, the serial is read by run()
+        hotplug->arrived.push_back(libusb_ref_device(device));
+    } else {
+        Event detached;
+        detached.type = EVENT_DETACHED;
+        detached.path = UsbDeviceSelector::get_port_path(device);
+        hotplug->events.push_back(detached);
+    }
+
+    // Keep the callback registered
+    return 0;
+}
+
+void UsbHotplug::run() {
+    while (!quit) {
+        timeval timeout = { 0, 250000 };
+        libusb_handle_events_timeout_completed(usb_context, &timeout, nullptr);
+
+        std::vector<libusb_device*> devices;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            devices.swap(arrived);
+        }
+
+        for (libusb_device* device : devices) {
+            Event attached;
+            attached.type = EVENT_ATTACHED;
+            attached.path = UsbDeviceSelector::get_port_path(device);
+            attached.serial = UsbDeviceSelector::read_serial(device);
+            libusb_unref_device(device);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            events.push_back(attached);
+        }
+    }
+}
@@ -0,0 +1,86 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <libusb-1.0/libusb.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace godot {
+
+// Attach and detach notifications for one vid/pid from libusb hotplug
+// callbacks, for desktop builds. The callbacks run on an event thread and only
+// queue the change, the main thread picks it up with take_event, so an idle
+// frame costs a mutex and no USB traffic.
+//
+// Every event names the camera by its port path, arrivals also carry the
+// serial number so instances can pick their own camera. Reading the serial
+// needs control transfers, it is done on the event thread after the callback.
+//
+// Android has no device discovery in libusb, the EiffelCamera plugin sends
+// the same events from a USB broadcast receiver there.
+class UsbHotplug {
+public:
+    enum EVENT {
+        EVENT_NONE,
+        EVENT_ATTACHED,
+        EVENT_DETACHED
+    };
+
+    ~UsbHotplug() { stop(); }
+
+    // False if libusb has no hotplug support on this platform. A device that
+    // is already plugged in is reported as attached right away.
+    bool start(int vid, int pid);
+    void stop();
+
+    struct Event {
+        EVENT type = EVENT_NONE;
+        std::string path;
+        std::string serial;     // arrivals only
+    };
+
+    // Oldest change not taken yet, main thread. type is EVENT_NONE if there is none.
+    Event take_event();
+
+private:
+    static int LIBUSB_CALL hotplug_callback(libusb_context* context, libusb_device* device, libusb_hotplug_event event, void* user_data);
+    void run();
+
+    libusb_context* usb_context = nullptr;
+    libusb_hotplug_callback_handle callback_handle = 0;
+    std::thread event_thread;
+    std::atomic<bool> quit{false};
+
+    std::mutex mutex;
+    std::deque<Event> events;
+    std::vector<libusb_device*> arrived;     // referenced, serial not read yet
+};
+
+}
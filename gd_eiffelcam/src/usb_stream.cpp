@@ -0,0 +1,225 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include "usb_stream.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "tracing.h"
+
+using namespace godot;
+
+void UsbFrameQueue::init(MetricsRegistry& metrics) {
+    usb_frames = metrics.counter("usb_frames");
+    usb_lost_frames = metrics.counter("usb_lost_frames");
+    usb_incomplete_frames = metrics.counter("usb_incomplete_frames");
+    usb_skipped_frames = metrics.counter("usb_skipped_frames");
+    usb_bandwidth_mbps = metrics.gauge("usb_bandwidth_mbps");
+    usb_frame_kb = metrics.histogram("usb_frame_kb", MetricsRegistry::size_buckets_kb());
+    usb_frame_interval_ms = metrics.histogram("usb_frame_interval_ms", MetricsRegistry::latency_buckets_ms());
+}
+
+void UsbFrameQueue::configure(int frame_buffers, size_t expected_frame_size) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    slots.clear();
+    slots.resize(std::max(2, frame_buffers));
+    for (Slot& slot : slots) {
+        slot.frame.data.reserve(expected_frame_size);
+    }
+
+    last_sequence = 0;
+    window_start = std::chrono::steady_clock::now();
+    window_frames = 0;
+    window_bytes = 0;
+    last_arrival = std::chrono::steady_clock::time_point();
+
+    slot_memory.set(slots.size() * expected_frame_size);
+}
+
+void UsbFrameQueue::uvc_callback(uvc_frame_t* frame, void* ptr) {
+    static_cast<UsbFrameQueue*>(ptr)->push(frame);
+}
+
+bool UsbFrameQueue::is_complete_jpeg(const uint8_t* data, size_t size) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+
+    // Some cameras pad the payload after the end of image marker
+    size_t search_from = size > 64 ? size - 64 : 0;
+    for (size_t i = size - 2; i + 1 > search_from; --i) {
+        if (data[i] == 0xFF && data[i + 1] == 0xD9) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void UsbFrameQueue::push(const uvc_frame_t* frame) {
+    TRACE_EVENT("usb_stream", "UsbFrameQueue::push");
+
+    auto now = std::chrono::steady_clock::now();
+    const uint8_t* data = static_cast<const uint8_t*>(frame->data);
+    size_t size = frame->data_bytes;
+
+    usb_frames->add();
+    usb_frame_kb->record(size / 1024.0);
+    if (last_arrival != std::chrono::steady_clock::time_point()) {
+        usb_frame_interval_ms->record(std::chrono::duration<double, std::milli>(now - last_arrival).count());
+    }
+    last_arrival = now;
+
+    uint64_t lost = 0;
+    if (last_sequence != 0 && frame->sequence > last_sequence + 1) {
+        lost = frame->sequence - last_sequence - 1;
+        usb_lost_frames->add(lost);
+    }
+    last_sequence = frame->sequence;
+
+    window_frames++;
+    window_bytes += size;
+    double window_s = std::chrono::duration<double>(now - window_start).count();
+    double bandwidth = -1.0, frame_rate = 0.0;
+    if (window_s >= 1.0) {
+        bandwidth = window_bytes * 8.0 / window_s / 1e6;
+        frame_rate = window_frames / window_s;
+        usb_bandwidth_mbps->set(bandwidth);
+        TRACE_COUNTER("usb_stream", "usb_bandwidth_mbps", bandwidth);
+        window_start = now;
+        window_frames = 0;
+        window_bytes = 0;
+    }
+
+    bool complete = is_complete_jpeg(data, size);
+    if (!complete) {
+        usb_incomplete_frames->add();
+    }
+
+    Slot* target = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        stats.frames++;
+        stats.bytes += size;
+        stats.lost += lost;
+        stats.largest_frame = std::max(stats.largest_frame, size);
+        if (bandwidth >= 0.0) {
+            stats.bandwidth_mbps = bandwidth;
+            stats.frame_rate = frame_rate;
+        }
+        if (!complete) {
+            // Would only fail in the decoder
+            stats.incomplete++;
+            return;
+        }
+
+        // A free buffer, otherwise replace the oldest frame nobody took yet
+        for (Slot& slot : slots) {
+            if (slot.state == SLOT_FREE) {
+                target = &slot;
+                break;
+            }
+        }
+        if (target == nullptr) {
+            for (Slot& slot : slots) {
+                if (slot.state == SLOT_READY && (target == nullptr || slot.frame.sequence < target->frame.sequence)) {
+                    target = &slot;
+                }
+            }
+            if (target != nullptr) {
+                stats.skipped++;
+                usb_skipped_frames->add();
+            }
+        }
+        if (target == nullptr) {
+            return;
+        }
+        target->state = SLOT_WRITING;
+    }
+
+    // Copied outside the lock, the render thread only looks at READY slots
+    target->frame.data.resize(size);
+    memcpy(target->frame.data.data(), data, size);
+    target->frame.data_bytes = size;
+    target->frame.sequence = frame->sequence;
+    target->frame.arrival = now;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        target->state = SLOT_READY;
+    }
+    frame_ready.notify_one();
+}
+
+const UsbFrame* UsbFrameQueue::take_latest(int64_t timeout_us) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // The previous frame is done with
+    for (Slot& slot : slots) {
+        if (slot.state == SLOT_TAKEN) {
+            slot.state = SLOT_FREE;
+        }
+    }
+
+    auto has_ready = [this]() {
+        return std::any_of(slots.begin(), slots.end(), [](const Slot& slot) { return slot.state == SLOT_READY; });
+    };
+
+    if (timeout_us > 0 && !has_ready()) {
+        frame_ready.wait_for(lock, std::chrono::microseconds(timeout_us), has_ready);
+    }
+
+    Slot* newest = nullptr;
+    for (Slot& slot : slots) {
+        if (slot.state == SLOT_READY && (newest == nullptr || slot.frame.sequence > newest->frame.sequence)) {
+            newest = &slot;
+        }
+    }
+    if (newest == nullptr) {
+        return nullptr;
+    }
+
+    // Older frames are not shown anymore
+    for (Slot& slot : slots) {
+        if (slot.state == SLOT_READY && &slot != newest) {
+            slot.state = SLOT_FREE;
+            stats.skipped++;
+            usb_skipped_frames->add();
+        }
+    }
+
+    newest->state = SLOT_TAKEN;
+    return &newest->frame;
+}
+
+UsbFrameQueue::Stats UsbFrameQueue::get_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void UsbFrameQueue::reset_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats = Stats();
+}
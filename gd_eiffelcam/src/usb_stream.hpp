@@ -0,0 +1,135 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#pragma once
+
+#include <libuvc/libuvc.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "memory_accounting.hpp"
+#include "metrics.hpp"
+
+namespace godot {
+
+// How the UVC stream is opened. Both only take effect on the next connection.
+struct UsbStreamSettings {
+    // Bytes per USB transfer. For isochronous endpoints it selects the
+    // alternate setting, so the bandwidth reserved on the bus. 0 keeps the
+    // value negotiated with the camera.
+    uint32_t max_payload_transfer_size = 0;
+
+    // Frames held between the libuvc thread and the render thread. With two
+    // the camera can complete a frame while the previous one is decoded, more
+    // give headroom when the render thread stalls.
+    int frame_buffers = 3;
+};
+
+struct UsbFrame {
+    std::vector<uint8_t> data;
+    size_t data_bytes = 0;
+    uint32_t sequence = 0;
+    std::chrono::steady_clock::time_point arrival;
+};
+
+// Hands frames over from the libuvc callback thread to the render thread and
+// measures what arrives on the bus. The callback copies every complete frame
+// into a free buffer, the render thread takes the newest one.
+//
+// Frames that are replaced before the render thread got to them are counted
+// as skipped, gaps in the UVC sequence numbers (frames libuvc discarded) as
+// lost and frames without a JPEG start or end marker as incomplete.
+class UsbFrameQueue {
+public:
+    void init(MetricsRegistry& metrics);
+
+    // Before the stream starts. expected_frame_size is dwMaxVideoFrameSize of
+    // the negotiated stream, used to size the buffers up front.
+    void configure(int frame_buffers, size_t expected_frame_size);
+
+    // libuvc frame callback, ptr is the queue.
+    static void uvc_callback(uvc_frame_t* frame, void* ptr);
+    void push(const uvc_frame_t* frame);
+
+    // Newest frame since the previous call, nullptr if there is none after
+    // waiting timeout_us. The frame stays valid until the next call. Only one
+    // thread at a time may take frames.
+    const UsbFrame* take_latest(int64_t timeout_us = 0);
+
+    struct Stats {
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+        uint64_t lost = 0;
+        uint64_t incomplete = 0;
+        uint64_t skipped = 0;
+        double bandwidth_mbps = 0.0;       // over the last second
+        double frame_rate = 0.0;           // over the last second
+        size_t largest_frame = 0;
+    };
+    Stats get_stats();
+    void reset_stats();
+
+private:
+    enum SLOT_STATE {
+        SLOT_FREE,
+        SLOT_WRITING,
+        SLOT_READY,
+        SLOT_TAKEN
+    };
+
+    struct Slot {
+        UsbFrame frame;
+        SLOT_STATE state = SLOT_FREE;
+    };
+
+    static bool is_complete_jpeg(const uint8_t* data, size_t size);
+
+    std::mutex mutex;
+    std::condition_variable frame_ready;
+    std::vector<Slot> slots;
+
+    // Callback thread only
+    uint32_t last_sequence = 0;
+    std::chrono::steady_clock::time_point window_start;
+    uint64_t window_frames = 0;
+    uint64_t window_bytes = 0;
+
+    Stats stats;
+
+    MetricCounter* usb_frames = nullptr;
+    MetricCounter* usb_lost_frames = nullptr;
+    MetricCounter* usb_incomplete_frames = nullptr;
+    MetricCounter* usb_skipped_frames = nullptr;
+    MetricGauge* usb_bandwidth_mbps = nullptr;
+    MetricHistogram* usb_frame_kb = nullptr;
+    MetricHistogram* usb_frame_interval_ms = nullptr;
+    std::chrono::steady_clock::time_point last_arrival;
+
+    MemoryReservation slot_memory{MemoryAccounting::SUBSYSTEM_USB, MemoryAccounting::KIND_CPU};
+};
+
+}
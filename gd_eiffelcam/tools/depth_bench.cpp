@@ -0,0 +1,427 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+// Headless benchmark for StereoDepth.
+//
+// Runs every preset at every scale over a corpus of rectified stereo pairs
+// and writes runtime, memory peak, valid pixel density and, where a reference
+// disparity exists, the error against it to a JSON file. The pyramid presets
+// fill their holes, the valid density is only measured for the full preset.
+//
+// Corpus layout, one directory per pair:
+//   <corpus>/<pair>/im0.png, im1.png     left and right image (or left.png, right.png)
+//   <corpus>/<pair>/disp0.pfm            optional reference disparity of the left image
+//
+// Usage:
+//   depth_bench <corpus> [--out results.json] [--label name] [--presets full,quality,speed]
+//               [--scales 1,0.5] [--repeat 5]
+
+#include <opencv2/core.hpp>
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "stereo_depth.hpp"
+
+using namespace godot;
+
+namespace {
+
+struct StereoPair {
+    std::string name;
+    cv::Mat left;
+    cv::Mat right;
+    cv::Mat reference;  // CV_32FC1, non finite or <= 0 where unknown
+};
+
+struct Result {
+    std::string pair;
+    std::string preset;
+    double scale;
+    cv::Size size;
+    double runtime_min_ms;
+    double runtime_median_ms;
+    double memory_peak_mb;
+    bool has_valid_density;
+    double valid_density;
+    bool has_reference;
+    double mean_abs_error;
+    double bad_1;
+    double bad_2;
+};
+
+const char* preset_name(int preset) {
+    switch (preset) {
+        case StereoDepth::PRESET_QUALITY: return "quality";
+        case StereoDepth::PRESET_SPEED: return "speed";
+        default: return "full";
+    }
+}
+
+int preset_from_name(const std::string& name) {
+    if (name == "quality") return StereoDepth::PRESET_QUALITY;
+    if (name == "speed") return StereoDepth::PRESET_SPEED;
+    if (name == "full") return StereoDepth::PRESET_FULL;
+    return -1;
+}
+
+std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+bool file_exists(const std::string& path) {
+    std::ifstream file(path);
+    return file.good();
+}
+
+// Portable float map as used by the Middlebury and KITTI style datasets.
+cv::Mat read_pfm(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return cv::Mat();
+
+    std::string type;
+    int width = 0, height = 0;
+    double scale = 0.0;
+    file >> type >> width >> height >> scale;
+    file.get();
+
+    if (type != "Pf" || width <= 0 || height <= 0) {
+        std::cerr << "Unsupported PFM " << path << std::endl;
+        return cv::Mat();
+    }
+
+    cv::Mat map(height, width, CV_32FC1);
+    bool swap_bytes = (scale > 0.0);   // positive scale means big endian
+
+    // Rows are stored bottom to top.
+    for (int y = height - 1; y >= 0; --y) {
+        file.read((char*) map.ptr<float>(y), width * sizeof(float));
+        if (swap_bytes) {
+            uint32_t* row = map.ptr<uint32_t>(y);
+            for (int x = 0; x < width; ++x) row[x] = __builtin_bswap32(row[x]);
+        }
+    }
+
+    if (!file) return cv::Mat();
+    return map;
+}
+
+bool load_pair(const std::string& directory, const std::string& name, StereoPair& pair) {
+    std::string base = directory + "/" + name + "/";
+
+    std::string left_path = base + "im0.png";
+    std::string right_path = base + "im1.png";
+    if (!file_exists(left_path)) {
+        left_path = base + "left.png";
+        right_path = base + "right.png";
+    }
+
+    pair.name = name;
+    pair.left = cv::imread(left_path, cv::IMREAD_GRAYSCALE);
+    pair.right = cv::imread(right_path, cv::IMREAD_GRAYSCALE);
+    if (pair.left.empty() || pair.right.empty() || pair.left.size() != pair.right.size()) {
+        return false;
+    }
+
+    if (file_exists(base + "disp0.pfm")) {
+        pair.reference = read_pfm(base + "disp0.pfm");
+        if (pair.reference.size() != pair.left.size()) {
+            std::cerr << name << ": reference size does not match, ignored" << std::endl;
+            pair.reference = cv::Mat();
+        }
+    }
+
+    return true;
+}
+
+// Peak resident set size since the last reset, in MB.
+double memory_peak_mb() {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::atof(line.c_str() + 6) / 1024.0;
+        }
+    }
+    return 0.0;
+#else
+    // No reset on macOS, this is the peak of the whole process.
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#endif
+}
+
+void reset_memory_peak() {
+#ifdef __linux__
+    // Writing 5 resets VmHWM to the current RSS.
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+#endif
+}
+
+// The pyramid presets halve the image twice, keep the sizes divisible.
+cv::Rect aligned_rect(cv::Size size) {
+    return cv::Rect(0, 0, size.width & ~7, size.height & ~7);
+}
+
+Result run_case(const StereoPair& pair, int preset, double scale, int repeat) {
+    Result result = {};
+    result.pair = pair.name;
+    result.preset = preset_name(preset);
+    result.scale = scale;
+
+    cv::Mat left, right, reference;
+    if (scale != 1.0) {
+        cv::resize(pair.left, left, cv::Size(), scale, scale, cv::INTER_AREA);
+        cv::resize(pair.right, right, cv::Size(), scale, scale, cv::INTER_AREA);
+        if (!pair.reference.empty()) {
+            cv::resize(pair.reference, reference, left.size(), 0, 0, cv::INTER_NEAREST);
+            reference *= scale;
+        }
+    } else {
+        left = pair.left;
+        right = pair.right;
+        reference = pair.reference;
+    }
+
+    cv::Rect rect = aligned_rect(left.size());
+    left = left(rect).clone();
+    right = right(rect).clone();
+    if (!reference.empty()) reference = reference(rect);
+    result.size = rect.size();
+
+    StereoDepth stereo_depth;
+    stereo_depth.set_preset(preset);
+
+    reset_memory_peak();
+
+    // The first run creates the matchers, it is not timed.
+    cv::Mat disparity = stereo_depth.compute(left, right);
+
+    std::vector<double> runtimes;
+    for (int i = 0; i < repeat; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        disparity = stereo_depth.compute(left, right);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        runtimes.push_back(elapsed.count());
+    }
+
+    result.memory_peak_mb = memory_peak_mb();
+
+    std::sort(runtimes.begin(), runtimes.end());
+    result.runtime_min_ms = runtimes.front();
+    result.runtime_median_ms = runtimes[runtimes.size() / 2];
+
+    if (preset == StereoDepth::PRESET_FULL) {
+        result.has_valid_density = true;
+        result.valid_density = (double) cv::countNonZero(disparity > 0.0f) / disparity.total();
+    }
+
+    if (!reference.empty()) {
+        double error_sum = 0.0;
+        size_t count = 0, bad_1 = 0, bad_2 = 0;
+
+        for (int y = 0; y < reference.rows; ++y) {
+            const float* expected = reference.ptr<float>(y);
+            const float* actual = disparity.ptr<float>(y);
+            for (int x = 0; x < reference.cols; ++x) {
+                if (!std::isfinite(expected[x]) || expected[x] <= 0.0f) continue;
+
+                // Pixels without a disparity count as wrong by the whole reference.
+                double error = std::abs(actual[x] - expected[x]);
+                error_sum += error;
+                bad_1 += error > 1.0;
+                bad_2 += error > 2.0;
+                ++count;
+            }
+        }
+
+        if (count > 0) {
+            result.has_reference = true;
+            result.mean_abs_error = error_sum / count;
+            result.bad_1 = (double) bad_1 / count;
+            result.bad_2 = (double) bad_2 / count;
+        }
+    }
+
+    return result;
+}
+
+void write_results(const std::string& path, const std::string& label, const std::vector<Result>& results) {
+    cv::FileStorage fs(path, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_JSON);
+
+    fs << "label" << label;
+    fs << "opencv_version" << CV_VERSION;
+    fs << "threads" << cv::getNumThreads();
+    fs << "num_disparities" << FULL_NUM_DISPARITIES;
+
+    fs << "results" << "[";
+    for (const Result& result : results) {
+        fs << "{";
+        fs << "pair" << result.pair;
+        fs << "preset" << result.preset;
+        fs << "scale" << result.scale;
+        fs << "width" << result.size.width;
+        fs << "height" << result.size.height;
+        fs << "runtime_min_ms" << result.runtime_min_ms;
+        fs << "runtime_median_ms" << result.runtime_median_ms;
+        fs << "memory_peak_mb" << result.memory_peak_mb;
+        if (result.has_valid_density) {
+            fs << "valid_density" << result.valid_density;
+        }
+        if (result.has_reference) {
+            fs << "mean_abs_error" << result.mean_abs_error;
+            fs << "bad_1" << result.bad_1;
+            fs << "bad_2" << result.bad_2;
+        }
+        fs << "}";
+    }
+    fs << "]";
+}
+
+std::vector<std::string> list_pairs(const std::string& corpus) {
+    std::vector<cv::String> files;
+    cv::glob(corpus + "/*", files, true);
+
+    std::vector<std::string> pairs;
+    for (const cv::String& file : files) {
+        std::string path(file);
+        std::string name = path.substr(0, path.find_last_of('/'));
+        name = name.substr(name.find_last_of('/') + 1);
+        if (std::find(pairs.begin(), pairs.end(), name) == pairs.end()) {
+            pairs.push_back(name);
+        }
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+    return pairs;
+}
+
+}
+
+void print_usage() {
+    std::cerr << "Usage: depth_bench <corpus> [--out results.json] [--label name] [--presets full,quality,speed] [--scales 1,0.5] [--repeat 5]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+
+    std::string corpus = argv[1];
+    std::string out_path = "depth_bench.json";
+    std::string label = "";
+    std::vector<std::string> preset_names = { "full", "quality", "speed" };
+    std::vector<double> scales = { 1.0 };
+    int repeat = 5;
+
+    for (int i = 2; i < argc; i += 2) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << std::endl;
+            print_usage();
+            return 1;
+        }
+        std::string value = argv[i + 1];
+
+        if (option == "--out") out_path = value;
+        else if (option == "--label") label = value;
+        else if (option == "--presets") preset_names = split(value);
+        else if (option == "--scales") {
+            scales.clear();
+            for (const std::string& scale : split(value)) scales.push_back(std::atof(scale.c_str()));
+        } else if (option == "--repeat") repeat = std::max(1, std::atoi(value.c_str()));
+        else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+
+    for (const std::string& name : list_pairs(corpus)) {
+        StereoPair pair;
+        if (!load_pair(corpus, name, pair)) {
+            std::cerr << name << ": no stereo pair, skipped" << std::endl;
+            continue;
+        }
+
+        for (const std::string& preset_name_value : preset_names) {
+            int preset = preset_from_name(preset_name_value);
+            if (preset < 0) {
+                std::cerr << "Unknown preset " << preset_name_value << std::endl;
+                return 1;
+            }
+
+            for (double scale : scales) {
+                Result result = run_case(pair, preset, scale, repeat);
+                results.push_back(result);
+
+                printf("%-24s %-8s %4.2f %5dx%-5d %8.2f ms %7.1f MB",
+                       result.pair.c_str(), result.preset.c_str(), result.scale,
+                       result.size.width, result.size.height,
+                       result.runtime_median_ms, result.memory_peak_mb);
+                if (result.has_valid_density) {
+                    printf("  valid %5.1f%%", result.valid_density * 100.0);
+                } else {
+                    printf("  valid    n/a");
+                }
+                if (result.has_reference) {
+                    printf("  mae %6.2f  bad1 %5.1f%%  bad2 %5.1f%%", result.mean_abs_error, result.bad_1 * 100.0, result.bad_2 * 100.0);
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    if (results.empty()) {
+        std::cerr << "No stereo pairs found in " << corpus << std::endl;
+        return 1;
+    }
+
+    write_results(out_path, label, results);
+    std::cout << "Results written to " << out_path << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,455 @@
+/*************************************************************************/
+/* Copyright (c) 2022 Nolan Consulting Limited.                          */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+// Performance regression harness for the frame pipeline.
+//
+// Runs the decode, remap, upload staging, disparity and calibration workloads
+// on fixed inputs: the stereo calibration shipped in foxus/calibration and a
+// synthetic side by side frame that is JPEG encoded at startup. The median
+// runtime of every stage is compared with a committed baseline and the run
+// fails if a stage got slower than the tolerance allows. Stages without a
+// baseline are warned about until one is recorded.
+//
+// Baselines are only comparable on the machine they were recorded on, record
+// one with --update-baseline after checking out a known good revision.
+//
+// Usage:
+//   perf_regression [--calibration ../foxus/calibration/stereo_cam.yml]
+//                   [--baseline tools/perf_baseline.json] [--out perf_results.json]
+//                   [--tolerance 0.15] [--repeat 20] [--update-baseline]
+
+#include <opencv2/core.hpp>
+#include "opencv2/calib3d.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <turbojpeg.h>
+
+#include "calibration_job.hpp"
+#include "stereo_calibration.hpp"
+#include "stereo_depth.hpp"
+
+using namespace godot;
+
+namespace {
+
+const int WIDTH = 1280;
+const int HEIGHT = 960;
+const cv::Size PATTERN_SIZE(9, 6);
+const float SQUARE_SIZE = 24.0f;
+
+struct StageResult {
+    std::string name;
+    double min_ms = 0.0;
+    double median_ms = 0.0;
+    bool has_baseline = false;
+    double baseline_ms = 0.0;
+    double tolerance = 0.0;
+    bool regressed = false;
+};
+
+struct Inputs {
+    cv::Mat rgb;                        // CV_8UC3 side by side frame
+    std::vector<unsigned char> jpeg;
+    cv::Mat map_x, map_y;               // side by side rectification maps, as in loadMaps
+    cv::Mat K1, D1, K2, D2, R, T;
+    cv::Mat left_gray, right_gray;      // rectified pair with a known disparity
+};
+
+// Median and minimum of repeat timed runs after one warm up run.
+StageResult time_stage(const std::string& name, int repeat, const std::function<void()>& workload) {
+    workload();
+
+    std::vector<double> runtimes;
+    for (int i = 0; i < repeat; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        workload();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        runtimes.push_back(elapsed.count());
+    }
+
+    std::sort(runtimes.begin(), runtimes.end());
+
+    StageResult result;
+    result.name = name;
+    result.min_ms = runtimes.front();
+    result.median_ms = runtimes[runtimes.size() / 2];
+    return result;
+}
+
+// Textured scene with some structure, so the JPEG size and the matcher
+// workload are close to a real frame. Seeded, every run sees the same pixels.
+cv::Mat synthetic_texture(cv::Size size, int seed) {
+    cv::RNG rng(seed);
+    cv::Mat texture(size, CV_8UC1);
+    rng.fill(texture, cv::RNG::UNIFORM, 0, 255);
+    cv::GaussianBlur(texture, texture, cv::Size(5, 5), 1.5);
+
+    for (int i = 0; i < 60; ++i) {
+        cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        cv::circle(texture, center, rng.uniform(10, 120), cv::Scalar(rng.uniform(0, 255)), cv::FILLED);
+    }
+    return texture;
+}
+
+bool load_calibration(const std::string& path, Inputs& inputs) {
+    cv::FileStorage fs;
+    if (!fs.open(path, cv::FileStorage::READ)) return false;
+
+    fs["K1"] >> inputs.K1;
+    fs["D1"] >> inputs.D1;
+    fs["K2"] >> inputs.K2;
+    fs["D2"] >> inputs.D2;
+    fs["R"] >> inputs.R;
+    fs["T"] >> inputs.T;
+    if (inputs.K1.empty() || inputs.K2.empty() || inputs.D1.empty() || inputs.D2.empty()) return false;
+
+    if (inputs.R.empty() || inputs.T.empty()) {
+        inputs.R = cv::Mat::eye(3, 3, CV_64F);
+        inputs.T = (cv::Mat_<double>(3, 1) << -64.0, 0.0, 0.0);
+    }
+
+    // Same maps as GDEiffelCam::loadMaps
+    cv::Size size(WIDTH, HEIGHT);
+    cv::Mat M1 = cv::getOptimalNewCameraMatrix(inputs.K1, inputs.D1, size, 0.8, size);
+    cv::Mat M2 = cv::getOptimalNewCameraMatrix(inputs.K2, inputs.D2, size, 0.8, size);
+
+    cv::Mat left_x, left_y, right_x, right_y;
+    cv::initUndistortRectifyMap(inputs.K1, inputs.D1, cv::Mat(), M1, size, CV_32FC1, left_x, left_y);
+    cv::initUndistortRectifyMap(inputs.K2, inputs.D2, cv::Mat(), M2, size, CV_32FC1, right_x, right_y);
+
+    // The right half reads from the right half of the side by side frame
+    right_x += WIDTH;
+    cv::hconcat(left_x, right_x, inputs.map_x);
+    cv::hconcat(left_y, right_y, inputs.map_y);
+    return true;
+}
+
+bool prepare_frame(Inputs& inputs) {
+    // The right eye sees the left texture shifted by 24 pixels.
+    cv::Mat texture = synthetic_texture(cv::Size(WIDTH + 64, HEIGHT), 1);
+    inputs.left_gray = texture(cv::Rect(24, 0, WIDTH, HEIGHT)).clone();
+    inputs.right_gray = texture(cv::Rect(0, 0, WIDTH, HEIGHT)).clone();
+
+    cv::Mat side_by_side;
+    cv::hconcat(inputs.left_gray, inputs.right_gray, side_by_side);
+    cv::Mat channels[3] = { side_by_side, side_by_side * 0.9, side_by_side * 0.8 };
+    cv::merge(channels, 3, inputs.rgb);
+
+    // 4:2:2 like the MJPEG stream of the camera
+    tjhandle compressor = tjInitCompress();
+    unsigned char* jpeg = nullptr;
+    unsigned long jpeg_size = 0;
+    int result = tjCompress2(compressor, inputs.rgb.ptr(), inputs.rgb.cols, 0, inputs.rgb.rows, TJPF_RGB, &jpeg, &jpeg_size, TJSAMP_422, 85, TJFLAG_FASTDCT);
+    if (result == 0) inputs.jpeg.assign(jpeg, jpeg + jpeg_size);
+    tjFree(jpeg);
+    tjDestroy(compressor);
+    return result == 0;
+}
+
+// Views of a chessboard seen by both cameras from a fixed set of poses.
+CalibrationViews synthetic_views(const Inputs& inputs) {
+    CalibrationViews views;
+    std::vector<cv::Point3f> board = StereoCalibration::board_object_points(PATTERN_SIZE, SQUARE_SIZE);
+    cv::RNG rng(7);
+
+    cv::Mat R_vec;
+    cv::Rodrigues(inputs.R, R_vec);
+
+    for (int i = 0; i < 20; ++i) {
+        cv::Mat rvec = (cv::Mat_<double>(3, 1) << 0.3 * std::sin(i), 0.3 * std::cos(1.7 * i), 0.1 * std::sin(0.5 * i));
+        cv::Mat tvec = (cv::Mat_<double>(3, 1) << -96.0 + 150.0 * std::sin(1.3 * i), -60.0 + 100.0 * std::cos(0.9 * i), 500.0 + 150.0 * std::sin(0.7 * i));
+
+        cv::Mat right_rvec, right_tvec;
+        cv::composeRT(rvec, tvec, R_vec, inputs.T, right_rvec, right_tvec);
+
+        std::vector<cv::Point2f> left_points, right_points;
+        cv::projectPoints(board, rvec, tvec, inputs.K1, inputs.D1, left_points);
+        cv::projectPoints(board, right_rvec, right_tvec, inputs.K2, inputs.D2, right_points);
+
+        // Corner detection noise
+        for (cv::Point2f& point : left_points) point += cv::Point2f(rng.gaussian(0.1), rng.gaussian(0.1));
+        for (cv::Point2f& point : right_points) point += cv::Point2f(rng.gaussian(0.1), rng.gaussian(0.1));
+
+        views.object_points.push_back(board);
+        views.left_image_points.push_back(left_points);
+        views.right_image_points.push_back(right_points);
+    }
+
+    return views;
+}
+
+std::vector<StageResult> run_stages(const Inputs& inputs, int repeat, bool& r_ok) {
+    std::vector<StageResult> results;
+    r_ok = true;
+
+    tjhandle decompressor = tjInitDecompress();
+    std::vector<unsigned char> rgb(WIDTH * 2 * HEIGHT * 3);
+    std::vector<unsigned char> yuv(tjBufSizeYUV(WIDTH * 2, HEIGHT, TJSAMP_422));
+
+    results.push_back(time_stage("decode_rgb", repeat, [&]() {
+        if (tjDecompress2(decompressor, inputs.jpeg.data(), inputs.jpeg.size(), rgb.data(), WIDTH * 2, 0, HEIGHT, TJPF_RGB, TJFLAG_FASTDCT) != 0) r_ok = false;
+    }));
+
+    results.push_back(time_stage("decode_yuv", repeat, [&]() {
+        if (tjDecompressToYUV(decompressor, (unsigned char*) inputs.jpeg.data(), inputs.jpeg.size(), yuv.data(), TJFLAG_FASTDCT) != 0) r_ok = false;
+    }));
+
+    tjDestroy(decompressor);
+
+    cv::Mat remapped;
+    results.push_back(time_stage("remap_rgb", repeat, [&]() {
+        cv::remap(inputs.rgb, remapped, inputs.map_x, inputs.map_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
+    }));
+
+    // The CPU side of ImageTexture::update_from_data, one copy of the frame.
+    std::vector<unsigned char> staging(inputs.rgb.total() * inputs.rgb.elemSize());
+    results.push_back(time_stage("upload_staging", repeat, [&]() {
+        memcpy(staging.data(), remapped.ptr(), staging.size());
+    }));
+
+    cv::Mat luma, rectified_luma;
+    results.push_back(time_stage("rectify_luma", repeat, [&]() {
+        cv::cvtColor(inputs.rgb, luma, cv::COLOR_RGB2GRAY);
+        cv::remap(luma, rectified_luma, inputs.map_x, inputs.map_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
+    }));
+
+    const char* preset_names[] = { "disparity_full", "disparity_quality", "disparity_speed" };
+    for (int preset = StereoDepth::PRESET_FULL; preset <= StereoDepth::PRESET_SPEED; ++preset) {
+        StereoDepth stereo_depth;
+        stereo_depth.set_preset(preset);
+        results.push_back(time_stage(preset_names[preset], std::max(1, repeat / 4), [&]() {
+            stereo_depth.compute(inputs.left_gray, inputs.right_gray);
+        }));
+    }
+
+    CalibrationViews views = synthetic_views(inputs);
+    CalibrationJob::Settings settings;
+    settings.image_size = cv::Size(WIDTH, HEIGHT);
+    settings.pattern_size = PATTERN_SIZE;
+    settings.square_size = SQUARE_SIZE;
+    settings.criteria = cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::MAX_ITER, 30, 0.001);
+    settings.output_path = std::string("/tmp/perf_regression_") + std::to_string(getpid()) + ".yml";
+
+    results.push_back(time_stage("calibration", std::max(1, repeat / 10), [&]() {
+        CalibrationJob job(settings, views);
+        job.run();
+        if (job.get_state() != CalibrationJob::STATE_SUCCEEDED) {
+            std::cerr << "calibration: " << job.get_error() << std::endl;
+            r_ok = false;
+        }
+    }));
+    std::remove(settings.output_path.c_str());
+
+    return results;
+}
+
+std::string machine_name() {
+    char host[256] = {};
+    gethostname(host, sizeof(host) - 1);
+
+    std::string cpu;
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            cpu = line.substr(line.find(':') + 2);
+            break;
+        }
+    }
+
+    return std::string(host) + (cpu.empty() ? "" : " / " + cpu);
+}
+
+// Baseline: { "machine": ..., "tolerance": 0.15, "stages": { "<name>": { "median_ms": ..., "tolerance": ... } } }
+// A stage without an entry has has_baseline false and only warns.
+void compare_with_baseline(const std::string& path, double default_tolerance, std::vector<StageResult>& results) {
+    cv::FileStorage fs;
+    if (!fs.open(path, cv::FileStorage::READ)) {
+        std::cerr << "No baseline at " << path << std::endl;
+        return;
+    }
+
+    std::string machine;
+    fs["machine"] >> machine;
+    if (!machine.empty() && machine != machine_name()) {
+        std::cerr << "Baseline was recorded on " << machine << ", numbers may not be comparable" << std::endl;
+    }
+
+    double tolerance = default_tolerance;
+    if (default_tolerance < 0.0) {
+        fs["tolerance"] >> tolerance;
+        if (tolerance <= 0.0) tolerance = 0.15;
+    }
+
+    cv::FileNode stages = fs["stages"];
+    for (StageResult& result : results) {
+        cv::FileNode stage = stages[result.name];
+        if (stage.empty() || stage["median_ms"].empty()) continue;
+
+        result.has_baseline = true;
+        stage["median_ms"] >> result.baseline_ms;
+        result.tolerance = tolerance;
+        if (default_tolerance < 0.0 && !stage["tolerance"].empty()) {
+            stage["tolerance"] >> result.tolerance;
+        }
+        result.regressed = result.median_ms > result.baseline_ms * (1.0 + result.tolerance);
+    }
+}
+
+void write_baseline(const std::string& path, double tolerance, const std::vector<StageResult>& results) {
+    cv::FileStorage fs(path, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_JSON);
+
+    fs << "machine" << machine_name();
+    fs << "opencv_version" << CV_VERSION;
+    fs << "tolerance" << (tolerance < 0.0 ? 0.15 : tolerance);
+    fs << "stages" << "{";
+    for (const StageResult& result : results) {
+        fs << result.name << "{";
+        fs << "median_ms" << result.median_ms;
+        fs << "}";
+    }
+    fs << "}";
+}
+
+void write_results(const std::string& path, const std::vector<StageResult>& results) {
+    cv::FileStorage fs(path, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_JSON);
+
+    fs << "machine" << machine_name();
+    fs << "opencv_version" << CV_VERSION;
+    fs << "threads" << cv::getNumThreads();
+    fs << "results" << "[";
+    for (const StageResult& result : results) {
+        fs << "{";
+        fs << "stage" << result.name;
+        fs << "min_ms" << result.min_ms;
+        fs << "median_ms" << result.median_ms;
+        if (result.has_baseline) {
+            fs << "baseline_ms" << result.baseline_ms;
+            fs << "tolerance" << result.tolerance;
+            fs << "regressed" << (int) result.regressed;
+        }
+        fs << "}";
+    }
+    fs << "]";
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string calibration_path = "../foxus/calibration/stereo_cam.yml";
+    std::string baseline_path = "tools/perf_baseline.json";
+    std::string out_path = "perf_results.json";
+    double tolerance = -1.0;      // from the baseline file
+    int repeat = 20;
+    bool update_baseline = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+
+        if (option == "--update-baseline") {
+            update_baseline = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << std::endl;
+            return 1;
+        }
+
+        std::string value = argv[++i];
+        if (option == "--calibration") calibration_path = value;
+        else if (option == "--baseline") baseline_path = value;
+        else if (option == "--out") out_path = value;
+        else if (option == "--tolerance") tolerance = std::atof(value.c_str());
+        else if (option == "--repeat") repeat = std::max(1, std::atoi(value.c_str()));
+        else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+
+    Inputs inputs;
+    if (!load_calibration(calibration_path, inputs)) {
+        std::cerr << "Unable to read the calibration " << calibration_path << std::endl;
+        return 1;
+    }
+    if (!prepare_frame(inputs)) {
+        std::cerr << "Unable to encode the test frame" << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    std::vector<StageResult> results = run_stages(inputs, repeat, ok);
+    if (!ok) {
+        std::cerr << "A workload failed, results are not valid" << std::endl;
+        return 1;
+    }
+
+    if (update_baseline) {
+        write_baseline(baseline_path, tolerance, results);
+        std::cout << "Baseline written to " << baseline_path << std::endl;
+        return 0;
+    }
+
+    compare_with_baseline(baseline_path, tolerance, results);
+    write_results(out_path, results);
+
+    int regressions = 0;
+    int missing = 0;
+    for (const StageResult& result : results) {
+        printf("%-20s %9.2f ms (min %9.2f)", result.name.c_str(), result.median_ms, result.min_ms);
+        if (result.has_baseline) {
+            printf("  baseline %9.2f ms  %+6.1f%%  %s", result.baseline_ms,
+                   (result.median_ms / result.baseline_ms - 1.0) * 100.0, result.regressed ? "REGRESSED" : "ok");
+        } else {
+            printf("  NO BASELINE");
+            ++missing;
+        }
+        printf("\n");
+        regressions += result.regressed;
+    }
+
+    // An empty or outdated baseline lets regressions of those stages through
+    if (missing > 0) {
+        std::cerr << "WARNING: " << missing << " stage(s) have no baseline in " << baseline_path
+                  << " and are not checked, record one with --update-baseline on the reference machine" << std::endl;
+    }
+    if (regressions > 0) {
+        std::cerr << regressions << " stage(s) regressed beyond the tolerance" << std::endl;
+        return 1;
+    }
+    return 0;
+}